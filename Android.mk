@@ -27,7 +27,11 @@ LOCAL_SRC_FILES := \
     screen_ui.cpp \
     messagesocket.cpp \
     asn1_decoder.cpp \
+    digest_engine.cpp \
+    hash_tree.cpp \
     verifier.cpp \
+    keystore.cpp \
+    verify_cache.cpp \
     adb_install.cpp
 
 # External tools
@@ -62,6 +66,7 @@ LOCAL_STATIC_LIBRARIES := \
     libminzip \
     libz \
     libmtdutils \
+    libminhash \
     libmincrypt \
     libminadbd \
     libbusybox \
@@ -141,7 +146,8 @@ RECOVERY_BUSYBOX_SYMLINKS := $(addprefix $(TARGET_RECOVERY_ROOT_OUT)/sbin/,$(fil
 ifeq ($(ONE_SHOT_MAKEFILE),)
 
 LOCAL_ADDITIONAL_DEPENDENCIES := \
-    bu_recovery
+    bu_recovery \
+    $(TARGET_RECOVERY_ROOT_OUT)/res/keystore
 
 LOCAL_ADDITIONAL_DEPENDENCIES += \
     minivold \
@@ -156,6 +162,24 @@ endif
 
 include $(BUILD_EXECUTABLE)
 
+# Binary copy of the OTA keys that install.cpp checks packages against.
+# The keys are the same ones the build dumps into res/keys; if that file
+# is later replaced (e.g. by re-signing the target files), recovery
+# notices and falls back to parsing it.
+recovery_keystore := $(TARGET_RECOVERY_ROOT_OUT)/res/keystore
+recovery_keystore_certs := \
+    $(DEFAULT_SYSTEM_DEV_CERTIFICATE).x509.pem \
+    $(patsubst %,%.x509.pem,$(PRODUCT_EXTRA_RECOVERY_KEYS))
+$(recovery_keystore): PRIVATE_CERTS := $(recovery_keystore_certs)
+$(recovery_keystore): MKKEYSTORE := $(HOST_OUT_EXECUTABLES)/mkkeystore$(HOST_EXECUTABLE_SUFFIX)
+$(recovery_keystore): $(recovery_keystore_certs) $(DUMPKEY_JAR) \
+        $(HOST_OUT_EXECUTABLES)/mkkeystore$(HOST_EXECUTABLE_SUFFIX)
+	@echo "Keystore: $@ <= $(PRIVATE_CERTS)"
+	@mkdir -p $(dir $@)
+	$(hide) java -jar $(DUMPKEY_JAR) $(PRIVATE_CERTS) > $@.keys
+	$(hide) $(MKKEYSTORE) $@.keys $@
+	$(hide) rm -f $@.keys
+
 # nc is provided by external/netcat
 $(RECOVERY_SYMLINKS): RECOVERY_BINARY := $(LOCAL_MODULE)
 $(RECOVERY_SYMLINKS):
@@ -200,6 +224,7 @@ LOCAL_STATIC_LIBRARIES += \
     libvoldclient \
     libz \
     libmtdutils \
+    libminhash \
     libminadbd \
     libminui \
     libfs_mgr \
@@ -256,7 +281,10 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := libverifier
 LOCAL_MODULE_TAGS := tests
 LOCAL_SRC_FILES := \
-    asn1_decoder.cpp
+    asn1_decoder.cpp \
+    digest_engine.cpp \
+    hash_tree.cpp \
+    keystore.cpp
 include $(BUILD_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
@@ -268,11 +296,15 @@ LOCAL_C_INCLUDES += system/core/fs_mgr/include
 LOCAL_SRC_FILES := \
     verifier_test.cpp \
     asn1_decoder.cpp \
+    digest_engine.cpp \
+    hash_tree.cpp \
     verifier.cpp \
+    keystore.cpp \
     ui.cpp \
     messagesocket.cpp
 LOCAL_STATIC_LIBRARIES := \
     libvoldclient \
+    libminhash \
     libmincrypt \
     libminui \
     libminzip \
@@ -281,10 +313,88 @@ LOCAL_STATIC_LIBRARIES := \
     libc
 include $(BUILD_EXECUTABLE)
 
+include $(CLEAR_VARS)
+LOCAL_MODULE := mkkeystore
+LOCAL_MODULE_TAGS := optional
+LOCAL_SRC_FILES := \
+    mkkeystore.cpp \
+    keystore.cpp
+LOCAL_STATIC_LIBRARIES := \
+    libminhash \
+    libmincrypt
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := hash_bench
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := hash_bench.cpp
+LOCAL_STATIC_LIBRARIES := \
+    libminhash \
+    libmincrypt \
+    libstdc++ \
+    libc
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := crc_bench
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := crc_bench.cpp
+LOCAL_C_INCLUDES += external/zlib
+LOCAL_STATIC_LIBRARIES := \
+    libminzip \
+    libz \
+    libstdc++ \
+    libc
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := zip_bench
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := zip_bench.cpp
+LOCAL_STATIC_LIBRARIES := \
+    libminzip \
+    libz \
+    libselinux \
+    libstdc++ \
+    libc
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := bspatch_bench
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := bspatch_bench.cpp
+LOCAL_STATIC_LIBRARIES := \
+    libapplypatch \
+    libmtdutils \
+    libminhash \
+    libmincrypt \
+    libbz \
+    libminelf \
+    libz \
+    libstdc++ \
+    libc
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := bsdiff_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := \
+    bsdiff_bench.cpp \
+    applypatch/bsdiff.c \
+    applypatch/sais.c
+LOCAL_C_INCLUDES += external/bzip2
+LOCAL_STATIC_LIBRARIES := libbz
+include $(BUILD_HOST_EXECUTABLE)
+
 
 include $(LOCAL_PATH)/minui/Android.mk \
     $(LOCAL_PATH)/minelf/Android.mk \
     $(LOCAL_PATH)/minzip/Android.mk \
+    $(LOCAL_PATH)/minhash/Android.mk \
     $(LOCAL_PATH)/minadbd/Android.mk \
     $(LOCAL_PATH)/mtdutils/Android.mk \
     $(LOCAL_PATH)/tests/Android.mk \
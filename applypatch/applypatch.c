@@ -19,18 +19,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/cdefs.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
 
-#include "mincrypt/sha.h"
+#include "minhash/sha.h"
 #include "applypatch.h"
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
 
-static int LoadPartitionContents(const char* filename, FileContents* file);
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int map);
 static ssize_t FileSink(unsigned char* data, ssize_t len, void* token);
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
@@ -44,21 +47,55 @@ static int GenerateTarget(FileContents* source_file,
 
 static int mtd_partitions_scanned = 0;
 
-// Read a file into memory; optionally (retouch_flag == RETOUCH_DO_MASK) mask
+// Map len bytes of fd into file->data, privately, so that masking
+// retouched entries doesn't touch the file.  Pages are only read as
+// they're used, and the kernel can drop them again, so unlike reading
+// the file into memory this costs nothing like its size.  Return 0 on
+// success.
+static int MapContents(int fd, size_t len, FileContents* file) {
+    if (len == 0) {
+        // mmap() can't map nothing.
+        file->data = malloc(1);
+        return file->data == NULL ? -1 : 0;
+    }
+    void* addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+    file->data = addr;
+    file->mapped = len;
+    return 0;
+}
+
+void FreeFileContents(FileContents* file) {
+    if (file->data == NULL) {
+        return;
+    }
+    if (file->mapped) {
+        munmap(file->data, file->mapped);
+    } else {
+        free(file->data);
+    }
+    file->data = NULL;
+    file->mapped = 0;
+}
+
+// Read or map a file; optionally (retouch_flag == RETOUCH_DO_MASK) mask
 // the retouched entries back to their original value (such that SHA-1 checks
 // don't fail due to randomization); store the file contents and associated
 // metadata in *file.
 //
 // Return 0 on success.
-int LoadFileContents(const char* filename, FileContents* file,
-                     int retouch_flag) {
+static int ReadFileContents(const char* filename, FileContents* file,
+                            int retouch_flag, int map) {
     file->data = NULL;
+    file->mapped = 0;
 
     // A special 'filename' beginning with "MTD:" or "EMMC:" means to
     // load the contents of a partition.
     if (strncmp(filename, "MTD:", 4) == 0 ||
         strncmp(filename, "EMMC:", 5) == 0) {
-        return LoadPartitionContents(filename, file);
+        return LoadPartitionContents(filename, file, map);
     }
 
     if (stat(filename, &file->st) != 0) {
@@ -67,25 +104,40 @@ int LoadFileContents(const char* filename, FileContents* file,
     }
 
     file->size = file->st.st_size;
-    file->data = malloc(file->size);
 
-    FILE* f = fopen(filename, "rb");
-    if (f == NULL) {
-        printf("failed to open \"%s\": %s\n", filename, strerror(errno));
-        free(file->data);
-        file->data = NULL;
-        return -1;
-    }
+    if (map) {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+            return -1;
+        }
+        if (MapContents(fd, file->size, file) != 0) {
+            printf("failed to map \"%s\": %s\n", filename, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        close(fd);
+    } else {
+        file->data = malloc(file->size);
 
-    ssize_t bytes_read = fread(file->data, 1, file->size, f);
-    if (bytes_read != file->size) {
-        printf("short read of \"%s\" (%ld bytes of %ld)\n",
-               filename, (long)bytes_read, (long)file->size);
-        free(file->data);
-        file->data = NULL;
-        return -1;
+        FILE* f = fopen(filename, "rb");
+        if (f == NULL) {
+            printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+            free(file->data);
+            file->data = NULL;
+            return -1;
+        }
+
+        ssize_t bytes_read = fread(file->data, 1, file->size, f);
+        if (bytes_read != file->size) {
+            printf("short read of \"%s\" (%ld bytes of %ld)\n",
+                   filename, (long)bytes_read, (long)file->size);
+            free(file->data);
+            file->data = NULL;
+            return -1;
+        }
+        fclose(f);
     }
-    fclose(f);
 
     // apply_patch[_check] functions are blind to randomization. Randomization
     // is taken care of in [Undo]RetouchBinariesFn. If there is a mismatch
@@ -95,16 +147,25 @@ int LoadFileContents(const char* filename, FileContents* file,
         if (retouch_mask_data(file->data, file->size,
                               &desired_offset, NULL) != RETOUCH_DATA_MATCHED) {
             printf("error trying to mask retouch entries\n");
-            free(file->data);
-            file->data = NULL;
+            FreeFileContents(file);
             return -1;
         }
     }
 
-    SHA_hash(file->data, file->size, file->sha1);
+    MH_SHA_hash(file->data, file->size, file->sha1);
     return 0;
 }
 
+int LoadFileContents(const char* filename, FileContents* file,
+                     int retouch_flag) {
+    return ReadFileContents(filename, file, retouch_flag, 0);
+}
+
+int MapFileContents(const char* filename, FileContents* file,
+                    int retouch_flag) {
+    return ReadFileContents(filename, file, retouch_flag, 1);
+}
+
 static size_t* size_array;
 // comparison function for qsort()ing an int array of indexes into
 // size_array[].
@@ -135,9 +196,13 @@ static int compare_size_indices(const void* a, const void* b) {
 // "end-of-file" marker), so the caller must specify the possible
 // lengths and the hash of the data, and we'll do the load expecting
 // to find one of those hashes.
+//
+// If 'map' is nonzero, an EMMC partition is mapped rather than read
+// into memory.
 enum PartitionType { MTD, EMMC };
 
-static int LoadPartitionContents(const char* filename, FileContents* file) {
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int map) {
     char* copy = strdup(filename);
     const char* magic = strtok(copy, ":");
 
@@ -222,11 +287,27 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     }
 
     SHA_CTX sha_ctx;
-    SHA_init(&sha_ctx);
+    MH_SHA_init(&sha_ctx);
     uint8_t parsed_sha[SHA_DIGEST_SIZE];
 
-    // allocate enough memory to hold the largest size.
-    file->data = malloc(size[index[pairs-1]]);
+    // allocate enough memory to hold the largest size, or map that
+    // much of the partition (or all of it, if it's smaller).
+    size_t largest = size[index[pairs-1]];
+    off_t dev_size = (map && type == EMMC) ? lseek(fileno(dev), 0, SEEK_END) : -1;
+    if (map && dev_size > 0) {
+        if (MapContents(fileno(dev), (size_t)dev_size < largest ? (size_t)dev_size : largest,
+                        file) != 0) {
+            printf("failed to map emmc partition \"%s\": %s\n",
+                   partition, strerror(errno));
+            fclose(dev);
+            return -1;
+        }
+    } else {
+        if (map && type == EMMC) {
+            rewind(dev);
+        }
+        file->data = malloc(largest);
+    }
     char* p = (char*)file->data;
     file->size = 0;                // # bytes read so far
 
@@ -243,17 +324,21 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
                     break;
 
                 case EMMC:
-                    read = fread(p, 1, next, dev);
+                    if (file->mapped) {
+                        read = file->mapped - file->size;
+                        if (read > next) read = next;
+                    } else {
+                        read = fread(p, 1, next, dev);
+                    }
                     break;
             }
             if (next != read) {
                 printf("short read (%zu bytes of %zu) for partition \"%s\"\n",
                        read, next, partition);
-                free(file->data);
-                file->data = NULL;
+                FreeFileContents(file);
                 return -1;
             }
-            SHA_update(&sha_ctx, p, read);
+            MH_SHA_update(&sha_ctx, p, read);
             file->size += read;
         }
 
@@ -261,13 +346,12 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         // check it against this pair's expected hash.
         SHA_CTX temp_ctx;
         memcpy(&temp_ctx, &sha_ctx, sizeof(SHA_CTX));
-        const uint8_t* sha_so_far = SHA_final(&temp_ctx);
+        const uint8_t* sha_so_far = MH_SHA_final(&temp_ctx);
 
         if (ParseSha1(sha1sum[index[i]], parsed_sha) != 0) {
             printf("failed to parse sha1 %s in %s\n",
                    sha1sum[index[i]], filename);
-            free(file->data);
-            file->data = NULL;
+            FreeFileContents(file);
             return -1;
         }
 
@@ -298,12 +382,11 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         // finding a match.
         printf("contents of partition \"%s\" didn't match %s\n",
                partition, filename);
-        free(file->data);
-        file->data = NULL;
+        FreeFileContents(file);
         return -1;
     }
 
-    const uint8_t* sha_final = SHA_final(&sha_ctx);
+    const uint8_t* sha_final = MH_SHA_final(&sha_ctx);
     for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
         file->sha1[i] = sha_final[i];
     }
@@ -355,172 +438,186 @@ int SaveFileContents(const char* filename, const FileContents* file) {
     return 0;
 }
 
-// Write a memory buffer to 'target' partition, a string of the form
-// "MTD:<partition>[:...]" or "EMMC:<partition_device>:".  Return 0 on
-// success.
-int WriteToPartition(unsigned char* data, size_t len,
-                        const char* target) {
+// Streams patch output to a partition as it is produced, so the
+// target never has to be held in memory.
+typedef struct {
+    enum PartitionType type;
+    char* partition;
+    MtdWriteContext* mtd;
+    int fd;
+    size_t written;
+} PartitionWriter;
+
+// Open 'target', a string of the form "MTD:<partition>[:...]" or
+// "EMMC:<partition_device>:", for writing from the start.  Return 0
+// on success.
+static int OpenPartitionWriter(PartitionWriter* pw, const char* target) {
     char* copy = strdup(target);
     const char* magic = strtok(copy, ":");
 
-    enum PartitionType type;
-    if (strcmp(magic, "MTD") == 0) {
-        type = MTD;
-    } else if (strcmp(magic, "EMMC") == 0) {
-        type = EMMC;
+    memset(pw, 0, sizeof(*pw));
+    pw->fd = -1;
+    if (magic != NULL && strcmp(magic, "MTD") == 0) {
+        pw->type = MTD;
+    } else if (magic != NULL && strcmp(magic, "EMMC") == 0) {
+        pw->type = EMMC;
     } else {
-        printf("WriteToPartition called with bad target (%s)\n", target);
+        printf("OpenPartitionWriter called with bad target (%s)\n", target);
+        free(copy);
         return -1;
     }
     const char* partition = strtok(NULL, ":");
 
     if (partition == NULL) {
         printf("bad partition target name \"%s\"\n", target);
+        free(copy);
         return -1;
     }
+    pw->partition = strdup(partition);
+    free(copy);
 
-    switch (type) {
+    switch (pw->type) {
         case MTD:
             if (!mtd_partitions_scanned) {
                 mtd_scan_partitions();
                 mtd_partitions_scanned = 1;
             }
 
-            const MtdPartition* mtd = mtd_find_partition_by_name(partition);
+            const MtdPartition* mtd = mtd_find_partition_by_name(pw->partition);
             if (mtd == NULL) {
                 printf("mtd partition \"%s\" not found for writing\n",
-                       partition);
-                return -1;
+                       pw->partition);
+                break;
             }
 
-            MtdWriteContext* ctx = mtd_write_partition(mtd);
-            if (ctx == NULL) {
+            pw->mtd = mtd_write_partition(mtd);
+            if (pw->mtd == NULL) {
                 printf("failed to init mtd partition \"%s\" for writing\n",
-                       partition);
-                return -1;
+                       pw->partition);
             }
+            break;
 
-            size_t written = mtd_write_data(ctx, (char*)data, len);
-            if (written != len) {
-                printf("only wrote %zu of %zu bytes to MTD %s\n",
-                       written, len, partition);
-                mtd_write_close(ctx);
-                return -1;
+        case EMMC:
+            pw->fd = open(pw->partition, O_RDWR);
+            if (pw->fd < 0) {
+                printf("failed to open %s: %s\n", pw->partition, strerror(errno));
             }
+            break;
+    }
 
-            if (mtd_erase_blocks(ctx, -1) < 0) {
-                printf("error finishing mtd write of %s\n", partition);
-                mtd_write_close(ctx);
-                return -1;
-            }
+    if (pw->mtd == NULL && pw->fd < 0) {
+        free(pw->partition);
+        return -1;
+    }
+    return 0;
+}
 
-            if (mtd_write_close(ctx)) {
-                printf("error closing mtd write of %s\n", partition);
-                return -1;
-            }
-            break;
+static ssize_t PartitionSink(unsigned char* data, ssize_t len, void* token) {
+    PartitionWriter* pw = (PartitionWriter*)token;
 
-        case EMMC:
-        {
-            size_t start = 0;
-            int success = 0;
-            int fd = open(partition, O_RDWR);
-            if (fd < 0) {
-                printf("failed to open %s: %s\n", partition, strerror(errno));
-                return -1;
-            }
-            int attempt;
-
-            for (attempt = 0; attempt < 2; ++attempt) {
-                lseek(fd, start, SEEK_SET);
-                while (start < len) {
-                    size_t to_write = len - start;
-                    if (to_write > 1<<20) to_write = 1<<20;
-
-                    ssize_t written = write(fd, data+start, to_write);
-                    if (written < 0) {
-                        if (errno == EINTR) {
-                            written = 0;
-                        } else {
-                            printf("failed write writing to %s (%s)\n",
-                                   partition, strerror(errno));
-                            return -1;
-                        }
-                    }
-                    start += written;
-                }
-                fsync(fd);
-
-                // drop caches so our subsequent verification read
-                // won't just be reading the cache.
-                sync();
-                int dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
-                write(dc, "3\n", 2);
-                close(dc);
-                sleep(1);
-                printf("  caches dropped\n");
-
-                // verify
-                lseek(fd, 0, SEEK_SET);
-                unsigned char buffer[4096];
-                start = len;
-                size_t p;
-                for (p = 0; p < len; p += sizeof(buffer)) {
-                    size_t to_read = len - p;
-                    if (to_read > sizeof(buffer)) to_read = sizeof(buffer);
-
-                    size_t so_far = 0;
-                    while (so_far < to_read) {
-                        ssize_t read_count = read(fd, buffer+so_far, to_read-so_far);
-                        if (read_count < 0) {
-                            if (errno == EINTR) {
-                                read_count = 0;
-                            } else {
-                                printf("verify read error %s at %zu: %s\n",
-                                       partition, p, strerror(errno));
-                                return -1;
-                            }
-                        }
-                        if ((size_t)read_count < to_read) {
-                            printf("short verify read %s at %zu: %zd %zu %s\n",
-                                   partition, p, read_count, to_read, strerror(errno));
-                        }
-                        so_far += read_count;
-                    }
+    if (pw->type == MTD) {
+        ssize_t written = mtd_write_data(pw->mtd, (char*)data, len);
+        if (written != len) {
+            printf("only wrote %zd of %zd bytes to MTD %s\n",
+                   written, len, pw->partition);
+            return -1;
+        }
+        pw->written += len;
+        return len;
+    }
 
-                    if (memcmp(buffer, data+p, to_read)) {
-                        printf("verification failed starting at %zu\n", p);
-                        start = p;
-                        break;
-                    }
-                }
+    ssize_t done = 0;
+    while (done < len) {
+        ssize_t written = write(pw->fd, data+done, len-done);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            printf("failed write writing to %s (%s)\n",
+                   pw->partition, strerror(errno));
+            return -1;
+        }
+        done += written;
+    }
+    pw->written += len;
+    return len;
+}
 
-                if (start == len) {
-                    printf("verification read succeeded (attempt %d)\n", attempt+1);
-                    success = true;
-                    break;
-                }
-            }
+// Read back what was written to an EMMC partition, bypassing the page
+// cache, and check it against 'sha1'.  Return 0 if it matches.
+static int VerifyPartition(PartitionWriter* pw, const uint8_t sha1[SHA_DIGEST_SIZE]) {
+    fsync(pw->fd);
 
-            if (!success) {
-                printf("failed to verify after all attempts\n");
-                return -1;
+    // drop caches so our subsequent verification read
+    // won't just be reading the cache.
+    sync();
+    int dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    write(dc, "3\n", 2);
+    close(dc);
+    sleep(1);
+    printf("  caches dropped\n");
+
+    SHA_CTX ctx;
+    MH_SHA_init(&ctx);
+    lseek(pw->fd, 0, SEEK_SET);
+    unsigned char buffer[4096];
+    size_t p = 0;
+    while (p < pw->written) {
+        size_t to_read = pw->written - p;
+        if (to_read > sizeof(buffer)) to_read = sizeof(buffer);
+
+        ssize_t read_count = read(pw->fd, buffer, to_read);
+        if (read_count < 0 && errno == EINTR) continue;
+        if (read_count <= 0) {
+            printf("verify read error %s at %zu: %s\n",
+                   pw->partition, p, strerror(errno));
+            return -1;
+        }
+        MH_SHA_update(&ctx, buffer, read_count);
+        p += read_count;
+    }
+
+    if (memcmp(MH_SHA_final(&ctx), sha1, SHA_DIGEST_SIZE) != 0) {
+        printf("verification of %s failed\n", pw->partition);
+        return -1;
+    }
+    printf("verification read succeeded\n");
+    return 0;
+}
+
+// Finish writing the partition.  If 'sha1' is non-NULL, an EMMC
+// partition is read back and checked against it; pass NULL to give up
+// on a failed write.  Return 0 on success.
+static int ClosePartitionWriter(PartitionWriter* pw,
+                                const uint8_t sha1[SHA_DIGEST_SIZE]) {
+    int result = 0;
+
+    switch (pw->type) {
+        case MTD:
+            if (sha1 != NULL && mtd_erase_blocks(pw->mtd, -1) < 0) {
+                printf("error finishing mtd write of %s\n", pw->partition);
+                result = -1;
+            }
+            if (mtd_write_close(pw->mtd)) {
+                printf("error closing mtd write of %s\n", pw->partition);
+                result = -1;
             }
+            break;
 
-            if (close(fd) != 0) {
-                printf("error closing %s (%s)\n", partition, strerror(errno));
-                return -1;
+        case EMMC:
+            if (sha1 != NULL && VerifyPartition(pw, sha1) != 0) {
+                result = -1;
+            }
+            if (close(pw->fd) != 0) {
+                printf("error closing %s (%s)\n", pw->partition, strerror(errno));
+                result = -1;
             }
             sync();
             break;
-        }
     }
 
-    free(copy);
-    return 0;
+    free(pw->partition);
+    return result;
 }
 
-
 // Take a string 'str' of 40 hex digits and parse it into the 20
 // byte array 'digest'.  'str' may contain only the digest or be of
 // the form "<digest>:<anything>".  Return 0 on success, -1 on any
@@ -579,7 +676,7 @@ int applypatch_check(const char* filename,
     // LoadFileContents is successful.  (Useful for reading
     // partitions, where the filename encodes the sha1s; no need to
     // check them twice.)
-    int filestate = LoadFileContents(filename, &file, RETOUCH_DO_MASK);
+    int filestate = MapFileContents(filename, &file, RETOUCH_DO_MASK);
     if (filestate == -ENOENT) {
         return -ENOENT;
     }
@@ -590,8 +687,7 @@ int applypatch_check(const char* filename,
         printf("file \"%s\" doesn't have any of expected "
                "sha1 sums; checking cache\n", filename);
 
-        free(file.data);
-        file.data = NULL;
+        FreeFileContents(&file);
 
         // If the source file is missing or corrupted, it might be because
         // we were killed in the middle of patching it.  A copy of it
@@ -599,19 +695,19 @@ int applypatch_check(const char* filename,
         // exists and matches the sha1 we're looking for, the check still
         // passes.
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
             printf("failed to load cache file\n");
             return 1;
         }
 
         if (FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0) {
             printf("cache bits don't match any sha1 for \"%s\"\n", filename);
-            free(file.data);
+            FreeFileContents(&file);
             return 1;
         }
     }
 
-    free(file.data);
+    FreeFileContents(&file);
     return 0;
 }
 
@@ -635,22 +731,6 @@ ssize_t FileSink(unsigned char* data, ssize_t len, void* token) {
     return done;
 }
 
-typedef struct {
-    unsigned char* buffer;
-    ssize_t size;
-    ssize_t pos;
-} MemorySinkInfo;
-
-ssize_t MemorySink(unsigned char* data, ssize_t len, void* token) {
-    MemorySinkInfo* msi = (MemorySinkInfo*)token;
-    if (msi->size - msi->pos < len) {
-        return -1;
-    }
-    memcpy(msi->buffer + msi->pos, data, len);
-    msi->pos += len;
-    return len;
-}
-
 // Return the amount of free space (in bytes) on the filesystem
 // containing filename.  filename must exist.  Return -1 on error.
 size_t FreeSpaceForFile(const char* filename) {
@@ -735,15 +815,17 @@ int applypatch(const char* source_filename,
     const Value* copy_patch_value = NULL;
 
     // We try to load the target file into the source_file object.
-    if (LoadFileContents(target_filename, &source_file,
-                         RETOUCH_DO_MASK) == 0) {
+    // Files and partitions are mapped rather than read, so that neither
+    // the source nor the target has to fit in memory.
+    if (MapFileContents(target_filename, &source_file,
+                        RETOUCH_DO_MASK) == 0) {
         if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
             // has the desired hash, nothing for us to do.
             printf("already ");
             print_short_sha1(target_sha1);
             putchar('\n');
-            free(source_file.data);
+            FreeFileContents(&source_file);
             return 0;
         }
     }
@@ -753,10 +835,9 @@ int applypatch(const char* source_filename,
          strcmp(target_filename, source_filename) != 0)) {
         // Need to load the source file:  either we failed to load the
         // target file, or we did but it's different from the source file.
-        free(source_file.data);
-        source_file.data = NULL;
-        LoadFileContents(source_filename, &source_file,
-                         RETOUCH_DO_MASK);
+        FreeFileContents(&source_file);
+        MapFileContents(source_filename, &source_file,
+                        RETOUCH_DO_MASK);
     }
 
     if (source_file.data != NULL) {
@@ -768,12 +849,11 @@ int applypatch(const char* source_filename,
     }
 
     if (source_patch_value == NULL) {
-        free(source_file.data);
-        source_file.data = NULL;
+        FreeFileContents(&source_file);
         printf("source file is bad; trying copy\n");
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file,
-                             RETOUCH_DO_MASK) < 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &copy_file,
+                            RETOUCH_DO_MASK) < 0) {
             // fail.
             printf("failed to read copy file\n");
             return 1;
@@ -788,7 +868,7 @@ int applypatch(const char* source_filename,
         if (copy_patch_value == NULL) {
             // fail.
             printf("copy file doesn't match source SHA-1s either\n");
-            free(copy_file.data);
+            FreeFileContents(&copy_file);
             return 1;
         }
     }
@@ -797,12 +877,128 @@ int applypatch(const char* source_filename,
                                 &copy_file, copy_patch_value,
                                 source_filename, target_filename,
                                 target_sha1, target_size, bonus_data);
-    free(source_file.data);
-    free(copy_file.data);
+    FreeFileContents(&source_file);
+    FreeFileContents(&copy_file);
 
     return result;
 }
 
+// Discards the output, for checking what a patch produces before
+// any of it is written.
+static ssize_t NullSink(unsigned char* data __unused, ssize_t len,
+                        void* token __unused) {
+    return len;
+}
+
+// Apply 'patch' to 'source', passing the output to 'sink' and hashing
+// it into 'ctx'.  Return 0 on success.
+static int ApplyPatchTo(const FileContents* source, const Value* patch,
+                        SinkFn sink, void* token, SHA_CTX* ctx,
+                        const Value* bonus_data) {
+    MH_SHA_init(ctx);
+    if (memcmp(patch->data, "BSDIFF40", 8) == 0) {
+        return ApplyBSDiffPatch(source->data, source->size,
+                                patch, 0, sink, token, ctx);
+    }
+    return ApplyImagePatch(source->data, source->size,
+                           patch, sink, token, ctx, bonus_data);
+}
+
+// Patch to an MTD or EMMC partition.  The output is streamed into the
+// partition, so it's never held in memory, but none of it may be
+// written until it's known to be right: an MTD write can't be read
+// back, and the target may be the source partition.  So the patch is
+// applied twice, once only to check the output's SHA-1 and then, if
+// that matched, to write it.  That doubles the bspatch/imgpatch CPU
+// time for boot and radio images; it's the price of never leaving a
+// partition half-written by a patch that was wrong all along, which
+// the /cache backup alone wouldn't prevent.
+//
+// Memory doesn't stay flat in every case either.  An MTD source is
+// still read into memory whole, since it can't be mapped, and imgpatch
+// expands each deflate chunk's source whole, since bspatch reads it
+// anywhere.
+//
+// Before the write, the source is saved to /cache, where the next
+// attempt will find it if this one is interrupted, and the write reads
+// that copy rather than the source itself: a partition patched in
+// place changes under its mapping as it's written.
+static int GeneratePartitionTarget(FileContents* source,
+                                   int from_original,
+                                   const Value* patch,
+                                   const char* target_filename,
+                                   const uint8_t target_sha1[SHA_DIGEST_SIZE],
+                                   const Value* bonus_data) {
+    SHA_CTX ctx;
+    FileContents saved;
+    saved.data = NULL;
+    saved.mapped = 0;
+
+    if (ApplyPatchTo(source, patch, NullSink, NULL, &ctx, bonus_data) != 0) {
+        printf("applying patch failed\n");
+        return 1;
+    }
+    if (memcmp(MH_SHA_final(&ctx), target_sha1, SHA_DIGEST_SIZE) != 0) {
+        printf("patch did not produce expected sha1\n");
+        return 1;
+    }
+
+    if (from_original) {
+        if (MakeFreeSpaceOnCache(source->size) < 0) {
+            printf("not enough free space on /cache\n");
+            return 1;
+        }
+        if (SaveFileContents(CACHE_TEMP_SOURCE, source) < 0) {
+            printf("failed to back up source file\n");
+            return 1;
+        }
+        if (MapFileContents(CACHE_TEMP_SOURCE, &saved, RETOUCH_DONT_MASK) != 0 ||
+            memcmp(saved.sha1, source->sha1, SHA_DIGEST_SIZE) != 0) {
+            printf("backup of source file doesn't match source\n");
+            FreeFileContents(&saved);
+            return 1;
+        }
+        source = &saved;
+    }
+
+    int result;
+    int attempt;
+    for (attempt = 0; ; ++attempt) {
+        PartitionWriter pw;
+        if (OpenPartitionWriter(&pw, target_filename) != 0) {
+            result = -1;
+            break;
+        }
+        result = ApplyPatchTo(source, patch, PartitionSink, &pw, &ctx, bonus_data);
+        if (result == 0 &&
+            memcmp(MH_SHA_final(&ctx), target_sha1, SHA_DIGEST_SIZE) != 0) {
+            printf("patch did not produce expected sha1\n");
+            result = -1;
+        }
+        if (ClosePartitionWriter(&pw, result == 0 ? target_sha1 : NULL) != 0) {
+            result = -1;
+        }
+        // An EMMC write that doesn't read back right gets one more
+        // try, as when the output was written from memory.
+        if (result == 0 || pw.type != EMMC || attempt > 0) break;
+        printf("retrying write of %s\n", target_filename);
+    }
+    FreeFileContents(&saved);
+
+    if (result != 0) {
+        printf("write of patched data to %s failed\n", target_filename);
+        return 1;
+    }
+    printf("now ");
+    print_short_sha1(target_sha1);
+    putchar('\n');
+
+    // The partition has the target now, so the saved source isn't
+    // needed, whichever run saved it.
+    unlink(CACHE_TEMP_SOURCE);
+    return 0;
+}
+
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
                           FileContents* copy_file,
@@ -815,11 +1011,37 @@ static int GenerateTarget(FileContents* source_file,
     int retry = 1;
     SHA_CTX ctx;
     int output;
-    MemorySinkInfo msi;
     FileContents* source_to_use;
+    const Value* patch;
     char* outname;
     int made_copy = 0;
 
+    if (source_patch_value != NULL) {
+        source_to_use = source_file;
+        patch = source_patch_value;
+    } else {
+        source_to_use = copy_file;
+        patch = copy_patch_value;
+    }
+
+    if (patch->type != VAL_BLOB) {
+        printf("patch is not a blob\n");
+        return 1;
+    }
+    if (patch->size < 8 ||
+        (memcmp(patch->data, "BSDIFF40", 8) != 0 &&
+         memcmp(patch->data, "IMGDIFF2", 8) != 0)) {
+        printf("Unknown patch file format\n");
+        return 1;
+    }
+
+    if (strncmp(target_filename, "MTD:", 4) == 0 ||
+        strncmp(target_filename, "EMMC:", 5) == 0) {
+        return GeneratePartitionTarget(source_to_use, source_patch_value != NULL,
+                                       patch, target_filename, target_sha1,
+                                       bonus_data);
+    }
+
     // assume that target_filename (eg "/system/app/Foo.apk") is located
     // on the same filesystem as its top-level directory ("/system").
     // We need something that exists for calling statfs().
@@ -836,147 +1058,70 @@ static int GenerateTarget(FileContents* source_file,
     do {
         // Is there enough room in the target filesystem to hold the patched
         // file?
+        int enough_space = 0;
+        if (retry > 0) {
+            size_t free_space = FreeSpaceForFile(target_fs);
+            enough_space =
+                (free_space > (256 << 10)) &&          // 256k (two-block) minimum
+                (free_space > (target_size * 3 / 2));  // 50% margin of error
+            if (!enough_space) {
+                printf("target %ld bytes; free space %ld bytes; retry %d; enough %d\n",
+                       (long)target_size, (long)free_space, retry, enough_space);
+            }
+        }
+
+        if (!enough_space) {
+            retry = 0;
+        }
 
-        if (strncmp(target_filename, "MTD:", 4) == 0 ||
-            strncmp(target_filename, "EMMC:", 5) == 0) {
-            // If the target is a partition, we're actually going to
-            // write the output to /tmp and then copy it to the
-            // partition.  statfs() always returns 0 blocks free for
-            // /tmp, so instead we'll just assume that /tmp has enough
-            // space to hold the file.
+        if (!enough_space && source_patch_value != NULL) {
+            // Using the original source, but not enough free space.  First
+            // copy the source file to cache, then delete it from the original
+            // location.
+
+            if (strncmp(source_filename, "MTD:", 4) == 0 ||
+                strncmp(source_filename, "EMMC:", 5) == 0) {
+                // It's impossible to free space on the target filesystem by
+                // deleting the source if the source is a partition.  If
+                // we're ever in a state where we need to do this, fail.
+                printf("not enough free space for target but source "
+                       "is partition\n");
+                return 1;
+            }
 
-            // We still write the original source to cache, in case
-            // the partition write is interrupted.
             if (MakeFreeSpaceOnCache(source_file->size) < 0) {
                 printf("not enough free space on /cache\n");
                 return 1;
             }
+
             if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
                 printf("failed to back up source file\n");
                 return 1;
             }
             made_copy = 1;
-            retry = 0;
-        } else {
-            int enough_space = 0;
-            if (retry > 0) {
-                size_t free_space = FreeSpaceForFile(target_fs);
-                enough_space =
-                    (free_space > (256 << 10)) &&          // 256k (two-block) minimum
-                    (free_space > (target_size * 3 / 2));  // 50% margin of error
-                if (!enough_space) {
-                    printf("target %ld bytes; free space %ld bytes; retry %d; enough %d\n",
-                           (long)target_size, (long)free_space, retry, enough_space);
-                }
-            }
+            unlink(source_filename);
 
-            if (!enough_space) {
-                retry = 0;
-            }
-
-            if (!enough_space && source_patch_value != NULL) {
-                // Using the original source, but not enough free space.  First
-                // copy the source file to cache, then delete it from the original
-                // location.
-
-                if (strncmp(source_filename, "MTD:", 4) == 0 ||
-                    strncmp(source_filename, "EMMC:", 5) == 0) {
-                    // It's impossible to free space on the target filesystem by
-                    // deleting the source if the source is a partition.  If
-                    // we're ever in a state where we need to do this, fail.
-                    printf("not enough free space for target but source "
-                           "is partition\n");
-                    return 1;
-                }
-
-                if (MakeFreeSpaceOnCache(source_file->size) < 0) {
-                    printf("not enough free space on /cache\n");
-                    return 1;
-                }
-
-                if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
-                    printf("failed to back up source file\n");
-                    return 1;
-                }
-                made_copy = 1;
-                unlink(source_filename);
-
-                size_t free_space = FreeSpaceForFile(target_fs);
-                printf("(now %ld bytes free for target) ", (long)free_space);
-            }
+            size_t free_space = FreeSpaceForFile(target_fs);
+            printf("(now %ld bytes free for target) ", (long)free_space);
         }
 
-        const Value* patch;
-        if (source_patch_value != NULL) {
-            source_to_use = source_file;
-            patch = source_patch_value;
-        } else {
-            source_to_use = copy_file;
-            patch = copy_patch_value;
-        }
+        // We write the decoded output to "<tgt-file>.patch".
+        outname = (char*)malloc(strlen(target_filename) + 10);
+        strcpy(outname, target_filename);
+        strcat(outname, ".patch");
 
-        if (patch->type != VAL_BLOB) {
-            printf("patch is not a blob\n");
+        output = open(outname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (output < 0) {
+            printf("failed to open output file %s: %s\n",
+                   outname, strerror(errno));
             return 1;
         }
 
-        SinkFn sink = NULL;
-        void* token = NULL;
-        output = -1;
-        outname = NULL;
-        if (strncmp(target_filename, "MTD:", 4) == 0 ||
-            strncmp(target_filename, "EMMC:", 5) == 0) {
-            // We store the decoded output in memory.
-            msi.buffer = malloc(target_size);
-            if (msi.buffer == NULL) {
-                printf("failed to alloc %ld bytes for output\n",
-                       (long)target_size);
-                return 1;
-            }
-            msi.pos = 0;
-            msi.size = target_size;
-            sink = MemorySink;
-            token = &msi;
-        } else {
-            // We write the decoded output to "<tgt-file>.patch".
-            outname = (char*)malloc(strlen(target_filename) + 10);
-            strcpy(outname, target_filename);
-            strcat(outname, ".patch");
-
-            output = open(outname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-            if (output < 0) {
-                printf("failed to open output file %s: %s\n",
-                       outname, strerror(errno));
-                return 1;
-            }
-            sink = FileSink;
-            token = &output;
-        }
-
-        char* header = patch->data;
-        ssize_t header_bytes_read = patch->size;
-
-        SHA_init(&ctx);
+        int result = ApplyPatchTo(source_to_use, patch, FileSink, &output,
+                                  &ctx, bonus_data);
 
-        int result;
-
-        if (header_bytes_read >= 8 &&
-            memcmp(header, "BSDIFF40", 8) == 0) {
-            result = ApplyBSDiffPatch(source_to_use->data, source_to_use->size,
-                                      patch, 0, sink, token, &ctx);
-        } else if (header_bytes_read >= 8 &&
-                   memcmp(header, "IMGDIFF2", 8) == 0) {
-            result = ApplyImagePatch(source_to_use->data, source_to_use->size,
-                                     patch, sink, token, &ctx, bonus_data);
-        } else {
-            printf("Unknown patch file format\n");
-            return 1;
-        }
-
-        if (output >= 0) {
-            fsync(output);
-            close(output);
-        }
+        fsync(output);
+        close(output);
 
         if (result != 0) {
             if (retry == 0) {
@@ -985,16 +1130,14 @@ static int GenerateTarget(FileContents* source_file,
             } else {
                 printf("applying patch failed; retrying\n");
             }
-            if (outname != NULL) {
-                unlink(outname);
-            }
+            unlink(outname);
         } else {
             // succeeded; no need to retry
             break;
         }
     } while (retry-- > 0);
 
-    const uint8_t* current_target_sha1 = SHA_final(&ctx);
+    const uint8_t* current_target_sha1 = MH_SHA_final(&ctx);
     if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_SIZE) != 0) {
         printf("patch did not produce expected sha1\n");
         return 1;
@@ -1004,32 +1147,23 @@ static int GenerateTarget(FileContents* source_file,
         putchar('\n');
     }
 
-    if (output < 0) {
-        // Copy the temp file to the partition.
-        if (WriteToPartition(msi.buffer, msi.pos, target_filename) != 0) {
-            printf("write of patched data to %s failed\n", target_filename);
-            return 1;
-        }
-        free(msi.buffer);
-    } else {
-        // Give the .patch file the same owner, group, and mode of the
-        // original source file.
-        if (chmod(outname, source_to_use->st.st_mode) != 0) {
-            printf("chmod of \"%s\" failed: %s\n", outname, strerror(errno));
-            return 1;
-        }
-        if (chown(outname, source_to_use->st.st_uid,
-                  source_to_use->st.st_gid) != 0) {
-            printf("chown of \"%s\" failed: %s\n", outname, strerror(errno));
-            return 1;
-        }
+    // Give the .patch file the same owner, group, and mode of the
+    // original source file.
+    if (chmod(outname, source_to_use->st.st_mode) != 0) {
+        printf("chmod of \"%s\" failed: %s\n", outname, strerror(errno));
+        return 1;
+    }
+    if (chown(outname, source_to_use->st.st_uid,
+              source_to_use->st.st_gid) != 0) {
+        printf("chown of \"%s\" failed: %s\n", outname, strerror(errno));
+        return 1;
+    }
 
-        // Finally, rename the .patch file to replace the target file.
-        if (rename(outname, target_filename) != 0) {
-            printf("rename of .patch to \"%s\" failed: %s\n",
-                   target_filename, strerror(errno));
-            return 1;
-        }
+    // Finally, rename the .patch file to replace the target file.
+    if (rename(outname, target_filename) != 0) {
+        printf("rename of .patch to \"%s\" failed: %s\n",
+               target_filename, strerror(errno));
+        return 1;
     }
 
     // If this run of applypatch created the copy, and we're here, we
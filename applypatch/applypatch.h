@@ -32,6 +32,7 @@ typedef struct _FileContents {
   unsigned char* data;
   ssize_t size;
   struct stat st;
+  size_t mapped;    // length of the mapping if data is mmap()ed, else 0
 } FileContents;
 
 // When there isn't enough room on the target filesystem to hold the
@@ -63,6 +64,11 @@ int applypatch_check(const char* filename,
 
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag);
+// Like LoadFileContents(), but maps files and EMMC partitions rather
+// than reading them into memory.  Free the result with
+// FreeFileContents().
+int MapFileContents(const char* filename, FileContents* file,
+                    int retouch_flag);
 int SaveFileContents(const char* filename, const FileContents* file);
 void FreeFileContents(FileContents* file);
 int FindMatchingPatch(uint8_t* sha1, char* const * const patch_sha1_str,
@@ -76,6 +82,20 @@ int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
 int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
                         const Value* patch, ssize_t patch_offset,
                         unsigned char** new_data, ssize_t* new_size);
+// Whether ApplyBSDiffPatchMem() decodes the patch's bzip2 streams on
+// threads of their own: 1 always, 0 never, -1 (the default) when
+// there's more than one CPU and the output is large.
+void SetBSDiffPipelined(int enabled);
+
+// diffadd.c
+// dst[i] += src[i] for each of the len bytes, with the fastest
+// implementation this CPU has.
+void BSDiffAddBytes(unsigned char* dst, const unsigned char* src, size_t len);
+// Name of the implementation in use: "avx2", "sse2", "neon" or "scalar".
+const char* BSDiffAddBackend(void);
+// Switch to the named implementation, for benchmarks and tests.
+// Returns 0 on success, or -1 if this build or CPU doesn't have it.
+int SetBSDiffAddBackend(const char* name);
 
 // imgpatch.c
 int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
@@ -84,6 +84,7 @@ cleanup() {
   run_command rm $WORK_DIR/foo
   run_command rm $WORK_DIR/patch.bsdiff
   run_command rm $WORK_DIR/applypatch
+  run_command rm $WORK_DIR/diffadd_bench
   run_command rm $CACHE_TEMP_SOURCE
   run_command rm /cache/bloat*.dat
 
@@ -113,6 +114,16 @@ testname "display license"
 run_command $WORK_DIR/applypatch -l | grep -q -i copyright || fail
 
 
+# --------------- diff-add step ----------------------
+
+# Times each implementation of bspatch's diff-add step the device
+# supports; fails if any of them disagrees with a plain add.
+$ADB push $ANDROID_PRODUCT_OUT/system/bin/diffadd_bench $WORK_DIR/diffadd_bench
+
+testname "diff-add backends"
+run_command $WORK_DIR/diffadd_bench 16 || fail
+
+
 # --------------- check mode ----------------------
 
 $ADB push $DATA_DIR/old.file $WORK_DIR
@@ -50,13 +50,37 @@
 #include <bzlib.h>
 #include <err.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "sais.h"
+
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
+/* The sorted suffixes of old, starting with the empty suffix.  When old
+   is under 2GB, SuffixSort() builds them in linear time with 32-bit
+   indices, in I32; otherwise qsufsort() builds them in I, using twice
+   that again in V while it works. */
+typedef struct {
+	int32_t *I32;
+	off_t *I;
+} SuffixArray;
+
+#define SUFFIX(sa,i) ((sa)->I32!=NULL ? (off_t)(sa)->I32[i] : (sa)->I[i])
+
+static int use_sais = 1;
+
+/* Make bsdiff() build its suffix arrays with qsufsort() (0) or, when
+   old is small enough, with SuffixSort() (1, the default).  Both give
+   the same order, so the same patch. */
+void SetBSDiffSuffixSort(int sais)
+{
+	use_sais = sais;
+}
+
 static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
 {
 	off_t i,j,k,x,tmp,jj,kk;
@@ -166,29 +190,66 @@ static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 	return i;
 }
 
-static off_t search(off_t *I,u_char *old,off_t oldsize,
+static SuffixArray *sortsuffixes(u_char *old,off_t oldsize)
+{
+	SuffixArray *sa;
+	off_t *V;
+
+	if((sa=calloc(1,sizeof(SuffixArray)))==NULL) err(1,NULL);
+	if(use_sais && oldsize<INT32_MAX) {
+		if((sa->I32=malloc((oldsize+1)*sizeof(int32_t)))==NULL)
+			err(1,NULL);
+		sa->I32[0]=oldsize;
+		if(SuffixSort(old,sa->I32+1,oldsize)!=0) err(1,NULL);
+	} else {
+		if(((sa->I=malloc((oldsize+1)*sizeof(off_t)))==NULL) ||
+			((V=malloc((oldsize+1)*sizeof(off_t)))==NULL)) err(1,NULL);
+		qsufsort(sa->I,V,old,oldsize);
+		free(V);
+	}
+	return sa;
+}
+
+/* Free a suffix array that bsdiff() left in *IP, if there is one, and
+   clear *IP. */
+void FreeSuffixArray(void** IP)
+{
+	SuffixArray *sa=*IP;
+
+	if(sa!=NULL) {
+		free(sa->I32);
+		free(sa->I);
+		free(sa);
+		*IP=NULL;
+	}
+}
+
+static off_t search(const SuffixArray *sa,u_char *old,off_t oldsize,
 		u_char *new,off_t newsize,off_t st,off_t en,off_t *pos)
 {
-	off_t x,y;
+	off_t x,y,ist,ien,ix;
 
 	if(en-st<2) {
-		x=matchlen(old+I[st],oldsize-I[st],new,newsize);
-		y=matchlen(old+I[en],oldsize-I[en],new,newsize);
+		ist=SUFFIX(sa,st);
+		ien=SUFFIX(sa,en);
+		x=matchlen(old+ist,oldsize-ist,new,newsize);
+		y=matchlen(old+ien,oldsize-ien,new,newsize);
 
 		if(x>y) {
-			*pos=I[st];
+			*pos=ist;
 			return x;
 		} else {
-			*pos=I[en];
+			*pos=ien;
 			return y;
 		}
 	};
 
 	x=st+(en-st)/2;
-	if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) {
-		return search(I,old,oldsize,new,newsize,x,en,pos);
+	ix=SUFFIX(sa,x);
+	if(memcmp(old+ix,new,MIN(oldsize-ix,newsize))<0) {
+		return search(sa,old,oldsize,new,newsize,x,en,pos);
 	} else {
-		return search(I,old,oldsize,new,newsize,st,x,pos);
+		return search(sa,old,oldsize,new,newsize,st,x,pos);
 	};
 }
 
@@ -216,16 +277,19 @@ static void offtout(off_t x,u_char *buf)
 //      data from files.  old and new are owned by the caller; we
 //      don't free them at the end.
 //
-//    - the "I" block of memory is owned by the caller, who passes a
-//      pointer to *I, which can be NULL.  This way if we call
-//      bsdiff() multiple times with the same 'old' data, we only do
-//      the qsufsort() step the first time.
+//    - the suffix array is owned by the caller, who passes a pointer
+//      to it in *IP, which can be NULL.  This way if we call bsdiff()
+//      multiple times with the same 'old' data, we only sort its
+//      suffixes the first time.  FreeSuffixArray() frees it.
 //
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
+//    - the suffixes are sorted by SuffixSort() rather than qsufsort()
+//      when 'old' is small enough; see sortsuffixes().
+//
+int bsdiff(u_char* old, off_t oldsize, void** IP, u_char* new, off_t newsize,
            const char* patch_filename)
 {
 	int fd;
-	off_t *I;
+	SuffixArray *sa;
 	off_t scan,pos,len;
 	off_t lastscan,lastpos,lastoffset;
 	off_t oldscore,scsc;
@@ -241,13 +305,9 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	int bz2err;
 
         if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
+            *IP = sortsuffixes(old, oldsize);
         }
-        I = *IP;
+        sa = *IP;
 
 	if(((db=malloc(newsize+1))==NULL) ||
 		((eb=malloc(newsize+1))==NULL)) err(1,NULL);
@@ -284,7 +344,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 		oldscore=0;
 
 		for(scsc=scan+=len;scan<newsize;scan++) {
-			len=search(I,old,oldsize,new+scan,newsize-scan,
+			len=search(sa,old,oldsize,new+scan,newsize-scan,
 					0,oldsize,&pos);
 
 			for(;scsc<scan+len;scsc++)
@@ -21,14 +21,16 @@
 // notice.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
 
 #include <bzlib.h>
 
-#include "mincrypt/sha.h"
+#include "minhash/sha.h"
 #include "applypatch.h"
 
 void ShowBSDiffLicense() {
@@ -92,114 +94,283 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
         }
         if (stream->avail_out > 0) {
             printf("need %d more bytes\n", stream->avail_out);
+            if (bzerr == BZ_OK && stream->avail_in == 0) {
+                printf("bzip2 stream truncated\n");
+                return -1;
+            }
         }
     }
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
+// Decoding the three bzip2 streams is most of the work of applying a
+// patch.  With more than one CPU, each stream gets a thread of its own
+// that decodes it into a ring buffer, and the control loop below reads
+// from the three buffers instead.
+
+// Size of each stream's ring buffer.
+#define PIPE_BUFFER_SIZE (256 * 1024)
+
+// Outputs smaller than this are decoded on the calling thread; the
+// threads would cost more than they save.
+#define PIPE_MIN_OUTPUT (1024 * 1024)
+
+// -1 to decide by the number of CPUs.
+static int pipelined = -1;
+
+void SetBSDiffPipelined(int enabled) {
+    pipelined = enabled;
+}
+
+// One of the patch's bzip2 streams, and, if it's being decoded on its
+// own thread, that thread's ring buffer.
+typedef struct {
+    bz_stream stream;
+    int threaded;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // signalled whenever any of the below changes
+    unsigned char* ring;
+    unsigned long long produced;    // total bytes decoded into ring
+    unsigned long long consumed;    // total bytes taken out of it
+    int error;
+    int eof;
+    int stop;
+} BzReader;
+
+static void* BzDecodeThread(void* cookie) {
+    BzReader* r = (BzReader*)cookie;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->stop && !r->eof && !r->error) {
+        size_t filled = r->produced - r->consumed;
+        if (filled == PIPE_BUFFER_SIZE) {
+            pthread_cond_wait(&r->cond, &r->lock);
+            continue;
+        }
+        // Decode into the free space up to the end of the ring.
+        size_t pos = r->produced % PIPE_BUFFER_SIZE;
+        size_t space = PIPE_BUFFER_SIZE - filled;
+        if (space > PIPE_BUFFER_SIZE - pos) space = PIPE_BUFFER_SIZE - pos;
+        pthread_mutex_unlock(&r->lock);
+
+        r->stream.next_out = (char*)r->ring + pos;
+        r->stream.avail_out = space;
+        int bzerr = BZ2_bzDecompress(&r->stream);
+        size_t got = space - r->stream.avail_out;
+
+        pthread_mutex_lock(&r->lock);
+        r->produced += got;
+        if (bzerr == BZ_STREAM_END) {
+            r->eof = 1;
+        } else if (bzerr != BZ_OK) {
+            printf("bz error %d decompressing\n", bzerr);
+            r->error = 1;
+        } else if (got == 0 && r->stream.avail_in == 0) {
+            printf("bzip2 stream truncated\n");
+            r->error = 1;
+        }
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
 
-    unsigned char* new_data;
-    ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
+static int BzReaderInit(BzReader* r, char* data, ssize_t len, int threaded) {
+    memset(r, 0, sizeof(*r));
+    r->stream.next_in = data;
+    r->stream.avail_in = len;
+    r->stream.bzalloc = NULL;
+    r->stream.bzfree = NULL;
+    r->stream.opaque = NULL;
+    int bzerr = BZ2_bzDecompressInit(&r->stream, 0, 0);
+    if (bzerr != BZ_OK) {
+        printf("failed to bzinit stream (%d)\n", bzerr);
         return -1;
     }
+    if (!threaded) {
+        return 0;
+    }
 
-    if (sink(new_data, new_size, token) < new_size) {
-        printf("short write of output: %d (%s)\n", errno, strerror(errno));
-        return 1;
+    r->ring = malloc(PIPE_BUFFER_SIZE);
+    if (r->ring == NULL) {
+        return 0;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    if (pthread_create(&r->thread, NULL, BzDecodeThread, r) != 0) {
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+        free(r->ring);
+        r->ring = NULL;
+        return 0;
     }
-    if (ctx) {
-        SHA_update(ctx, new_data, new_size);
+    r->threaded = 1;
+    return 0;
+}
+
+// Read exactly size bytes of the stream into buffer.
+static int BzRead(BzReader* r, unsigned char* buffer, off_t size) {
+    if (!r->threaded) {
+        return FillBuffer(buffer, size, &r->stream);
     }
-    free(new_data);
 
+    pthread_mutex_lock(&r->lock);
+    while (size > 0) {
+        size_t filled = r->produced - r->consumed;
+        if (filled == 0) {
+            if (r->eof || r->error) {
+                if (r->eof) printf("need %ld more bytes\n", (long)size);
+                pthread_mutex_unlock(&r->lock);
+                return -1;
+            }
+            pthread_cond_wait(&r->cond, &r->lock);
+            continue;
+        }
+        size_t pos = r->consumed % PIPE_BUFFER_SIZE;
+        size_t n = filled;
+        if (n > PIPE_BUFFER_SIZE - pos) n = PIPE_BUFFER_SIZE - pos;
+        if ((off_t)n > size) n = size;
+        pthread_mutex_unlock(&r->lock);
+
+        // The decoder doesn't touch the filled part of the ring.
+        memcpy(buffer, r->ring + pos, n);
+        buffer += n;
+        size -= n;
+
+        pthread_mutex_lock(&r->lock);
+        r->consumed += n;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
     return 0;
 }
 
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        unsigned char** new_data, ssize_t* new_size) {
-    // Patch data format:
-    //   0       8       "BSDIFF40"
-    //   8       8       X
-    //   16      8       Y
-    //   24      8       sizeof(newfile)
-    //   32      X       bzip2(control block)
-    //   32+X    Y       bzip2(diff block)
-    //   32+X+Y  ???     bzip2(extra block)
-    // with control block a set of triples (x,y,z) meaning "add x bytes
-    // from oldfile to x bytes from the diff block; copy y bytes from the
-    // extra block; seek forwards in oldfile by z bytes".
+static void BzReaderEnd(BzReader* r) {
+    if (r->threaded) {
+        pthread_mutex_lock(&r->lock);
+        r->stop = 1;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        pthread_join(r->thread, NULL);
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+        free(r->ring);
+        r->threaded = 0;
+    }
+    BZ2_bzDecompressEnd(&r->stream);
+}
+
+// Where a patch's output goes.  It is built up a window at a time in
+// buffer, which is then handed to the sink, if there is one.  Without
+// a sink the buffer holds the whole output.
+typedef struct {
+    unsigned char* buffer;
+    size_t size;
+    size_t fill;
+    SinkFn sink;
+    void* token;
+    SHA_CTX* ctx;
+} OutputWindow;
+
+// How much output ApplyBSDiffPatch() holds before passing it on.
+#define OUTPUT_WINDOW_SIZE (1024 * 1024)
+
+static int FlushWindow(OutputWindow* w) {
+    if (w->sink == NULL || w->fill == 0) {
+        return 0;
+    }
+    if (w->sink(w->buffer, w->fill, w->token) < (ssize_t)w->fill) {
+        printf("short write of output: %d (%s)\n", errno, strerror(errno));
+        return -1;
+    }
+    if (w->ctx) {
+        MH_SHA_update(w->ctx, w->buffer, w->fill);
+    }
+    w->fill = 0;
+    return 0;
+}
 
+// Patch data format:
+//   0       8       "BSDIFF40"
+//   8       8       X
+//   16      8       Y
+//   24      8       sizeof(newfile)
+//   32      X       bzip2(control block)
+//   32+X    Y       bzip2(diff block)
+//   32+X+Y  ???     bzip2(extra block)
+// with control block a set of triples (x,y,z) meaning "add x bytes
+// from oldfile to x bytes from the diff block; copy y bytes from the
+// extra block; seek forwards in oldfile by z bytes".
+static int ReadBSDiffHeader(const Value* patch, ssize_t patch_offset,
+                            ssize_t* ctrl_len, ssize_t* data_len,
+                            ssize_t* extra_len, ssize_t* new_size) {
     unsigned char* header = (unsigned char*) patch->data + patch_offset;
+    if (patch_offset < 0 || patch->size - patch_offset < 32) {
+        printf("patch too short to contain bsdiff header\n");
+        return 1;
+    }
     if (memcmp(header, "BSDIFF40", 8) != 0) {
         printf("corrupt bsdiff patch file header (magic number)\n");
         return 1;
     }
 
-    ssize_t ctrl_len, data_len;
-    ctrl_len = offtin(header+8);
-    data_len = offtin(header+16);
+    *ctrl_len = offtin(header+8);
+    *data_len = offtin(header+16);
     *new_size = offtin(header+24);
 
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
+    if (*ctrl_len < 0 || *data_len < 0 || *new_size < 0) {
         printf("corrupt patch file header (data lengths)\n");
         return 1;
     }
 
-    int bzerr;
-
-    bz_stream cstream;
-    cstream.next_in = patch->data + patch_offset + 32;
-    cstream.avail_in = ctrl_len;
-    cstream.bzalloc = NULL;
-    cstream.bzfree = NULL;
-    cstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&cstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit control stream (%d)\n", bzerr);
+    *extra_len = patch->size - (patch_offset + 32 + *ctrl_len + *data_len);
+    if (*extra_len < 0) {
+        printf("corrupt patch file header (data lengths)\n");
+        return 1;
     }
+    return 0;
+}
 
-    bz_stream dstream;
-    dstream.next_in = patch->data + patch_offset + 32 + ctrl_len;
-    dstream.avail_in = data_len;
-    dstream.bzalloc = NULL;
-    dstream.bzfree = NULL;
-    dstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&dstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit diff stream (%d)\n", bzerr);
+// Run the control triples, producing new_size bytes of output into w.
+static int RunBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                          const Value* patch, ssize_t patch_offset,
+                          ssize_t ctrl_len, ssize_t data_len,
+                          ssize_t extra_len, ssize_t new_size,
+                          OutputWindow* w) {
+    int threaded = pipelined;
+    if (threaded < 0) {
+        threaded = new_size >= PIPE_MIN_OUTPUT &&
+                   sysconf(_SC_NPROCESSORS_ONLN) > 1;
     }
 
-    bz_stream estream;
-    estream.next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
-    estream.avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
-    estream.bzalloc = NULL;
-    estream.bzfree = NULL;
-    estream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&estream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit extra stream (%d)\n", bzerr);
+    char* blocks = patch->data + patch_offset + 32;
+    BzReader cstream, dstream, estream;
+    if (BzReaderInit(&cstream, blocks, ctrl_len, threaded) != 0) {
+        return 1;
     }
-
-    *new_data = malloc(*new_size);
-    if (*new_data == NULL) {
-        printf("failed to allocate %ld bytes of memory for output file\n",
-               (long)*new_size);
+    if (BzReaderInit(&dstream, blocks + ctrl_len, data_len, threaded) != 0) {
+        BzReaderEnd(&cstream);
+        return 1;
+    }
+    if (BzReaderInit(&estream, blocks + ctrl_len + data_len, extra_len,
+                     threaded) != 0) {
+        BzReaderEnd(&cstream);
+        BzReaderEnd(&dstream);
         return 1;
     }
 
+    int result = 1;
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
+    off_t left;
     unsigned char buf[24];
-    while (newpos < *new_size) {
+    while (newpos < new_size) {
         // Read control data
-        if (FillBuffer(buf, 24, &cstream) != 0) {
+        if (BzRead(&cstream, buf, 24) != 0) {
             printf("error while reading control stream\n");
-            return 1;
+            goto done;
         }
         ctrl[0] = offtin(buf);
         ctrl[1] = offtin(buf+8);
@@ -207,51 +378,137 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
 
         if (ctrl[0] < 0 || ctrl[1] < 0) {
             printf("corrupt patch (negative byte counts)\n");
-            return 1;
+            goto done;
         }
 
         // Sanity check
-        if (newpos + ctrl[0] > *new_size) {
+        if (newpos + ctrl[0] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto done;
         }
 
-        // Read diff string
-        if (FillBuffer(*new_data + newpos, ctrl[0], &dstream) != 0) {
-            printf("error while reading diff stream\n");
-            return 1;
-        }
+        // Read diff string and add old data to it, where there is old
+        // data, as much as fits in the window at a time
+        for (left = ctrl[0]; left > 0; ) {
+            off_t n = w->size - w->fill;
+            if (n > left) n = left;
+            unsigned char* out = w->buffer + w->fill;
+            if (BzRead(&dstream, out, n) != 0) {
+                printf("error while reading diff stream\n");
+                goto done;
+            }
 
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
+            off_t add_start = oldpos < 0 ? -oldpos : 0;
+            off_t add_end = n;
+            if (oldpos + add_end > old_size) add_end = old_size - oldpos;
+            if (add_end > add_start) {
+                BSDiffAddBytes(out + add_start, old_data + oldpos + add_start,
+                               add_end - add_start);
             }
-        }
 
-        // Adjust pointers
-        newpos += ctrl[0];
-        oldpos += ctrl[0];
+            // Adjust pointers
+            w->fill += n;
+            newpos += n;
+            oldpos += n;
+            left -= n;
+            if (w->fill == w->size && FlushWindow(w) != 0) {
+                goto done;
+            }
+        }
 
         // Sanity check
-        if (newpos + ctrl[1] > *new_size) {
+        if (newpos + ctrl[1] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto done;
         }
 
         // Read extra string
-        if (FillBuffer(*new_data + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
+        for (left = ctrl[1]; left > 0; ) {
+            off_t n = w->size - w->fill;
+            if (n > left) n = left;
+            if (BzRead(&estream, w->buffer + w->fill, n) != 0) {
+                printf("error while reading extra stream\n");
+                goto done;
+            }
+            w->fill += n;
+            newpos += n;
+            left -= n;
+            if (w->fill == w->size && FlushWindow(w) != 0) {
+                goto done;
+            }
         }
 
         // Adjust pointers
-        newpos += ctrl[1];
         oldpos += ctrl[2];
     }
+    result = FlushWindow(w) != 0;
+
+  done:
+    BzReaderEnd(&cstream);
+    BzReaderEnd(&dstream);
+    BzReaderEnd(&estream);
+    return result;
+}
+
+// Apply the patch, passing the output to the sink (and hash) a window
+// at a time as it is produced, so that memory use doesn't grow with
+// the size of the target.
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
+    ssize_t ctrl_len, data_len, extra_len, new_size;
+    if (ReadBSDiffHeader(patch, patch_offset, &ctrl_len, &data_len,
+                         &extra_len, &new_size) != 0) {
+        return -1;
+    }
+
+    OutputWindow w;
+    w.size = new_size < OUTPUT_WINDOW_SIZE ? new_size : OUTPUT_WINDOW_SIZE;
+    w.buffer = malloc(w.size > 0 ? w.size : 1);
+    if (w.buffer == NULL) {
+        printf("failed to allocate %zu bytes of memory for output\n", w.size);
+        return -1;
+    }
+    w.fill = 0;
+    w.sink = sink;
+    w.token = token;
+    w.ctx = ctx;
+
+    int result = RunBSDiffPatch(old_data, old_size, patch, patch_offset,
+                                ctrl_len, data_len, extra_len, new_size, &w);
+    free(w.buffer);
+    return result != 0 ? -1 : 0;
+}
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        unsigned char** new_data, ssize_t* new_size) {
+    ssize_t ctrl_len, data_len, extra_len;
+    if (ReadBSDiffHeader(patch, patch_offset, &ctrl_len, &data_len,
+                         &extra_len, new_size) != 0) {
+        return 1;
+    }
 
-    BZ2_bzDecompressEnd(&cstream);
-    BZ2_bzDecompressEnd(&dstream);
-    BZ2_bzDecompressEnd(&estream);
+    *new_data = malloc(*new_size);
+    if (*new_data == NULL) {
+        printf("failed to allocate %ld bytes of memory for output file\n",
+               (long)*new_size);
+        return 1;
+    }
+
+    OutputWindow w;
+    w.buffer = *new_data;
+    w.size = *new_size;
+    w.fill = 0;
+    w.sink = NULL;
+    w.token = NULL;
+    w.ctx = NULL;
+
+    if (RunBSDiffPatch(old_data, old_size, patch, patch_offset,
+                       ctrl_len, data_len, extra_len, *new_size, &w) != 0) {
+        free(*new_data);
+        *new_data = NULL;
+        return 1;
+    }
     return 0;
 }
@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The byte-wise add at the heart of bspatch: each byte of the diff
+// block is added, modulo 256, to the byte at the same offset in the
+// old file.  For a large image that's most of its bytes, so use the
+// widest vectors the CPU has.
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "applypatch.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_X86_ADD 1
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_ADD 1
+#endif
+
+typedef void (*AddFn)(unsigned char* dst, const unsigned char* src, size_t len);
+
+static void AddScalar(unsigned char* dst, const unsigned char* src, size_t len) {
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        dst[i] += src[i];
+    }
+}
+
+#ifdef HAVE_X86_ADD
+static int HasSse2(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+    return (edx & bit_SSE2) != 0;
+}
+
+// AVX2 needs the CPU to have it and the kernel to save the ymm
+// registers.
+static int HasAvx2(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) return 0;
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6) return 0;
+    if (__get_cpuid_max(0, NULL) < 7) return 0;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 5)) != 0;
+}
+
+__attribute__((target("sse2")))
+static void AddSse2(unsigned char* dst, const unsigned char* src, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m128i a0 = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i a1 = _mm_loadu_si128((const __m128i*)(dst + i + 16));
+        __m128i a2 = _mm_loadu_si128((const __m128i*)(dst + i + 32));
+        __m128i a3 = _mm_loadu_si128((const __m128i*)(dst + i + 48));
+        a0 = _mm_add_epi8(a0, _mm_loadu_si128((const __m128i*)(src + i)));
+        a1 = _mm_add_epi8(a1, _mm_loadu_si128((const __m128i*)(src + i + 16)));
+        a2 = _mm_add_epi8(a2, _mm_loadu_si128((const __m128i*)(src + i + 32)));
+        a3 = _mm_add_epi8(a3, _mm_loadu_si128((const __m128i*)(src + i + 48)));
+        _mm_storeu_si128((__m128i*)(dst + i), a0);
+        _mm_storeu_si128((__m128i*)(dst + i + 16), a1);
+        _mm_storeu_si128((__m128i*)(dst + i + 32), a2);
+        _mm_storeu_si128((__m128i*)(dst + i + 48), a3);
+    }
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+        a = _mm_add_epi8(a, _mm_loadu_si128((const __m128i*)(src + i)));
+        _mm_storeu_si128((__m128i*)(dst + i), a);
+    }
+    AddScalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void AddAvx2(unsigned char* dst, const unsigned char* src, size_t len) {
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i*)(dst + i + 32));
+        __m256i a2 = _mm256_loadu_si256((const __m256i*)(dst + i + 64));
+        __m256i a3 = _mm256_loadu_si256((const __m256i*)(dst + i + 96));
+        a0 = _mm256_add_epi8(a0, _mm256_loadu_si256((const __m256i*)(src + i)));
+        a1 = _mm256_add_epi8(a1, _mm256_loadu_si256((const __m256i*)(src + i + 32)));
+        a2 = _mm256_add_epi8(a2, _mm256_loadu_si256((const __m256i*)(src + i + 64)));
+        a3 = _mm256_add_epi8(a3, _mm256_loadu_si256((const __m256i*)(src + i + 96)));
+        _mm256_storeu_si256((__m256i*)(dst + i), a0);
+        _mm256_storeu_si256((__m256i*)(dst + i + 32), a1);
+        _mm256_storeu_si256((__m256i*)(dst + i + 64), a2);
+        _mm256_storeu_si256((__m256i*)(dst + i + 96), a3);
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(dst + i));
+        a = _mm256_add_epi8(a, _mm256_loadu_si256((const __m256i*)(src + i)));
+        _mm256_storeu_si256((__m256i*)(dst + i), a);
+    }
+    AddScalar(dst + i, src + i, len - i);
+}
+#endif
+
+#ifdef HAVE_NEON_ADD
+// NEON is part of every ARMv8 CPU, and we're only built with it for
+// 32-bit ARM when the platform requires it.
+static int HasNeon(void) {
+    return 1;
+}
+
+static void AddNeon(unsigned char* dst, const unsigned char* src, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint8x16_t a0 = vld1q_u8(dst + i);
+        uint8x16_t a1 = vld1q_u8(dst + i + 16);
+        uint8x16_t a2 = vld1q_u8(dst + i + 32);
+        uint8x16_t a3 = vld1q_u8(dst + i + 48);
+        vst1q_u8(dst + i, vaddq_u8(a0, vld1q_u8(src + i)));
+        vst1q_u8(dst + i + 16, vaddq_u8(a1, vld1q_u8(src + i + 16)));
+        vst1q_u8(dst + i + 32, vaddq_u8(a2, vld1q_u8(src + i + 32)));
+        vst1q_u8(dst + i + 48, vaddq_u8(a3, vld1q_u8(src + i + 48)));
+    }
+    for (; i + 16 <= len; i += 16) {
+        vst1q_u8(dst + i, vaddq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+    }
+    AddScalar(dst + i, src + i, len - i);
+}
+#endif
+
+static int AlwaysSupported(void) {
+    return 1;
+}
+
+typedef struct {
+    const char* name;
+    int (*supported)(void);
+    AddFn add;
+} AddBackend;
+
+// In order of preference.
+static const AddBackend backends[] = {
+#ifdef HAVE_X86_ADD
+    { "avx2", HasAvx2, AddAvx2 },
+    { "sse2", HasSse2, AddSse2 },
+#endif
+#ifdef HAVE_NEON_ADD
+    { "neon", HasNeon, AddNeon },
+#endif
+    { "scalar", AlwaysSupported, AddScalar },
+};
+
+#define NUM_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+static pthread_once_t probe_once = PTHREAD_ONCE_INIT;
+static const AddBackend* backend = &backends[NUM_BACKENDS - 1];
+
+static void ProbeBackend(void) {
+    size_t i;
+    for (i = 0; i < NUM_BACKENDS; ++i) {
+        if (backends[i].supported()) {
+            backend = &backends[i];
+            return;
+        }
+    }
+}
+
+void BSDiffAddBytes(unsigned char* dst, const unsigned char* src, size_t len) {
+    pthread_once(&probe_once, ProbeBackend);
+    backend->add(dst, src, len);
+}
+
+const char* BSDiffAddBackend(void) {
+    pthread_once(&probe_once, ProbeBackend);
+    return backend->name;
+}
+
+int SetBSDiffAddBackend(const char* name) {
+    size_t i;
+    pthread_once(&probe_once, ProbeBackend);
+    for (i = 0; i < NUM_BACKENDS; ++i) {
+        if (strcmp(backends[i].name, name) == 0) {
+            if (!backends[i].supported()) return -1;
+            backend = &backends[i];
+            return 0;
+        }
+    }
+    return -1;
+}
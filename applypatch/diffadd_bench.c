@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Microbenchmark for bspatch's diff-add step, run by applypatch.sh.
+// Times each implementation of BSDiffAddBytes() this CPU supports
+// against a plain loop, at a few lengths, and exits non-zero if any
+// of them gives a different answer.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "applypatch.h"
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char* kBackends[] = { "scalar", "sse2", "avx2", "neon" };
+
+int main(int argc, char** argv) {
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [<MB>]\n", argv[0]);
+        return 2;
+    }
+    size_t length = (argc == 2 ? strtoul(argv[1], NULL, 0) : 64) * 1024 * 1024;
+
+    unsigned char* src = malloc(length);
+    unsigned char* dst = malloc(length);
+    unsigned char* expected = malloc(length);
+    unsigned char* work = malloc(length + 1);
+    if (src == NULL || dst == NULL || expected == NULL || work == NULL) {
+        fprintf(stderr, "failed to allocate %zu bytes\n", length);
+        return 1;
+    }
+    size_t i;
+    srand(1);
+    for (i = 0; i < length; ++i) {
+        src[i] = rand();
+        dst[i] = rand();
+    }
+
+    // Control triples' add lengths run from a few bytes to whole
+    // files; check odd lengths and offsets too, for the tails.
+    static const size_t pieces[] = { 7, 100, 4096, 1024 * 1024, 0 };
+    const char* preferred = BSDiffAddBackend();
+    int failed = 0;
+    size_t p, b;
+
+    printf("default backend: %s\n", preferred);
+    for (p = 0; p < sizeof(pieces) / sizeof(pieces[0]); ++p) {
+        size_t piece = pieces[p] ? pieces[p] : length;
+        size_t count = length / piece;
+        size_t total = count * piece;
+        for (i = 0; i < total; ++i) {
+            expected[i] = dst[i] + src[i];
+        }
+
+        for (b = 0; b < sizeof(kBackends) / sizeof(kBackends[0]); ++b) {
+            if (SetBSDiffAddBackend(kBackends[b]) != 0) {
+                continue;
+            }
+            // Start each run from the same destination bytes.
+            memcpy(work + 1, dst, total);
+            double start = now_sec();
+            for (i = 0; i < count; ++i) {
+                BSDiffAddBytes(work + 1 + i * piece, src + i * piece, piece);
+            }
+            double elapsed = now_sec() - start;
+            int match = memcmp(work + 1, expected, total) == 0;
+            printf("%8zu %-7s %8.1f MB/s%s\n", piece, kBackends[b],
+                   elapsed > 0 ? total / elapsed / (1024 * 1024) : 0.0,
+                   match ? "" : "  MISMATCH");
+            if (!match) failed = 1;
+        }
+    }
+    SetBSDiffAddBackend(preferred);
+
+    free(src);
+    free(dst);
+    free(expected);
+    free(work);
+    return failed;
+}
@@ -143,7 +143,7 @@ typedef struct {
   size_t source_start;
   size_t source_len;
 
-  off_t* I;             // used by bsdiff
+  void* I;              // used by bsdiff
 
   // --- for CHUNK_DEFLATE chunks only: ---
 
@@ -179,8 +179,9 @@ static int fileentry_compare(const void* a, const void* b) {
 }
 
 // from bsdiff.c
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
+int bsdiff(u_char* old, off_t oldsize, void** IP, u_char* new, off_t newsize,
            const char* patch_filename);
+void FreeSuffixArray(void** IP);
 
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
@@ -953,6 +954,8 @@ int main(int argc, char** argv) {
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
                                  num_src_chunks))) {
         patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
+        // A second target of the same name would just sort it again.
+        FreeSuffixArray(&src->I);
       } else {
         patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
       }
@@ -965,10 +968,16 @@ int main(int argc, char** argv) {
      }
 
       patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      FreeSuffixArray(&src_chunks[i].I);
     }
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
   }
+  // In zip mode, the whole source is diffed against any number of
+  // targets, so its suffixes are kept until now.
+  if (num_src_chunks > 0) {
+    FreeSuffixArray(&src_chunks[0].I);
+  }
 
   // Figure out how big the imgdiff file header is going to be, so
   // that we can correctly compute the offset of each bsdiff patch
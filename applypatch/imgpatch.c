@@ -18,216 +18,573 @@
 // format.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/cdefs.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
 
 #include "zlib.h"
-#include "mincrypt/sha.h"
+#include "minhash/sha.h"
 #include "applypatch.h"
 #include "imgdiff.h"
 #include "utils.h"
 
-/*
- * Apply the patch given in 'patch_filename' to the source data given
- * by (old_data, old_size).  Write the patched output to the 'output'
- * file, and update the SHA context with the output data as well.
- * Return 0 on success.
- */
-int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size __unused,
-                    const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx,
-                    const Value* bonus_data) {
+// Most threads to patch chunks on at once.
+#define MAX_PATCH_THREADS 4
+
+// How many chunks past the one being written the workers may get
+// ahead, per thread.  Every finished chunk waiting to be written holds
+// its whole output in memory.
+#define CHUNKS_AHEAD_PER_THREAD 2
+
+// Normal chunks whose output is larger than this, and deflate chunks
+// that expand to more, are streamed to the sink by the writing thread
+// rather than patched into memory by the workers.  This and the limit
+// above bound what the workers hold, whatever the size of the target.
+// The price is that such a chunk is patched on one thread, though the
+// workers still get on with the chunks after it meanwhile.
+#define MAX_BUFFERED_CHUNK (4 << 20)
+
+// How much deflate output to pass to the sink at a time.
+#define DEFLATE_OUTPUT_SIZE 32768
+
+typedef struct {
+    int type;
+
+    // CHUNK_NORMAL and CHUNK_DEFLATE
+    size_t src_start;
+    size_t src_len;
+    size_t patch_offset;
+
+    // CHUNK_NORMAL: the size of its output, from its bsdiff header, or
+    // -1 if there's no sense to be made of that.
+    long long new_size;
+
+    // CHUNK_DEFLATE
+    size_t expanded_len;
+    size_t target_len;
+    int level;
+    int method;
+    int windowBits;
+    int memLevel;
+    int strategy;
+    size_t bonus_size;
+
+    // The chunk's output: for CHUNK_RAW this points into the patch,
+    // for a buffered chunk of another type it's allocated by
+    // BufferChunk().
+    unsigned char* data;
+    ssize_t size;
+    size_t allocated;
+
+    int status;         // nonzero if patching the chunk failed
+    int done;
+} ImageChunk;
+
+// Read and check the header records of all the chunks in the patch.
+static ImageChunk* ReadChunks(const Value* patch, const Value* bonus_data,
+                              int* num_chunks) {
     ssize_t pos = 12;
-    char* header = patch->data;
-    if (patch->size < 12) {
-        printf("patch too short to contain header\n");
-        return -1;
+    int n = Read4(patch->data+8);
+    if (n < 0) {
+        printf("corrupt patch file header (chunk count)\n");
+        return NULL;
     }
-
-    // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW.
-    // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and
-    // CHUNK_GZIP.)
-    if (memcmp(header, "IMGDIFF2", 8) != 0) {
-        printf("corrupt patch file header (magic number)\n");
-        return -1;
+    ImageChunk* chunks = calloc(n > 0 ? n : 1, sizeof(ImageChunk));
+    if (chunks == NULL) {
+        printf("failed to allocate %d chunk records\n", n);
+        return NULL;
     }
 
-    int num_chunks = Read4(header+8);
-
     int i;
-    for (i = 0; i < num_chunks; ++i) {
+    for (i = 0; i < n; ++i) {
+        ImageChunk* c = chunks + i;
+
         // each chunk's header record starts with 4 bytes.
         if (pos + 4 > patch->size) {
             printf("failed to read chunk %d record\n", i);
-            return -1;
+            goto fail;
         }
-        int type = Read4(patch->data + pos);
+        c->type = Read4(patch->data + pos);
         pos += 4;
 
-        if (type == CHUNK_NORMAL) {
+        if (c->type == CHUNK_NORMAL) {
             char* normal_header = patch->data + pos;
             pos += 24;
             if (pos > patch->size) {
                 printf("failed to read chunk %d normal header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            size_t src_start = Read8(normal_header);
-            size_t src_len = Read8(normal_header+8);
-            size_t patch_offset = Read8(normal_header+16);
+            c->src_start = Read8(normal_header);
+            c->src_len = Read8(normal_header+8);
+            c->patch_offset = Read8(normal_header+16);
 
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
-        } else if (type == CHUNK_RAW) {
+            // bspatch checks the rest of the bsdiff header.  A size with
+            // the sign bit set reads as negative here.
+            c->new_size = -1;
+            if (c->patch_offset <= (size_t)patch->size &&
+                patch->size - c->patch_offset >= 32) {
+                c->new_size = Read8(patch->data + c->patch_offset + 24);
+            }
+        } else if (c->type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
             if (pos > patch->size) {
                 printf("failed to read chunk %d raw header data\n", i);
-                return -1;
+                goto fail;
             }
 
             ssize_t data_len = Read4(raw_header);
 
-            if (pos + data_len > patch->size) {
+            if (data_len < 0 || pos + data_len > patch->size) {
                 printf("failed to read chunk %d raw data\n", i);
-                return -1;
-            }
-            SHA_update(ctx, patch->data + pos, data_len);
-            if (sink((unsigned char*)patch->data + pos,
-                     data_len, token) != data_len) {
-                printf("failed to write chunk %d raw data\n", i);
-                return -1;
+                goto fail;
             }
+            c->data = (unsigned char*)patch->data + pos;
+            c->size = data_len;
+            c->done = 1;
             pos += data_len;
-        } else if (type == CHUNK_DEFLATE) {
+        } else if (c->type == CHUNK_DEFLATE) {
             // deflate chunks have an additional 60 bytes in their chunk header.
             char* deflate_header = patch->data + pos;
             pos += 60;
             if (pos > patch->size) {
                 printf("failed to read chunk %d deflate header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
-            size_t patch_offset = Read8(deflate_header+16);
-            size_t expanded_len = Read8(deflate_header+24);
-            size_t target_len = Read8(deflate_header+32);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
+            c->src_start = Read8(deflate_header);
+            c->src_len = Read8(deflate_header+8);
+            c->patch_offset = Read8(deflate_header+16);
+            c->expanded_len = Read8(deflate_header+24);
+            c->target_len = Read8(deflate_header+32);
+            c->level = Read4(deflate_header+40);
+            c->method = Read4(deflate_header+44);
+            c->windowBits = Read4(deflate_header+48);
+            c->memLevel = Read4(deflate_header+52);
+            c->strategy = Read4(deflate_header+56);
 
             // Note: expanded_len will include the bonus data size if
             // the patch was constructed with bonus data.  The
             // deflation will come up 'bonus_size' bytes short; these
             // must be appended from the bonus_data value.
-            size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
-
-            unsigned char* expanded_source = malloc(expanded_len);
-            if (expanded_source == NULL) {
-                printf("failed to allocate %zu bytes for expanded_source\n",
-                       expanded_len);
-                return -1;
+            c->bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
+            if (c->bonus_size > c->expanded_len) {
+                printf("chunk %d is smaller than its bonus data\n", i);
+                goto fail;
             }
+        } else {
+            printf("patch chunk %d is unknown type %d\n", i, c->type);
+            goto fail;
+        }
+    }
 
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = src_len;
-            strm.next_in = (unsigned char*)(old_data + src_start);
-            strm.avail_out = expanded_len;
-            strm.next_out = expanded_source;
-
-            int ret;
-            ret = inflateInit2(&strm, -15);
-            if (ret != Z_OK) {
-                printf("failed to init source inflation: %d\n", ret);
-                return -1;
-            }
+    *num_chunks = n;
+    return chunks;
 
-            // Because we've provided enough room to accommodate the output
-            // data, we expect one call to inflate() to suffice.
-            ret = inflate(&strm, Z_SYNC_FLUSH);
-            if (ret != Z_STREAM_END) {
-                printf("source inflation returned %d\n", ret);
-                return -1;
-            }
-            // We should have filled the output buffer exactly, except
-            // for the bonus_size.
-            if (strm.avail_out != bonus_size) {
-                printf("source inflation short by %zu bytes\n", strm.avail_out-bonus_size);
-                return -1;
-            }
-            inflateEnd(&strm);
+  fail:
+    free(chunks);
+    return NULL;
+}
 
-            if (bonus_size) {
-                memcpy(expanded_source + (expanded_len - bonus_size),
-                       bonus_data->data, bonus_size);
-            }
+// Re-deflates a deflate chunk's output as bspatch produces it.  What
+// comes out of deflate goes on to the sink, DEFLATE_OUTPUT_SIZE bytes
+// at most at a time.
+typedef struct {
+    z_stream strm;
+    SinkFn sink;
+    void* token;
+    SHA_CTX* ctx;
+    unsigned char buffer[DEFLATE_OUTPUT_SIZE];
+} DeflateSinkInfo;
 
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
-                return -1;
-            }
+// Run deflate over whatever input it has, with the given flush mode,
+// and pass on the output.  Returns 0 on success.
+static int DrainDeflate(DeflateSinkInfo* d, int flush) {
+    int ret;
+    do {
+        d->strm.avail_out = sizeof(d->buffer);
+        d->strm.next_out = d->buffer;
+        ret = deflate(&d->strm, flush);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            printf("target deflation returned %d\n", ret);
+            return -1;
+        }
+        ssize_t have = sizeof(d->buffer) - d->strm.avail_out;
+        if (have > 0 && d->sink(d->buffer, have, d->token) != have) {
+            printf("failed to write %ld compressed bytes to output\n",
+                   (long)have);
+            return -1;
+        }
+        if (d->ctx) {
+            MH_SHA_update(d->ctx, d->buffer, have);
+        }
+    } while (flush == Z_FINISH ? ret != Z_STREAM_END : d->strm.avail_out == 0);
+    return 0;
+}
 
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
-            }
+static ssize_t DeflateSink(unsigned char* data, ssize_t len, void* token) {
+    DeflateSinkInfo* d = (DeflateSinkInfo*)token;
+    d->strm.avail_in = len;
+    d->strm.next_in = data;
+    return DrainDeflate(d, Z_NO_FLUSH) == 0 ? len : -1;
+}
 
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
-                    printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
-                }
-                SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
-
-            free(temp_data);
-            free(uncompressed_target_data);
-        } else {
-            printf("patch chunk %d is unknown type %d\n", i, type);
+// Collects a deflate chunk's re-deflated output in c->data, for a worker.
+static ssize_t BufferSink(unsigned char* data, ssize_t len, void* token) {
+    ImageChunk* c = (ImageChunk*)token;
+    if (c->allocated - c->size < (size_t)len) {
+        size_t allocated = c->allocated * 2;
+        if (allocated < c->size + len) allocated = c->size + len;
+        if (allocated < c->target_len) allocated = c->target_len;
+        unsigned char* grown = realloc(c->data, allocated);
+        if (grown == NULL) {
+            printf("failed to allocate %zu bytes for deflated target\n",
+                   allocated);
             return -1;
         }
+        c->data = grown;
+        c->allocated = allocated;
+    }
+    memcpy(c->data + c->size, data, len);
+    c->size += len;
+    return len;
+}
+
+// Patch one CHUNK_DEFLATE chunk and pass its re-deflated output to the
+// sink, adding it to ctx if that isn't NULL.  This only reads the
+// source and patch, so chunks can be patched on any thread.  Returns 0
+// on success.
+//
+// The patched data is never held whole: bspatch hands it over a window
+// at a time, and each window is fed straight to deflate.  The expanded
+// source is, since bspatch reads it anywhere.
+static int PatchDeflateChunk(const unsigned char* old_data, const Value* patch,
+                             const Value* bonus_data, const ImageChunk* c,
+                             SinkFn sink, void* token, SHA_CTX* ctx) {
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+    unsigned char* expanded_source = malloc(c->expanded_len);
+    if (expanded_source == NULL) {
+        printf("failed to allocate %zu bytes for expanded_source\n",
+               c->expanded_len);
+        return -1;
+    }
+
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = c->src_len;
+    strm.next_in = (unsigned char*)(old_data + c->src_start);
+    strm.avail_out = c->expanded_len;
+    strm.next_out = expanded_source;
+
+    int ret;
+    ret = inflateInit2(&strm, -15);
+    if (ret != Z_OK) {
+        printf("failed to init source inflation: %d\n", ret);
+        free(expanded_source);
+        return -1;
+    }
+
+    // Because we've provided enough room to accommodate the output
+    // data, we expect one call to inflate() to suffice.
+    ret = inflate(&strm, Z_SYNC_FLUSH);
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d\n", ret);
+        free(expanded_source);
+        return -1;
+    }
+    // We should have filled the output buffer exactly, except
+    // for the bonus_size.
+    if (strm.avail_out != c->bonus_size) {
+        printf("source inflation short by %zu bytes\n",
+               strm.avail_out - c->bonus_size);
+        free(expanded_source);
+        return -1;
+    }
+
+    if (c->bonus_size) {
+        memcpy(expanded_source + (c->expanded_len - c->bonus_size),
+               bonus_data->data, c->bonus_size);
+    }
+
+    // Next, apply the bsdiff patch to the uncompressed data, deflating
+    // the target as it comes.  Deflate's output doesn't depend on how
+    // its input is split up, so this matches what imgdiff checked.
+    DeflateSinkInfo* d = malloc(sizeof(DeflateSinkInfo));
+    if (d == NULL) {
+        printf("failed to allocate target deflation state\n");
+        free(expanded_source);
+        return -1;
+    }
+    d->strm.zalloc = Z_NULL;
+    d->strm.zfree = Z_NULL;
+    d->strm.opaque = Z_NULL;
+    d->strm.avail_in = 0;
+    d->strm.next_in = Z_NULL;
+    d->sink = sink;
+    d->token = token;
+    d->ctx = ctx;
+    ret = deflateInit2(&d->strm, c->level, c->method, c->windowBits,
+                       c->memLevel, c->strategy);
+    if (ret != Z_OK) {
+        printf("failed to init target deflation: %d\n", ret);
+        free(d);
+        free(expanded_source);
+        return -1;
+    }
+
+    int result = ApplyBSDiffPatch(expanded_source, c->expanded_len,
+                                  patch, c->patch_offset,
+                                  DeflateSink, d, NULL);
+    free(expanded_source);
+    if (result == 0) {
+        result = DrainDeflate(d, Z_FINISH);
+    }
+    deflateEnd(&d->strm);
+    free(d);
+    return result == 0 ? 0 : -1;
+}
+
+// Patch a chunk into c->data, for a worker.
+static int BufferChunk(const unsigned char* old_data, const Value* patch,
+                       const Value* bonus_data, ImageChunk* c) {
+    c->data = NULL;
+    c->size = 0;
+    c->allocated = 0;
+    if (c->type == CHUNK_NORMAL) {
+        return ApplyBSDiffPatchMem(old_data + c->src_start, c->src_len,
+                                   patch, c->patch_offset,
+                                   &c->data, &c->size) == 0 ? 0 : -1;
     }
+    if (PatchDeflateChunk(old_data, patch, bonus_data, c,
+                          BufferSink, c, NULL) != 0) {
+        free(c->data);
+        c->data = NULL;
+        return -1;
+    }
+    return 0;
+}
 
+// Whether chunk c is left to the workers.
+static int IsBufferedChunk(const ImageChunk* c) {
+    if (c->type == CHUNK_NORMAL) {
+        return c->new_size >= 0 && c->new_size <= MAX_BUFFERED_CHUNK;
+    }
+    return c->type == CHUNK_DEFLATE && c->expanded_len <= MAX_BUFFERED_CHUNK;
+}
+
+// Write one chunk's output and add it to the hash.
+static int WriteChunk(int i, const ImageChunk* c,
+                      SinkFn sink, void* token, SHA_CTX* ctx) {
+    if (sink(c->data, c->size, token) != c->size) {
+        printf("failed to write %ld bytes of chunk %d to output\n",
+               (long)c->size, i);
+        return -1;
+    }
+    if (ctx) {
+        MH_SHA_update(ctx, c->data, c->size);
+    }
     return 0;
 }
+
+// Patch a chunk the workers don't take straight to the sink.
+static int StreamChunk(const unsigned char* old_data, const Value* patch,
+                       const Value* bonus_data, const ImageChunk* c,
+                       SinkFn sink, void* token, SHA_CTX* ctx) {
+    if (c->type == CHUNK_DEFLATE) {
+        return PatchDeflateChunk(old_data, patch, bonus_data, c,
+                                 sink, token, ctx);
+    }
+    return ApplyBSDiffPatch(old_data + c->src_start, c->src_len,
+                            patch, c->patch_offset, sink, token, ctx) == 0 ? 0 : -1;
+}
+
+// State shared by the workers of a parallel ApplyImagePatch().
+typedef struct {
+    const unsigned char* old_data;
+    const Value* patch;
+    const Value* bonus_data;
+    ImageChunk* chunks;
+    int num_chunks;
+    int ahead;
+
+    pthread_mutex_t lock;   // guards the rest, and chunk status
+    pthread_cond_t cond;    // signalled whenever any of it changes
+    int next;               // next chunk for a worker to take
+    int written;            // chunks before this have been written
+    int failed;
+} PatchPool;
+
+// Take buffered chunks off the pool and patch them, staying no more
+// than pool->ahead chunks in front of the writer.
+static void* PatchWorker(void* cookie) {
+    PatchPool* pool = (PatchPool*)cookie;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->next < pool->num_chunks &&
+               !IsBufferedChunk(pool->chunks + pool->next)) {
+            ++pool->next;
+        }
+        if (pool->failed || pool->next == pool->num_chunks) break;
+        if (pool->next >= pool->written + pool->ahead) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
+        ImageChunk* c = pool->chunks + pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        int status = BufferChunk(pool->old_data, pool->patch,
+                                 pool->bonus_data, c);
+
+        pthread_mutex_lock(&pool->lock);
+        c->status = status;
+        c->done = 1;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static int PatchThreads(const ImageChunk* chunks, int num_chunks) {
+    int work = 0;
+    int i;
+    for (i = 0; i < num_chunks; ++i) {
+        if (IsBufferedChunk(chunks + i)) ++work;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > 0 ? cpus : 1;
+    if (threads > MAX_PATCH_THREADS) threads = MAX_PATCH_THREADS;
+    if (threads > work) threads = work;
+    return threads;
+}
+
+/*
+ * Apply the patch given in 'patch_filename' to the source data given
+ * by (old_data, old_size).  Write the patched output to the 'output'
+ * file, and update the SHA context with the output data as well.
+ * Return 0 on success.
+ *
+ * With more than one CPU, chunks up to MAX_BUFFERED_CHUNK are patched
+ * (and re-deflated) on a pool of threads, while this thread writes them
+ * out in order.  Larger ones are streamed to the sink by this thread
+ * as they are patched.
+ */
+int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size __unused,
+                    const Value* patch,
+                    SinkFn sink, void* token, SHA_CTX* ctx,
+                    const Value* bonus_data) {
+    char* header = patch->data;
+    if (patch->size < 12) {
+        printf("patch too short to contain header\n");
+        return -1;
+    }
+
+    // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW.
+    // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and
+    // CHUNK_GZIP.)
+    if (memcmp(header, "IMGDIFF2", 8) != 0) {
+        printf("corrupt patch file header (magic number)\n");
+        return -1;
+    }
+
+    int num_chunks;
+    ImageChunk* chunks = ReadChunks(patch, bonus_data, &num_chunks);
+    if (chunks == NULL) {
+        return -1;
+    }
+
+    int threads = PatchThreads(chunks, num_chunks);
+    int result = 0;
+    int i;
+
+    if (threads <= 1) {
+        for (i = 0; i < num_chunks && result == 0; ++i) {
+            ImageChunk* c = chunks + i;
+            if (c->type == CHUNK_RAW) {
+                result = WriteChunk(i, c, sink, token, ctx);
+            } else {
+                result = StreamChunk(old_data, patch, bonus_data, c,
+                                     sink, token, ctx);
+            }
+        }
+        free(chunks);
+        return result;
+    }
+
+    PatchPool pool;
+    pool.old_data = old_data;
+    pool.patch = patch;
+    pool.bonus_data = bonus_data;
+    pool.chunks = chunks;
+    pool.num_chunks = num_chunks;
+    pool.ahead = threads * CHUNKS_AHEAD_PER_THREAD;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pool.next = 0;
+    pool.written = 0;
+    pool.failed = 0;
+
+    pthread_t workers[MAX_PATCH_THREADS];
+    int started = 0;
+    for (i = 0; i < threads; ++i) {
+        if (pthread_create(&workers[started], NULL, PatchWorker, &pool) == 0) {
+            ++started;
+        }
+    }
+
+    // Write the chunks out in order as they are finished, streaming
+    // the rest while the workers get on with the buffered chunks after
+    // them.  If no worker could be started, stream those here too.
+    for (i = 0; i < num_chunks; ++i) {
+        ImageChunk* c = chunks + i;
+        if (c->type != CHUNK_RAW && (started == 0 || !IsBufferedChunk(c))) {
+            result = StreamChunk(old_data, patch, bonus_data, c,
+                                 sink, token, ctx);
+        } else {
+            pthread_mutex_lock(&pool.lock);
+            while (!c->done) {
+                pthread_cond_wait(&pool.cond, &pool.lock);
+            }
+            pthread_mutex_unlock(&pool.lock);
+
+            if (c->status != 0 || WriteChunk(i, c, sink, token, ctx) != 0) {
+                result = -1;
+            }
+            if (c->type != CHUNK_RAW) {
+                free(c->data);
+                c->data = NULL;
+            }
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        pool.written = i + 1;
+        if (result != 0) pool.failed = 1;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+        if (result != 0) break;
+    }
+
+    for (i = 0; i < started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+
+    // Chunks the workers finished after a failure were never written.
+    for (i = 0; i < num_chunks; ++i) {
+        if (chunks[i].type != CHUNK_RAW) {
+            free(chunks[i].data);
+        }
+    }
+    free(chunks);
+    return result;
+}
@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Linear-time suffix sorting by induced sorting (SA-IS), after Nong,
+// Zhang and Chan, "Two Efficient Algorithms for Linear Time Suffix
+// Array Construction".  The string is taken to end with a virtual
+// sentinel smaller than any character, so a suffix sorts before every
+// longer suffix it is a prefix of -- the same order qsufsort() gives.
+//
+// Besides SA itself this needs a bit per character for the suffix
+// types and a bucket array per level of recursion; the reduced string
+// at each level lives in the unused part of SA.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sais.h"
+
+// At the top level the string is bytes; below that it's the int32_t
+// names of the LMS substrings.
+typedef struct {
+    const unsigned char* bytes;
+    const int32_t* names;
+    int32_t n;
+    int32_t k;          // alphabet size
+    unsigned char* t;   // bit i set if suffix i is S-type
+    int32_t* bkt;
+} SaisLevel;
+
+static inline int32_t Chr(const SaisLevel* l, int32_t i) {
+    return l->bytes ? l->bytes[i] : l->names[i];
+}
+
+static inline int IsS(const SaisLevel* l, int32_t i) {
+    return (l->t[i >> 3] >> (i & 7)) & 1;
+}
+
+// Suffix n-1 is always L-type (it's followed by the sentinel), so
+// LMS suffixes are all in [1, n-2].
+static inline int IsLMS(const SaisLevel* l, int32_t i) {
+    return i > 0 && i < l->n && IsS(l, i) && !IsS(l, i - 1);
+}
+
+static void ClassifySuffixes(SaisLevel* l) {
+    int32_t i;
+    memset(l->t, 0, l->n / 8 + 1);
+    for (i = l->n - 2; i >= 0; --i) {
+        int32_t a = Chr(l, i), b = Chr(l, i + 1);
+        if (a < b || (a == b && IsS(l, i + 1))) {
+            l->t[i >> 3] |= 1 << (i & 7);
+        }
+    }
+}
+
+// Point each bucket at its first slot, or one past its last.
+static void GetBuckets(SaisLevel* l, int end) {
+    int32_t i, sum = 0;
+    memset(l->bkt, 0, l->k * sizeof(int32_t));
+    for (i = 0; i < l->n; ++i) {
+        ++l->bkt[Chr(l, i)];
+    }
+    for (i = 0; i < l->k; ++i) {
+        sum += l->bkt[i];
+        l->bkt[i] = end ? sum : sum - l->bkt[i];
+    }
+}
+
+static void InduceL(SaisLevel* l, int32_t* SA) {
+    int32_t i;
+    GetBuckets(l, 0);
+    // The sentinel comes before everything, and the suffix just ahead
+    // of it is L-type.
+    SA[l->bkt[Chr(l, l->n - 1)]++] = l->n - 1;
+    for (i = 0; i < l->n; ++i) {
+        int32_t j = SA[i] - 1;
+        if (j >= 0 && !IsS(l, j)) {
+            SA[l->bkt[Chr(l, j)]++] = j;
+        }
+    }
+}
+
+static void InduceS(SaisLevel* l, int32_t* SA) {
+    int32_t i;
+    GetBuckets(l, 1);
+    for (i = l->n - 1; i >= 0; --i) {
+        int32_t j = SA[i] - 1;
+        if (j >= 0 && IsS(l, j)) {
+            SA[--l->bkt[Chr(l, j)]] = j;
+        }
+    }
+}
+
+// Do the LMS substrings starting at a and b match, up to and including
+// the next LMS position?  One that runs into the sentinel matches
+// nothing else.
+static int SameLMSSubstring(const SaisLevel* l, int32_t a, int32_t b) {
+    int32_t d;
+    for (d = 0; ; ++d) {
+        if (a + d == l->n || b + d == l->n) return 0;
+        if (Chr(l, a + d) != Chr(l, b + d) ||
+            IsS(l, a + d) != IsS(l, b + d)) return 0;
+        if (d > 0 && IsLMS(l, a + d)) return 1;
+    }
+}
+
+static int Sais(const unsigned char* bytes, const int32_t* names,
+                int32_t* SA, int32_t n, int32_t k) {
+    int32_t i, j;
+    int result = -1;
+
+    if (n < 2) {
+        if (n == 1) SA[0] = 0;
+        return 0;
+    }
+
+    SaisLevel l;
+    l.bytes = bytes;
+    l.names = names;
+    l.n = n;
+    l.k = k;
+    l.t = malloc(n / 8 + 1);
+    l.bkt = malloc(k * sizeof(int32_t));
+    if (l.t == NULL || l.bkt == NULL) goto done;
+    ClassifySuffixes(&l);
+
+    // Sort the LMS substrings: drop the LMS suffixes in at the ends of
+    // their buckets, in any order, and induce.
+    GetBuckets(&l, 1);
+    for (i = 0; i < n; ++i) SA[i] = -1;
+    for (i = 1; i < n; ++i) {
+        if (IsLMS(&l, i)) SA[--l.bkt[Chr(&l, i)]] = i;
+    }
+    InduceL(&l, SA);
+    InduceS(&l, SA);
+
+    // Gather the sorted LMS substrings at the front and name them.
+    // LMS positions are at least two apart, so the name of the one at
+    // p can go in SA[n1 + p/2] without any two colliding.
+    int32_t n1 = 0;
+    for (i = 0; i < n; ++i) {
+        if (IsLMS(&l, SA[i])) SA[n1++] = SA[i];
+    }
+    for (i = n1; i < n; ++i) SA[i] = -1;
+    int32_t name = 0, prev = -1;
+    for (i = 0; i < n1; ++i) {
+        int32_t p = SA[i];
+        if (prev < 0 || !SameLMSSubstring(&l, p, prev)) {
+            ++name;
+            prev = p;
+        }
+        SA[n1 + p / 2] = name - 1;
+    }
+    for (i = n - 1, j = n - 1; i >= n1; --i) {
+        if (SA[i] >= 0) SA[j--] = SA[i];
+    }
+
+    // Sort the LMS suffixes: the names, in string order, make up the
+    // reduced string at the end of SA; its suffix array goes at the
+    // front.  If the names are all different there's nothing to sort.
+    int32_t* SA1 = SA;
+    int32_t* s1 = SA + n - n1;
+    if (name < n1) {
+        free(l.bkt);
+        l.bkt = NULL;
+        if (Sais(NULL, s1, SA1, n1, name) != 0) goto done;
+        l.bkt = malloc(k * sizeof(int32_t));
+        if (l.bkt == NULL) goto done;
+    } else {
+        for (i = 0; i < n1; ++i) SA1[s1[i]] = i;
+    }
+
+    // Turn that back into positions in the string, put the LMS
+    // suffixes at the ends of their buckets in order, and induce the
+    // rest.
+    for (i = 1, j = 0; i < n; ++i) {
+        if (IsLMS(&l, i)) s1[j++] = i;
+    }
+    for (i = 0; i < n1; ++i) SA1[i] = s1[SA1[i]];
+    for (i = n1; i < n; ++i) SA[i] = -1;
+    GetBuckets(&l, 1);
+    for (i = n1 - 1; i >= 0; --i) {
+        j = SA[i];
+        SA[i] = -1;
+        SA[--l.bkt[Chr(&l, j)]] = j;
+    }
+    InduceL(&l, SA);
+    InduceS(&l, SA);
+    result = 0;
+
+  done:
+    free(l.t);
+    free(l.bkt);
+    return result;
+}
+
+int SuffixSort(const unsigned char* data, int32_t* SA, int32_t n) {
+    if (n < 0) return -1;
+    return Sais(data, NULL, SA, n, 256);
+}
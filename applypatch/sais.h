@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BUILD_TOOLS_APPLYPATCH_SAIS_H
+#define _BUILD_TOOLS_APPLYPATCH_SAIS_H
+
+#include <stdint.h>
+
+// Fill SA[0..n-1] with the start positions of the suffixes of
+// data[0..n-1] in sorted order, a shorter suffix sorting before any
+// longer one it is a prefix of.  Runs in linear time.  Return 0 on
+// success, -1 if out of memory.
+
+int SuffixSort(const unsigned char* data, int32_t* SA, int32_t n);
+
+#endif //  _BUILD_TOOLS_APPLYPATCH_SAIS_H
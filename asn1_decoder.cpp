@@ -31,6 +31,7 @@ static const int kMaskConstructed = 0xE0;
 static const int kMaskTag = 0x7F;
 static const int kMaskAppType = 0x1F;
 
+static const int kTagBitString = 0x03;
 static const int kTagOctetString = 0x04;
 static const int kTagOid = 0x06;
 static const int kTagSequence = 0x30;
@@ -188,3 +189,25 @@ bool asn1_octet_string_get(asn1_context_t* ctx, uint8_t** octet_string, size_t*
     *octet_string = ctx->p;
     return true;
 }
+
+/**
+ * Returns the contents of a BIT STRING, without the leading unused-bits
+ * octet.  Only whole-octet strings are accepted, which covers every DER
+ * encoded key and signature.
+ */
+bool asn1_bit_string_get(asn1_context_t* ctx, uint8_t** bit_string, size_t* length) {
+    if (get_byte(ctx) != kTagBitString) {
+        return false;
+    }
+    size_t encoded_length;
+    if (!decode_length(ctx, &encoded_length) || encoded_length < 2
+            || encoded_length > ctx->length) {
+        return false;
+    }
+    if (get_byte(ctx) != 0) {
+        return false;
+    }
+    *bit_string = ctx->p;
+    *length = encoded_length - 1;
+    return true;
+}
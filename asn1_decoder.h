@@ -32,5 +32,6 @@ asn1_context_t* asn1_set_get(asn1_context_t* ctx);
 bool asn1_sequence_next(asn1_context_t* seq);
 bool asn1_oid_get(asn1_context_t* ctx, uint8_t** oid, size_t* length);
 bool asn1_octet_string_get(asn1_context_t* ctx, uint8_t** octet_string, size_t* length);
+bool asn1_bit_string_get(asn1_context_t* ctx, uint8_t** bit_string, size_t* length);
 
 #endif /* ASN1_DECODER_H_ */
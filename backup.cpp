@@ -84,7 +84,7 @@ static int append_eod(const char* opt_hash)
     char hexdigest[HASH_MAX_STRING_LENGTH];
 
     if (!strcasecmp(opt_hash, "sha1")) {
-        SHA1Final(digest, &sha1_ctx);
+        memcpy(digest, MH_SHA_final(&sha1_ctx), SHA1_DIGEST_LENGTH);
         for (n = 0; n < SHA1_DIGEST_LENGTH; ++n) {
             sprintf(hexdigest+2*n, "%02x", digest[n]);
         }
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmark for the suffix sort in bsdiff().  Makes a patch from a
+// pair of images (say, the boot or system images of two builds) with
+// qsufsort() and with SuffixSort(), each in a process of its own so
+// its peak memory can be reported, and checks the patches match.
+//
+// bsdiff() is run twice with the same suffix array; the first run
+// includes the sort and the second doesn't, so the difference is the
+// time the sort takes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// from applypatch/bsdiff.c
+extern "C" {
+int bsdiff(u_char* old, off_t oldsize, void** IP, u_char* new_data, off_t newsize,
+           const char* patch_filename);
+void SetBSDiffSuffixSort(int sais);
+void FreeSuffixArray(void** IP);
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned char* load(const char* filename, off_t* size) {
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "failed to open %s\n", filename);
+        return NULL;
+    }
+    fseeko(f, 0, SEEK_END);
+    *size = ftello(f);
+    rewind(f);
+    unsigned char* data = (unsigned char*) malloc(*size > 0 ? *size : 1);
+    if (data == NULL || fread(data, 1, *size, f) != (size_t) *size) {
+        fprintf(stderr, "failed to read %s\n", filename);
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+static bool same_file(const char* a, const char* b) {
+    off_t a_size, b_size;
+    unsigned char* a_data = load(a, &a_size);
+    unsigned char* b_data = load(b, &b_size);
+    bool same = a_data != NULL && b_data != NULL && a_size == b_size &&
+                memcmp(a_data, b_data, a_size) == 0;
+    free(a_data);
+    free(b_data);
+    return same;
+}
+
+static const char* kSorts[] = { "qsufsort", "sais" };
+
+// Make the patch with one suffix sort, in a child process.  bsdiff()
+// exits on errors, so this also keeps a failure from taking the
+// benchmark down with it.
+static int run(int sais, u_char* old_data, off_t old_size,
+               u_char* new_data, off_t new_size, const char* patch) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        SetBSDiffSuffixSort(sais);
+        void* I = NULL;
+        double start = now_sec();
+        bsdiff(old_data, old_size, &I, new_data, new_size, patch);
+        double first = now_sec() - start;
+        start = now_sec();
+        bsdiff(old_data, old_size, &I, new_data, new_size, patch);
+        double second = now_sec() - start;
+        FreeSuffixArray(&I);
+
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        printf("%-9s sort %8.1f ms  diff %8.1f ms  peak %7ld KB\n",
+               kSorts[sais], (first - second) * 1000, second * 1000,
+               (long) ru.ru_maxrss);
+        exit(0);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("%-9s failed\n", kSorts[sais]);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <old-file> <new-file>\n", argv[0]);
+        return 2;
+    }
+
+    off_t old_size, new_size;
+    u_char* old_data = load(argv[1], &old_size);
+    u_char* new_data = load(argv[2], &new_size);
+    if (old_data == NULL || new_data == NULL) {
+        return 1;
+    }
+    printf("old %lld bytes, new %lld bytes\n",
+           (long long) old_size, (long long) new_size);
+
+    char patches[2][32];
+    int failed = 0;
+    for (int sais = 0; sais < 2; ++sais) {
+        strcpy(patches[sais], "/tmp/bsdiff_bench-XXXXXX");
+        int fd = mkstemp(patches[sais]);
+        if (fd < 0) {
+            perror("mkstemp");
+            return 1;
+        }
+        close(fd);
+        if (run(sais, old_data, old_size, new_data, new_size, patches[sais]) != 0) {
+            failed = 1;
+        }
+    }
+
+    if (!failed) {
+        if (same_file(patches[0], patches[1])) {
+            printf("patches identical\n");
+        } else {
+            printf("MISMATCH\n");
+            failed = 1;
+        }
+    }
+
+    unlink(patches[0]);
+    unlink(patches[1]);
+    free(old_data);
+    free(new_data);
+    return failed;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmark for ApplyBSDiffPatchMem().  Applies a bsdiff patch (as
+// written by bsdiff, or found in an OTA for a large system file) to its
+// source file with the bzip2 streams decoded on the calling thread and
+// on threads of their own, checks that both give the same output and
+// reports the time each takes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+extern "C" {
+#include "applypatch/applypatch.h"
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned char* load(const char* filename, ssize_t* size) {
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "failed to open %s\n", filename);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    rewind(f);
+    unsigned char* data = (unsigned char*) malloc(*size > 0 ? *size : 1);
+    if (data == NULL || fread(data, 1, *size, f) != (size_t) *size) {
+        fprintf(stderr, "failed to read %s\n", filename);
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+// Apply the patch runs times.  Keeps the last output in *out and
+// returns the best time in seconds, or a negative value on failure.
+static double run(const unsigned char* old_data, ssize_t old_size,
+                  const Value* patch, int runs,
+                  unsigned char** out, ssize_t* out_size) {
+    double best = -1;
+    *out = NULL;
+    for (int i = 0; i < runs; ++i) {
+        free(*out);
+        double start = now_sec();
+        if (ApplyBSDiffPatchMem(old_data, old_size, patch, 0, out, out_size) != 0) {
+            *out = NULL;
+            return -1;
+        }
+        double elapsed = now_sec() - start;
+        if (best < 0 || elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    int runs = 3;
+    if (argc == 5 && strcmp(argv[3], "-runs") == 0) {
+        runs = atoi(argv[4]);
+    } else if (argc != 3) {
+        fprintf(stderr, "Usage: %s <source-file> <bsdiff-patch> [-runs <n>]\n",
+                argv[0]);
+        return 2;
+    }
+    if (runs < 1) runs = 1;
+
+    ssize_t old_size, patch_size;
+    unsigned char* old_data = load(argv[1], &old_size);
+    unsigned char* patch_data = load(argv[2], &patch_size);
+    if (old_data == NULL || patch_data == NULL) {
+        return 1;
+    }
+    Value patch;
+    patch.type = VAL_BLOB;
+    patch.size = patch_size;
+    patch.data = (char*) patch_data;
+
+    static const char* kModes[] = { "serial", "pipelined" };
+    unsigned char* outputs[2];
+    ssize_t sizes[2];
+    int failed = 0;
+
+    for (int mode = 0; mode < 2; ++mode) {
+        SetBSDiffPipelined(mode);
+        double elapsed = run(old_data, old_size, &patch, runs,
+                             &outputs[mode], &sizes[mode]);
+        if (elapsed < 0) {
+            printf("%-10s failed\n", kModes[mode]);
+            failed = 1;
+            continue;
+        }
+        printf("%-10s %8.1f ms %8.1f MB/s\n", kModes[mode], elapsed * 1000,
+               elapsed > 0 ? sizes[mode] / elapsed / (1024 * 1024) : 0.0);
+    }
+    SetBSDiffPipelined(-1);
+
+    if (!failed && (sizes[0] != sizes[1] ||
+                    memcmp(outputs[0], outputs[1], sizes[0]) != 0)) {
+        printf("MISMATCH\n");
+        failed = 1;
+    }
+    if (!failed) {
+        printf("output %zd bytes, identical\n", sizes[0]);
+        free(outputs[0]);
+        free(outputs[1]);
+    }
+
+    free(old_data);
+    free(patch_data);
+    return failed;
+}
@@ -33,7 +33,7 @@ gzFile gzf;
 
 char* hash_name;
 size_t hash_datalen;
-SHA1_CTX sha1_ctx;
+SHA_CTX sha1_ctx;
 MD5_CTX md5_ctx;
 
 static MessageSocket ms;
@@ -160,7 +160,7 @@ static ssize_t tar_cb_read(int fd, void* buf, size_t len)
     ssize_t nread;
     nread = ::read(fd, buf, len);
     if (nread > 0 && hash_name) {
-        SHA1Update(&sha1_ctx, (u_char*)buf, nread);
+        MH_SHA_update(&sha1_ctx, buf, nread);
         MD5_Update(&md5_ctx, buf, nread);
         hash_datalen += nread;
     }
@@ -173,7 +173,7 @@ static ssize_t tar_cb_write(int fd, const void* buf, size_t len)
     ssize_t written = 0;
 
     if (hash_name) {
-        SHA1Update(&sha1_ctx, (u_char*)buf, len);
+        MH_SHA_update(&sha1_ctx, buf, len);
         MD5_Update(&md5_ctx, buf, len);
         hash_datalen += len;
     }
@@ -206,7 +206,7 @@ static ssize_t tar_gz_cb_read(int fd, void* buf, size_t len)
     int nread;
     nread = gzread(gzf, buf, len);
     if (nread > 0 && hash_name) {
-        SHA1Update(&sha1_ctx, (u_char*)buf, nread);
+        MH_SHA_update(&sha1_ctx, buf, nread);
         MD5_Update(&md5_ctx, buf, nread);
         hash_datalen += nread;
     }
@@ -219,7 +219,7 @@ static ssize_t tar_gz_cb_write(int fd, const void* buf, size_t len)
     ssize_t written = 0;
 
     if (hash_name) {
-        SHA1Update(&sha1_ctx, (u_char*)buf, len);
+        MH_SHA_update(&sha1_ctx, buf, len);
         MD5_Update(&md5_ctx, buf, len);
         hash_datalen += len;
     }
@@ -251,7 +251,7 @@ int create_tar(const char* compress, const char* mode)
 {
     int rc = -1;
 
-    SHA1Init(&sha1_ctx);
+    MH_SHA_init(&sha1_ctx);
     MD5_Init(&md5_ctx);
 
     if (!compress || strcasecmp(compress, "none") == 0) {
@@ -3,8 +3,11 @@
 #include <lib/libtar.h>
 #include <zlib.h>
 
+#include "minhash/sha.h"
+#define SHA1_DIGEST_LENGTH SHA_DIGEST_SIZE
+#define SHA1_DIGEST_STRING_LENGTH (SHA_DIGEST_SIZE*2+1)
+
 extern "C" {
-#include <sha1.h>
 #include <md5.h>
 // Add some compatibility stuff for bionic md5
 #ifndef MD5_DIGEST_LENGTH
@@ -34,7 +37,7 @@ extern gzFile gzf;
 
 extern char* hash_name;
 extern size_t hash_datalen;
-extern SHA1_CTX sha1_ctx;
+extern SHA_CTX sha1_ctx;
 extern MD5_CTX md5_ctx;
 
 struct partspec {
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Microbenchmark for the minzip CRC-32 backends.  Takes the CRC of the
+// same buffer with zlib's crc32() and with every backend this device
+// supports, at the piece sizes extraction uses, checks that all of them
+// agree and reports the throughput of each.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "minzip/Crc32.h"
+#include "zlib.h"
+
+static const char* kBackends[] = { "zlib", "x86-pclmul", "armv8-crc" };
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t zlib_crc(uint32_t crc, const unsigned char* data, size_t len) {
+    return crc32(crc, data, len);
+}
+
+// CRC length bytes at data, chunk bytes per call, with fn.  Stores the
+// CRC in out and returns MB/s.
+static double run(uint32_t (*fn)(uint32_t, const unsigned char*, size_t),
+                  const unsigned char* data, size_t length, size_t chunk, uint32_t* out) {
+    uint32_t crc = 0;
+    double start = now_sec();
+    for (size_t so_far = 0; so_far < length; so_far += chunk) {
+        size_t size = length - so_far < chunk ? length - so_far : chunk;
+        crc = fn(crc, data + so_far, size);
+    }
+    double elapsed = now_sec() - start;
+    *out = crc;
+    return elapsed > 0 ? length / elapsed / (1024 * 1024) : 0.0;
+}
+
+int main(int argc, char** argv) {
+    size_t length = 64 * 1024 * 1024;
+    if (argc == 3 && strcmp(argv[1], "-size") == 0) {
+        length = strtoul(argv[2], NULL, 0) * 1024 * 1024;
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [-size <MB>]\n", argv[0]);
+        return 2;
+    }
+
+    unsigned char* data = (unsigned char*) malloc(length);
+    if (data == NULL) {
+        fprintf(stderr, "failed to allocate %zu bytes\n", length);
+        return 1;
+    }
+    srand(1);
+    for (size_t i = 0; i < length; ++i) {
+        data[i] = rand();
+    }
+
+    // The inflate bounce buffer, and the pieces extractEntryToBuffer()
+    // and stored extraction use.
+    static const size_t chunks[] = { 64, 4096, 32 * 1024, 256 * 1024, 1024 * 1024 };
+    const char* preferred = mzCrc32Backend();
+    int failed = 0;
+
+    printf("default backend: %s\n", preferred);
+    for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); ++c) {
+        uint32_t expected, actual;
+        double mbps = run(zlib_crc, data, length, chunks[c], &expected);
+        printf("%8zu %-11s %8.1f MB/s\n", chunks[c], "crc32()", mbps);
+
+        for (size_t b = 0; b < sizeof(kBackends) / sizeof(kBackends[0]); ++b) {
+            if (mzSetCrc32Backend(kBackends[b]) != 0) {
+                continue;
+            }
+            mbps = run(mzCrc32, data, length, chunks[c], &actual);
+            bool match = expected == actual;
+            printf("%8zu %-11s %8.1f MB/s%s\n", chunks[c], kBackends[b], mbps,
+                   match ? "" : "  MISMATCH");
+            if (!match) failed = 1;
+        }
+    }
+    mzSetCrc32Backend(preferred);
+
+    free(data);
+    return failed;
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <limits.h>
+#include <string.h>
+
+#include "digest_engine.h"
+
+#include "minhash/sha.h"
+
+// mincrypt takes an int length; feed it in pieces that always fit.
+static void hash_update(HASH_CTX* ctx, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        int size = len > (size_t)INT_MAX ? INT_MAX : (int)len;
+        HASH_update(ctx, data, size);
+        data += size;
+        len -= size;
+    }
+}
+
+DigestEngine::DigestEngine(int digests)
+    : num_lanes_(0), data_(NULL), len_(0), generation_(0), pending_(0),
+      exiting_(false), sha1_(NULL), sha256_(NULL) {
+    memset(lanes_, 0, sizeof(lanes_));
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&work_cond_, NULL);
+    pthread_cond_init(&done_cond_, NULL);
+
+    if (digests & SHA1) {
+        MH_SHA_init(&lanes_[num_lanes_].ctx);
+        lanes_[num_lanes_].result = &sha1_;
+        ++num_lanes_;
+    }
+    if (digests & SHA256) {
+        MH_SHA256_init(&lanes_[num_lanes_].ctx);
+        lanes_[num_lanes_].result = &sha256_;
+        ++num_lanes_;
+    }
+
+    // Lane 0 always runs on the caller's thread.  If a worker can't be
+    // started, that lane falls back to the caller as well.
+    for (int i = 1; i < num_lanes_; ++i) {
+        lanes_[i].engine = this;
+        lanes_[i].threaded =
+            pthread_create(&lanes_[i].thread, NULL, WorkerMain, &lanes_[i]) == 0;
+    }
+}
+
+DigestEngine::~DigestEngine() {
+    pthread_mutex_lock(&mutex_);
+    exiting_ = true;
+    pthread_cond_broadcast(&work_cond_);
+    pthread_mutex_unlock(&mutex_);
+
+    for (int i = 1; i < num_lanes_; ++i) {
+        if (lanes_[i].threaded) {
+            pthread_join(lanes_[i].thread, NULL);
+        }
+    }
+
+    pthread_cond_destroy(&done_cond_);
+    pthread_cond_destroy(&work_cond_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+void* DigestEngine::WorkerMain(void* cookie) {
+    Lane* lane = reinterpret_cast<Lane*>(cookie);
+    lane->engine->RunLane(lane);
+    return NULL;
+}
+
+void DigestEngine::RunLane(Lane* lane) {
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&mutex_);
+    while (true) {
+        while (!exiting_ && generation_ == seen) {
+            pthread_cond_wait(&work_cond_, &mutex_);
+        }
+        if (exiting_) {
+            break;
+        }
+        seen = generation_;
+        const unsigned char* data = data_;
+        size_t len = len_;
+        pthread_mutex_unlock(&mutex_);
+
+        hash_update(&lane->ctx, data, len);
+
+        pthread_mutex_lock(&mutex_);
+        if (--pending_ == 0) {
+            pthread_cond_signal(&done_cond_);
+        }
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+void DigestEngine::Update(const unsigned char* data, size_t len) {
+    int threaded = 0;
+    for (int i = 1; i < num_lanes_; ++i) {
+        if (lanes_[i].threaded) ++threaded;
+    }
+
+    if (threaded > 0) {
+        pthread_mutex_lock(&mutex_);
+        data_ = data;
+        len_ = len;
+        pending_ = threaded;
+        ++generation_;
+        pthread_cond_broadcast(&work_cond_);
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    for (int i = 0; i < num_lanes_; ++i) {
+        if (i == 0 || !lanes_[i].threaded) {
+            hash_update(&lanes_[i].ctx, data, len);
+        }
+    }
+
+    if (threaded > 0) {
+        pthread_mutex_lock(&mutex_);
+        while (pending_ > 0) {
+            pthread_cond_wait(&done_cond_, &mutex_);
+        }
+        pthread_mutex_unlock(&mutex_);
+    }
+}
+
+void DigestEngine::Final() {
+    // The workers are idle between calls to Update(), so the contexts
+    // can safely be finished from here.
+    for (int i = 0; i < num_lanes_; ++i) {
+        *lanes_[i].result = HASH_final(&lanes_[i].ctx);
+    }
+}
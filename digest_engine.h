@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_DIGEST_ENGINE_H
+#define _RECOVERY_DIGEST_ENGINE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mincrypt/hash-internal.h"
+
+// Computes several digests over the same stream of bytes at once.
+// The calling thread runs the first digest; every other digest gets a
+// worker thread of its own, so each block handed to Update() is hashed
+// by all of them concurrently.
+class DigestEngine {
+  public:
+    enum {
+        SHA1   = 1 << 0,
+        SHA256 = 1 << 1,
+    };
+
+    // digests is a mask of the constants above.
+    explicit DigestEngine(int digests);
+    ~DigestEngine();
+
+    // Feed the next len bytes of the stream to every digest.  Returns
+    // once all of them have consumed the block, so the caller may
+    // reuse or unmap it afterwards.
+    void Update(const unsigned char* data, size_t len);
+
+    // Finish every digest.  Call once, after the last Update().
+    void Final();
+
+    // Results are only valid after Final(), and are NULL for digests
+    // that were not requested.
+    const uint8_t* sha1() const { return sha1_; }
+    const uint8_t* sha256() const { return sha256_; }
+
+  private:
+    enum { MAX_DIGESTS = 2 };
+
+    struct Lane {
+        HASH_CTX ctx;
+        DigestEngine* engine;
+        pthread_t thread;
+        bool threaded;
+        const uint8_t** result;
+    };
+
+    static void* WorkerMain(void* cookie);
+    void RunLane(Lane* lane);
+
+    Lane lanes_[MAX_DIGESTS];
+    int num_lanes_;
+
+    pthread_mutex_t mutex_;
+    pthread_cond_t work_cond_;
+    pthread_cond_t done_cond_;
+    const unsigned char* data_;
+    size_t len_;
+    unsigned int generation_;
+    int pending_;
+    bool exiting_;
+
+    const uint8_t* sha1_;
+    const uint8_t* sha256_;
+};
+
+#endif  /* _RECOVERY_DIGEST_ENGINE_H */
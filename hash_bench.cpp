@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Microbenchmark for the minhash backends.  Hashes the same buffer
+// with plain mincrypt and with every minhash backend this device
+// supports, at a few update sizes, checks that all of them agree and
+// reports the throughput of each.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "minhash/sha.h"
+
+static const char* kBackends[] = { "portable", "x86-shani", "armv8-ce" };
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Hash length bytes at data, chunk bytes per update, with a context
+// set up by init.  Copies the digest to out and returns MB/s.
+static double run(void (*init)(HASH_CTX*), const unsigned char* data, size_t length,
+                  size_t chunk, uint8_t* out) {
+    HASH_CTX ctx;
+    double start = now_sec();
+    init(&ctx);
+    for (size_t so_far = 0; so_far < length; so_far += chunk) {
+        size_t size = length - so_far < chunk ? length - so_far : chunk;
+        HASH_update(&ctx, data + so_far, size);
+    }
+    const uint8_t* digest = HASH_final(&ctx);
+    double elapsed = now_sec() - start;
+    memcpy(out, digest, HASH_size(&ctx));
+    return elapsed > 0 ? length / elapsed / (1024 * 1024) : 0.0;
+}
+
+int main(int argc, char** argv) {
+    size_t length = 64 * 1024 * 1024;
+    if (argc == 3 && strcmp(argv[1], "-size") == 0) {
+        length = strtoul(argv[2], NULL, 0) * 1024 * 1024;
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [-size <MB>]\n", argv[0]);
+        return 2;
+    }
+
+    unsigned char* data = (unsigned char*) malloc(length);
+    if (data == NULL) {
+        fprintf(stderr, "failed to allocate %zu bytes\n", length);
+        return 1;
+    }
+    srand(1);
+    for (size_t i = 0; i < length; ++i) {
+        data[i] = rand();
+    }
+
+    static const struct {
+        const char* name;
+        void (*reference)(HASH_CTX*);
+        void (*init)(HASH_CTX*);
+        size_t size;
+    } digests[] = {
+        { "sha1", SHA_init, MH_SHA_init, SHA_DIGEST_SIZE },
+        { "sha256", SHA256_init, MH_SHA256_init, SHA256_DIGEST_SIZE },
+    };
+    static const size_t chunks[] = { 64, 4096, 1024 * 1024 };
+    const char* preferred = MH_backend();
+    int failed = 0;
+
+    printf("default backend: %s\n", preferred);
+    for (size_t d = 0; d < sizeof(digests) / sizeof(digests[0]); ++d) {
+        for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); ++c) {
+            uint8_t expected[SHA256_DIGEST_SIZE];
+            uint8_t actual[SHA256_DIGEST_SIZE];
+            double mbps = run(digests[d].reference, data, length, chunks[c], expected);
+            printf("%-7s %8zu %-10s %8.1f MB/s\n", digests[d].name, chunks[c],
+                   "mincrypt", mbps);
+
+            for (size_t b = 0; b < sizeof(kBackends) / sizeof(kBackends[0]); ++b) {
+                if (MH_set_backend(kBackends[b]) != 0) {
+                    continue;
+                }
+                mbps = run(digests[d].init, data, length, chunks[c], actual);
+                bool match = memcmp(expected, actual, digests[d].size) == 0;
+                printf("%-7s %8zu %-10s %8.1f MB/s%s\n", digests[d].name, chunks[c],
+                       kBackends[b], mbps, match ? "" : "  MISMATCH");
+                if (!match) failed = 1;
+            }
+        }
+    }
+    MH_set_backend(preferred);
+
+    free(data);
+    return failed;
+}
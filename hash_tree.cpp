@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hash_tree.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "minhash/sha.h"
+#include "minzip/SysUtil.h"
+
+// Upper bound on hashing threads, including the caller.  Beyond this
+// the storage, not the hashing, is what limits us.
+#define MAX_WORKERS 4
+
+static uint32_t read_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read_le64(const unsigned char* p) {
+    return read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+HashTree* HashTree::Parse(const unsigned char* data, size_t len) {
+    if (len < HASH_TREE_HEADER_SIZE ||
+        memcmp(data, HASH_TREE_MAGIC, HASH_TREE_MAGIC_SIZE) != 0) {
+        return NULL;
+    }
+
+    size_t chunk_size = read_le32(data + 8);
+    size_t num_chunks = read_le32(data + 12);
+    uint64_t data_size = read_le64(data + 16);
+
+    if (chunk_size == 0 || chunk_size > HASH_TREE_MAX_CHUNK_SIZE) {
+        LOGE("hash tree has bad chunk size %zu\n", chunk_size);
+        return NULL;
+    }
+    if (num_chunks != (data_size + chunk_size - 1) / chunk_size) {
+        LOGE("hash tree has %zu chunks for %llu bytes\n", num_chunks,
+             (unsigned long long)data_size);
+        return NULL;
+    }
+    // num_chunks < 2^32, so none of this can overflow.
+    size_t leaves_size = num_chunks * HASH_TREE_LEAF_SIZE;
+    if (len - HASH_TREE_HEADER_SIZE < leaves_size + 4) {
+        LOGE("hash tree is larger than its block\n");
+        return NULL;
+    }
+    const unsigned char* signature = data + HASH_TREE_HEADER_SIZE + leaves_size;
+    size_t signature_size = read_le32(signature);
+    signature += 4;
+    if (len - HASH_TREE_HEADER_SIZE - leaves_size - 4 < signature_size) {
+        LOGE("hash tree signature is larger than its block\n");
+        return NULL;
+    }
+
+    HashTree* tree = new HashTree;
+    tree->data_ = data;
+    tree->data_size_ = data_size;
+    tree->chunk_size_ = chunk_size;
+    tree->num_chunks_ = num_chunks;
+    tree->fingerprint_ = data + 24;
+    tree->leaves_ = data + HASH_TREE_HEADER_SIZE;
+    tree->signature_ = signature;
+    tree->signature_size_ = signature_size;
+    return tree;
+}
+
+size_t HashTree::chunk_length(size_t i) const {
+    uint64_t remaining = data_size_ - chunk_offset(i);
+    return remaining < chunk_size_ ? remaining : chunk_size_;
+}
+
+bool HashTree::VerifyChunk(size_t i, const unsigned char* data, size_t len) const {
+    if (i >= num_chunks_ || len != chunk_length(i)) {
+        return false;
+    }
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    MH_SHA256_hash(data, len, digest);
+    return memcmp(digest, leaves_ + i * HASH_TREE_LEAF_SIZE, HASH_TREE_LEAF_SIZE) == 0;
+}
+
+// State the workers of one VerifyAll() call share.
+struct HashTree::Shared {
+    const HashTree* tree;
+    const unsigned char* addr;
+    const SysReader* reader;
+    void (*progress)(double);
+    SysReadahead* readahead;    // follows the chunks handed out, if mapped
+
+    pthread_mutex_t mutex;
+    size_t next;    // next chunk to hand out
+    size_t done;    // chunks checked so far
+    bool failed;
+};
+
+void* HashTree::WorkerMain(void* cookie) {
+    Shared* shared = reinterpret_cast<Shared*>(cookie);
+    shared->tree->RunWorker(shared, false);
+    return NULL;
+}
+
+// Take chunks off the shared counter and check them until there are
+// none left or some worker has found a bad one.
+void HashTree::RunWorker(Shared* shared, bool report) const {
+    unsigned char* buffer = NULL;
+    if (shared->addr == NULL) {
+        buffer = (unsigned char*)malloc(chunk_size_);
+    }
+
+    double frac = -1.0;
+    while (true) {
+        pthread_mutex_lock(&shared->mutex);
+        if (shared->failed || shared->next == num_chunks_) {
+            pthread_mutex_unlock(&shared->mutex);
+            break;
+        }
+        size_t i = shared->next++;
+        pthread_mutex_unlock(&shared->mutex);
+        sysReadaheadSetCursor(shared->readahead, chunk_offset(i));
+
+        size_t len = chunk_length(i);
+        const unsigned char* data = NULL;
+        bool ok;
+        if (shared->addr != NULL) {
+            data = shared->addr + chunk_offset(i);
+            ok = true;
+        } else if (buffer == NULL) {
+            LOGE("failed to allocate %zu-byte chunk buffer\n", chunk_size_);
+            ok = false;
+        } else {
+            data = buffer;
+            ok = sysReaderRead(shared->reader, buffer, len, chunk_offset(i));
+            if (!ok) {
+                LOGE("failed to read package chunk %zu: %s\n", i, strerror(errno));
+            }
+        }
+        if (ok && !VerifyChunk(i, data, len)) {
+            LOGE("package chunk %zu (offset %llu) doesn't match hash tree\n", i,
+                 (unsigned long long)chunk_offset(i));
+            ok = false;
+        }
+
+        pthread_mutex_lock(&shared->mutex);
+        if (!ok) shared->failed = true;
+        size_t done = ++shared->done;
+        pthread_mutex_unlock(&shared->mutex);
+
+        if (report && shared->progress != NULL) {
+            double f = done / (double)num_chunks_;
+            if (f > frac + 0.02) {
+                shared->progress(f);
+                frac = f;
+            }
+        }
+    }
+    free(buffer);
+}
+
+bool HashTree::VerifyAll(const unsigned char* addr, const SysReader* reader,
+                         void (*progress)(double)) const {
+    Shared shared;
+    shared.tree = this;
+    shared.addr = addr;
+    shared.reader = reader;
+    shared.progress = progress;
+    pthread_mutex_init(&shared.mutex, NULL);
+    shared.next = 0;
+    shared.done = 0;
+    shared.failed = false;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t num_workers = cpus > 0 ? cpus : 1;
+    if (num_workers > MAX_WORKERS) num_workers = MAX_WORKERS;
+    if (num_workers > num_chunks_) num_workers = num_chunks_;
+
+    // When mapped, keep a couple of chunks per worker coming in ahead
+    // of them, rather than having each fault its chunk in a page at a
+    // time.  Through a reader, each worker's pread() is already one
+    // large request.
+    shared.readahead = NULL;
+    if (addr != NULL) {
+        shared.readahead = sysReadaheadStart(addr, data_size_, 2 * num_workers * chunk_size_,
+                                             false);
+    }
+
+    // The calling thread is one of the workers, and the only one that
+    // reports progress.
+    pthread_t threads[MAX_WORKERS];
+    size_t started = 0;
+    for (size_t i = 1; i < num_workers; ++i) {
+        if (pthread_create(&threads[started], NULL, WorkerMain, &shared) == 0) {
+            ++started;
+        }
+    }
+    RunWorker(&shared, true);
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    sysReadaheadStop(shared.readahead);
+    pthread_mutex_destroy(&shared.mutex);
+
+    if (!shared.failed && progress != NULL) {
+        progress(1.0);
+    }
+    LOGI("checked %zu of %zu chunk(s) on %zu thread(s)\n", shared.done, num_chunks_,
+         started + 1);
+    return !shared.failed;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_HASH_TREE_H
+#define _RECOVERY_HASH_TREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mincrypt/sha.h"
+#include "mincrypt/sha256.h"
+#include "minzip/SysUtil.h"
+
+// A package may carry a signed hash tree at the start of its archive
+// comment, ahead of the whole-file signature:
+//
+//   [hash tree block] [other comment] [PKCS#7 signature] [6-byte footer]
+//
+// The block splits the signed region of the package (everything the
+// whole-file signature covers) into fixed-size chunks, lists the
+// SHA-256 of each one, and signs the hash of that list.  Recovery checks
+// every chunk up front, several at once, and stops at the first one
+// that doesn't match instead of after reading the whole package.
+// Chunks aren't checked lazily as the package is read later on: the
+// updater reads it in its own process, with nothing that would tie its
+// reads back to the tree, so the whole package is verified before it
+// runs, as with the whole-file signature.  All the leaf hashes fit in
+// the comment, so the tree only has two levels: the leaves, and the
+// signed root over them.
+//
+// The block is little-endian:
+//
+//    0  magic "RHASHTR1"
+//    8  uint32 chunk_size
+//   12  uint32 num_chunks
+//   16  uint64 data_size       same as the whole-file signed length
+//   24  uint8  fingerprint[20] key that signed the root (see Certificate)
+//   44  uint8  leaves[num_chunks][32]
+//       uint32 signature_size
+//       uint8  signature[signature_size]
+//
+// The root is the SHA-1 or SHA-256 (as the signing key calls for) of
+// the header and leaves, so the signature's size needn't be known in
+// advance.  RSA signatures are PKCS#1 v1.5 and EC ones DER-encoded
+// ECDSA-Sig-Value, as in the PKCS#7 block.
+//
+// tools/ota/add_hash_tree.py adds a block to a signed package.  The
+// whole-file signature doesn't cover the comment, so it stays valid,
+// and verifiers that don't know about the tree ignore it.
+
+#define HASH_TREE_MAGIC "RHASHTR1"
+#define HASH_TREE_MAGIC_SIZE 8
+#define HASH_TREE_HEADER_SIZE 44
+#define HASH_TREE_LEAF_SIZE SHA256_DIGEST_SIZE
+
+// Refuse chunks larger than this, since every verifying thread needs a
+// buffer of one chunk when reading through a SysReader.
+#define HASH_TREE_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+
+class HashTree {
+  public:
+    // Parse the block at the start of the len bytes at data.  Returns
+    // NULL if there is no well-formed block there.  The tree points
+    // into data, which must outlive it.  The root signature is not
+    // checked here; see signed_data() and signature().
+    static HashTree* Parse(const unsigned char* data, size_t len);
+
+    uint64_t data_size() const { return data_size_; }
+    size_t chunk_size() const { return chunk_size_; }
+    size_t num_chunks() const { return num_chunks_; }
+    const uint8_t* fingerprint() const { return fingerprint_; }
+
+    // The bytes the root is computed over, and the signature of it.
+    const unsigned char* signed_data() const { return data_; }
+    size_t signed_size() const {
+        return HASH_TREE_HEADER_SIZE + num_chunks_ * HASH_TREE_LEAF_SIZE;
+    }
+    const unsigned char* signature() const { return signature_; }
+    size_t signature_size() const { return signature_size_; }
+
+    // Offset and length of chunk i within the package.
+    uint64_t chunk_offset(size_t i) const { return (uint64_t)i * chunk_size_; }
+    size_t chunk_length(size_t i) const;
+
+    // Check every chunk, hashing on several threads at once.  Chunks
+    // are read from addr if it isn't NULL (a mapping of the whole
+    // package), or else through reader.  Returns false as soon as any chunk
+    // fails to read or to match.  If progress isn't NULL, it's called
+    // on the calling thread with the fraction of chunks done so far.
+    bool VerifyAll(const unsigned char* addr, const SysReader* reader,
+                   void (*progress)(double)) const;
+
+  private:
+    HashTree() {}
+
+    // Check that the len bytes at data are chunk i.
+    bool VerifyChunk(size_t i, const unsigned char* data, size_t len) const;
+
+    struct Shared;
+    static void* WorkerMain(void* cookie);
+    void RunWorker(Shared* shared, bool report) const;
+
+    const unsigned char* data_;
+    uint64_t data_size_;
+    size_t chunk_size_;
+    size_t num_chunks_;
+    const uint8_t* fingerprint_;
+    const unsigned char* leaves_;
+    const unsigned char* signature_;
+    size_t signature_size_;
+};
+
+#endif  /* _RECOVERY_HASH_TREE_H */
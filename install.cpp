@@ -18,6 +18,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -32,6 +34,8 @@
 #include "mtdutils/mtdutils.h"
 #include "roots.h"
 #include "verifier.h"
+#include "keystore.h"
+#include "verify_cache.h"
 #include "ui.h"
 
 #include "cutils/properties.h"
@@ -40,6 +44,9 @@ extern RecoveryUI* ui;
 
 #define ASSUMED_UPDATE_BINARY_NAME  "META-INF/com/google/android/update-binary"
 #define PUBLIC_KEYS_FILE "/res/keys"
+#define PUBLIC_KEYSTORE_FILE "/res/keystore"
+#define UPDATE_BINARY_FILE "/tmp/update_binary"
+#define ZIP_INDEX_FILE "/tmp/update_zip_index"
 
 // Default allocation of progress bar segments to operations
 static const int VERIFICATION_PROGRESS_TIME = 60;
@@ -47,32 +54,120 @@ static const float VERIFICATION_PROGRESS_FRACTION = 0.25;
 static const float DEFAULT_FILES_PROGRESS_FRACTION = 0.4;
 static const float DEFAULT_IMAGE_PROGRESS_FRACTION = 0.1;
 
-// If the package contains an update binary, extract it and run it.
-static int
-try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
+// Everything done with the package between opening it and running its
+// update binary.  This can run on its own thread while the package is
+// still being verified; nothing it leaves behind is used, and all of
+// it is removed, unless verification then succeeds.
+struct StagedUpdate {
+    const char* path;
+    SysReader* reader;          // the package, read without mapping it
+    int fd;                     // the package file, or -1 for a block map
+    pthread_t thread;
+
+    int status;                 // INSTALL_SUCCESS once staged
+    char error[256];            // why not, if it isn't
+    const char* zip_index;      // ZIP_INDEX_FILE, or NULL if not written
+};
+
+static void stage_error(StagedUpdate* staged, int status, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(staged->error, sizeof(staged->error), fmt, ap);
+    va_end(ap);
+    staged->status = status;
+}
+
+// Open the package, extract its update binary and save its entry
+// table.  Errors are recorded in staged rather than reported, since
+// they don't matter if the package turns out not to verify.
+static void stage_update_binary(StagedUpdate* staged) {
+    staged->status = INSTALL_SUCCESS;
+    staged->error[0] = '\0';
+    staged->zip_index = NULL;
+
+    ZipArchive zip;
+    int err = mzOpenZipArchiveReader(staged->reader, &zip);
+    if (err != 0) {
+        stage_error(staged, INSTALL_CORRUPT, "Can't open %s\n(%s)", staged->path,
+                    err != -1 ? strerror(err) : "bad");
+        return;
+    }
+    mzSetZipArchiveFd(&zip, staged->fd);
+
     const ZipEntry* binary_entry =
-            mzFindZipEntry(zip, ASSUMED_UPDATE_BINARY_NAME);
+            mzFindZipEntry(&zip, ASSUMED_UPDATE_BINARY_NAME);
     if (binary_entry == NULL) {
-        mzCloseZipArchive(zip);
-        return INSTALL_CORRUPT;
+        mzCloseZipArchive(&zip);
+        stage_error(staged, INSTALL_CORRUPT, "Can't find %s", ASSUMED_UPDATE_BINARY_NAME);
+        return;
     }
 
-    const char* binary = "/tmp/update_binary";
+    const char* binary = UPDATE_BINARY_FILE;
     unlink(binary);
     int fd = creat(binary, 0755);
     if (fd < 0) {
-        mzCloseZipArchive(zip);
-        LOGE("Can't make %s\n", binary);
-        return INSTALL_ERROR;
+        mzCloseZipArchive(&zip);
+        stage_error(staged, INSTALL_ERROR, "Can't make %s", binary);
+        return;
     }
-    bool ok = mzExtractZipEntryToFile(zip, binary_entry, fd);
+    bool ok = mzExtractZipEntryToFile(&zip, binary_entry, fd);
     close(fd);
-    mzCloseZipArchive(zip);
+
+    // Save the parsed entry table so the update binary needn't parse
+    // the central directory again.  It's only an optimization, so
+    // failing to write it isn't an error.
+    const char* zip_index = ZIP_INDEX_FILE;
+    unlink(zip_index);
+    fd = creat(zip_index, 0600);
+    if (fd >= 0) {
+        bool wrote = mzWriteZipIndex(&zip, fd);
+        close(fd);
+        if (!wrote) {
+            LOGW("Can't write %s\n", zip_index);
+            unlink(zip_index);
+            zip_index = NULL;
+        }
+    } else {
+        zip_index = NULL;
+    }
+    staged->zip_index = zip_index;
+    mzCloseZipArchive(&zip);
 
     if (!ok) {
-        LOGE("Can't copy %s\n", ASSUMED_UPDATE_BINARY_NAME);
-        return INSTALL_ERROR;
+        stage_error(staged, INSTALL_ERROR, "Can't copy %s", ASSUMED_UPDATE_BINARY_NAME);
+    }
+}
+
+static void* stage_thread(void* cookie) {
+    stage_update_binary(reinterpret_cast<StagedUpdate*>(cookie));
+    return NULL;
+}
+
+// Start staging the package on another thread.  Returns false (and
+// stages nothing) if the thread can't be started.
+static bool start_staging(StagedUpdate* staged, const char* path, SysReader* reader,
+                          int fd) {
+    staged->path = path;
+    staged->reader = reader;
+    staged->fd = fd;
+    return pthread_create(&staged->thread, NULL, stage_thread, staged) == 0;
+}
+
+// Wait for staging to finish.  Unless the package verified, throw away
+// whatever it wrote.
+static void finish_staging(StagedUpdate* staged, bool verified) {
+    pthread_join(staged->thread, NULL);
+    if (!verified) {
+        unlink(UPDATE_BINARY_FILE);
+        unlink(ZIP_INDEX_FILE);
+        staged->zip_index = NULL;
     }
+}
+
+// Run the staged update binary.
+static int
+run_update_binary(const char *path, const char* zip_index, int* wipe_cache) {
+    const char* binary = UPDATE_BINARY_FILE;
 
     int pipefd[2];
     pipe(pipefd);
@@ -110,6 +205,11 @@ try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
     //
     //   - the name of the package zip file.
     //
+    // If UPDATER_ZIP_INDEX is set in its environment, it names a file
+    // holding the package's entry table as written by mzWriteZipIndex().
+    // Update binaries that know about it can use it instead of parsing
+    // the package again; older ones just ignore it.
+    //
 
     const char** args = (const char**)malloc(sizeof(char*) * 5);
     args[0] = binary;
@@ -123,6 +223,9 @@ try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
     pid_t pid = fork();
     if (pid == 0) {
         close(pipefd[0]);
+        if (zip_index != NULL) {
+            setenv("UPDATER_ZIP_INDEX", zip_index, 1);
+        }
         execv(binary, (char* const*)args);
         fprintf(stdout, "E:Can't run %s (%s)\n", binary, strerror(errno));
         _exit(-1);
@@ -226,14 +329,8 @@ really_install_package(const char *path, int* wipe_cache)
         }
     }
 
-    MemMapping map;
-    if (sysMapFile(path, &map) != 0) {
-        LOGE("failed to map file\n");
-        return INSTALL_CORRUPT;
-    }
-
     int numKeys;
-    Certificate* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
+    Certificate* loadedKeys = load_keystore(PUBLIC_KEYSTORE_FILE, PUBLIC_KEYS_FILE, &numKeys);
     if (loadedKeys == NULL) {
         LOGE("Failed to load keys\n");
         return INSTALL_CORRUPT;
@@ -244,24 +341,66 @@ really_install_package(const char *path, int* wipe_cache)
 
     ui->Print("Verifying update package...\n");
 
+    // While the package is verified, a second thread parses it and
+    // extracts the update binary; see StagedUpdate.  Nothing that thread
+    // produces is trusted until verification succeeds.  Neither of them
+    // maps the package, so its size doesn't matter to memory use.
+    SysReader* reader;
+    StagedUpdate staged;
+    bool staging = false;
+    int fd = -1;
     int err;
-    err = verify_file(map.addr, map.length, loadedKeys, numKeys);
+    if (path[0] == '@') {
+        // Read the package's blocks straight off the device.
+        reader = sysReaderOpen(path);
+        if (reader == NULL) {
+            LOGE("failed to open %s\n", path);
+            free(loadedKeys);
+            ret = INSTALL_CORRUPT;
+            goto out;
+        }
+        staging = start_staging(&staged, path, reader, -1);
+        err = verify_file_reader(reader, loadedKeys, numKeys);
+    } else {
+        // Verify by streaming the file, so the whole package never has
+        // to be resident at once.
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            LOGE("failed to open %s: %s\n", path, strerror(errno));
+            free(loadedKeys);
+            ret = INSTALL_CORRUPT;
+            goto out;
+        }
+        reader = sysReaderOpenFd(fd);
+        if (reader == NULL) {
+            LOGE("failed to open %s\n", path);
+            close(fd);
+            free(loadedKeys);
+            ret = INSTALL_CORRUPT;
+            goto out;
+        }
+        if (verify_cache_lookup(fd, loadedKeys, numKeys)) {
+            // Verified earlier in this session and unchanged since;
+            // e.g. a retry after a failed install.
+            LOGI("package already verified; skipping signature check\n");
+            err = VERIFY_SUCCESS;
+        } else {
+            staging = start_staging(&staged, path, reader, fd);
+            err = verify_file_fd(fd, loadedKeys, numKeys);
+            if (err == VERIFY_SUCCESS) {
+                verify_cache_store(fd, loadedKeys, numKeys);
+            }
+        }
+    }
     free(loadedKeys);
     LOGI("verify_file returned %d\n", err);
+    if (staging) {
+        finish_staging(&staged, err == VERIFY_SUCCESS);
+    }
     if (err != VERIFY_SUCCESS) {
         LOGE("signature verification failed\n");
-        sysReleaseMap(&map);
-        ret = INSTALL_CORRUPT;
-        goto out;
-    }
-
-    /* Try to open the package.
-     */
-    ZipArchive zip;
-    err = mzOpenZipArchive(map.addr, map.length, &zip);
-    if (err != 0) {
-        LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
-        sysReleaseMap(&map);
+        sysReaderClose(reader);
+        if (fd >= 0) close(fd);
         ret = INSTALL_CORRUPT;
         goto out;
     }
@@ -269,9 +408,20 @@ really_install_package(const char *path, int* wipe_cache)
     /* Verify and install the contents of the package.
      */
     ui->Print("Installing update...\n");
-    ret = try_update_binary(path, &zip, wipe_cache);
-
-    sysReleaseMap(&map);
+    if (!staging) {
+        staged.path = path;
+        staged.reader = reader;
+        staged.fd = fd;
+        stage_update_binary(&staged);
+    }
+    sysReaderClose(reader);
+    if (fd >= 0) close(fd);
+    if (staged.status != INSTALL_SUCCESS) {
+        LOGE("%s\n", staged.error);
+        ret = staged.status;
+        goto out;
+    }
+    ret = run_update_binary(path, staged.zip_index, wipe_cache);
 
 out:
     set_perf_mode(false);
@@ -0,0 +1,455 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "keystore.h"
+#include "verifier.h"
+
+#include "mincrypt/p256.h"
+#include "mincrypt/rsa.h"
+#include "mincrypt/sha.h"
+#include "mincrypt/sha256.h"
+#include "minhash/sha.h"
+
+#define KEYSTORE_MAGIC "RKEYSTO1"
+#define KEYSTORE_MAGIC_SIZE 8
+
+// Sanity limit on the number of keys in a store.
+#define MAX_KEYSTORE_RECORDS 1024
+
+// All fields are in host byte order, and the keys are stored in the
+// layout of the mincrypt structs themselves; record_size guards
+// against a store written for a different layout.
+typedef struct {
+    char magic[KEYSTORE_MAGIC_SIZE];
+    uint32_t record_size;
+    uint32_t num_records;
+    uint8_t keys_digest[SHA_DIGEST_SIZE];
+} KeystoreHeader;
+
+typedef struct {
+    uint8_t fingerprint[SHA_DIGEST_SIZE];
+    uint32_t key_type;
+    uint32_t hash_len;
+    union {
+        RSAPublicKey rsa;
+        ECPublicKey ec;
+    } key;
+} KeystoreRecord;
+
+// Append a DER length field.
+static uint8_t* put_der_length(uint8_t* p, size_t len) {
+    if (len < 0x80) {
+        *p++ = len;
+    } else if (len < 0x100) {
+        *p++ = 0x81;
+        *p++ = len;
+    } else {
+        *p++ = 0x82;
+        *p++ = len >> 8;
+        *p++ = len;
+    }
+    return p;
+}
+
+// Append a DER INTEGER holding the unsigned big-endian number in mag.
+static uint8_t* put_der_integer(uint8_t* p, const uint8_t* mag, size_t len) {
+    while (len > 1 && mag[0] == 0) {
+        ++mag;
+        --len;
+    }
+    size_t pad = (mag[0] & 0x80) ? 1 : 0;
+    *p++ = 0x02;
+    p = put_der_length(p, len + pad);
+    if (pad) {
+        *p++ = 0;
+    }
+    memcpy(p, mag, len);
+    return p + len;
+}
+
+static void put_be32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// The fingerprint covers what a certificate carries in its
+// subjectPublicKey BIT STRING: the DER RSAPublicKey SEQUENCE
+// { modulus, publicExponent } for RSA, and the uncompressed point
+// 04 || x || y for EC.
+void set_key_fingerprint(Certificate* cert) {
+    uint8_t der[RSANUMBYTES + 32];
+    size_t der_len = 0;
+
+    if (cert->key_type == Certificate::RSA && cert->rsa != NULL) {
+        const RSAPublicKey* key = cert->rsa;
+        uint8_t n[RSANUMBYTES];
+        uint8_t e[4];
+        for (int i = 0; i < key->len; ++i) {
+            put_be32(n + 4 * i, key->n[key->len - 1 - i]);
+        }
+        put_be32(e, key->exponent);
+
+        uint8_t body[RSANUMBYTES + 16];
+        uint8_t* p = put_der_integer(body, n, key->len * 4);
+        p = put_der_integer(p, e, sizeof(e));
+        size_t body_len = p - body;
+
+        der[0] = 0x30;
+        p = put_der_length(der + 1, body_len);
+        memcpy(p, body, body_len);
+        der_len = (p - der) + body_len;
+    } else if (cert->key_type == Certificate::EC && cert->ec != NULL) {
+        der[0] = 0x04;
+        p256_to_bin(&cert->ec->x, der + 1);
+        p256_to_bin(&cert->ec->y, der + 1 + P256_NBYTES);
+        der_len = 1 + 2 * P256_NBYTES;
+    }
+
+    if (der_len == 0) {
+        memset(cert->fingerprint, 0, sizeof(cert->fingerprint));
+        return;
+    }
+    MH_SHA_hash(der, der_len, cert->fingerprint);
+}
+
+bool keys_file_digest(const char* filename, uint8_t* digest) {
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        return false;
+    }
+    SHA_CTX ctx;
+    MH_SHA_init(&ctx);
+    unsigned char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        MH_SHA_update(&ctx, buffer, n);
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+    memcpy(digest, MH_SHA_final(&ctx), SHA_DIGEST_SIZE);
+    return ok;
+}
+
+static int compare_fingerprints(const void* a, const void* b) {
+    return memcmp(((const KeystoreRecord*)a)->fingerprint,
+                  ((const KeystoreRecord*)b)->fingerprint, SHA_DIGEST_SIZE);
+}
+
+int write_keystore(const char* filename, const Certificate* pKeys, int numKeys,
+                   const uint8_t* keys_digest) {
+    KeystoreRecord* records = (KeystoreRecord*)calloc(numKeys, sizeof(KeystoreRecord));
+    if (records == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < numKeys; ++i) {
+        KeystoreRecord* r = records + i;
+        memcpy(r->fingerprint, pKeys[i].fingerprint, SHA_DIGEST_SIZE);
+        r->key_type = pKeys[i].key_type;
+        r->hash_len = pKeys[i].hash_len;
+        if (pKeys[i].key_type == Certificate::RSA) {
+            r->key.rsa = *pKeys[i].rsa;
+        } else {
+            r->key.ec = *pKeys[i].ec;
+        }
+    }
+    qsort(records, numKeys, sizeof(KeystoreRecord), compare_fingerprints);
+
+    KeystoreHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, KEYSTORE_MAGIC, KEYSTORE_MAGIC_SIZE);
+    header.record_size = sizeof(KeystoreRecord);
+    header.num_records = numKeys;
+    memcpy(header.keys_digest, keys_digest, SHA_DIGEST_SIZE);
+
+    int result = -1;
+    FILE* f = fopen(filename, "wb");
+    if (f != NULL) {
+        if (fwrite(&header, sizeof(header), 1, f) == 1 &&
+            fwrite(records, sizeof(KeystoreRecord), numKeys, f) == (size_t)numKeys) {
+            result = 0;
+        }
+        if (fclose(f) != 0) {
+            result = -1;
+        }
+    }
+    free(records);
+    return result;
+}
+
+// Read the keystore into a block laid out as the Certificate array
+// followed by the file contents, which the certificates point into.
+// Returns NULL if the store is missing, malformed, or was built from
+// some other keys file.
+static Certificate* read_keystore(const char* keystore_file, const uint8_t* keys_digest,
+                                  int* numKeys) {
+    int fd = open(keystore_file, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    Certificate* out = NULL;
+    struct stat st;
+    KeystoreHeader header;
+    if (fstat(fd, &st) != 0 ||
+        TEMP_FAILURE_RETRY(read(fd, &header, sizeof(header))) != (ssize_t)sizeof(header)) {
+        goto exit;
+    }
+    if (memcmp(header.magic, KEYSTORE_MAGIC, KEYSTORE_MAGIC_SIZE) != 0 ||
+        header.record_size != sizeof(KeystoreRecord) ||
+        header.num_records == 0 || header.num_records > MAX_KEYSTORE_RECORDS ||
+        (size_t)st.st_size != sizeof(header) + header.num_records * sizeof(KeystoreRecord)) {
+        LOGW("%s is not a valid keystore\n", keystore_file);
+        goto exit;
+    }
+    if (memcmp(header.keys_digest, keys_digest, SHA_DIGEST_SIZE) != 0) {
+        LOGI("%s was not built from the current keys\n", keystore_file);
+        goto exit;
+    }
+
+    {
+        size_t certs_size = header.num_records * sizeof(Certificate);
+        size_t records_size = header.num_records * sizeof(KeystoreRecord);
+        out = (Certificate*)malloc(certs_size + records_size);
+        if (out == NULL) {
+            goto exit;
+        }
+        KeystoreRecord* records = (KeystoreRecord*)((uint8_t*)out + certs_size);
+        if (TEMP_FAILURE_RETRY(read(fd, records, records_size)) != (ssize_t)records_size) {
+            goto fail;
+        }
+
+        for (uint32_t i = 0; i < header.num_records; ++i) {
+            Certificate* cert = out + i;
+            KeystoreRecord* r = records + i;
+            memset(cert, 0, sizeof(*cert));
+            cert->hash_len = r->hash_len;
+            memcpy(cert->fingerprint, r->fingerprint, SHA_DIGEST_SIZE);
+            if (r->hash_len != SHA_DIGEST_SIZE && r->hash_len != SHA256_DIGEST_SIZE) {
+                goto fail;
+            }
+            if (r->key_type == Certificate::RSA && r->key.rsa.len == RSANUMWORDS) {
+                cert->key_type = Certificate::RSA;
+                cert->rsa = &r->key.rsa;
+            } else if (r->key_type == Certificate::EC && r->hash_len == SHA256_DIGEST_SIZE) {
+                cert->key_type = Certificate::EC;
+                cert->ec = &r->key.ec;
+            } else {
+                goto fail;
+            }
+        }
+        *numKeys = header.num_records;
+        goto exit;
+    }
+
+fail:
+    LOGW("%s holds an unsupported key\n", keystore_file);
+    free(out);
+    out = NULL;
+exit:
+    close(fd);
+    return out;
+}
+
+Certificate* load_keystore(const char* keystore_file, const char* keys_file, int* numKeys) {
+    uint8_t keys_digest[SHA_DIGEST_SIZE];
+    if (keys_file_digest(keys_file, keys_digest)) {
+        Certificate* out = read_keystore(keystore_file, keys_digest, numKeys);
+        if (out != NULL) {
+            return out;
+        }
+    }
+    return load_keys(keys_file, numKeys);
+}
+
+// Reads a file containing one or more public keys as produced by
+// DumpPublicKey:  this is an RSAPublicKey struct as it would appear
+// as a C source literal, eg:
+//
+//  "{64,0xc926ad21,{1795090719,...,-695002876},{-857949815,...,1175080310}}"
+//
+// For key versions newer than the original 2048-bit e=3 keys
+// supported by Android, the string is preceded by a version
+// identifier, eg:
+//
+//  "v2 {64,0xc926ad21,{1795090719,...,-695002876},{-857949815,...,1175080310}}"
+//
+// (Note that the braces and commas in this example are actual
+// characters the parser expects to find in the file; the ellipses
+// indicate more numbers omitted from this example.)
+//
+// The file may contain multiple keys in this format, separated by
+// commas.  The last key must not be followed by a comma.
+//
+// A Certificate is a pair of an RSAPublicKey and a particular hash
+// (we support SHA-1 and SHA-256; we store the hash length to signify
+// which is being used).  The hash used is implied by the version number.
+//
+//       1: 2048-bit RSA key with e=3 and SHA-1 hash
+//       2: 2048-bit RSA key with e=65537 and SHA-1 hash
+//       3: 2048-bit RSA key with e=3 and SHA-256 hash
+//       4: 2048-bit RSA key with e=65537 and SHA-256 hash
+//       5: 256-bit EC key using the NIST P-256 curve parameters and SHA-256 hash
+//
+// Returns NULL if the file failed to parse, or if it contain zero keys.
+Certificate*
+load_keys(const char* filename, int* numKeys) {
+    Certificate* out = NULL;
+    *numKeys = 0;
+
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) {
+        LOGE("opening %s: %s\n", filename, strerror(errno));
+        goto exit;
+    }
+
+    {
+        int i;
+        bool done = false;
+        while (!done) {
+            ++*numKeys;
+            out = (Certificate*)realloc(out, *numKeys * sizeof(Certificate));
+            Certificate* cert = out + (*numKeys - 1);
+            memset(cert, '\0', sizeof(Certificate));
+
+            char start_char;
+            if (fscanf(f, " %c", &start_char) != 1) goto exit;
+            if (start_char == '{') {
+                // a version 1 key has no version specifier.
+                cert->key_type = Certificate::RSA;
+                cert->rsa = (RSAPublicKey*)malloc(sizeof(RSAPublicKey));
+                cert->rsa->exponent = 3;
+                cert->hash_len = SHA_DIGEST_SIZE;
+            } else if (start_char == 'v') {
+                int version;
+                if (fscanf(f, "%d {", &version) != 1) goto exit;
+                switch (version) {
+                    case 2:
+                        cert->key_type = Certificate::RSA;
+                        cert->rsa = (RSAPublicKey*)malloc(sizeof(RSAPublicKey));
+                        cert->rsa->exponent = 65537;
+                        cert->hash_len = SHA_DIGEST_SIZE;
+                        break;
+                    case 3:
+                        cert->key_type = Certificate::RSA;
+                        cert->rsa = (RSAPublicKey*)malloc(sizeof(RSAPublicKey));
+                        cert->rsa->exponent = 3;
+                        cert->hash_len = SHA256_DIGEST_SIZE;
+                        break;
+                    case 4:
+                        cert->key_type = Certificate::RSA;
+                        cert->rsa = (RSAPublicKey*)malloc(sizeof(RSAPublicKey));
+                        cert->rsa->exponent = 65537;
+                        cert->hash_len = SHA256_DIGEST_SIZE;
+                        break;
+                    case 5:
+                        cert->key_type = Certificate::EC;
+                        cert->ec = (ECPublicKey*)calloc(1, sizeof(ECPublicKey));
+                        cert->hash_len = SHA256_DIGEST_SIZE;
+                        break;
+                    default:
+                        goto exit;
+                }
+            }
+
+            if (cert->key_type == Certificate::RSA) {
+                RSAPublicKey* key = cert->rsa;
+                if (fscanf(f, " %i , 0x%x , { %u",
+                           &(key->len), &(key->n0inv), &(key->n[0])) != 3) {
+                    goto exit;
+                }
+                if (key->len != RSANUMWORDS) {
+                    LOGE("key length (%d) does not match expected size\n", key->len);
+                    goto exit;
+                }
+                for (i = 1; i < key->len; ++i) {
+                    if (fscanf(f, " , %u", &(key->n[i])) != 1) goto exit;
+                }
+                if (fscanf(f, " } , { %u", &(key->rr[0])) != 1) goto exit;
+                for (i = 1; i < key->len; ++i) {
+                    if (fscanf(f, " , %u", &(key->rr[i])) != 1) goto exit;
+                }
+                fscanf(f, " } } ");
+
+                LOGI("read key e=%d hash=%d\n", key->exponent, cert->hash_len);
+            } else if (cert->key_type == Certificate::EC) {
+                ECPublicKey* key = cert->ec;
+                int key_len;
+                unsigned int byte;
+                uint8_t x_bytes[P256_NBYTES];
+                uint8_t y_bytes[P256_NBYTES];
+                if (fscanf(f, " %i , { %u", &key_len, &byte) != 2) goto exit;
+                if (key_len != P256_NBYTES) {
+                    LOGE("Key length (%d) does not match expected size %d\n", key_len, P256_NBYTES);
+                    goto exit;
+                }
+                x_bytes[P256_NBYTES - 1] = byte;
+                for (i = P256_NBYTES - 2; i >= 0; --i) {
+                    if (fscanf(f, " , %u", &byte) != 1) goto exit;
+                    x_bytes[i] = byte;
+                }
+                if (fscanf(f, " } , { %u", &byte) != 1) goto exit;
+                y_bytes[P256_NBYTES - 1] = byte;
+                for (i = P256_NBYTES - 2; i >= 0; --i) {
+                    if (fscanf(f, " , %u", &byte) != 1) goto exit;
+                    y_bytes[i] = byte;
+                }
+                fscanf(f, " } } ");
+                p256_from_bin(x_bytes, &key->x);
+                p256_from_bin(y_bytes, &key->y);
+            } else {
+                LOGE("Unknown key type %d\n", cert->key_type);
+                goto exit;
+            }
+
+            set_key_fingerprint(cert);
+
+            // if the line ends in a comma, this file has more keys.
+            switch (fgetc(f)) {
+            case ',':
+                // more keys to come.
+                break;
+
+            case EOF:
+                done = true;
+                break;
+
+            default:
+                LOGE("unexpected character between keys\n");
+                goto exit;
+            }
+        }
+    }
+
+    fclose(f);
+    return out;
+
+exit:
+    if (f) fclose(f);
+    free(out);
+    *numKeys = 0;
+    return NULL;
+}
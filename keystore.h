@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_KEYSTORE_H
+#define _RECOVERY_KEYSTORE_H
+
+#include "verifier.h"
+
+/* A keystore is a binary form of the keys file written by
+ * DumpPublicKey: fixed-size records holding each key in the in-memory
+ * layout mincrypt uses, sorted by key fingerprint.  mkkeystore builds
+ * it on the host, and loading it is a single read.
+ *
+ * The store also records the SHA-1 of the keys file it was built
+ * from.  When the keys file changes (e.g. when a target-files package
+ * is re-signed with release keys), the store is ignored.
+ */
+
+/* Compute cert->fingerprint from its key. */
+void set_key_fingerprint(Certificate* cert);
+
+/* SHA-1 of the contents of filename.  Returns false if it can't be
+ * read.
+ */
+bool keys_file_digest(const char* filename, uint8_t* digest);
+
+/* Write the keys to a keystore at filename, recording keys_digest as
+ * the digest of the keys file they came from.  Returns 0 on success.
+ */
+int write_keystore(const char* filename, const Certificate* pKeys, int numKeys,
+                   const uint8_t* keys_digest);
+
+/* Load the keys in keys_file, from the keystore at keystore_file if
+ * it was built from keys_file as it is now, and otherwise by parsing
+ * keys_file with load_keys().  Either way the caller releases the
+ * result with free(), as for load_keys().
+ */
+Certificate* load_keystore(const char* keystore_file, const char* keys_file, int* numKeys);
+
+#endif  /* _RECOVERY_KEYSTORE_H */
@@ -0,0 +1,36 @@
+LOCAL_PATH := $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	sha.c \
+	sha_portable.c
+
+LOCAL_SRC_FILES_x86 := sha_x86.c
+LOCAL_SRC_FILES_x86_64 := sha_x86.c
+
+# The crypto instructions are only reached after a hwcap check, so it
+# is safe to make them available to the whole library.
+LOCAL_SRC_FILES_arm64 := sha_arm64.c
+LOCAL_CFLAGS_arm64 := -march=armv8-a+crypto
+
+LOCAL_MODULE := libminhash
+
+LOCAL_CFLAGS += -Wall -O3
+
+include $(BUILD_STATIC_LIBRARY)
+
+# For host tools such as mkkeystore.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	sha.c \
+	sha_portable.c
+
+LOCAL_SRC_FILES_x86 := sha_x86.c
+LOCAL_SRC_FILES_x86_64 := sha_x86.c
+
+LOCAL_MODULE := libminhash
+
+LOCAL_CFLAGS += -Wall -O3
+
+include $(BUILD_HOST_STATIC_LIBRARY)
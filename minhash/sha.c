@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Buffering, padding and backend selection for minhash.  The block
+ * functions themselves live in sha_portable.c and the per-architecture
+ * files.
+ */
+#include <pthread.h>
+#include <string.h>
+
+#include "sha.h"
+#include "sha_impl.h"
+
+typedef struct {
+    const char* name;
+    int (*supported)(void);
+    MhBlockFn sha1;
+    MhBlockFn sha256;
+} Backend;
+
+static int alwaysSupported(void) {
+    return 1;
+}
+
+/* In order of preference. */
+static const Backend gBackends[] = {
+#ifdef MH_HAVE_X86_SHANI
+    { "x86-shani", mhX86HasShaNi, mhSha1BlocksShaNi, mhSha256BlocksShaNi },
+#endif
+#ifdef MH_HAVE_ARMV8_CE
+    { "armv8-ce", mhArmv8HasSha, mhSha1BlocksArmv8, mhSha256BlocksArmv8 },
+#endif
+    { "portable", alwaysSupported, mhSha1BlocksPortable, mhSha256BlocksPortable },
+};
+
+#define NUM_BACKENDS (sizeof(gBackends) / sizeof(gBackends[0]))
+
+static pthread_once_t gProbeOnce = PTHREAD_ONCE_INIT;
+static const Backend* gBackend = &gBackends[NUM_BACKENDS - 1];
+
+static void probeBackend(void) {
+    size_t i;
+    for (i = 0; i < NUM_BACKENDS; ++i) {
+        if (gBackends[i].supported()) {
+            gBackend = &gBackends[i];
+            return;
+        }
+    }
+}
+
+static const Backend* backend(void) {
+    pthread_once(&gProbeOnce, probeBackend);
+    return gBackend;
+}
+
+const char* MH_backend(void) {
+    return backend()->name;
+}
+
+int MH_set_backend(const char* name) {
+    size_t i;
+    pthread_once(&gProbeOnce, probeBackend);
+    for (i = 0; i < NUM_BACKENDS; ++i) {
+        if (strcmp(gBackends[i].name, name) == 0 && gBackends[i].supported()) {
+            gBackend = &gBackends[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * ctx->count is the number of bytes hashed so far; the partial block
+ * waits in ctx->buf.
+ */
+static void update(HASH_CTX* ctx, const void* data, int len, MhBlockFn fn) {
+    const uint8_t* p = (const uint8_t*)data;
+    size_t remaining;
+    unsigned int used;
+
+    if (len <= 0) {
+        return;
+    }
+    remaining = (size_t)len;
+    used = (unsigned int)(ctx->count & 63);
+    ctx->count += remaining;
+
+    if (used > 0) {
+        size_t fill = 64 - used;
+        if (remaining < fill) {
+            memcpy(ctx->buf + used, p, remaining);
+            return;
+        }
+        memcpy(ctx->buf + used, p, fill);
+        fn(ctx->state, ctx->buf, 1);
+        p += fill;
+        remaining -= fill;
+    }
+
+    if (remaining >= 64) {
+        fn(ctx->state, p, remaining / 64);
+        p += remaining & ~(size_t)63;
+        remaining &= 63;
+    }
+
+    if (remaining > 0) {
+        memcpy(ctx->buf, p, remaining);
+    }
+}
+
+/*
+ * Pad the message, then write the first digest_words state words into
+ * ctx->buf in big-endian order and return it.
+ */
+static const uint8_t* finish(HASH_CTX* ctx, MhBlockFn fn, int digest_words) {
+    uint64_t bits = ctx->count * 8;
+    unsigned int used = (unsigned int)(ctx->count & 63);
+    int i;
+
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->buf + used, 0, 64 - used);
+        fn(ctx->state, ctx->buf, 1);
+        used = 0;
+    }
+    memset(ctx->buf + used, 0, 56 - used);
+    for (i = 0; i < 8; ++i) {
+        ctx->buf[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    fn(ctx->state, ctx->buf, 1);
+
+    for (i = 0; i < digest_words; ++i) {
+        uint32_t s = ctx->state[i];
+        ctx->buf[4*i]   = (uint8_t)(s >> 24);
+        ctx->buf[4*i+1] = (uint8_t)(s >> 16);
+        ctx->buf[4*i+2] = (uint8_t)(s >> 8);
+        ctx->buf[4*i+3] = (uint8_t)s;
+    }
+    return ctx->buf;
+}
+
+static const HASH_VTAB SHA_VTAB = {
+    MH_SHA_init,
+    MH_SHA_update,
+    MH_SHA_final,
+    MH_SHA_hash,
+    SHA_DIGEST_SIZE
+};
+
+void MH_SHA_init(SHA_CTX* ctx) {
+    backend();
+    ctx->f = &SHA_VTAB;
+    ctx->count = 0;
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xc3d2e1f0;
+}
+
+void MH_SHA_update(SHA_CTX* ctx, const void* data, int len) {
+    update(ctx, data, len, gBackend->sha1);
+}
+
+const uint8_t* MH_SHA_final(SHA_CTX* ctx) {
+    return finish(ctx, gBackend->sha1, SHA_DIGEST_SIZE / 4);
+}
+
+const uint8_t* MH_SHA_hash(const void* data, int len, uint8_t* digest) {
+    SHA_CTX ctx;
+    MH_SHA_init(&ctx);
+    MH_SHA_update(&ctx, data, len);
+    memcpy(digest, MH_SHA_final(&ctx), SHA_DIGEST_SIZE);
+    return digest;
+}
+
+static const HASH_VTAB SHA256_VTAB = {
+    MH_SHA256_init,
+    MH_SHA256_update,
+    MH_SHA256_final,
+    MH_SHA256_hash,
+    SHA256_DIGEST_SIZE
+};
+
+void MH_SHA256_init(SHA256_CTX* ctx) {
+    backend();
+    ctx->f = &SHA256_VTAB;
+    ctx->count = 0;
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+}
+
+void MH_SHA256_update(SHA256_CTX* ctx, const void* data, int len) {
+    update(ctx, data, len, gBackend->sha256);
+}
+
+const uint8_t* MH_SHA256_final(SHA256_CTX* ctx) {
+    return finish(ctx, gBackend->sha256, SHA256_DIGEST_SIZE / 4);
+}
+
+const uint8_t* MH_SHA256_hash(const void* data, int len, uint8_t* digest) {
+    SHA256_CTX ctx;
+    MH_SHA256_init(&ctx);
+    MH_SHA256_update(&ctx, data, len);
+    memcpy(digest, MH_SHA256_final(&ctx), SHA256_DIGEST_SIZE);
+    return digest;
+}
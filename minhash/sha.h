@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * SHA-1 and SHA-256 with runtime selection of the block function.
+ *
+ * Contexts are ordinary mincrypt HASH_CTXs (SHA_CTX, SHA256_CTX), so
+ * they can be copied with memcpy() and driven through HASH_update() and
+ * HASH_final() like any other mincrypt hash.  The first init call
+ * probes the CPU and picks the fastest available implementation:
+ * SHA-NI on x86, the ARMv8 crypto extensions on arm64, and portable C
+ * everywhere else.
+ */
+#ifndef _MINHASH_SHA_H
+#define _MINHASH_SHA_H
+
+#include <stdint.h>
+
+#include "mincrypt/hash-internal.h"
+#include "mincrypt/sha.h"
+#include "mincrypt/sha256.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void MH_SHA_init(SHA_CTX* ctx);
+void MH_SHA_update(SHA_CTX* ctx, const void* data, int len);
+const uint8_t* MH_SHA_final(SHA_CTX* ctx);
+const uint8_t* MH_SHA_hash(const void* data, int len, uint8_t* digest);
+
+void MH_SHA256_init(SHA256_CTX* ctx);
+void MH_SHA256_update(SHA256_CTX* ctx, const void* data, int len);
+const uint8_t* MH_SHA256_final(SHA256_CTX* ctx);
+const uint8_t* MH_SHA256_hash(const void* data, int len, uint8_t* digest);
+
+/*
+ * Name of the implementation in use: "portable", "x86-shani" or
+ * "armv8-ce".
+ */
+const char* MH_backend(void);
+
+/*
+ * Switch to the named implementation, for benchmarks and tests.
+ * Returns 0 on success, or -1 if it isn't supported by this build or
+ * this CPU.  Contexts that are already in use stay valid; every
+ * implementation produces the same state.
+ */
+int MH_set_backend(const char* name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* _MINHASH_SHA_H */
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * SHA-1 and SHA-256 block functions using the ARMv8 cryptography
+ * extensions.  Android.mk builds this library with +crypto on arm64;
+ * the instructions are only reached once mhArmv8HasSha() has checked
+ * the kernel's hwcaps.
+ */
+#include "sha_impl.h"
+
+#ifdef MH_HAVE_ARMV8_CE
+
+#include <arm_neon.h>
+#include <sys/auxv.h>
+
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+
+int mhArmv8HasSha(void) {
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    return (hwcap & HWCAP_SHA1) && (hwcap & HWCAP_SHA2);
+}
+
+static inline uint32x4_t load_be(const uint8_t* p) {
+    return vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p)));
+}
+
+/*
+ * Four SHA-1 rounds over W[4g..4g+3], held in m0, using the round
+ * function op and constant k.  When do_sched is set, m0 is then
+ * replaced by W[4g+16..4g+19], computed from itself and m1..m3.
+ */
+#define SHA1_ROUNDS4(op, k, m0, m1, m2, m3, do_sched)                 \
+    do {                                                              \
+        uint32x4_t wk = vaddq_u32(m0, vdupq_n_u32(k));                \
+        uint32_t e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));        \
+        abcd = op(abcd, e, wk);                                       \
+        e = e_next;                                                   \
+        if (do_sched) {                                               \
+            m0 = vsha1su1q_u32(vsha1su0q_u32(m0, m1, m2), m3);        \
+        }                                                             \
+    } while (0)
+
+#define K0 0x5a827999
+#define K1 0x6ed9eba1
+#define K2 0x8f1bbcdc
+#define K3 0xca62c1d6
+
+void mhSha1BlocksArmv8(uint32_t* state, const uint8_t* data, size_t nblocks) {
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32_t e = state[4];
+
+    while (nblocks-- > 0) {
+        uint32x4_t abcd_save = abcd;
+        uint32_t e_save = e;
+        uint32x4_t m0 = load_be(data);
+        uint32x4_t m1 = load_be(data + 16);
+        uint32x4_t m2 = load_be(data + 32);
+        uint32x4_t m3 = load_be(data + 48);
+
+        SHA1_ROUNDS4(vsha1cq_u32, K0, m0, m1, m2, m3, 1);   /*  0-3  */
+        SHA1_ROUNDS4(vsha1cq_u32, K0, m1, m2, m3, m0, 1);   /*  4-7  */
+        SHA1_ROUNDS4(vsha1cq_u32, K0, m2, m3, m0, m1, 1);   /*  8-11 */
+        SHA1_ROUNDS4(vsha1cq_u32, K0, m3, m0, m1, m2, 1);   /* 12-15 */
+        SHA1_ROUNDS4(vsha1cq_u32, K0, m0, m1, m2, m3, 1);   /* 16-19 */
+        SHA1_ROUNDS4(vsha1pq_u32, K1, m1, m2, m3, m0, 1);   /* 20-23 */
+        SHA1_ROUNDS4(vsha1pq_u32, K1, m2, m3, m0, m1, 1);   /* 24-27 */
+        SHA1_ROUNDS4(vsha1pq_u32, K1, m3, m0, m1, m2, 1);   /* 28-31 */
+        SHA1_ROUNDS4(vsha1pq_u32, K1, m0, m1, m2, m3, 1);   /* 32-35 */
+        SHA1_ROUNDS4(vsha1pq_u32, K1, m1, m2, m3, m0, 1);   /* 36-39 */
+        SHA1_ROUNDS4(vsha1mq_u32, K2, m2, m3, m0, m1, 1);   /* 40-43 */
+        SHA1_ROUNDS4(vsha1mq_u32, K2, m3, m0, m1, m2, 1);   /* 44-47 */
+        SHA1_ROUNDS4(vsha1mq_u32, K2, m0, m1, m2, m3, 1);   /* 48-51 */
+        SHA1_ROUNDS4(vsha1mq_u32, K2, m1, m2, m3, m0, 1);   /* 52-55 */
+        SHA1_ROUNDS4(vsha1mq_u32, K2, m2, m3, m0, m1, 1);   /* 56-59 */
+        SHA1_ROUNDS4(vsha1pq_u32, K3, m3, m0, m1, m2, 1);   /* 60-63 */
+        SHA1_ROUNDS4(vsha1pq_u32, K3, m0, m1, m2, m3, 0);   /* 64-67 */
+        SHA1_ROUNDS4(vsha1pq_u32, K3, m1, m2, m3, m0, 0);   /* 68-71 */
+        SHA1_ROUNDS4(vsha1pq_u32, K3, m2, m3, m0, m1, 0);   /* 72-75 */
+        SHA1_ROUNDS4(vsha1pq_u32, K3, m3, m0, m1, m2, 0);   /* 76-79 */
+
+        abcd = vaddq_u32(abcd, abcd_save);
+        e += e_save;
+        data += 64;
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e;
+}
+
+static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/*
+ * Four SHA-256 rounds over W[4g..4g+3], held in m0.  When do_sched is
+ * set, m0 is then replaced by W[4g+16..4g+19].
+ */
+#define SHA256_ROUNDS4(g, m0, m1, m2, m3, do_sched)                   \
+    do {                                                              \
+        uint32x4_t wk = vaddq_u32(m0, vld1q_u32(&K256[4*(g)]));       \
+        uint32x4_t abcd = state0;                                     \
+        if (do_sched) {                                               \
+            m0 = vsha256su1q_u32(vsha256su0q_u32(m0, m1), m2, m3);    \
+        }                                                             \
+        state0 = vsha256hq_u32(state0, state1, wk);                   \
+        state1 = vsha256h2q_u32(state1, abcd, wk);                    \
+    } while (0)
+
+void mhSha256BlocksArmv8(uint32_t* state, const uint8_t* data, size_t nblocks) {
+    uint32x4_t state0 = vld1q_u32(&state[0]);
+    uint32x4_t state1 = vld1q_u32(&state[4]);
+
+    while (nblocks-- > 0) {
+        uint32x4_t abcd_save = state0;
+        uint32x4_t efgh_save = state1;
+        uint32x4_t m0 = load_be(data);
+        uint32x4_t m1 = load_be(data + 16);
+        uint32x4_t m2 = load_be(data + 32);
+        uint32x4_t m3 = load_be(data + 48);
+
+        SHA256_ROUNDS4( 0, m0, m1, m2, m3, 1);
+        SHA256_ROUNDS4( 1, m1, m2, m3, m0, 1);
+        SHA256_ROUNDS4( 2, m2, m3, m0, m1, 1);
+        SHA256_ROUNDS4( 3, m3, m0, m1, m2, 1);
+        SHA256_ROUNDS4( 4, m0, m1, m2, m3, 1);
+        SHA256_ROUNDS4( 5, m1, m2, m3, m0, 1);
+        SHA256_ROUNDS4( 6, m2, m3, m0, m1, 1);
+        SHA256_ROUNDS4( 7, m3, m0, m1, m2, 1);
+        SHA256_ROUNDS4( 8, m0, m1, m2, m3, 1);
+        SHA256_ROUNDS4( 9, m1, m2, m3, m0, 1);
+        SHA256_ROUNDS4(10, m2, m3, m0, m1, 1);
+        SHA256_ROUNDS4(11, m3, m0, m1, m2, 1);
+        SHA256_ROUNDS4(12, m0, m1, m2, m3, 0);
+        SHA256_ROUNDS4(13, m1, m2, m3, m0, 0);
+        SHA256_ROUNDS4(14, m2, m3, m0, m1, 0);
+        SHA256_ROUNDS4(15, m3, m0, m1, m2, 0);
+
+        state0 = vaddq_u32(state0, abcd_save);
+        state1 = vaddq_u32(state1, efgh_save);
+        data += 64;
+    }
+
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+}
+
+#endif  /* MH_HAVE_ARMV8_CE */
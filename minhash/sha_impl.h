@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Block functions behind minhash/sha.h.  Each one consumes nblocks
+ * consecutive 64-byte blocks and updates state in place; the state
+ * words are in the natural order of the spec (a, b, c, ...).
+ */
+#ifndef _MINHASH_SHA_IMPL_H
+#define _MINHASH_SHA_IMPL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void (*MhBlockFn)(uint32_t* state, const uint8_t* data, size_t nblocks);
+
+void mhSha1BlocksPortable(uint32_t* state, const uint8_t* data, size_t nblocks);
+void mhSha256BlocksPortable(uint32_t* state, const uint8_t* data, size_t nblocks);
+
+#if defined(__i386__) || defined(__x86_64__)
+#define MH_HAVE_X86_SHANI 1
+int mhX86HasShaNi(void);
+void mhSha1BlocksShaNi(uint32_t* state, const uint8_t* data, size_t nblocks);
+void mhSha256BlocksShaNi(uint32_t* state, const uint8_t* data, size_t nblocks);
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+#define MH_HAVE_ARMV8_CE 1
+int mhArmv8HasSha(void);
+void mhSha1BlocksArmv8(uint32_t* state, const uint8_t* data, size_t nblocks);
+void mhSha256BlocksArmv8(uint32_t* state, const uint8_t* data, size_t nblocks);
+#endif
+
+#endif  /* _MINHASH_SHA_IMPL_H */
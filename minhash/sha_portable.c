@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sha_impl.h"
+
+#define ROL(bits, value) (((value) << (bits)) | ((value) >> (32 - (bits))))
+#define ROR(bits, value) (((value) >> (bits)) | ((value) << (32 - (bits))))
+
+static inline uint32_t load_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+/* One SHA-1 round with mixing function f and constant k. */
+#define SHA1_ROUND(f, k)                                     \
+    do {                                                     \
+        uint32_t tmp = ROL(5, A) + (f) + E + (k) + W[t];     \
+        E = D;                                               \
+        D = C;                                               \
+        C = ROL(30, B);                                      \
+        B = A;                                               \
+        A = tmp;                                             \
+    } while (0)
+
+void mhSha1BlocksPortable(uint32_t* state, const uint8_t* data, size_t nblocks) {
+    while (nblocks-- > 0) {
+        uint32_t W[80];
+        uint32_t A = state[0], B = state[1], C = state[2], D = state[3], E = state[4];
+        int t;
+
+        for (t = 0; t < 16; ++t) {
+            W[t] = load_be32(data + 4 * t);
+        }
+        for (; t < 80; ++t) {
+            uint32_t tmp = W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16];
+            W[t] = ROL(1, tmp);
+        }
+
+        for (t = 0; t < 20; ++t) SHA1_ROUND(D ^ (B & (C ^ D)), 0x5A827999);
+        for (; t < 40; ++t) SHA1_ROUND(B ^ C ^ D, 0x6ED9EBA1);
+        for (; t < 60; ++t) SHA1_ROUND((B & C) | (D & (B | C)), 0x8F1BBCDC);
+        for (; t < 80; ++t) SHA1_ROUND(B ^ C ^ D, 0xCA62C1D6);
+
+        state[0] += A;
+        state[1] += B;
+        state[2] += C;
+        state[3] += D;
+        state[4] += E;
+        data += 64;
+    }
+}
+
+static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+void mhSha256BlocksPortable(uint32_t* state, const uint8_t* data, size_t nblocks) {
+    while (nblocks-- > 0) {
+        uint32_t W[64];
+        uint32_t A = state[0], B = state[1], C = state[2], D = state[3];
+        uint32_t E = state[4], F = state[5], G = state[6], H = state[7];
+        int t;
+
+        for (t = 0; t < 16; ++t) {
+            W[t] = load_be32(data + 4 * t);
+        }
+        for (; t < 64; ++t) {
+            uint32_t s0 = ROR(7, W[t-15]) ^ ROR(18, W[t-15]) ^ (W[t-15] >> 3);
+            uint32_t s1 = ROR(17, W[t-2]) ^ ROR(19, W[t-2]) ^ (W[t-2] >> 10);
+            W[t] = W[t-16] + s0 + W[t-7] + s1;
+        }
+
+        for (t = 0; t < 64; ++t) {
+            uint32_t s0 = ROR(2, A) ^ ROR(13, A) ^ ROR(22, A);
+            uint32_t maj = (A & B) ^ (A & C) ^ (B & C);
+            uint32_t t2 = s0 + maj;
+            uint32_t s1 = ROR(6, E) ^ ROR(11, E) ^ ROR(25, E);
+            uint32_t ch = (E & F) ^ ((~E) & G);
+            uint32_t t1 = H + s1 + ch + K256[t] + W[t];
+
+            H = G;
+            G = F;
+            F = E;
+            E = D + t1;
+            D = C;
+            C = B;
+            B = A;
+            A = t1 + t2;
+        }
+
+        state[0] += A;
+        state[1] += B;
+        state[2] += C;
+        state[3] += D;
+        state[4] += E;
+        state[5] += F;
+        state[6] += G;
+        state[7] += H;
+        data += 64;
+    }
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * SHA-1 and SHA-256 block functions using the Intel SHA extensions.
+ * They are compiled with per-function target attributes so the rest of
+ * the build can keep its baseline flags; mhX86HasShaNi() decides at
+ * runtime whether they may be called.
+ */
+#include "sha_impl.h"
+
+#ifdef MH_HAVE_X86_SHANI
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHANI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+int mhX86HasShaNi(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return 0;
+    }
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+        return 0;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 29)) != 0;
+}
+
+/*
+ * Four SHA-1 rounds.  Group g hashes W[4g..4g+3], held in m0, while
+ * also advancing the message schedule: m1 receives its final sha1msg2
+ * step, m3 its sha1msg1 step and m2 the xor that sits between them.
+ * Each flag says whether that step is still needed at this point.
+ */
+#define SHA1_ROUNDS4(e_in, e_out, m0, m1, m2, m3, func, do_msg2, do_msg1, do_xor) \
+    do {                                                               \
+        e_in = _mm_sha1nexte_epu32(e_in, m0);                          \
+        e_out = abcd;                                                  \
+        if (do_msg2) m1 = _mm_sha1msg2_epu32(m1, m0);                  \
+        abcd = _mm_sha1rnds4_epu32(abcd, e_in, func);                  \
+        if (do_msg1) m3 = _mm_sha1msg1_epu32(m3, m0);                  \
+        if (do_xor) m2 = _mm_xor_si128(m2, m0);                        \
+    } while (0)
+
+SHANI_TARGET
+void mhSha1BlocksShaNi(uint32_t* state, const uint8_t* data, size_t nblocks) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1b);
+    __m128i e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+    __m128i e1, m0, m1, m2, m3, abcd_save, e0_save;
+
+    while (nblocks-- > 0) {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 0)), mask);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), mask);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), mask);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), mask);
+
+        /* Rounds 0-3: E is added directly rather than through nexte. */
+        e0 = _mm_add_epi32(e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        SHA1_ROUNDS4(e1, e0, m1, m2, m3, m0, 0, 0, 1, 0);   /*  4-7  */
+        SHA1_ROUNDS4(e0, e1, m2, m3, m0, m1, 0, 0, 1, 1);   /*  8-11 */
+        SHA1_ROUNDS4(e1, e0, m3, m0, m1, m2, 0, 1, 1, 1);   /* 12-15 */
+        SHA1_ROUNDS4(e0, e1, m0, m1, m2, m3, 0, 1, 1, 1);   /* 16-19 */
+        SHA1_ROUNDS4(e1, e0, m1, m2, m3, m0, 1, 1, 1, 1);   /* 20-23 */
+        SHA1_ROUNDS4(e0, e1, m2, m3, m0, m1, 1, 1, 1, 1);   /* 24-27 */
+        SHA1_ROUNDS4(e1, e0, m3, m0, m1, m2, 1, 1, 1, 1);   /* 28-31 */
+        SHA1_ROUNDS4(e0, e1, m0, m1, m2, m3, 1, 1, 1, 1);   /* 32-35 */
+        SHA1_ROUNDS4(e1, e0, m1, m2, m3, m0, 1, 1, 1, 1);   /* 36-39 */
+        SHA1_ROUNDS4(e0, e1, m2, m3, m0, m1, 2, 1, 1, 1);   /* 40-43 */
+        SHA1_ROUNDS4(e1, e0, m3, m0, m1, m2, 2, 1, 1, 1);   /* 44-47 */
+        SHA1_ROUNDS4(e0, e1, m0, m1, m2, m3, 2, 1, 1, 1);   /* 48-51 */
+        SHA1_ROUNDS4(e1, e0, m1, m2, m3, m0, 2, 1, 1, 1);   /* 52-55 */
+        SHA1_ROUNDS4(e0, e1, m2, m3, m0, m1, 2, 1, 1, 1);   /* 56-59 */
+        SHA1_ROUNDS4(e1, e0, m3, m0, m1, m2, 3, 1, 1, 1);   /* 60-63 */
+        SHA1_ROUNDS4(e0, e1, m0, m1, m2, m3, 3, 1, 1, 1);   /* 64-67 */
+        SHA1_ROUNDS4(e1, e0, m1, m2, m3, m0, 3, 1, 0, 1);   /* 68-71 */
+        SHA1_ROUNDS4(e0, e1, m2, m3, m0, m1, 3, 1, 0, 0);   /* 72-75 */
+        SHA1_ROUNDS4(e1, e0, m3, m0, m1, m2, 3, 0, 0, 0);   /* 76-79 */
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+        data += 64;
+    }
+
+    _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+static const uint32_t K256[64] __attribute__((aligned(16))) = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/*
+ * Four SHA-256 rounds over W[4g..4g+3], held in m0.  When do_sched is
+ * set, m0 is then replaced by W[4g+16..4g+19], computed from itself
+ * and the three following groups m1..m3.
+ */
+#define SHA256_ROUNDS4(g, m0, m1, m2, m3, do_sched)                        \
+    do {                                                                   \
+        __m128i wk = _mm_add_epi32(m0, _mm_load_si128((const __m128i*)&K256[4*(g)])); \
+        state1 = _mm_sha256rnds2_epu32(state1, state0, wk);                \
+        wk = _mm_shuffle_epi32(wk, 0x0e);                                  \
+        state0 = _mm_sha256rnds2_epu32(state0, state1, wk);                \
+        if (do_sched) {                                                    \
+            m0 = _mm_add_epi32(_mm_sha256msg1_epu32(m0, m1),               \
+                               _mm_alignr_epi8(m3, m2, 4));                \
+            m0 = _mm_sha256msg2_epu32(m0, m3);                             \
+        }                                                                  \
+    } while (0)
+
+SHANI_TARGET
+void mhSha256BlocksShaNi(uint32_t* state, const uint8_t* data, size_t nblocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, tmp, m0, m1, m2, m3, abef_save, cdgh_save;
+
+    /* The round instructions want the state as ABEF and CDGH. */
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xb1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    while (nblocks-- > 0) {
+        abef_save = state0;
+        cdgh_save = state1;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 0)), mask);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), mask);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), mask);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), mask);
+
+        SHA256_ROUNDS4( 0, m0, m1, m2, m3, 1);
+        SHA256_ROUNDS4( 1, m1, m2, m3, m0, 1);
+        SHA256_ROUNDS4( 2, m2, m3, m0, m1, 1);
+        SHA256_ROUNDS4( 3, m3, m0, m1, m2, 1);
+        SHA256_ROUNDS4( 4, m0, m1, m2, m3, 1);
+        SHA256_ROUNDS4( 5, m1, m2, m3, m0, 1);
+        SHA256_ROUNDS4( 6, m2, m3, m0, m1, 1);
+        SHA256_ROUNDS4( 7, m3, m0, m1, m2, 1);
+        SHA256_ROUNDS4( 8, m0, m1, m2, m3, 1);
+        SHA256_ROUNDS4( 9, m1, m2, m3, m0, 1);
+        SHA256_ROUNDS4(10, m2, m3, m0, m1, 1);
+        SHA256_ROUNDS4(11, m3, m0, m1, m2, 1);
+        SHA256_ROUNDS4(12, m0, m1, m2, m3, 0);
+        SHA256_ROUNDS4(13, m1, m2, m3, m0, 0);
+        SHA256_ROUNDS4(14, m2, m3, m0, m1, 0);
+        SHA256_ROUNDS4(15, m3, m0, m1, m2, 0);
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+        data += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+#endif  /* MH_HAVE_X86_SHANI */
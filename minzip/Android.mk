@@ -2,12 +2,21 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
+	Crc32.c \
 	Hash.c \
 	SysUtil.c \
 	DirUtil.c \
 	Inlines.c \
 	Zip.c
 
+LOCAL_SRC_FILES_x86 := Crc32_x86.c
+LOCAL_SRC_FILES_x86_64 := Crc32_x86.c
+
+# The CRC32 instructions are only reached after a hwcap check, so it
+# is safe to make them available to the whole library.
+LOCAL_SRC_FILES_arm64 := Crc32_arm64.c
+LOCAL_CFLAGS_arm64 := -march=armv8-a+crc
+
 LOCAL_C_INCLUDES := \
 	external/zlib \
 	external/safe-iop/include
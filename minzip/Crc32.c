@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * CRC-32 with runtime selection of the implementation.  The
+ * accelerated ones live in the per-architecture files.
+ */
+#include "zlib.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include "Crc32.h"
+#include "Crc32Impl.h"
+
+typedef struct {
+    const char* name;
+    int (*supported)(void);
+    MzCrc32Fn crc32;
+} Backend;
+
+static int alwaysSupported(void)
+{
+    return 1;
+}
+
+/* In order of preference. */
+static const Backend gBackends[] = {
+#ifdef MZ_HAVE_X86_PCLMUL
+    { "x86-pclmul", mzX86HasPclmul, mzCrc32Pclmul },
+#endif
+#ifdef MZ_HAVE_ARMV8_CRC
+    { "armv8-crc", mzArmv8HasCrc32, mzCrc32Armv8 },
+#endif
+    { "zlib", alwaysSupported, mzCrc32Zlib },
+};
+
+#define NUM_BACKENDS (sizeof(gBackends) / sizeof(gBackends[0]))
+
+static pthread_once_t gProbeOnce = PTHREAD_ONCE_INIT;
+static const Backend* gBackend = &gBackends[NUM_BACKENDS - 1];
+
+static void probeBackend(void)
+{
+    size_t i;
+    for (i = 0; i < NUM_BACKENDS; i++) {
+        if (gBackends[i].supported()) {
+            gBackend = &gBackends[i];
+            return;
+        }
+    }
+}
+
+/*
+ * zlib's crc32() takes an unsigned int length, so feed it a gigabyte
+ * at a time.
+ */
+uint32_t mzCrc32Zlib(uint32_t crc, const unsigned char* data, size_t len)
+{
+    while (len > 0) {
+        unsigned int step = len > (1U << 30) ? (1U << 30) : (unsigned int) len;
+        crc = crc32(crc, data, step);
+        data += step;
+        len -= step;
+    }
+    return crc;
+}
+
+uint32_t mzCrc32(uint32_t crc, const unsigned char* data, size_t len)
+{
+    pthread_once(&gProbeOnce, probeBackend);
+    return gBackend->crc32(crc, data, len);
+}
+
+const char* mzCrc32Backend(void)
+{
+    pthread_once(&gProbeOnce, probeBackend);
+    return gBackend->name;
+}
+
+int mzSetCrc32Backend(const char* name)
+{
+    size_t i;
+    pthread_once(&gProbeOnce, probeBackend);
+    for (i = 0; i < NUM_BACKENDS; i++) {
+        if (strcmp(gBackends[i].name, name) == 0 && gBackends[i].supported()) {
+            gBackend = &gBackends[i];
+            return 0;
+        }
+    }
+    return -1;
+}
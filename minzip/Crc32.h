@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * CRC-32 of zip entry contents.
+ */
+#ifndef _MINZIP_CRC32
+#define _MINZIP_CRC32
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Continue the CRC-32 "crc" over "len" bytes at "data"; start with 0.
+ * This is the same CRC as zlib's crc32(), but the first call probes
+ * the CPU and picks the fastest way to compute it: carry-less multiply
+ * (PCLMULQDQ) on x86, the ARMv8 CRC32 instructions on arm64, and zlib
+ * everywhere else.
+ */
+uint32_t mzCrc32(uint32_t crc, const unsigned char* data, size_t len);
+
+/*
+ * Name of the implementation in use: "zlib", "x86-pclmul" or
+ * "armv8-crc".
+ */
+const char* mzCrc32Backend(void);
+
+/*
+ * Switch to the named implementation, for benchmarks and tests.
+ * Returns 0 on success, or -1 if it isn't supported by this build or
+ * this CPU.
+ */
+int mzSetCrc32Backend(const char* name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_MINZIP_CRC32*/
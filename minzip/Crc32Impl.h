@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Implementations behind mzCrc32().  Each one takes and returns the
+ * CRC as zlib does, not inverted, and handles any length itself.
+ */
+#ifndef _MINZIP_CRC32_IMPL
+#define _MINZIP_CRC32_IMPL
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t (*MzCrc32Fn)(uint32_t crc, const unsigned char* data, size_t len);
+
+uint32_t mzCrc32Zlib(uint32_t crc, const unsigned char* data, size_t len);
+
+#if defined(__i386__) || defined(__x86_64__)
+#define MZ_HAVE_X86_PCLMUL 1
+int mzX86HasPclmul(void);
+uint32_t mzCrc32Pclmul(uint32_t crc, const unsigned char* data, size_t len);
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define MZ_HAVE_ARMV8_CRC 1
+int mzArmv8HasCrc32(void);
+uint32_t mzCrc32Armv8(uint32_t crc, const unsigned char* data, size_t len);
+#endif
+
+#endif /*_MINZIP_CRC32_IMPL*/
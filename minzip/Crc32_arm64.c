@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * CRC-32 using the ARMv8 CRC32 instructions, which compute the zip
+ * polynomial directly.  Android.mk builds libminzip with +crc on arm64;
+ * the instructions are only reached once mzArmv8HasCrc32() has checked
+ * the kernel's hwcaps, since they're optional before ARMv8.1.
+ */
+#include "Crc32Impl.h"
+
+#ifdef MZ_HAVE_ARMV8_CRC
+
+#include <arm_acle.h>
+#include <string.h>
+#include <sys/auxv.h>
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+
+int mzArmv8HasCrc32(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+static inline uint64_t load64(const unsigned char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t mzCrc32Armv8(uint32_t crc, const unsigned char* data, size_t len)
+{
+    crc = ~crc;
+    while (len > 0 && ((uintptr_t) data & 7) != 0) {
+        crc = __crc32b(crc, *data++);
+        len--;
+    }
+    while (len >= 32) {
+        crc = __crc32d(crc, load64(data));
+        crc = __crc32d(crc, load64(data + 8));
+        crc = __crc32d(crc, load64(data + 16));
+        crc = __crc32d(crc, load64(data + 24));
+        data += 32;
+        len -= 32;
+    }
+    while (len >= 8) {
+        crc = __crc32d(crc, load64(data));
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = __crc32b(crc, *data++);
+        len--;
+    }
+    return ~crc;
+}
+
+#endif  /* MZ_HAVE_ARMV8_CRC */
@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
 
 #include "DirUtil.h"
@@ -52,6 +53,44 @@ getPathDirStatus(const char *path)
     return DMISSING;
 }
 
+/* Make the directory "name" in "dirfd", labelled as "fullPath".
+ */
+static int
+makeDir(int dirfd, const char *name, const char *fullPath, int mode,
+        const struct utimbuf *timestamp, struct selabel_handle *sehnd)
+{
+    int err;
+
+    char *secontext = NULL;
+
+    if (sehnd) {
+        selabel_lookup(sehnd, &secontext, fullPath, mode);
+        setfscreatecon(secontext);
+    }
+
+    err = mkdirat(dirfd, name, mode);
+
+    if (secontext) {
+        freecon(secontext);
+        setfscreatecon(NULL);
+    }
+
+    if (err != 0) {
+        return -1;
+    }
+    if (timestamp != NULL) {
+        struct timespec times[2];
+        times[0].tv_sec = timestamp->actime;
+        times[0].tv_nsec = 0;
+        times[1].tv_sec = timestamp->modtime;
+        times[1].tv_nsec = 0;
+        if (utimensat(dirfd, name, times, 0) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 int
 dirCreateHierarchy(const char *path, int mode,
         const struct utimbuf *timestamp, bool stripFileName,
@@ -104,8 +143,10 @@ dirCreateHierarchy(const char *path, int mode,
      */
     ds = getPathDirStatus(cpath);
     if (ds == DDIR) {
+        free(cpath);
         return 0;
     } else if (ds == DILLEGAL) {
+        free(cpath);
         return -1;
     }
 
@@ -143,27 +184,7 @@ dirCreateHierarchy(const char *path, int mode,
             free(cpath);
             return -1;
         } else if (ds == DMISSING) {
-            int err;
-
-            char *secontext = NULL;
-
-            if (sehnd) {
-                selabel_lookup(sehnd, &secontext, cpath, mode);
-                setfscreatecon(secontext);
-            }
-
-            err = mkdir(cpath, mode);
-
-            if (secontext) {
-                freecon(secontext);
-                setfscreatecon(NULL);
-            }
-
-            if (err != 0) {
-                free(cpath);
-                return -1;
-            }
-            if (timestamp != NULL && utime(cpath, timestamp)) {
+            if (makeDir(AT_FDCWD, cpath, cpath, mode, timestamp, sehnd) != 0) {
                 free(cpath);
                 return -1;
             }
@@ -179,6 +200,201 @@ dirCreateHierarchy(const char *path, int mode,
     return 0;
 }
 
+struct DirCache {
+    /* The chain of directories held open, as "/a/b/c" or "a/b/c".
+     * Level i is the component ending at ends[i], open as fds[i].
+     */
+    char *path;
+    size_t pathAlloc;
+    size_t *ends;
+    int *fds;
+    int depth;
+    int alloc;
+    bool absolute;
+    int rootFd;     // "/", opened when first needed
+};
+
+DirCache *
+dirCacheCreate(void)
+{
+    DirCache *cache = (DirCache *)calloc(1, sizeof(DirCache));
+    if (cache != NULL) {
+        cache->rootFd = -1;
+    }
+    return cache;
+}
+
+/* Forget all but the first "depth" levels of the cached chain.
+ */
+static void
+dirCacheTrim(DirCache *cache, int depth)
+{
+    while (cache->depth > depth) {
+        close(cache->fds[--cache->depth]);
+    }
+}
+
+void
+dirCacheFree(DirCache *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+    dirCacheTrim(cache, 0);
+    if (cache->rootFd >= 0) {
+        close(cache->rootFd);
+    }
+    free(cache->path);
+    free(cache->ends);
+    free(cache->fds);
+    free(cache);
+}
+
+int
+dirCacheCreateHierarchy(DirCache *cache, const char *path, int mode,
+        const struct utimbuf *timestamp, bool stripFileName,
+        struct selabel_handle *sehnd)
+{
+    if (path[0] == '\0') {
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* Find the end of the directory part, as dirCreateHierarchy() would.
+     */
+    size_t pathLen = strlen(path);
+    if (stripFileName) {
+        const char *c = path + pathLen - 1;
+        while (c != path && *c != '/') {
+            c--;
+        }
+        if (c == path) {
+            errno = ENOENT;
+            return -1;
+        }
+        pathLen = c - path;
+    }
+
+    /* Spell the directory the way the cache does, without repeated
+     * or trailing slashes, and see how much of it the cache has.
+     */
+    char *dpath = (char *)malloc(pathLen + 2);
+    size_t *ends = (size_t *)malloc((pathLen / 2 + 1) * sizeof(*ends));
+    if (dpath == NULL || ends == NULL) {
+        free(dpath);
+        free(ends);
+        errno = ENOMEM;
+        return -1;
+    }
+    bool absolute = (path[0] == '/');
+    size_t len = 0;
+    int count = 0;
+    size_t i = 0;
+    if (absolute) {
+        dpath[len++] = '/';
+    }
+    while (i < pathLen) {
+        while (i < pathLen && path[i] == '/') {
+            i++;
+        }
+        if (i == pathLen) {
+            break;
+        }
+        if (count > 0) {
+            dpath[len++] = '/';
+        }
+        while (i < pathLen && path[i] != '/') {
+            dpath[len++] = path[i++];
+        }
+        ends[count++] = len;
+    }
+    dpath[len] = '\0';
+
+    if (absolute != cache->absolute) {
+        dirCacheTrim(cache, 0);
+        cache->absolute = absolute;
+    }
+    int level = 0;
+    while (level < cache->depth && level < count &&
+            cache->ends[level] == ends[level] &&
+            memcmp(cache->path, dpath, ends[level]) == 0) {
+        level++;
+    }
+    dirCacheTrim(cache, level);
+
+    /* Take on the new path, keeping the levels we still have open.
+     */
+    if (cache->pathAlloc < len + 1) {
+        char *p = (char *)realloc(cache->path, len + 1);
+        if (p == NULL) {
+            goto nomem;
+        }
+        cache->path = p;
+        cache->pathAlloc = len + 1;
+    }
+    if (cache->alloc < count) {
+        size_t *e = (size_t *)realloc(cache->ends, count * sizeof(*e));
+        if (e != NULL) {
+            cache->ends = e;
+        }
+        int *f = (int *)realloc(cache->fds, count * sizeof(*f));
+        if (f != NULL) {
+            cache->fds = f;
+        }
+        if (e == NULL || f == NULL) {
+            goto nomem;
+        }
+        cache->alloc = count;
+    }
+    memcpy(cache->path, dpath, len + 1);
+    free(dpath);
+
+    /* Open, or make and open, each level we don't have yet.
+     */
+    int ret = 0;
+    if (absolute && level < count && cache->rootFd < 0) {
+        cache->rootFd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cache->rootFd < 0) {
+            ret = -1;
+        }
+    }
+    for (; ret == 0 && level < count; level++) {
+        int parent = level > 0 ? cache->fds[level - 1] :
+                absolute ? cache->rootFd : AT_FDCWD;
+        size_t start = level > 0 ? ends[level - 1] + 1 : (absolute ? 1 : 0);
+        char *name = cache->path + start;
+        char saved = cache->path[ends[level]];
+
+        /* Here the path so far serves as the full name for labelling.
+         */
+        cache->path[ends[level]] = '\0';
+        int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 && errno == ENOENT) {
+            if (makeDir(parent, name, cache->path, mode, timestamp, sehnd) == 0
+                    || errno == EEXIST) {
+                fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            }
+        }
+        cache->path[ends[level]] = saved;
+
+        if (fd < 0) {
+            ret = -1;
+            break;
+        }
+        cache->ends[level] = ends[level];
+        cache->fds[level] = fd;
+        cache->depth = level + 1;
+    }
+    free(ends);
+    return ret;
+
+nomem:
+    free(dpath);
+    free(ends);
+    errno = ENOMEM;
+    return -1;
+}
+
 int
 dirUnlinkHierarchy(const char *path)
 {
@@ -44,6 +44,27 @@ int dirCreateHierarchy(const char *path, int mode,
         const struct utimbuf *timestamp, bool stripFileName,
         struct selabel_handle* sehnd);
 
+/* Remembers the directories a run of dirCacheCreateHierarchy() calls
+ * has already made or found, and holds them open, so that the next
+ * path under them needs no lookups of its parents.  The cache holds
+ * one chain of directories, the last one asked for; paths that come
+ * in sorted order, as a zip archive's entries do, reuse it most.
+ *
+ * A cache assumes that nothing else is removing the directories it
+ * has seen while it is in use.
+ */
+typedef struct DirCache DirCache;
+
+DirCache *dirCacheCreate(void);
+void dirCacheFree(DirCache *cache);
+
+/* As dirCreateHierarchy(), but skipping the directories "cache" already
+ * knows about, and creating the others relative to their parents.
+ */
+int dirCacheCreateHierarchy(DirCache *cache, const char *path, int mode,
+        const struct utimbuf *timestamp, bool stripFileName,
+        struct selabel_handle* sehnd);
+
 /* rm -rf <path>
  */
 int dirUnlinkHierarchy(const char *path);
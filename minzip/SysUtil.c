@@ -14,28 +14,35 @@
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #define LOG_TAG "sysutil"
 #include "Log.h"
 #include "SysUtil.h"
 
-static int getFileStartAndLength(int fd, off_t *start_, size_t *length_)
+static int getFileStartAndLength(int fd, off64_t *start_, size_t *length_)
 {
-    off_t start, end;
+    off64_t start, end;
     size_t length;
 
     assert(start_ != NULL);
     assert(length_ != NULL);
 
-    start = lseek(fd, 0L, SEEK_CUR);
-    end = lseek(fd, 0L, SEEK_END);
-    (void) lseek(fd, start, SEEK_SET);
+    start = lseek64(fd, 0L, SEEK_CUR);
+    end = lseek64(fd, 0L, SEEK_END);
+    (void) lseek64(fd, start, SEEK_SET);
 
-    if (start == (off_t) -1 || end == (off_t) -1) {
+    if (start == (off64_t) -1 || end == (off64_t) -1) {
         LOGE("could not determine length of file\n");
         return -1;
     }
 
+    // A Zip64 package can be larger than a 32-bit process can map.
+    if ((uint64_t) (end - start) > SIZE_MAX) {
+        LOGE("file is too large to map (%lld bytes)\n", (long long) (end - start));
+        return -1;
+    }
     length = end - start;
     if (length == 0) {
         LOGE("file is empty\n");
@@ -55,9 +62,9 @@ static int getFileStartAndLength(int fd, off_t *start_, size_t *length_)
  * On success, returns 0 and fills out "pMap".  On failure, returns a nonzero
  * value and does not disturb "pMap".
  */
-static int sysMapFD(int fd, MemMapping* pMap)
+int sysMapFD(int fd, MemMapping* pMap)
 {
-    off_t start;
+    off64_t start;
     size_t length;
     void* memPtr;
 
@@ -66,7 +73,7 @@ static int sysMapFD(int fd, MemMapping* pMap)
     if (getFileStartAndLength(fd, &start, &length) < 0)
         return -1;
 
-    memPtr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, start);
+    memPtr = mmap64(NULL, length, PROT_READ, MAP_PRIVATE, fd, start);
     if (memPtr == MAP_FAILED) {
         LOGW("mmap(%d, R, PRIVATE, %d, %d) failed: %s\n", (int) length,
             fd, (int) start, strerror(errno));
@@ -83,22 +90,48 @@ static int sysMapFD(int fd, MemMapping* pMap)
     return 0;
 }
 
-static int sysMapBlockFile(FILE* mapf, MemMapping* pMap)
+/*
+ * One run of blocks of a block-mapped file: "length" bytes at
+ * "fileOffset" in the file live at "devOffset" on the block device.
+ */
+typedef struct BlockExtent {
+    off64_t fileOffset;
+    off64_t devOffset;
+    off64_t length;
+} BlockExtent;
+
+/*
+ * Parse a block map, as written by uncrypt:
+ *
+ *   <block device>
+ *   <file size> <block size>
+ *   <range count>
+ *   <start block> <end block>      (one line per range, in file order)
+ *
+ * Ranges that continue where the previous one ended on the device are
+ * merged, so the extents are sorted by file offset and no two of them
+ * are contiguous on the device.  On success, returns 0 and fills in
+ * the outputs; the caller frees *pExtents.
+ */
+static int parseBlockMap(FILE* mapf, char* blockDev, size_t blockDevSize,
+        size_t* pSize, size_t* pBlksize, BlockExtent** pExtents,
+        unsigned int* pExtentCount)
 {
-    char block_dev[PATH_MAX+1];
     size_t size;
     unsigned int blksize;
-    unsigned int blocks;
     unsigned int range_count;
     unsigned int i;
+    unsigned int count = 0;
+    BlockExtent* extents;
+    off64_t fileOffset = 0;
 
-    if (fgets(block_dev, sizeof(block_dev), mapf) == NULL) {
+    if (fgets(blockDev, blockDevSize, mapf) == NULL) {
         LOGW("failed to read block device from header\n");
         return -1;
     }
-    for (i = 0; i < sizeof(block_dev); ++i) {
-        if (block_dev[i] == '\n') {
-            block_dev[i] = 0;
+    for (i = 0; i < blockDevSize; ++i) {
+        if (blockDev[i] == '\n') {
+            blockDev[i] = 0;
             break;
         }
     }
@@ -107,53 +140,131 @@ static int sysMapBlockFile(FILE* mapf, MemMapping* pMap)
         LOGW("failed to parse block map header\n");
         return -1;
     }
+    if (size == 0 || blksize == 0 || range_count == 0) {
+        LOGW("invalid block map header (size %zu, block size %u, %u ranges)\n",
+            size, blksize, range_count);
+        return -1;
+    }
 
-    blocks = ((size-1) / blksize) + 1;
+    extents = malloc(range_count * sizeof(BlockExtent));
+    if (extents == NULL) {
+        LOGW("failed to allocate %u block extents\n", range_count);
+        return -1;
+    }
+
+    for (i = 0; i < range_count; ++i) {
+        unsigned int start, end;
+        if (fscanf(mapf, "%u %u\n", &start, &end) != 2 || end < start) {
+            LOGW("failed to parse range %d in block map\n", i);
+            free(extents);
+            return -1;
+        }
+        off64_t devOffset = (off64_t) start * blksize;
+        off64_t length = (off64_t) (end - start) * blksize;
+        if (length == 0)
+            continue;
+
+        BlockExtent* prev = count > 0 ? &extents[count-1] : NULL;
+        if (prev != NULL && prev->devOffset + prev->length == devOffset) {
+            prev->length += length;
+        } else {
+            extents[count].fileOffset = fileOffset;
+            extents[count].devOffset = devOffset;
+            extents[count].length = length;
+            ++count;
+        }
+        fileOffset += length;
+    }
+
+    if ((size_t) fileOffset < size) {
+        LOGW("block map covers %lld bytes of a %zu-byte file\n",
+            (long long) fileOffset, size);
+        free(extents);
+        return -1;
+    }
+
+    // Drop any blocks listed past the last one the file needs.
+    off64_t limit = (off64_t) ((size + blksize - 1) / blksize) * blksize;
+    while (count > 0 && extents[count-1].fileOffset >= limit)
+        --count;
+    if (count > 0 && extents[count-1].fileOffset + extents[count-1].length > limit)
+        extents[count-1].length = limit - extents[count-1].fileOffset;
+
+    LOGI("block map has %u ranges in %u extents\n", range_count, count);
+    *pSize = size;
+    *pBlksize = blksize;
+    *pExtents = extents;
+    *pExtentCount = count;
+    return 0;
+}
+
+static int sysMapBlockFile(FILE* mapf, MemMapping* pMap)
+{
+    char block_dev[PATH_MAX+1];
+    size_t size;
+    size_t blksize;
+    size_t blocks;
+    BlockExtent* extents;
+    unsigned int count;
+    unsigned int i;
+
+    if (parseBlockMap(mapf, block_dev, sizeof(block_dev), &size, &blksize,
+            &extents, &count) != 0) {
+        return -1;
+    }
 
-    pMap->range_count = range_count;
-    pMap->ranges = malloc(range_count * sizeof(MappedRange));
-    memset(pMap->ranges, 0, range_count * sizeof(MappedRange));
+    blocks = ((size-1) / blksize) + 1;
 
     // Reserve enough contiguous address space for the whole file.
     unsigned char* reserve;
     reserve = mmap64(NULL, blocks * blksize, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
     if (reserve == MAP_FAILED) {
         LOGW("failed to reserve address space: %s\n", strerror(errno));
+        free(extents);
         return -1;
     }
 
-    pMap->ranges[range_count-1].addr = reserve;
-    pMap->ranges[range_count-1].length = blocks * blksize;
-
     int fd = open(block_dev, O_RDONLY);
     if (fd < 0) {
         LOGW("failed to open block device %s: %s\n", block_dev, strerror(errno));
+        munmap(reserve, blocks * blksize);
+        free(extents);
         return -1;
     }
 
-    unsigned char* next = reserve;
-    for (i = 0; i < range_count; ++i) {
-        int start, end;
-        if (fscanf(mapf, "%d %d\n", &start, &end) != 2) {
-            LOGW("failed to parse range %d in block map\n", i);
-            return -1;
-        }
-
-        void* addr = mmap64(next, (end-start)*blksize, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, ((off64_t)start)*blksize);
+    // One mapping per extent, not per range: merging ranges that are
+    // contiguous on the device keeps the number of VMAs down.
+    pMap->range_count = 0;
+    pMap->ranges = calloc(count, sizeof(MappedRange));
+    for (i = 0; pMap->ranges != NULL && i < count; ++i) {
+        off64_t length = extents[i].length;
+        void* addr = mmap64(reserve + extents[i].fileOffset, length,
+                PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, extents[i].devOffset);
         if (addr == MAP_FAILED) {
-            LOGW("failed to map block %d: %s\n", i, strerror(errno));
-            return -1;
+            LOGW("failed to map extent %d: %s\n", i, strerror(errno));
+            break;
         }
         pMap->ranges[i].addr = addr;
-        pMap->ranges[i].length = (end-start)*blksize;
-
-        next += pMap->ranges[i].length;
+        pMap->ranges[i].length = length;
+        pMap->range_count = i + 1;
     }
+    if (pMap->ranges == NULL || pMap->range_count != count) {
+        // Covers the extents mapped so far, too.
+        munmap(reserve, blocks * blksize);
+        free(pMap->ranges);
+        pMap->ranges = NULL;
+        pMap->range_count = 0;
+        close(fd);
+        free(extents);
+        return -1;
+    }
+    close(fd);
+    free(extents);
 
     pMap->addr = reserve;
     pMap->length = size;
 
-    LOGI("mmapped %d ranges\n", range_count);
+    LOGI("mmapped %d extents\n", count);
 
     return 0;
 }
@@ -195,6 +306,356 @@ int sysMapFile(const char* fn, MemMapping* pMap)
     return 0;
 }
 
+static int toMadvise(SysMapAdvice advice)
+{
+    switch (advice) {
+    case SYS_MAP_SEQUENTIAL:    return MADV_SEQUENTIAL;
+    case SYS_MAP_RANDOM:        return MADV_RANDOM;
+    case SYS_MAP_WILLNEED:      return MADV_WILLNEED;
+    case SYS_MAP_DONTNEED:      return MADV_DONTNEED;
+    default:                    return MADV_NORMAL;
+    }
+}
+
+int sysAdviseRange(const unsigned char* addr, size_t length, SysMapAdvice advice)
+{
+    uintptr_t pageMask = (uintptr_t) sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t start = (uintptr_t) addr & ~pageMask;
+    uintptr_t end = ((uintptr_t) addr + length + pageMask) & ~pageMask;
+
+    if (length == 0)
+        return 0;
+    if (madvise((void*) start, end - start, toMadvise(advice)) != 0) {
+        LOGV("madvise(%p, %zu, %d) failed: %s\n", (void*) start,
+            (size_t) (end - start), advice, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int sysMapAdvise(const MemMapping* pMap, SysMapAdvice advice)
+{
+    return sysAdviseRange(pMap->addr, pMap->length, advice);
+}
+
+struct SysReadahead {
+    const unsigned char* addr;
+    size_t length;
+    size_t window;
+    size_t step;                /* most to ask for at once */
+    bool dropBehind;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    size_t cursor;              /* where the reader is */
+    size_t issued;              /* read ahead up to here */
+    size_t dropped;             /* released up to here */
+    bool exiting;
+};
+
+/*
+ * Work left for the readahead thread: more to read ahead, or (if
+ * dropping behind) more to release.  Called with the mutex held.
+ */
+static bool readaheadPending(const SysReadahead* ra, size_t* issueEnd, size_t* dropEnd)
+{
+    size_t target = ra->cursor + ra->window;
+    if (target > ra->length || target < ra->cursor)
+        target = ra->length;
+    *issueEnd = ra->issued;
+    if (target > ra->issued) {
+        *issueEnd = target - ra->issued > ra->step ? ra->issued + ra->step : target;
+    }
+    *dropEnd = ra->dropped;
+    if (ra->dropBehind && ra->cursor > ra->window + ra->dropped) {
+        *dropEnd = ra->cursor - ra->window;
+    }
+    return *issueEnd > ra->issued || *dropEnd > ra->dropped;
+}
+
+static void* readaheadThread(void* cookie)
+{
+    SysReadahead* ra = (SysReadahead*) cookie;
+    size_t issueEnd, dropEnd;
+
+    pthread_mutex_lock(&ra->mutex);
+    while (true) {
+        while (!ra->exiting && !readaheadPending(ra, &issueEnd, &dropEnd))
+            pthread_cond_wait(&ra->cond, &ra->mutex);
+        if (ra->exiting)
+            break;
+
+        size_t issueStart = ra->issued;
+        size_t dropStart = ra->dropped;
+        ra->issued = issueEnd;
+        ra->dropped = dropEnd;
+        pthread_mutex_unlock(&ra->mutex);
+
+        // Both can block on the device; that's why they're done here
+        // and not on the reader's thread.
+        if (issueEnd > issueStart) {
+            sysAdviseRange(ra->addr + issueStart, issueEnd - issueStart,
+                SYS_MAP_WILLNEED);
+        }
+        if (dropEnd > dropStart) {
+            sysAdviseRange(ra->addr + dropStart, dropEnd - dropStart,
+                SYS_MAP_DONTNEED);
+        }
+
+        pthread_mutex_lock(&ra->mutex);
+    }
+    pthread_mutex_unlock(&ra->mutex);
+    return NULL;
+}
+
+SysReadahead* sysReadaheadStart(const unsigned char* addr, size_t length,
+        size_t window, bool dropBehind)
+{
+    SysReadahead* ra = calloc(1, sizeof(SysReadahead));
+    if (ra == NULL)
+        return NULL;
+
+    ra->addr = addr;
+    ra->length = length;
+    ra->window = window;
+    ra->step = window / 4 > 0 ? window / 4 : 1;
+    ra->dropBehind = dropBehind;
+    pthread_mutex_init(&ra->mutex, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+
+    // The kernel's own readahead is still worth having in between.
+    sysAdviseRange(addr, length, SYS_MAP_SEQUENTIAL);
+
+    if (pthread_create(&ra->thread, NULL, readaheadThread, ra) != 0) {
+        LOGW("failed to start readahead thread: %s\n", strerror(errno));
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->mutex);
+        free(ra);
+        return NULL;
+    }
+    return ra;
+}
+
+void sysReadaheadSetCursor(SysReadahead* ra, size_t offset)
+{
+    if (ra == NULL)
+        return;
+
+    pthread_mutex_lock(&ra->mutex);
+    ra->cursor = offset;
+    // Only wake the thread once there's a worthwhile amount to do.
+    if (offset + ra->window >= ra->issued + ra->step ||
+            (ra->dropBehind && offset >= ra->dropped + ra->window + ra->step)) {
+        pthread_cond_signal(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->mutex);
+}
+
+void sysReadaheadStop(SysReadahead* ra)
+{
+    if (ra == NULL)
+        return;
+
+    pthread_mutex_lock(&ra->mutex);
+    ra->exiting = true;
+    pthread_cond_signal(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+    pthread_join(ra->thread, NULL);
+
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->mutex);
+    free(ra);
+}
+
+struct SysReader {
+    int fd;
+    bool ownsFd;
+    off64_t length;
+    BlockExtent* extents;       /* NULL unless reading through a block map */
+    unsigned int extentCount;
+};
+
+SysReader* sysReaderOpen(const char* fn)
+{
+    SysReader* reader = calloc(1, sizeof(SysReader));
+    if (reader == NULL)
+        return NULL;
+    reader->ownsFd = true;
+
+    if (fn[0] == '@') {
+        char block_dev[PATH_MAX+1];
+        size_t size, blksize;
+
+        FILE* mapf = fopen(fn+1, "r");
+        if (mapf == NULL) {
+            LOGE("Unable to open '%s': %s\n", fn+1, strerror(errno));
+            free(reader);
+            return NULL;
+        }
+        int ret = parseBlockMap(mapf, block_dev, sizeof(block_dev), &size, &blksize,
+                &reader->extents, &reader->extentCount);
+        fclose(mapf);
+        if (ret != 0) {
+            LOGE("Map of '%s' failed\n", fn);
+            free(reader);
+            return NULL;
+        }
+        reader->length = size;
+        reader->fd = open(block_dev, O_RDONLY);
+        if (reader->fd < 0) {
+            LOGE("failed to open block device %s: %s\n", block_dev, strerror(errno));
+            free(reader->extents);
+            free(reader);
+            return NULL;
+        }
+    } else {
+        struct stat st;
+        reader->fd = open(fn, O_RDONLY);
+        if (reader->fd < 0 || fstat(reader->fd, &st) != 0) {
+            LOGE("Unable to open '%s': %s\n", fn, strerror(errno));
+            if (reader->fd >= 0)
+                close(reader->fd);
+            free(reader);
+            return NULL;
+        }
+        reader->length = st.st_size;
+    }
+    return reader;
+}
+
+SysReader* sysReaderOpenFd(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        LOGE("failed to stat fd %d: %s\n", fd, strerror(errno));
+        return NULL;
+    }
+    SysReader* reader = calloc(1, sizeof(SysReader));
+    if (reader == NULL)
+        return NULL;
+    reader->fd = fd;
+    reader->ownsFd = false;
+    reader->length = st.st_size;
+    return reader;
+}
+
+off64_t sysReaderLength(const SysReader* reader)
+{
+    return reader->length;
+}
+
+/*
+ * Index of the extent holding file offset "offset", which must be
+ * within the file.
+ */
+static unsigned int findExtent(const SysReader* reader, off64_t offset)
+{
+    unsigned int lo = 0, hi = reader->extentCount;
+    while (hi - lo > 1) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (reader->extents[mid].fileOffset <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* pread() exactly len bytes at offset, retrying short reads. */
+static bool readFully(int fd, unsigned char* buf, size_t len, off64_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pread64(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = EIO;
+            return false;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+/*
+ * Call fn for each piece of the file range [offset, offset+len) that
+ * is contiguous on the underlying file or device, with the offset of
+ * that piece there and its offset within the range.  Stops early and
+ * returns false if fn does.
+ */
+static bool forEachPiece(const SysReader* reader, off64_t offset, size_t len,
+        bool (*fn)(const SysReader*, off64_t where, size_t pieceLen,
+                size_t done, void* cookie), void* cookie)
+{
+    if (offset < 0 || offset > reader->length ||
+            (off64_t) len > reader->length - offset) {
+        errno = EINVAL;
+        return false;
+    }
+    if (reader->extents == NULL)
+        return fn(reader, offset, len, 0, cookie);
+
+    size_t done = 0;
+    unsigned int i = findExtent(reader, offset);
+    while (done < len) {
+        const BlockExtent* e = &reader->extents[i++];
+        off64_t within = offset + done - e->fileOffset;
+        size_t n = len - done;
+        if ((off64_t) n > e->length - within)
+            n = e->length - within;
+        if (!fn(reader, e->devOffset + within, n, done, cookie))
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+static bool readPiece(const SysReader* reader, off64_t where, size_t pieceLen,
+        size_t done, void* cookie)
+{
+    return readFully(reader->fd, (unsigned char*) cookie + done, pieceLen, where);
+}
+
+bool sysReaderRead(const SysReader* reader, void* buf, size_t len, off64_t offset)
+{
+    return forEachPiece(reader, offset, len, readPiece, buf);
+}
+
+static bool advisePiece(const SysReader* reader, off64_t where, size_t pieceLen,
+        size_t done, void* cookie)
+{
+    int advice;
+    switch (*(const SysMapAdvice*) cookie) {
+    case SYS_MAP_SEQUENTIAL:    advice = POSIX_FADV_SEQUENTIAL; break;
+    case SYS_MAP_RANDOM:        advice = POSIX_FADV_RANDOM; break;
+    case SYS_MAP_WILLNEED:      advice = POSIX_FADV_WILLNEED; break;
+    case SYS_MAP_DONTNEED:      advice = POSIX_FADV_DONTNEED; break;
+    default:                    advice = POSIX_FADV_NORMAL; break;
+    }
+    posix_fadvise(reader->fd, where, pieceLen, advice);
+    return true;
+}
+
+void sysReaderAdvise(const SysReader* reader, off64_t offset, size_t len,
+        SysMapAdvice advice)
+{
+    forEachPiece(reader, offset, len, advisePiece, &advice);
+}
+
+void sysReaderClose(SysReader* reader)
+{
+    if (reader == NULL)
+        return;
+    if (reader->ownsFd)
+        close(reader->fd);
+    free(reader->extents);
+    free(reader);
+}
+
 /*
  * Release a memory mapping.
  */
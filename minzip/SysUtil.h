@@ -6,6 +6,7 @@
 #ifndef _MINZIP_SYSUTIL
 #define _MINZIP_SYSUTIL
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <sys/types.h>
 
@@ -38,6 +39,103 @@ typedef struct MemMapping {
  */
 int sysMapFile(const char* fn, MemMapping* pMap);
 
+/*
+ * Map an already-open regular file (from fd's current offset) into a
+ * private, read-only memory segment.  The caller may close fd once this
+ * returns.
+ *
+ * On success, "pMap" is filled in, and zero is returned.
+ */
+int sysMapFD(int fd, MemMapping* pMap);
+
+/*
+ * How part of a mapping is about to be read.
+ */
+typedef enum SysMapAdvice {
+    SYS_MAP_NORMAL,         /* no particular pattern; the default */
+    SYS_MAP_SEQUENTIAL,     /* once, front to back: read ahead harder */
+    SYS_MAP_RANDOM,         /* scattered small reads: don't read ahead */
+    SYS_MAP_WILLNEED,       /* soon: start reading it in now */
+    SYS_MAP_DONTNEED,       /* not again: let the pages go */
+} SysMapAdvice;
+
+/*
+ * Tell the kernel how the whole of a mapping will be read.
+ *
+ * Returns 0 on success.  Failure is harmless; the mapping just keeps
+ * its current behavior.
+ */
+int sysMapAdvise(const MemMapping* pMap, SysMapAdvice advice);
+
+/*
+ * Like sysMapAdvise(), for "length" bytes at "addr" within a mapping.
+ * The range is widened to whole pages.
+ */
+int sysAdviseRange(const unsigned char* addr, size_t length, SysMapAdvice advice);
+
+/*
+ * A background thread that keeps the "window" bytes past a reader's
+ * cursor coming in from storage, in large requests, while the reader
+ * works through the "length" bytes at "addr" (part of a mapping).
+ * With "dropBehind", pages more than a window behind the cursor are
+ * released as it moves.
+ *
+ * Returns NULL if the thread can't be started; the other calls accept
+ * NULL and do nothing, so callers needn't check.
+ */
+typedef struct SysReadahead SysReadahead;
+
+SysReadahead* sysReadaheadStart(const unsigned char* addr, size_t length,
+        size_t window, bool dropBehind);
+
+/*
+ * Report that the reader has reached "offset" bytes into the range.
+ */
+void sysReadaheadSetCursor(SysReadahead* pReadahead, size_t offset);
+
+/*
+ * Stop the thread and free "pReadahead".
+ */
+void sysReadaheadStop(SysReadahead* pReadahead);
+
+/*
+ * Reads a file with pread() rather than through a mapping.  The file
+ * may also be a map of blocks (an '@' name, as for sysMapFile()), in
+ * which case reads are translated through its sorted list of extents
+ * and go straight to the block device; nothing is mapped, however
+ * fragmented the file is.
+ */
+typedef struct SysReader SysReader;
+
+/*
+ * Open a file or block map for reading.  Returns NULL on failure.
+ */
+SysReader* sysReaderOpen(const char* fn);
+
+/*
+ * Read an already-open regular file.  fd stays owned by the caller,
+ * and must stay open until sysReaderClose().
+ */
+SysReader* sysReaderOpenFd(int fd);
+
+off64_t sysReaderLength(const SysReader* pReader);
+
+/*
+ * Read exactly "len" bytes at "offset" into "buf".  Safe to call from
+ * several threads at once.  Returns false (with errno set) on error,
+ * or if the range doesn't lie within the file.
+ */
+bool sysReaderRead(const SysReader* pReader, void* buf, size_t len, off64_t offset);
+
+/*
+ * Pass an access-pattern hint for part of the file on to the kernel's
+ * page cache.
+ */
+void sysReaderAdvise(const SysReader* pReader, off64_t offset, size_t len,
+        SysMapAdvice advice);
+
+void sysReaderClose(SysReader* pReader);
+
 /*
  * Release the pages associated with a shared memory segment.
  *
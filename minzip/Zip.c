@@ -3,27 +3,54 @@
  *
  * Simple Zip file support.
  */
-#include "safe_iop.h"
 #include "zlib.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
-#include <sys/stat.h>   // for S_ISLNK()
+#include <sys/sendfile.h>
+#include <sys/stat.h>   // for S_ISLNK(), fstat()
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #define LOG_TAG "minzip"
 #include "Zip.h"
 #include "Bits.h"
+#include "Crc32.h"
 #include "Log.h"
 #include "DirUtil.h"
 
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
 
-#define SORT_ENTRIES 1
+/*
+ * Entries with more data than this are read with a readahead thread
+ * following the reader; smaller ones are simply asked for up front.
+ */
+#define READAHEAD_WINDOW (4 * 1024 * 1024)
+
+/*
+ * Stored entries that can't be copied within the kernel are written in
+ * pieces of this size, aligned to it in the output.
+ */
+#define STORED_WRITE_CHUNK (1024 * 1024)
+
+/*
+ * zlib counts input and output in unsigned ints, and processFunction
+ * takes an int, so entries larger than this are handed over in pieces.
+ */
+#define MAX_PIECE (1 << 30)
+
+/*
+ * Archives that aren't mapped are read this much at a time, into a
+ * buffer that's reused for the whole entry.  It divides
+ * STORED_WRITE_CHUNK, so stored writes still line up.  Compressed data
+ * is handed to zlib in pieces of this size either way.
+ */
+#define READ_CHUNK (128 * 1024)
 
 /*
  * Offset and length constants (java.util.zip naming convention).
@@ -57,6 +84,23 @@ enum {
     ENDOFF = 16,
     ENDCOM = 20,
 
+    ZIP64_ENDSIG = 0x06064b50,   // PK66
+    ZIP64_ENDHDR = 56,
+
+    ZIP64_ENDSUB = 24,
+    ZIP64_ENDTOT = 32,
+    ZIP64_ENDSIZ = 40,
+    ZIP64_ENDOFF = 48,
+
+    ZIP64_LOCSIG = 0x07064b50,   // PK67
+    ZIP64_LOCHDR = 20,
+
+    ZIP64_LOCOFF =  8,
+
+    ZIP64_EXTID = 0x0001,        // Zip64 extended information extra field
+    ZIP64_MAGICCOUNT = 0xffff,
+    ZIP64_MAGICVAL = 0xffffffff,
+
     EXTSIG = 0x08074b50,     // PK78
     EXTHDR = 16,
 
@@ -91,70 +135,148 @@ enum {
 static void dumpEntry(const ZipEntry* pEntry)
 {
     LOGI(" %p '%.*s'\n", pEntry->fileName,pEntry->fileNameLen,pEntry->fileName);
-    LOGI("   off=%ld comp=%ld uncomp=%ld how=%d\n", pEntry->offset,
-        pEntry->compLen, pEntry->uncompLen, pEntry->compression);
+    LOGI("   off=%llu comp=%llu uncomp=%llu how=%d\n",
+        (unsigned long long) pEntry->offset,
+        (unsigned long long) pEntry->compLen,
+        (unsigned long long) pEntry->uncompLen, pEntry->compression);
 }
 #endif
 
 /*
- * (This is a mzHashTableLookup callback.)
+ * Compute the hash code for a ZipEntry filename.
  *
- * Compare two ZipEntry structs, by name.
+ * Not expected to be compatible with any other hash function, so we init
+ * to 2 to ensure it doesn't happen to match.
  */
-static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
+static unsigned int computeHash(const char* name, int nameLen)
 {
-    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
-    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+    unsigned int hash = 2;
+
+    while (nameLen--)
+        hash = hash * 31 + *name++;
 
-    if (entry1->fileNameLen != entry2->fileNameLen)
-        return entry1->fileNameLen - entry2->fileNameLen;
-    return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
+    return hash;
 }
 
 /*
- * (This is a mzHashTableLookup callback.)
- *
- * find a ZipEntry struct by name.
+ * How far the slot at "pos" is from where its entry's hash would put it.
+ */
+static unsigned int slotDistance(const ZipArchive* pArchive, unsigned int pos)
+{
+    return (pos - (pArchive->pSlots[pos].hash & pArchive->slotMask)) &
+        pArchive->slotMask;
+}
+
+/*
+ * Size the name index for "numEntries" entries: a power of two, at
+ * most 80% full.
  */
-static int hashcmpZipName(const void* ventry, const void* vname)
+static unsigned int slotCountFor(unsigned int numEntries)
 {
-    const ZipEntry* entry = (const ZipEntry*) ventry;
-    const char* name = (const char*) vname;
-    unsigned int nameLen = strlen(name);
+    unsigned int count = 2;
 
-    if (entry->fileNameLen != nameLen)
-        return entry->fileNameLen - nameLen;
-    return memcmp(entry->fileName, name, nameLen);
+    while (count < numEntries + numEntries / 4 + 1)
+        count *= 2;
+    return count;
 }
 
 /*
- * Compute the hash code for a ZipEntry filename.
+ * Add entry "index" to the name index.
  *
- * Not expected to be compatible with any other hash function, so we init
- * to 2 to ensure it doesn't happen to match.
+ * The index is a Robin Hood hash: inserting an entry displaces any
+ * entry that is nearer its own home slot, so entries are kept in order
+ * of home slot and a lookup can stop as soon as it passes where its
+ * name would have to be.
  */
-static unsigned int computeHash(const char* name, int nameLen)
+static void addEntryToIndex(ZipArchive* pArchive, unsigned int index)
 {
-    unsigned int hash = 2;
+    const ZipEntry* pEntry = &pArchive->pEntries[index];
+    ZipNameSlot slot;
+    unsigned int pos, dist;
+    bool original = true;
+
+    slot.hash = computeHash(pEntry->fileName, pEntry->fileNameLen);
+    slot.entry = index + 1;
+    pos = slot.hash & pArchive->slotMask;
+    for (dist = 0; ; dist++, pos = (pos + 1) & pArchive->slotMask) {
+        ZipNameSlot* pSlot = &pArchive->pSlots[pos];
+        if (pSlot->entry == 0) {
+            *pSlot = slot;
+            return;
+        }
+        if (original && pSlot->hash == slot.hash) {
+            const ZipEntry* pOther = &pArchive->pEntries[pSlot->entry - 1];
+            if (pOther->fileNameLen == pEntry->fileNameLen &&
+                memcmp(pOther->fileName, pEntry->fileName, pEntry->fileNameLen) == 0)
+            {
+                LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
+                    pOther->fileNameLen, pOther->fileName);
+                /* keep going */
+                return;
+            }
+        }
+        unsigned int slotDist = slotDistance(pArchive, pos);
+        if (slotDist < dist) {
+            ZipNameSlot displaced = *pSlot;
+            *pSlot = slot;
+            slot = displaced;
+            dist = slotDist;
+            original = false;
+        }
+    }
+}
 
-    while (nameLen--)
-        hash = hash * 31 + *name++;
+/*
+ * Allocate the name index and add every entry to it.
+ *
+ * Returns "true" on success.
+ */
+static bool buildIndex(ZipArchive* pArchive)
+{
+    unsigned int i, count = slotCountFor(pArchive->numEntries);
 
-    return hash;
+    free(pArchive->pSlots);
+    pArchive->pSlots = (ZipNameSlot*) calloc(count, sizeof(ZipNameSlot));
+    if (pArchive->pSlots == NULL)
+        return false;
+    pArchive->slotMask = count - 1;
+
+    for (i = 0; i < pArchive->numEntries; i++)
+        addEntryToIndex(pArchive, i);
+    return true;
 }
 
-static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
+/*
+ * Compare an entry's name with the first len bytes of name, as strcmp()
+ * would.  Entries are kept in this order.
+ */
+static int compareEntryName(const ZipEntry* pEntry, const char* name,
+        unsigned int len)
 {
-    unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
-    const ZipEntry* found;
+    unsigned int common = pEntry->fileNameLen < len ? pEntry->fileNameLen : len;
+    int diff = memcmp(pEntry->fileName, name, common);
 
-    found = (const ZipEntry*)mzHashTableLookup(pHash,
-                itemHash, pEntry, hashcmpZipEntry, true);
-    if (found != pEntry) {
-        LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
-            found->fileNameLen, found->fileName);
-        /* keep going */
-    }
+    if (diff == 0)
+        diff = (int) pEntry->fileNameLen - (int) len;
+    return diff;
+}
+
+/*
+ * (This is a qsort callback.)
+ *
+ * Order entries by name, and entries with the same name by offset, so
+ * that the order doesn't depend on qsort().
+ */
+static int compareEntries(const void* ventry1, const void* ventry2)
+{
+    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
+    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+    int diff;
+
+    diff = compareEntryName(entry1, entry2->fileName, entry2->fileNameLen);
+    if (diff == 0)
+        diff = entry1->offset < entry2->offset ? -1 : entry1->offset > entry2->offset;
+    return diff;
 }
 
 static int validFilename(const char *fileName, unsigned int fileNameLen)
@@ -177,6 +299,175 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
     return 1;
 }
 
+/*
+ * Get "len" bytes of the archive at "offset", which the caller has
+ * checked lie within it: a pointer into the mapping or, if the archive
+ * isn't mapped, "buf" with them read into it.  Returns NULL if they
+ * can't be read.
+ */
+static const unsigned char* archiveBytes(const ZipArchive* pArchive,
+        uint64_t offset, size_t len, unsigned char* buf)
+{
+    if (pArchive->addr != NULL)
+        return pArchive->addr + offset;
+    if (!sysReaderRead(pArchive->reader, buf, len, offset)) {
+        LOGW("Can't read %zu bytes at %llu: %s\n", len,
+            (unsigned long long) offset, strerror(errno));
+        return NULL;
+    }
+    return buf;
+}
+
+/*
+ * The EOCD is at most a maximal comment from the end, and a Zip64
+ * locator comes just before it; nothing further back is searched.
+ */
+#define MAX_TAIL (ZIP64_LOCHDR + ENDHDR + 0xffff)
+
+/*
+ * Find the EOCD.  We'll find it immediately unless they have a file
+ * comment.  Returns NULL if there isn't one.
+ */
+static const unsigned char* findEndOfCentralDir(const unsigned char* addr,
+        size_t length)
+{
+    const unsigned char* ptr;
+
+    if (length < ENDHDR)
+        return NULL;
+    ptr = addr + length - ENDHDR;
+    while (ptr >= addr) {
+        if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
+            return ptr;
+        ptr--;
+    }
+    return NULL;
+}
+
+/*
+ * Where the central directory is, and how many entries it holds.
+ */
+typedef struct {
+    uint64_t eocdOffset;
+    uint64_t numEntries;
+    uint64_t cdOffset;
+    uint64_t cdEnd;     // the EOCD, or the Zip64 EOCD record if there is one
+} CentralDir;
+
+/*
+ * Find the central directory from the EOCD and, in a Zip64 archive,
+ * the Zip64 EOCD record that the locator just before the EOCD points
+ * to.  The EOCD's own fields are then 0xffff or 0xffffffff if they
+ * didn't fit.
+ *
+ * Returns "true" on success.
+ */
+static bool findCentralDir(const ZipArchive* pArchive, CentralDir* pDir)
+{
+    unsigned char* tailBuf = NULL;
+    unsigned char recordBuf[ZIP64_ENDHDR];
+    const unsigned char* tail;
+    const unsigned char* eocd;
+    const unsigned char* locator;
+    const unsigned char* record;
+    uint64_t tailOffset, recordOffset;
+    size_t tailLen;
+    bool needZip64;
+    bool result = false;
+
+    tailLen = pArchive->length < MAX_TAIL ? pArchive->length : MAX_TAIL;
+    tailOffset = pArchive->length - tailLen;
+    if (pArchive->addr == NULL) {
+        tailBuf = (unsigned char*) malloc(tailLen);
+        if (tailBuf == NULL)
+            return false;
+    }
+    tail = archiveBytes(pArchive, tailOffset, tailLen, tailBuf);
+    if (tail == NULL)
+        goto bail;
+
+    eocd = findEndOfCentralDir(tail, tailLen);
+    if (eocd == NULL) {
+        LOGI("Could not find end-of-central-directory in Zip\n");
+        goto bail;
+    }
+    pDir->eocdOffset = tailOffset + (eocd - tail);
+    pDir->numEntries = get2LE(eocd + ENDSUB);
+    pDir->cdOffset = get4LE(eocd + ENDOFF);
+    pDir->cdEnd = pDir->eocdOffset;
+    needZip64 = pDir->numEntries == ZIP64_MAGICCOUNT ||
+        pDir->cdOffset == ZIP64_MAGICVAL;
+
+    locator = eocd - ZIP64_LOCHDR;
+    if (eocd - tail < ZIP64_LOCHDR || get4LE(locator) != ZIP64_LOCSIG) {
+        if (needZip64)
+            LOGW("Zip64 end-of-central-directory locator is missing\n");
+        result = !needZip64;
+        goto bail;
+    }
+
+    recordOffset = get8LE(locator + ZIP64_LOCOFF);
+    record = NULL;
+    if (pDir->eocdOffset - ZIP64_LOCHDR >= ZIP64_ENDHDR &&
+        recordOffset <= pDir->eocdOffset - ZIP64_LOCHDR - ZIP64_ENDHDR)
+    {
+        record = archiveBytes(pArchive, recordOffset, ZIP64_ENDHDR, recordBuf);
+    }
+    if (record == NULL || get4LE(record) != ZIP64_ENDSIG) {
+        /* A classic archive could have the locator's signature there
+         * by chance; it only matters if the EOCD depends on it.
+         */
+        if (needZip64)
+            LOGW("Bad Zip64 end-of-central-directory record\n");
+        result = !needZip64;
+        goto bail;
+    }
+    pDir->numEntries = get8LE(record + ZIP64_ENDSUB);
+    pDir->cdOffset = get8LE(record + ZIP64_ENDOFF);
+    pDir->cdEnd = recordOffset;
+    result = true;
+
+bail:
+    free(tailBuf);
+    return result;
+}
+
+/*
+ * Replace the 32-bit sizes and local header offset of a central
+ * directory entry that are 0xffffffff with their 64-bit values from the
+ * Zip64 extra field, which holds only those, in this order.
+ *
+ * Returns "true" on success.
+ */
+static bool readZip64Extra(const unsigned char* extra, unsigned int extraLen,
+        uint64_t* pUncompLen, uint64_t* pCompLen, uint64_t* pLocalHdrOffset)
+{
+    uint64_t* fields[3] = { pUncompLen, pCompLen, pLocalHdrOffset };
+    const unsigned char* end = extra + extraLen;
+    unsigned int i;
+
+    while (end - extra >= 4 && get2LE(extra) != ZIP64_EXTID)
+        extra += 4 + get2LE(extra + 2);
+    if (end - extra < 4 || get2LE(extra + 2) > end - extra - 4) {
+        LOGW("Missing Zip64 extra field\n");
+        return false;
+    }
+    end = extra + 4 + get2LE(extra + 2);
+    extra += 4;
+
+    for (i = 0; i < 3; i++) {
+        if (*fields[i] != ZIP64_MAGICVAL)
+            continue;
+        if (end - extra < 8) {
+            LOGW("Zip64 extra field is too short\n");
+            return false;
+        }
+        *fields[i] = get8LE(extra);
+        extra += 8;
+    }
+    return true;
+}
+
 /*
  * Parse the contents of a Zip archive.  After confirming that the file
  * is in fact a Zip, we scan out the contents of the central directory and
@@ -187,8 +478,12 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
 static bool parseZipArchive(ZipArchive* pArchive)
 {
     bool result = false;
+    unsigned char sigBuf[4];
+    unsigned char localBuf[LOCHDR];
     const unsigned char* ptr;
-    unsigned int i, numEntries, cdOffset;
+    const unsigned char* cdEnd;
+    CentralDir dir;
+    unsigned int i, numEntries;
     unsigned int val;
 
     /*
@@ -196,7 +491,10 @@ static bool parseZipArchive(ZipArchive* pArchive)
      * signature for the first file (LOCSIG) or, if the archive doesn't
      * have any files in it, the end-of-central-directory signature (ENDSIG).
      */
-    val = get4LE(pArchive->addr);
+    ptr = archiveBytes(pArchive, 0, sizeof(sigBuf), sigBuf);
+    if (ptr == NULL)
+        goto bail;
+    val = get4LE(ptr);
     if (val == ENDSIG) {
         LOGI("Found Zip archive, but it looks empty\n");
         goto bail;
@@ -206,53 +504,68 @@ static bool parseZipArchive(ZipArchive* pArchive)
     }
 
     /*
-     * Find the EOCD.  We'll find it immediately unless they have a file
-     * comment.
+     * There are two interesting items in the EOCD block (or the Zip64
+     * one): the number of entries in the file, and the file offset of
+     * the start of the central directory.  Every entry takes at least
+     * CENHDR bytes of it.
      */
-    ptr = pArchive->addr + pArchive->length - ENDHDR;
-
-    while (ptr >= (const unsigned char*) pArchive->addr) {
-        if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
-            break;
-        ptr--;
-    }
-    if (ptr < (const unsigned char*) pArchive->addr) {
-        LOGI("Could not find end-of-central-directory in Zip\n");
+    if (!findCentralDir(pArchive, &dir))
         goto bail;
-    }
 
-    /*
-     * There are two interesting items in the EOCD block: the number of
-     * entries in the file, and the file offset of the start of the
-     * central directory.
-     */
-    numEntries = get2LE(ptr + ENDSUB);
-    cdOffset = get4LE(ptr + ENDOFF);
-
-    LOGVV("numEntries=%d cdOffset=%d\n", numEntries, cdOffset);
-    if (numEntries == 0 || cdOffset >= pArchive->length) {
-        LOGW("Invalid entries=%d offset=%d (len=%zd)\n",
-            numEntries, cdOffset, pArchive->length);
+    LOGVV("numEntries=%llu cdOffset=%llu\n",
+        (unsigned long long) dir.numEntries, (unsigned long long) dir.cdOffset);
+    if (dir.numEntries == 0 || dir.cdOffset > dir.cdEnd ||
+        dir.numEntries > (dir.cdEnd - dir.cdOffset) / CENHDR)
+    {
+        LOGW("Invalid entries=%llu offset=%llu (len=%llu)\n",
+            (unsigned long long) dir.numEntries,
+            (unsigned long long) dir.cdOffset,
+            (unsigned long long) pArchive->length);
         goto bail;
     }
+    numEntries = dir.numEntries;
 
     /*
      * Create data structures to hold entries.
      */
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+    if (pArchive->pEntries == NULL)
         goto bail;
 
-    ptr = pArchive->addr + cdOffset;
+    /*
+     * The central directory is read straight through, from wherever it
+     * is up to the EOCD; get it in with a few large reads instead of a
+     * fault per page.  An archive that isn't mapped keeps a copy of it,
+     * since the entries' names point into it.
+     */
+    if (dir.cdEnd - dir.cdOffset > SIZE_MAX) {
+        LOGW("Central directory is too large (%llu bytes)\n",
+            (unsigned long long) (dir.cdEnd - dir.cdOffset));
+        goto bail;
+    }
+    if (pArchive->addr != NULL) {
+        sysAdviseRange(pArchive->addr + dir.cdOffset,
+                dir.cdEnd - dir.cdOffset, SYS_MAP_WILLNEED);
+    } else {
+        pArchive->cdBuf = (unsigned char*) malloc(dir.cdEnd - dir.cdOffset);
+        if (pArchive->cdBuf == NULL)
+            goto bail;
+    }
+    pArchive->cdOffset = dir.cdOffset;
+    ptr = archiveBytes(pArchive, dir.cdOffset, dir.cdEnd - dir.cdOffset,
+            pArchive->cdBuf);
+    if (ptr == NULL)
+        goto bail;
+    cdEnd = ptr + (dir.cdEnd - dir.cdOffset);
     for (i = 0; i < numEntries; i++) {
         ZipEntry* pEntry;
-        unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
+        unsigned int fileNameLen, extraLen, commentLen;
+        uint64_t localHdrOffset;
         const unsigned char* localHdr;
         const char *fileName;
 
-        if (ptr + CENHDR > (const unsigned char*)pArchive->addr + pArchive->length) {
+        if (ptr + CENHDR > cdEnd) {
             LOGW("Ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -266,7 +579,7 @@ static bool parseZipArchive(ZipArchive* pArchive)
         extraLen = get2LE(ptr + CENEXT);
         commentLen = get2LE(ptr + CENCOM);
         fileName = (const char*)ptr + CENHDR;
-        if (fileName + fileNameLen > (const char*)pArchive->addr + pArchive->length) {
+        if ((size_t) (cdEnd - ptr) - CENHDR < fileNameLen + extraLen + commentLen) {
             LOGW("Filename ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -275,58 +588,7 @@ static bool parseZipArchive(ZipArchive* pArchive)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
         pEntry = &pArchive->pEntries[i];
-#endif
 
         //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
         //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
@@ -336,6 +598,15 @@ static bool parseZipArchive(ZipArchive* pArchive)
 
         pEntry->compLen = get4LE(ptr + CENSIZ);
         pEntry->uncompLen = get4LE(ptr + CENLEN);
+        if ((pEntry->compLen == ZIP64_MAGICVAL ||
+             pEntry->uncompLen == ZIP64_MAGICVAL ||
+             localHdrOffset == ZIP64_MAGICVAL) &&
+            !readZip64Extra(ptr + CENHDR + fileNameLen, extraLen,
+                &pEntry->uncompLen, &pEntry->compLen, &localHdrOffset))
+        {
+            LOGW("Bad Zip64 entry (at %d)\n", i);
+            goto bail;
+        }
         pEntry->compression = get2LE(ptr + CENHOW);
         pEntry->modTime = get4LE(ptr + CENTIM);
         pEntry->crc32 = get4LE(ptr + CENCRC);
@@ -352,97 +623,79 @@ static bool parseZipArchive(ZipArchive* pArchive)
         }
         pEntry->externalFileAttributes = get4LE(ptr + CENATX);
 
-        // Perform pArchive->addr + localHdrOffset, ensuring that it won't
-        // overflow. This is needed because localHdrOffset is untrusted.
-        if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pArchive->addr,
-            (uintptr_t)localHdrOffset)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
+        // localHdrOffset and the sizes are untrusted, and may be 64
+        // bits even where pointers aren't, so they're checked against
+        // the length before anything is added to them.
+        if (pArchive->length < LOCHDR || localHdrOffset > pArchive->length - LOCHDR) {
+            LOGW("Bad offset to local header: %llu (at %d)\n",
+                (unsigned long long) localHdrOffset, i);
             goto bail;
         }
-        if ((uintptr_t)localHdr + LOCHDR >
-            (uintptr_t)pArchive->addr + pArchive->length) {
-            LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
+        localHdr = archiveBytes(pArchive, localHdrOffset, LOCHDR, localBuf);
+        if (localHdr == NULL)
             goto bail;
-        }
         if (get4LE(localHdr) != LOCSIG) {
             LOGW("Missed a local header sig (at %d)\n", i);
             goto bail;
         }
         pEntry->offset = localHdrOffset + LOCHDR
             + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
-        if (!safe_add(NULL, pEntry->offset, pEntry->compLen)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
+        if (pEntry->offset > pArchive->length ||
+            pEntry->compLen > pArchive->length - pEntry->offset)
+        {
+            LOGW("Data ran off the end (at %d)\n", i);
             goto bail;
         }
-        if ((size_t)pEntry->offset + pEntry->compLen > pArchive->length) {
-            LOGW("Data ran off the end (at %d)\n", i);
+        // Stored entries are read for uncompLen bytes.
+        if (pEntry->compression == STORED && pEntry->uncompLen != pEntry->compLen) {
+            LOGW("Stored entry has different sizes (at %d)\n", i);
             goto bail;
         }
 
-#if !SORT_ENTRIES
-        /* Add to hash table; no need to lock here.
-         * Can't do this now if we're sorting, because entries
-         * will move around.
-         */
-        addEntryToHashTable(pArchive->pHash, pEntry);
-#endif
-
         //dumpEntry(pEntry);
         ptr += CENHDR + fileNameLen + extraLen + commentLen;
     }
 
-#if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
+    /* Sort all at once, rather than inserting each entry in place as
+     * it's read, which costs a memmove() per entry.  Lookups by prefix
+     * depend on this order.
      */
-    for (i = 0; i < numEntries; i++) {
-        /* Add to hash table; no need to lock here.
-         */
-        addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
-    }
-#endif
+    qsort(pArchive->pEntries, numEntries, sizeof(ZipEntry), compareEntries);
+
+    /* The index refers to entries by position, so it's built once
+     * they're in their final places.
+     */
+    if (!buildIndex(pArchive))
+        goto bail;
 
     result = true;
 
 bail:
     if (!result) {
-        mzHashTableFree(pArchive->pHash);
-        pArchive->pHash = NULL;
+        free(pArchive->pSlots);
+        pArchive->pSlots = NULL;
     }
     return result;
 }
 
 /*
- * Open a Zip archive and scan out the contents.
- *
- * The easiest way to do this is to mmap() the whole thing and do the
- * traditional backward scan for central directory.  Since the EOCD is
- * a relatively small bit at the end, we should end up only touching a
- * small set of pages.
- *
- * This will be called on non-Zip files, especially during startup, so
- * we don't want to be too noisy about failures.  (Do we want a "quiet"
- * flag?)
- *
- * On success, we fill out the contents of "pArchive".
+ * Parse the archive that "pArchive" maps or reads, which is otherwise
+ * empty, and close it again if that fails.
  */
-int mzOpenZipArchive(unsigned char* addr, size_t length, ZipArchive* pArchive)
+static int openZipArchive(ZipArchive* pArchive)
 {
     int err;
 
-    if (length < ENDHDR) {
+    if (pArchive->length < ENDHDR) {
         err = -1;
-        LOGV("File '%s' too small to be zip (%zd)\n", fileName, map.length);
+        LOGV("File too small to be zip (%llu)\n",
+            (unsigned long long) pArchive->length);
         goto bail;
     }
 
-    pArchive->addr = addr;
-    pArchive->length = length;
-
     if (!parseZipArchive(pArchive)) {
         err = -1;
-        LOGV("Parsing '%s' failed\n", fileName);
+        LOGV("Parsing failed\n");
         goto bail;
     }
 
@@ -454,6 +707,42 @@ bail:
     return err;
 }
 
+/*
+ * Open a Zip archive and scan out the contents.
+ *
+ * The easiest way to do this is to mmap() the whole thing and do the
+ * traditional backward scan for central directory.  Since the EOCD is
+ * a relatively small bit at the end, we should end up only touching a
+ * small set of pages.
+ *
+ * This will be called on non-Zip files, especially during startup, so
+ * we don't want to be too noisy about failures.  (Do we want a "quiet"
+ * flag?)
+ *
+ * On success, we fill out the contents of "pArchive".
+ */
+int mzOpenZipArchive(unsigned char* addr, size_t length, ZipArchive* pArchive)
+{
+    memset(pArchive, 0, sizeof(*pArchive));
+    pArchive->fd = -1;
+    pArchive->addr = addr;
+    pArchive->length = length;
+    return openZipArchive(pArchive);
+}
+
+/*
+ * Open a Zip archive read through "pReader", keeping only the central
+ * directory in memory.
+ */
+int mzOpenZipArchiveReader(SysReader* pReader, ZipArchive* pArchive)
+{
+    memset(pArchive, 0, sizeof(*pArchive));
+    pArchive->fd = -1;
+    pArchive->reader = pReader;
+    pArchive->length = sysReaderLength(pReader);
+    return openZipArchive(pArchive);
+}
+
 /*
  * Close a ZipArchive, closing the file and freeing the contents.
  *
@@ -464,11 +753,28 @@ void mzCloseZipArchive(ZipArchive* pArchive)
     LOGV("Closing archive %p\n", pArchive);
 
     free(pArchive->pEntries);
+    free(pArchive->pSlots);
+    free(pArchive->cdBuf);
 
-    mzHashTableFree(pArchive->pHash);
-
-    pArchive->pHash = NULL;
+    pArchive->pSlots = NULL;
     pArchive->pEntries = NULL;
+    pArchive->cdBuf = NULL;
+}
+
+/*
+ * Remember the file the archive was mapped from.
+ */
+void mzSetZipArchiveFd(ZipArchive* pArchive, int fd)
+{
+    pArchive->fd = fd;
+}
+
+/*
+ * Remember whether stored entries may be copied without a CRC check.
+ */
+void mzSetZipArchiveKernelCopy(ZipArchive* pArchive, bool kernelCopy)
+{
+    pArchive->kernelCopy = kernelCopy;
 }
 
 /*
@@ -479,10 +785,419 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
+    unsigned int nameLen = strlen(entryName);
+    unsigned int hash = computeHash(entryName, nameLen);
+    unsigned int pos = hash & pArchive->slotMask;
+    unsigned int dist;
+
+    /* Past the first empty slot, or the first entry nearer its own home
+     * than this name would be, there's no point looking further; see
+     * addEntryToIndex().
+     */
+    for (dist = 0; dist <= pArchive->slotMask; dist++) {
+        const ZipNameSlot* pSlot = &pArchive->pSlots[pos];
+        if (pSlot->entry == 0 || slotDistance(pArchive, pos) < dist)
+            break;
+        if (pSlot->hash == hash) {
+            const ZipEntry* pEntry = &pArchive->pEntries[pSlot->entry - 1];
+            if (pEntry->fileNameLen == nameLen &&
+                memcmp(pEntry->fileName, entryName, nameLen) == 0)
+            {
+                return pEntry;
+            }
+        }
+        pos = (pos + 1) & pArchive->slotMask;
+    }
+    return NULL;
+}
+
+/*
+ * Find the first entry, from first up to last, that compareEntryName()
+ * puts at or after the prefix, or (if "past" is set) after every name
+ * that begins with it.
+ */
+static unsigned int searchZipEntries(const ZipArchive* pArchive,
+        unsigned int first, unsigned int last, const char* prefix,
+        unsigned int prefixLen, bool past)
+{
+    while (first < last) {
+        unsigned int mid = first + (last - first) / 2;
+        const ZipEntry* pEntry = &pArchive->pEntries[mid];
+        int diff;
+
+        if (pEntry->fileNameLen >= prefixLen)
+            diff = memcmp(pEntry->fileName, prefix, prefixLen);
+        else
+            diff = compareEntryName(pEntry, prefix, prefixLen);
+        if (diff < 0 || (diff == 0 && past))
+            first = mid + 1;
+        else
+            last = mid;
+    }
+    return first;
+}
+
+/*
+ * Find the entries whose names begin with a prefix.
+ */
+unsigned int mzFindZipEntriesWithPrefix(const ZipArchive* pArchive,
+        const char* prefix, unsigned int* pFirst)
+{
+    unsigned int prefixLen = strlen(prefix);
+    unsigned int first, last;
+
+    first = searchZipEntries(pArchive, 0, pArchive->numEntries,
+            prefix, prefixLen, false);
+    last = searchZipEntries(pArchive, first, pArchive->numEntries,
+            prefix, prefixLen, true);
+    *pFirst = first;
+    return last - first;
+}
+
+/*
+ * Entry index, as written by mzWriteZipIndex().  Everything is in the
+ * device's own byte order, since the index never leaves it.  Names are
+ * kept as offsets into the archive, and the name index is written out
+ * as it is.  Recovery and the update binary may come from different
+ * builds, so a change to the layout needs a new magic; a build that
+ * doesn't recognize it parses the archive instead.  (MZINDEX1 had
+ * 32-bit name offsets, which don't reach past 4GB.)
+ */
+#define INDEX_MAGIC "MZINDEX2"
+
+typedef struct {
+    char     magic[8];
+    uint64_t archiveLength;
+    uint64_t eocdOffset;
+    unsigned char eocd[ENDHDR];     // must match the archive's
+    unsigned char pad[2];
+    uint32_t numEntries;
+    uint32_t hashSize;
+} IndexHeader;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t compLen;
+    uint64_t uncompLen;
+    uint64_t nameOffset;
+    uint32_t nameLen;
+    uint32_t compression;
+    uint32_t modTime;
+    uint32_t crc32;
+    uint32_t versionMadeBy;
+    uint32_t externalFileAttributes;
+} IndexEntry;
+
+static bool writeFully(int fd, const void* data, size_t len)
+{
+    const unsigned char* p = (const unsigned char*) data;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool readFully(int fd, void* data, size_t len)
+{
+    unsigned char* p = (unsigned char*) data;
+
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/*
+ * Write the parsed entry table and name hash of "pArchive" to "fd".
+ *
+ * Returns true on success.
+ */
+bool mzWriteZipIndex(const ZipArchive* pArchive, int fd)
+{
+    unsigned char eocdBuf[ENDHDR];
+    const unsigned char* eocd;
+    CentralDir dir;
+    IndexHeader header;
+    IndexEntry* entries = NULL;
+    bool result = false;
+    unsigned int i;
+
+    if (pArchive->pSlots == NULL || !findCentralDir(pArchive, &dir))
+        goto bail;
+    eocd = archiveBytes(pArchive, dir.eocdOffset, ENDHDR, eocdBuf);
+    if (eocd == NULL)
+        goto bail;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.archiveLength = pArchive->length;
+    header.eocdOffset = dir.eocdOffset;
+    memcpy(header.eocd, eocd, ENDHDR);
+    header.numEntries = pArchive->numEntries;
+    header.hashSize = pArchive->slotMask + 1;
+
+    entries = (IndexEntry*) calloc(pArchive->numEntries, sizeof(IndexEntry));
+    if (entries == NULL)
+        goto bail;
+
+    for (i = 0; i < pArchive->numEntries; i++) {
+        const ZipEntry* pEntry = &pArchive->pEntries[i];
+        IndexEntry* pIndex = &entries[i];
+
+        pIndex->offset = pEntry->offset;
+        pIndex->compLen = pEntry->compLen;
+        pIndex->uncompLen = pEntry->uncompLen;
+        if (pArchive->addr != NULL) {
+            pIndex->nameOffset = (const unsigned char*) pEntry->fileName - pArchive->addr;
+        } else {
+            pIndex->nameOffset = pArchive->cdOffset +
+                ((const unsigned char*) pEntry->fileName - pArchive->cdBuf);
+        }
+        pIndex->nameLen = pEntry->fileNameLen;
+        pIndex->compression = pEntry->compression;
+        pIndex->modTime = pEntry->modTime;
+        pIndex->crc32 = pEntry->crc32;
+        pIndex->versionMadeBy = pEntry->versionMadeBy;
+        pIndex->externalFileAttributes = pEntry->externalFileAttributes;
+    }
+
+    result = writeFully(fd, &header, sizeof(header)) &&
+        writeFully(fd, entries, pArchive->numEntries * sizeof(IndexEntry)) &&
+        writeFully(fd, pArchive->pSlots, header.hashSize * sizeof(ZipNameSlot));
+
+bail:
+    free(entries);
+    return result;
+}
+
+/*
+ * Rebuild the entry table and name hash of the archive that "pArchive"
+ * maps or reads from the index in "fd", instead of parsing the central
+ * directory.  The index is checked against the archive's EOCD, and every
+ * offset in it against the archive's length, but names aren't
+ * re-validated and the local headers aren't looked at.  An archive that
+ * isn't mapped still reads in its central directory, for the names.
+ */
+static bool loadZipIndex(ZipArchive* pArchive, int fd)
+{
+    unsigned char eocdBuf[ENDHDR];
+    const unsigned char* eocd;
+    CentralDir dir;
+    IndexHeader header;
+    IndexEntry* entries = NULL;
+    ZipNameSlot* slots = NULL;
+    struct stat sb;
+    uint64_t indexSize;
+    unsigned int i, used;
+    bool result = false;
+
+    if (!readFully(fd, &header, sizeof(header))) {
+        LOGW("Can't read zip index header\n");
+        goto bail;
+    }
+    if (memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+        header.archiveLength != pArchive->length ||
+        header.eocdOffset > pArchive->length - ENDHDR ||
+        (eocd = archiveBytes(pArchive, header.eocdOffset, ENDHDR, eocdBuf)) == NULL ||
+        memcmp(eocd, header.eocd, ENDHDR) != 0)
+    {
+        LOGW("Zip index doesn't belong to this archive\n");
+        goto bail;
+    }
+    if (!findCentralDir(pArchive, &dir) || dir.eocdOffset != header.eocdOffset) {
+        LOGW("Zip index has the wrong EOCD\n");
+        goto bail;
+    }
+    if (pArchive->addr == NULL) {
+        if (dir.cdOffset > dir.cdEnd || dir.cdEnd - dir.cdOffset > SIZE_MAX) {
+            LOGW("Zip index has the wrong EOCD\n");
+            goto bail;
+        }
+        pArchive->cdBuf = (unsigned char*) malloc(dir.cdEnd - dir.cdOffset);
+        if (pArchive->cdBuf == NULL ||
+            archiveBytes(pArchive, dir.cdOffset, dir.cdEnd - dir.cdOffset,
+                pArchive->cdBuf) == NULL)
+        {
+            goto bail;
+        }
+    }
+    pArchive->cdOffset = dir.cdOffset;
+
+    /* The table must be a power of two with room to spare, or a
+     * lookup for a missing name would never find an empty slot.
+     */
+    indexSize = sizeof(header) + (uint64_t) header.numEntries * sizeof(IndexEntry) +
+        (uint64_t) header.hashSize * sizeof(ZipNameSlot);
+    if (header.numEntries == 0 || header.numEntries != dir.numEntries ||
+        header.hashSize <= header.numEntries ||
+        (header.hashSize & (header.hashSize - 1)) != 0 ||
+        fstat(fd, &sb) != 0 || (uint64_t) sb.st_size != indexSize)
+    {
+        LOGW("Zip index is malformed\n");
+        goto bail;
+    }
+
+    entries = (IndexEntry*) malloc(header.numEntries * sizeof(IndexEntry));
+    slots = (ZipNameSlot*) malloc(header.hashSize * sizeof(ZipNameSlot));
+    pArchive->pEntries = (ZipEntry*) calloc(header.numEntries, sizeof(ZipEntry));
+    if (entries == NULL || slots == NULL || pArchive->pEntries == NULL)
+        goto bail;
+    if (!readFully(fd, entries, header.numEntries * sizeof(IndexEntry)) ||
+        !readFully(fd, slots, header.hashSize * sizeof(ZipNameSlot)))
+    {
+        LOGW("Can't read zip index\n");
+        goto bail;
+    }
+
+    for (i = 0; i < header.numEntries; i++) {
+        const IndexEntry* pIndex = &entries[i];
+        ZipEntry* pEntry = &pArchive->pEntries[i];
+
+        if (pIndex->nameLen >= PATH_MAX ||
+            pIndex->nameOffset > pArchive->length - pIndex->nameLen ||
+            pIndex->offset > pArchive->length ||
+            pIndex->compLen > pArchive->length - pIndex->offset)
+        {
+            LOGW("Zip index entry %u is out of range\n", i);
+            goto bail;
+        }
+        if (pArchive->addr != NULL) {
+            pEntry->fileName = (const char*) pArchive->addr + pIndex->nameOffset;
+        } else if (pIndex->nameOffset >= dir.cdOffset &&
+            pIndex->nameOffset + pIndex->nameLen <= dir.cdEnd)
+        {
+            pEntry->fileName = (const char*) pArchive->cdBuf +
+                (pIndex->nameOffset - dir.cdOffset);
+        } else {
+            LOGW("Zip index entry %u is out of range\n", i);
+            goto bail;
+        }
+        pEntry->fileNameLen = pIndex->nameLen;
+        pEntry->offset = pIndex->offset;
+        pEntry->compLen = pIndex->compLen;
+        pEntry->uncompLen = pIndex->uncompLen;
+        pEntry->compression = pIndex->compression;
+        pEntry->modTime = pIndex->modTime;
+        pEntry->crc32 = pIndex->crc32;
+        pEntry->versionMadeBy = pIndex->versionMadeBy;
+        pEntry->externalFileAttributes = pIndex->externalFileAttributes;
+    }
+
+    used = 0;
+    for (i = 0; i < header.hashSize; i++) {
+        if (slots[i].entry == 0)
+            continue;
+        if (slots[i].entry > header.numEntries) {
+            LOGW("Zip index slot %u is out of range\n", i);
+            goto bail;
+        }
+        used++;
+    }
+    if (used != header.numEntries) {
+        LOGW("Zip index hashes %u of %u entries\n", used, header.numEntries);
+        goto bail;
+    }
+    pArchive->numEntries = header.numEntries;
+    pArchive->pSlots = slots;
+    pArchive->slotMask = header.hashSize - 1;
+    slots = NULL;
+
+    /* Lookups by prefix need the entries in order.  Every build that
+     * writes an index sorts them first, but a damaged index could still
+     * get this far.
+     */
+    for (i = 1; i < header.numEntries; i++) {
+        const ZipEntry* pEntry = &pArchive->pEntries[i];
+        if (compareEntryName(pEntry - 1, pEntry->fileName, pEntry->fileNameLen) > 0) {
+            LOGW("Zip index entries are out of order\n");
+            goto bail;
+        }
+    }
+
+    /* An index from an older build may be a plain linear-probing table,
+     * which a lookup here can't stop early in.  In that case, rebuild it
+     * from the entries, which is still far cheaper than a parse.
+     */
+    for (i = 0; i < header.hashSize; i++) {
+        unsigned int next = (i + 1) & pArchive->slotMask;
+        if (pArchive->pSlots[next].entry != 0 &&
+            slotDistance(pArchive, next) > (pArchive->pSlots[i].entry != 0 ?
+                slotDistance(pArchive, i) + 1 : 0))
+        {
+            LOGI("Rebuilding zip index\n");
+            if (!buildIndex(pArchive))
+                goto bail;
+            break;
+        }
+    }
+    result = true;
+
+bail:
+    free(entries);
+    free(slots);
+    return result;
+}
+
+/*
+ * Open a Zip archive using an index written by mzWriteZipIndex() for
+ * the same archive.
+ *
+ * On success, returns 0 and populates "pArchive".  Returns nonzero on
+ * failure, in which case the caller can still mzOpenZipArchive() it.
+ */
+int mzOpenZipArchiveWithIndex(unsigned char* addr, size_t length, int indexFd,
+        ZipArchive* pArchive)
+{
+    memset(pArchive, 0, sizeof(*pArchive));
+    pArchive->fd = -1;
+    if (length < ENDHDR)
+        return -1;
 
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
-                itemHash, (char*) entryName, hashcmpZipName, false);
+    pArchive->addr = addr;
+    pArchive->length = length;
+
+    if (!loadZipIndex(pArchive, indexFd)) {
+        mzCloseZipArchive(pArchive);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Open a Zip archive read through "pReader" using an index written by
+ * mzWriteZipIndex() for the same archive.
+ *
+ * On success, returns 0 and populates "pArchive".  Returns nonzero on
+ * failure, in which case the caller can still mzOpenZipArchiveReader() it.
+ */
+int mzOpenZipArchiveReaderWithIndex(SysReader* pReader, int indexFd,
+        ZipArchive* pArchive)
+{
+    memset(pArchive, 0, sizeof(*pArchive));
+    pArchive->fd = -1;
+    pArchive->reader = pReader;
+    pArchive->length = sysReaderLength(pReader);
+    if (pArchive->length < ENDHDR)
+        return -1;
+
+    if (!loadZipIndex(pArchive, indexFd)) {
+        mzCloseZipArchive(pArchive);
+        return -1;
+    }
+    return 0;
 }
 
 /*
@@ -496,27 +1211,194 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
+/*
+ * The "length" bytes of an entry's data at "offset" in the archive,
+ * handed out front to back a piece at a time: straight from the
+ * mapping, or, if the archive isn't mapped, read into a buffer of
+ * READ_CHUNK that every piece reuses.
+ */
+typedef struct {
+    const ZipArchive* pArchive;
+    uint64_t start;
+    uint64_t offset;            // of the next piece
+    uint64_t end;
+    uint64_t dropped;           // not mapped: released from the cache up to here
+    bool follow;
+    unsigned char* buf;         // not mapped: allocated on first use
+    SysReadahead* readahead;    // mapped
+} EntryData;
+
+/*
+ * Get ready to read the data at "offset".  With "follow", it's only
+ * read once: a large entry is read ahead of the pieces and released
+ * behind them.  Otherwise the kernel is just told what's coming.
+ */
+static void startEntryData(EntryData* pData, const ZipArchive* pArchive,
+        uint64_t offset, uint64_t length, bool follow)
+{
+    SysMapAdvice advice = length > READAHEAD_WINDOW ? SYS_MAP_SEQUENTIAL : SYS_MAP_WILLNEED;
+
+    memset(pData, 0, sizeof(*pData));
+    pData->pArchive = pArchive;
+    pData->start = pData->offset = pData->dropped = offset;
+    pData->end = offset + length;
+    pData->follow = follow;
+
+    if (pArchive->addr != NULL) {
+        if (follow && length > READAHEAD_WINDOW) {
+            pData->readahead = sysReadaheadStart(pArchive->addr + offset, length,
+                    READAHEAD_WINDOW, true);
+        } else {
+            sysAdviseRange(pArchive->addr + offset, length, advice);
+        }
+    } else {
+        // The page cache reads ahead of pread() by itself; one window
+        // is enough to start it off.
+        sysReaderAdvise(pArchive->reader, offset,
+                length > READAHEAD_WINDOW ? READAHEAD_WINDOW : length, advice);
+    }
+}
+
+/*
+ * Mark the next "len" bytes as read, releasing what's now well behind
+ * if the data is being followed and isn't mapped.
+ */
+static void advanceEntryData(EntryData* pData, size_t len)
+{
+    pData->offset += len;
+    if (pData->pArchive->addr == NULL && pData->follow &&
+        pData->offset - pData->dropped >= 2 * READAHEAD_WINDOW)
+    {
+        uint64_t upTo = pData->offset - READAHEAD_WINDOW;
+        sysReaderAdvise(pData->pArchive->reader, pData->dropped,
+                upTo - pData->dropped, SYS_MAP_DONTNEED);
+        pData->dropped = upTo;
+    }
+}
+
+/*
+ * Get the next piece, of at most "max" bytes, and set *pLen to its
+ * length.  A piece read from an archive that isn't mapped is at most
+ * READ_CHUNK bytes, and only good until the next call.
+ *
+ * Returns NULL if there's nothing left, or on error.
+ */
+static const unsigned char* nextEntryData(EntryData* pData, size_t max,
+        size_t* pLen)
+{
+    const ZipArchive* pArchive = pData->pArchive;
+    const unsigned char* piece;
+    uint64_t left = pData->end - pData->offset;
+    size_t n = left < max ? left : max;
+
+    if (n == 0)
+        return NULL;
+    if (pArchive->addr != NULL) {
+        sysReadaheadSetCursor(pData->readahead, pData->offset - pData->start);
+        piece = pArchive->addr + pData->offset;
+    } else {
+        if (pData->buf == NULL) {
+            pData->buf = (unsigned char*) malloc(READ_CHUNK);
+            if (pData->buf == NULL) {
+                LOGE("Can't allocate read buffer\n");
+                return NULL;
+            }
+        }
+        if (n > READ_CHUNK)
+            n = READ_CHUNK;
+        piece = archiveBytes(pArchive, pData->offset, n, pData->buf);
+        if (piece == NULL)
+            return NULL;
+    }
+    advanceEntryData(pData, n);
+    *pLen = n;
+    return piece;
+}
+
+/*
+ * Copy the next "len" bytes to "dest", read straight there if the
+ * archive isn't mapped.  Returns false on error.
+ */
+static bool readEntryData(EntryData* pData, unsigned char* dest, size_t len)
+{
+    const ZipArchive* pArchive = pData->pArchive;
+
+    if (len > pData->end - pData->offset)
+        return false;
+    if (pArchive->addr != NULL) {
+        sysReadaheadSetCursor(pData->readahead, pData->offset - pData->start);
+        memcpy(dest, pArchive->addr + pData->offset, len);
+    } else if (archiveBytes(pArchive, pData->offset, len, dest) == NULL) {
+        return false;
+    }
+    advanceEntryData(pData, len);
+    return true;
+}
+
+static void endEntryData(EntryData* pData)
+{
+    sysReadaheadStop(pData->readahead);
+    free(pData->buf);
+}
+
 /* Call processFunction on the uncompressed data of a STORED entry.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    return processFunction(pArchive->addr + pEntry->offset, pEntry->uncompLen, cookie);
+    const unsigned char* piece;
+    EntryData data;
+    size_t n;
+    bool ok = true;
+
+    // processFunction gets all of a mapped entry at once unless it's
+    // huge, so there's no cursor to follow; let the kernel's readahead
+    // ramp up instead.
+    startEntryData(&data, pArchive, pEntry->offset, pEntry->uncompLen, false);
+    while (ok && data.offset < data.end) {
+        piece = nextEntryData(&data, MAX_PIECE, &n);
+        ok = piece != NULL && processFunction(piece, n, cookie);
+    }
+    endEntryData(&data);
+    return ok;
+}
+
+/*
+ * Once zlib has used up its input, give it the next piece.  Pieces are
+ * kept to READ_CHUNK even from a mapping, so that the readahead cursor
+ * moves with inflate.  Returns false on error.
+ */
+static bool feedInflate(z_stream* zstream, EntryData* pData)
+{
+    size_t n;
+
+    if (zstream->avail_in == 0 && pData->offset < pData->end) {
+        zstream->next_in = (Bytef*) nextEntryData(pData, READ_CHUNK, &n);
+        if (zstream->next_in == NULL)
+            return false;
+        zstream->avail_in = n;
+    }
+    return true;
 }
 
 static bool processDeflatedEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    long result = -1;
+    long long result = -1;
     unsigned char readBuf[32 * 1024];
     unsigned char procBuf[32 * 1024];
     z_stream zstream;
     int zerr;
-    long compRemaining;
+    uint64_t total = 0;
+    EntryData compData;
 
-    compRemaining = pEntry->compLen;
+    /*
+     * Compressed data is only read once, so a large entry can let go
+     * of it as inflate moves on.
+     */
+    startEntryData(&compData, pArchive, pEntry->offset, pEntry->compLen, true);
 
     /*
      * Initialize the zlib stream.
@@ -525,8 +1407,8 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     zstream.zalloc = Z_NULL;
     zstream.zfree = Z_NULL;
     zstream.opaque = Z_NULL;
-    zstream.next_in = pArchive->addr + pEntry->offset;
-    zstream.avail_in = pEntry->compLen;
+    zstream.next_in = NULL;
+    zstream.avail_in = 0;
     zstream.next_out = (Bytef*) procBuf;
     zstream.avail_out = sizeof(procBuf);
     zstream.data_type = Z_UNKNOWN;
@@ -550,6 +1432,9 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
      * Loop while we have data.
      */
     do {
+        if (!feedInflate(&zstream, &compData))
+            goto z_bail;
+
         /* uncompress the data */
         zerr = inflate(&zstream, Z_NO_FLUSH);
         if (zerr != Z_OK && zerr != Z_STREAM_END) {
@@ -568,6 +1453,7 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
                 LOGW("Process function elected to fail (in inflate)\n");
                 goto z_bail;
             }
+            total += procSize;
 
             zstream.next_out = procBuf;
             zstream.avail_out = sizeof(procBuf);
@@ -576,17 +1462,18 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
 
     assert(zerr == Z_STREAM_END);       /* other errors should've been caught */
 
-    // success!
-    result = zstream.total_out;
+    // success!  (zstream.total_out may be only 32 bits.)
+    result = total;
 
 z_bail:
     inflateEnd(&zstream);        /* free up any allocated structures */
 
 bail:
-    if (result != pEntry->uncompLen) {
+    endEntryData(&compData);
+    if (result < 0 || (uint64_t) result != pEntry->uncompLen) {
         if (result != -1)        // error already shown?
-            LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
-                result, pEntry->uncompLen);
+            LOGW("Size mismatch on inflated file (%lld vs %llu)\n",
+                result, (unsigned long long) pEntry->uncompLen);
         return false;
     }
     return true;
@@ -628,7 +1515,21 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
 static bool crcProcessFunction(const unsigned char *data, int dataLen,
         void *crc)
 {
-    *(unsigned long *)crc = crc32(*(unsigned long *)crc, data, dataLen);
+    *(uint32_t *)crc = mzCrc32(*(uint32_t *)crc, data, dataLen);
+    return true;
+}
+
+/*
+ * Compare the CRC of everything extracted from "pEntry" with the one
+ * the archive gives, and complain if they differ.
+ */
+static bool checkEntryCrc(const ZipEntry *pEntry, uint32_t crc)
+{
+    if (crc != pEntry->crc32) {
+        LOGW("CRC for entry %.*s (0x%08x) != expected (0x%08x)\n",
+                pEntry->fileNameLen, pEntry->fileName, crc, pEntry->crc32);
+        return false;
+    }
     return true;
 }
 
@@ -638,22 +1539,112 @@ static bool crcProcessFunction(const unsigned char *data, int dataLen,
  */
 bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
 {
-    unsigned long crc;
+    uint32_t crc = 0;
     bool ret;
 
-    crc = crc32(0L, Z_NULL, 0);
     ret = mzProcessZipEntryContents(pArchive, pEntry, crcProcessFunction,
             (void *)&crc);
     if (!ret) {
         LOGE("Can't calculate CRC for entry\n");
         return false;
     }
-    if (crc != (unsigned long)pEntry->crc32) {
-        LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
-                pEntry->fileNameLen, pEntry->fileName, crc, pEntry->crc32);
+    return checkEntryCrc(pEntry, crc);
+}
+
+/*
+ * Entries read into a buffer are inflated straight into it this much
+ * at a time, so the CRC of each piece is taken while it's still in the
+ * cache.  (zlib keeps a copy of the last 32K of each call's output,
+ * which is why this isn't smaller.)
+ */
+#define BUFFER_CRC_STEP (256 * 1024)
+
+/*
+ * Uncompress "pEntry" straight into "buffer", which has room for all
+ * of it, checking the CRC on the way.  This skips the bounce buffer
+ * and callbacks of mzProcessZipEntryContents().
+ *
+ * Returns true on success.
+ */
+static bool extractEntryToBuffer(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, unsigned char *buffer)
+{
+    EntryData compData;
+    uint32_t crc = 0;
+    uint64_t done = 0;
+    bool ok = false;
+
+    if (pEntry->compression == STORED) {
+        startEntryData(&compData, pArchive, pEntry->offset, pEntry->uncompLen, false);
+        while (done < pEntry->uncompLen) {
+            uint64_t step = pEntry->uncompLen - done;
+            if (step > BUFFER_CRC_STEP) step = BUFFER_CRC_STEP;
+            if (!readEntryData(&compData, buffer + done, step))
+                break;
+            crc = mzCrc32(crc, buffer + done, step);
+            done += step;
+        }
+        endEntryData(&compData);
+    } else if (pEntry->compression == DEFLATED) {
+        unsigned char empty;
+        z_stream zstream;
+        int zerr;
+
+        memset(&zstream, 0, sizeof(zstream));
+        zstream.next_in = NULL;
+        zstream.avail_in = 0;
+        // zlib wants somewhere to write even when there's nothing to.
+        zstream.next_out = pEntry->uncompLen > 0 ? buffer : &empty;
+        zstream.avail_out = 0;
+
+        zerr = inflateInit2(&zstream, -MAX_WBITS);
+        if (zerr != Z_OK) {
+            LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+            return false;
+        }
+        startEntryData(&compData, pArchive, pEntry->offset, pEntry->compLen, true);
+
+        /* The last step is made with Z_FINISH, once zlib has all the
+         * input; if that's the only step, zlib doesn't bother with its
+         * window at all.  (Z_FINISH without all the input is an error.)
+         */
+        do {
+            uint64_t step = pEntry->uncompLen - done;
+            if (step > BUFFER_CRC_STEP) step = BUFFER_CRC_STEP;
+            if (!feedInflate(&zstream, &compData)) {
+                zerr = Z_ERRNO;
+                break;
+            }
+
+            zstream.avail_out = step;
+            zerr = inflate(&zstream, done + step == pEntry->uncompLen &&
+                    compData.offset == compData.end ? Z_FINISH : Z_NO_FLUSH);
+            long produced = step - zstream.avail_out;
+            crc = mzCrc32(crc, buffer + done, produced);
+            done += produced;
+        } while (zerr == Z_OK);
+
+        endEntryData(&compData);
+        inflateEnd(&zstream);
+        if (zerr != Z_STREAM_END) {
+            LOGW("zlib inflate call failed (zerr=%d)\n", zerr);
+            return false;
+        }
+    } else {
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen, pEntry->fileName);
         return false;
     }
-    return true;
+
+    ok = true;
+    if (done != pEntry->uncompLen) {
+        LOGW("Size mismatch on inflated file (%llu vs %llu)\n",
+            (unsigned long long) done, (unsigned long long) pEntry->uncompLen);
+        ok = false;
+    } else if (!checkEntryCrc(pEntry, crc)) {
+        ok = false;
+    }
+    return ok;
 }
 
 typedef struct {
@@ -683,6 +1674,14 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
     CopyProcessArgs args;
     bool ret;
 
+    if (bufLen >= 0 && (uint64_t) bufLen >= pEntry->uncompLen) {
+        if (!extractEntryToBuffer(pArchive, pEntry, (unsigned char *)buf)) {
+            LOGE("Can't extract entry to buffer.\n");
+            return false;
+        }
+        return true;
+    }
+
     args.buf = buf;
     args.bufLen = bufLen;
     ret = mzProcessZipEntryContents(pArchive, pEntry, copyProcessFunction,
@@ -722,34 +1721,163 @@ static bool writeProcessFunction(const unsigned char *data, int dataLen,
     }
 }
 
+typedef struct {
+    int fd;
+    uint32_t crc;
+} WriteCrcArgs;
+
+/* Take the CRC of each piece while it's still in the cache from
+ * inflate, then write it out.
+ */
+static bool writeCrcProcessFunction(const unsigned char *data, int dataLen,
+                                    void *cookie)
+{
+    WriteCrcArgs *args = (WriteCrcArgs *)cookie;
+    args->crc = mzCrc32(args->crc, data, dataLen);
+    return writeProcessFunction(data, dataLen, (void*)(intptr_t)args->fd);
+}
+
 /*
- * Uncompress "pEntry" in "pArchive" to "fd" at the current offset.
+ * Copy as much as the kernel will of the STORED entry "pEntry" from the
+ * archive's file to "fd" at its current offset, without the data
+ * passing through user space.  copy_file_range() is tried first, since
+ * within a filesystem it may not need to copy at all, then sendfile().
+ *
+ * Returns the number of bytes copied, which is short if the kernel
+ * can't copy between these two files; the caller writes the rest.
  */
-bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
+static uint64_t copyStoredEntryInKernel(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd)
 {
-    bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
-                                         (void*)(intptr_t)fd);
-    if (!ret) {
-        LOGE("Can't extract entry to file.\n");
-        return false;
+    uint64_t done = 0;
+
+    if (pArchive->fd < 0)
+        return 0;
+
+#ifdef __NR_copy_file_range
+    while (done < pEntry->uncompLen) {
+        loff_t inOff = pEntry->offset + done;
+        uint64_t len = pEntry->uncompLen - done;
+        ssize_t n = syscall(__NR_copy_file_range, pArchive->fd, &inOff, fd, NULL,
+                (size_t) (len > MAX_PIECE ? MAX_PIECE : len), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
     }
-    return true;
+#endif
+    while (done < pEntry->uncompLen) {
+        off64_t inOff = pEntry->offset + done;
+        uint64_t len = pEntry->uncompLen - done;
+        ssize_t n = sendfile64(fd, pArchive->fd, &inOff,
+                (size_t) (len > MAX_PIECE ? MAX_PIECE : len));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    return done;
 }
 
-typedef struct {
-    unsigned char* buffer;
-    long len;
-} BufferExtractCookie;
+/*
+ * Write the STORED entry "pEntry" to "fd" at its current offset: within
+ * the kernel if the archive allows it and that's possible, and
+ * otherwise in pieces of STORED_WRITE_CHUNK (or READ_CHUNK, if the
+ * archive isn't mapped) that line up with the offset in "fd".
+ *
+ * The CRC is taken from the pieces as they're written.  What the kernel
+ * copies never passes through here, and checking it would mean reading
+ * the entry all over again -- for a pread archive, a second full read of
+ * a boot or firmware image -- so the kernel is only used when the caller
+ * has asked for it, and then the CRC isn't checked.
+ */
+static bool extractStoredEntryToFile(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd)
+{
+    uint64_t done = pArchive->kernelCopy ?
+            copyStoredEntryInKernel(pArchive, pEntry, fd) : 0;
+    const unsigned char* piece;
+    EntryData data;
+    uint32_t crc = 0;
+    size_t n;
+    bool ok = true;
+
+    if (done == pEntry->uncompLen)
+        return true;
+    if (done > 0) {
+        LOGI("Copied %llu of %llu bytes in the kernel; writing the rest\n",
+                (unsigned long long) done, (unsigned long long) pEntry->uncompLen);
+    }
+
+    /* Pipes and the like have no offset; then there's nothing to line
+     * up with.
+     */
+    off64_t pos = lseek64(fd, 0, SEEK_CUR);
+    if (pos < 0)
+        pos = 0;
+
+    startEntryData(&data, pArchive, pEntry->offset + done,
+            pEntry->uncompLen - done, true);
+    while (ok && data.offset < data.end) {
+        piece = nextEntryData(&data, STORED_WRITE_CHUNK - pos % STORED_WRITE_CHUNK, &n);
+        if (piece == NULL) {
+            ok = false;
+            break;
+        }
+        if (done == 0)
+            crc = mzCrc32(crc, piece, n);
+        ok = writeProcessFunction(piece, n, (void*)(intptr_t)fd);
+        pos += n;
+    }
+    endEntryData(&data);
+    /* Only a whole entry written from here has a CRC to check. */
+    return ok && (done > 0 || checkEntryCrc(pEntry, crc));
+}
 
-static bool bufferProcessFunction(const unsigned char *data, int dataLen,
-    void *cookie) {
-    BufferExtractCookie *bec = (BufferExtractCookie*)cookie;
+/*
+ * Ask for the start of an entry's data to be read in the background.
+ */
+void mzPrefetchZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
+        uint64_t maxLen)
+{
+    uint64_t len = pEntry->compLen < maxLen ? pEntry->compLen : maxLen;
+
+    if (len > SIZE_MAX)
+        len = SIZE_MAX;
+    if (len == 0)
+        return;
+    if (pArchive->addr != NULL)
+        sysAdviseRange(pArchive->addr + pEntry->offset, len, SYS_MAP_WILLNEED);
+    else
+        sysReaderAdvise(pArchive->reader, pEntry->offset, len, SYS_MAP_WILLNEED);
+}
 
-    memmove(bec->buffer, data, dataLen);
-    bec->buffer += dataLen;
-    bec->len -= dataLen;
+/*
+ * Uncompress "pEntry" in "pArchive" to "fd" at the current offset,
+ * checking its CRC.
+ */
+bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd)
+{
+    if (pEntry->compression == STORED) {
+        if (!extractStoredEntryToFile(pArchive, pEntry, fd)) {
+            LOGE("Can't extract entry to file.\n");
+            return false;
+        }
+        return true;
+    }
 
+    WriteCrcArgs args;
+    args.fd = fd;
+    args.crc = 0;
+    bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeCrcProcessFunction,
+                                         &args);
+    if (!ret || !checkEntryCrc(pEntry, args.crc)) {
+        LOGE("Can't extract entry to file.\n");
+        return false;
+    }
     return true;
 }
 
@@ -760,13 +1888,7 @@ static bool bufferProcessFunction(const unsigned char *data, int dataLen,
 bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char *buffer)
 {
-    BufferExtractCookie bec;
-    bec.buffer = buffer;
-    bec.len = mzGetZipEntryUncompLen(pEntry);
-
-    bool ret = mzProcessZipEntryContents(pArchive, pEntry,
-        bufferProcessFunction, (void*)&bec);
-    if (!ret || bec.len != 0) {
+    if (!extractEntryToBuffer(pArchive, pEntry, buffer)) {
         LOGE("Can't extract entry to memory buffer.\n");
         return false;
     }
@@ -834,6 +1956,179 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/* selabel_lookup() isn't safe to call from more than one thread at a
+ * time, so extraction workers take turns.
+ */
+static pthread_mutex_t gLabelLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Create targetFile from a non-directory entry: a symlink, unless
+ * FILES_ONLY is set, or else a regular file.  The containing directory
+ * must already exist.
+ *
+ * Returns true on success.
+ */
+static bool extractEntryFile(const ZipArchive *pArchive,
+        const ZipEntry *pEntry, const char *targetFile, int flags,
+        const struct utimbuf *timestamp, struct selabel_handle *sehnd)
+{
+    int ret;
+
+    /* With FILES_ONLY set, we need to ignore metadata entirely,
+     * so treat symlinks as regular files.
+     */
+    if (!(flags & MZ_EXTRACT_FILES_ONLY) && mzIsZipEntrySymlink(pEntry)) {
+        /* The entry is a symbolic link.
+         * The relative target of the symlink is in the
+         * data section of this entry.
+         */
+        if (pEntry->uncompLen == 0 || pEntry->uncompLen >= PATH_MAX) {
+            LOGE("Symlink entry \"%s\" has a bad target length\n",
+                    targetFile);
+            return false;
+        }
+        char *linkTarget = malloc(pEntry->uncompLen + 1);
+        if (linkTarget == NULL) {
+            return false;
+        }
+        if (!mzReadZipEntry(pArchive, pEntry, linkTarget,
+                pEntry->uncompLen)) {
+            LOGE("Can't read symlink target for \"%s\"\n",
+                    targetFile);
+            free(linkTarget);
+            return false;
+        }
+        linkTarget[pEntry->uncompLen] = '\0';
+
+        /* Make the link.
+         */
+        ret = symlink(linkTarget, targetFile);
+        if (ret != 0) {
+            LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
+                    targetFile, linkTarget, strerror(errno));
+            free(linkTarget);
+            return false;
+        }
+        LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
+                targetFile, linkTarget);
+        free(linkTarget);
+        return true;
+    }
+
+    /* The entry is a regular file.
+     * Open the target for writing.  The file creation context is
+     * per-thread, so only the lookup needs the lock.
+     */
+    char *secontext = NULL;
+
+    if (sehnd) {
+        pthread_mutex_lock(&gLabelLock);
+        selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
+        pthread_mutex_unlock(&gLabelLock);
+        setfscreatecon(secontext);
+    }
+
+    int fd = creat(targetFile, UNZIP_FILEMODE);
+
+    if (secontext) {
+        freecon(secontext);
+        setfscreatecon(NULL);
+    }
+
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                targetFile, strerror(errno));
+        return false;
+    }
+
+    bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+    close(fd);
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", targetFile);
+        return false;
+    }
+
+    if (timestamp != NULL && utime(targetFile, timestamp)) {
+        LOGE("Error touching \"%s\"\n", targetFile);
+        return false;
+    }
+
+    LOGV("Extracted file \"%s\"\n", targetFile);
+    return true;
+}
+
+/* State shared by the workers of one parallel mzExtractRecursive().
+ */
+typedef struct {
+    const ZipArchive *pArchive;
+    const char *targetDir;
+    const char *zipDir;
+    int flags;
+    const struct utimbuf *timestamp;
+    void (*callback)(const char *fn, void*);
+    void *cookie;
+    struct selabel_handle *sehnd;
+
+    const ZipEntry **entries;   // files and symlinks, in archive order
+    unsigned int numEntries;
+
+    pthread_mutex_t lock;       // guards the rest, and the callback
+    unsigned int next;
+    int extractCount;
+    bool failed;
+} MzExtractPool;
+
+/* Take entries off the pool and extract them until there are none
+ * left or one has failed.
+ */
+static void *extractWorker(void *cookie)
+{
+    MzExtractPool *pool = (MzExtractPool *)cookie;
+    MzPathHelper helper;
+    helper.targetDir = pool->targetDir;
+    helper.targetDirLen = strlen(helper.targetDir);
+    helper.zipDir = pool->zipDir;
+    helper.zipDirLen = strlen(helper.zipDir);
+    helper.buf = NULL;
+    helper.bufLen = 0;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->failed || pool->next == pool->numEntries) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        const ZipEntry *pEntry = pool->entries[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+
+        bool ok = false;
+        const char *targetFile = targetEntryPath(&helper, (ZipEntry *)pEntry);
+        if (targetFile == NULL) {
+            LOGE("Can't assemble target path for \"%.*s\"\n",
+                    pEntry->fileNameLen, pEntry->fileName);
+        } else {
+            ok = extractEntryFile(pool->pArchive, pEntry, targetFile,
+                    pool->flags, pool->timestamp, pool->sehnd);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (!ok) {
+            pool->failed = true;
+        } else {
+            if ((pool->flags & MZ_EXTRACT_FILES_ONLY) || !mzIsZipEntrySymlink(pEntry)) {
+                ++pool->extractCount;
+            }
+            if (pool->callback != NULL) pool->callback(targetFile, pool->cookie);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    free(helper.buf);
+    return NULL;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -859,6 +2154,22 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                         int flags, const struct utimbuf *timestamp,
                         void (*callback)(const char *fn, void *), void *cookie,
                         struct selabel_handle *sehnd)
+{
+    return mzExtractRecursiveParallel(pArchive, zipDir, targetDir, flags,
+            timestamp, callback, cookie, sehnd, 1);
+}
+
+/*
+ * As mzExtractRecursive(), but with up to numThreads threads inflating
+ * and writing files at once.  Every directory, including the ones
+ * holding files, is created first, in archive order, on the calling
+ * thread; then the files and symlinks are shared out.
+ */
+bool mzExtractRecursiveParallel(const ZipArchive *pArchive,
+                        const char *zipDir, const char *targetDir,
+                        int flags, const struct utimbuf *timestamp,
+                        void (*callback)(const char *fn, void *), void *cookie,
+                        struct selabel_handle *sehnd, int numThreads)
 {
     if (zipDir[0] == '/') {
         LOGE("mzExtractRecursive(): zipDir must be a relative path.\n");
@@ -904,51 +2215,61 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
-    /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
-     */
-    unsigned int i;
-    bool seenMatch = false;
-    int ok = true;
-    int extractCount = 0;
-    for (i = 0; i < pArchive->numEntries; i++) {
-        ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
+    /* Walk through the entries whose paths begin with zpath, and
+     * extract them.  If zpath is empty, that's all of them.
 //TODO: look out for a single empty directory entry that matches zpath, but
 //      missing the trailing slash.  Most zip files seem to include
 //      the trailing slash, but I think it's legal to leave it off.
 //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
-             */
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
+     */
+    unsigned int i, first, count;
+    int ok = true;
+    int extractCount = 0;
+
+    count = mzFindZipEntriesWithPrefix(pArchive, zpath, &first);
+
+    /* The entries come in name order, so each directory's files and
+     * subdirectories follow one another; keep the directories we're
+     * in open rather than looking every parent up again for each file.
+     */
+    DirCache *dirs = NULL;
+    if (!(flags & MZ_EXTRACT_DRY_RUN)) {
+        dirs = dirCacheCreate();
+        if (dirs == NULL) {
+            LOGE("Can't allocate directory cache\n");
+            free(zpath);
+            return false;
+        }
+    }
+
+    /* Files and symlinks to share among the workers, if there are to
+     * be any.  This has room for every entry under zipDir, but the
+     * directories aren't put in it.
+     */
+    MzExtractPool pool;
+    pool.entries = NULL;
+    pool.numEntries = 0;
+    if (numThreads > 1 && count > 1 && !(flags & MZ_EXTRACT_DRY_RUN)) {
+        pool.entries = (const ZipEntry **)malloc(
+                count * sizeof(*pool.entries));
+        if (pool.entries == NULL) {
+            LOGW("Can't allocate extraction pool; using one thread\n");
         }
-        /* If zpath is empty, this strncmp() will match everything,
-         * which is what we want.
+    }
+    for (i = first; i < first + count; i++) {
+        ZipEntry *pEntry = pArchive->pEntries + i;
+
+        /* A name that's in the archive more than once is extracted
+         * from its last copy only, which is what writing each copy in
+         * turn left behind; two workers mustn't write one file at once.
+         * Copies sort next to each other, in order of offset.
          */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
+        if (i + 1 < first + count && compareEntryName(pEntry + 1,
+                pEntry->fileName, pEntry->fileNameLen) == 0) {
+            LOGW("Skipping duplicate entry \"%.*s\"\n",
+                    pEntry->fileNameLen, pEntry->fileName);
             continue;
         }
-        /* This entry begins with zipDir, so we'll extract it.
-         */
-        seenMatch = true;
 
         /* Find the target location of the entry.
          */
@@ -969,11 +2290,9 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
         /* Create the file or directory.
          */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
         if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
-                int ret = dirCreateHierarchy(
+                int ret = dirCacheCreateHierarchy(dirs,
                         targetFile, UNZIP_DIRMODE, timestamp, false, sehnd);
                 if (ret != 0) {
                     LOGE("Can't create containing directory for \"%s\": %s\n",
@@ -987,7 +2306,7 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             /* This is not a directory.  First, make sure that
              * the containing directory exists.
              */
-            int ret = dirCreateHierarchy(
+            int ret = dirCacheCreateHierarchy(dirs,
                     targetFile, UNZIP_DIRMODE, timestamp, true, sehnd);
             if (ret != 0) {
                 LOGE("Can't create containing directory for \"%s\": %s\n",
@@ -996,89 +2315,20 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 break;
             }
 
-            /* With FILES_ONLY set, we need to ignore metadata entirely,
-             * so treat symlinks as regular files.
+            /* When extracting in parallel, leave the entry for the
+             * workers (and its callback for when they're done with it).
              */
-            if (!(flags & MZ_EXTRACT_FILES_ONLY) && mzIsZipEntrySymlink(pEntry)) {
-                /* The entry is a symbolic link.
-                 * The relative target of the symlink is in the
-                 * data section of this entry.
-                 */
-                if (pEntry->uncompLen == 0) {
-                    LOGE("Symlink entry \"%s\" has no target\n",
-                            targetFile);
-                    ok = false;
-                    break;
-                }
-                char *linkTarget = malloc(pEntry->uncompLen + 1);
-                if (linkTarget == NULL) {
-                    ok = false;
-                    break;
-                }
-                ok = mzReadZipEntry(pArchive, pEntry, linkTarget,
-                        pEntry->uncompLen);
-                if (!ok) {
-                    LOGE("Can't read symlink target for \"%s\"\n",
-                            targetFile);
-                    free(linkTarget);
-                    break;
-                }
-                linkTarget[pEntry->uncompLen] = '\0';
-
-                /* Make the link.
-                 */
-                ret = symlink(linkTarget, targetFile);
-                if (ret != 0) {
-                    LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
-                            targetFile, linkTarget, strerror(errno));
-                    free(linkTarget);
-                    ok = false;
-                    break;
-                }
-                LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
-                        targetFile, linkTarget);
-                free(linkTarget);
-            } else {
-                /* The entry is a regular file.
-                 * Open the target for writing.
-                 */
-
-                char *secontext = NULL;
-
-                if (sehnd) {
-                    selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
-                    setfscreatecon(secontext);
-                }
-
-                int fd = creat(targetFile, UNZIP_FILEMODE);
-
-                if (secontext) {
-                    freecon(secontext);
-                    setfscreatecon(NULL);
-                }
-
-                if (fd < 0) {
-                    LOGE("Can't create target file \"%s\": %s\n",
-                            targetFile, strerror(errno));
-                    ok = false;
-                    break;
-                }
-
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
+            if (pool.entries != NULL) {
+                pool.entries[pool.numEntries++] = pEntry;
+                continue;
+            }
 
-                LOGV("Extracted file \"%s\"\n", targetFile);
+            if (!extractEntryFile(pArchive, pEntry, targetFile, flags,
+                    timestamp, sehnd)) {
+                ok = false;
+                break;
+            }
+            if ((flags & MZ_EXTRACT_FILES_ONLY) || !mzIsZipEntrySymlink(pEntry)) {
                 ++extractCount;
             }
         }
@@ -1086,6 +2336,43 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
         if (callback != NULL) callback(targetFile, cookie);
     }
 
+    if (ok && pool.numEntries > 0) {
+        pthread_t threads[numThreads];
+        int started = 0;
+
+        pool.pArchive = pArchive;
+        pool.targetDir = targetDir;
+        pool.zipDir = zpath;
+        pool.flags = flags;
+        pool.timestamp = timestamp;
+        pool.callback = callback;
+        pool.cookie = cookie;
+        pool.sehnd = sehnd;
+        pthread_mutex_init(&pool.lock, NULL);
+        pool.next = 0;
+        pool.extractCount = 0;
+        pool.failed = false;
+
+        /* The calling thread is one of the workers.
+         */
+        for (i = 1; i < (unsigned int) numThreads && i < pool.numEntries; i++) {
+            if (pthread_create(&threads[started], NULL, extractWorker, &pool) == 0) {
+                started++;
+            }
+        }
+        extractWorker(&pool);
+        for (i = 0; i < (unsigned int) started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        pthread_mutex_destroy(&pool.lock);
+
+        ok = !pool.failed;
+        extractCount += pool.extractCount;
+        LOGD("Extracted on %d thread(s)\n", started + 1);
+    }
+    free(pool.entries);
+    dirCacheFree(dirs);
+
     LOGD("Extracted %d file(s)\n", extractCount);
 
     free(helper.buf);
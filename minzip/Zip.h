@@ -8,10 +8,10 @@
 
 #include "inline_magic.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <utime.h>
 
-#include "Hash.h"
 #include "SysUtil.h"
 
 #ifdef __cplusplus
@@ -24,33 +24,48 @@ extern "C" {
 /*
  * One entry in the Zip archive.  Treat this as opaque -- use accessors below.
  *
- * TODO: we're now keeping the pages mapped so we don't have to copy the
- * filename.  We can change the accessors to retrieve the various pieces
- * directly from the source file instead of copying them out, for a very
- * slight speed hit and a modest reduction in memory usage.
+ * The pages are kept mapped, so the name isn't copied.  Fields are
+ * sized to what the central directory holds, since archives can have
+ * tens of thousands of entries; offsets and sizes are 64 bits, as Zip64
+ * archives may need.
  */
 typedef struct ZipEntry {
-    unsigned int fileNameLen;
     const char*  fileName;       // not null-terminated
-    long         offset;
-    long         compLen;
-    long         uncompLen;
-    int          compression;
-    long         modTime;
-    long         crc32;
-    int          versionMadeBy;
-    long         externalFileAttributes;
+    uint64_t     offset;
+    uint64_t     compLen;
+    uint64_t     uncompLen;
+    uint32_t     crc32;
+    uint32_t     modTime;
+    uint32_t     externalFileAttributes;
+    uint16_t     fileNameLen;    // less than PATH_MAX
+    uint16_t     compression;
+    uint16_t     versionMadeBy;
 } ZipEntry;
 
+/*
+ * One slot of an archive's name index: the hash of an entry's name, and
+ * the entry's index plus one, or zero if the slot is empty.
+ */
+typedef struct ZipNameSlot {
+    uint32_t     hash;
+    uint32_t     entry;
+} ZipNameSlot;
+
 /*
  * One Zip archive.  Treat as opaque.
  */
 typedef struct ZipArchive {
     unsigned int   numEntries;
-    ZipEntry*      pEntries;
-    HashTable*     pHash;          // maps file name to ZipEntry
-    unsigned char* addr;
-    size_t         length;
+    ZipEntry*      pEntries;       // sorted by name
+    ZipNameSlot*   pSlots;         // maps file name to ZipEntry
+    unsigned int   slotMask;       // number of slots, less one
+    unsigned char* addr;           // the mapping, or NULL if read with pread
+    SysReader*     reader;         // if not mapped
+    unsigned char* cdBuf;          // if not mapped: the central directory,
+    uint64_t       cdOffset;       //   which entry names point into
+    uint64_t       length;
+    int            fd;             // the archive's file, if known, or -1
+    bool           kernelCopy;     // see mzSetZipArchiveKernelCopy()
 } ZipArchive;
 
 /*
@@ -63,13 +78,75 @@ typedef struct {
 } UnterminatedString;
 
 /*
- * Open a Zip archive.
+ * Open a Zip archive.  Zip64 archives are understood, but one larger
+ * than 4GB can only be mapped by a 64-bit process.
  *
  * On success, returns 0 and populates "pArchive".  Returns nonzero errno
  * value on failure.
  */
 int mzOpenZipArchive(unsigned char* addr, size_t length, ZipArchive* pArchive);
 
+/*
+ * Open a Zip archive that's read with pread() through "pReader" instead
+ * of being mapped.  Only the central directory is held in memory; entry
+ * data is read a small piece at a time as it's used, into buffers that
+ * are reused, so memory use doesn't grow with the size of the archive.
+ * "pReader" must stay open until the archive is closed; the archive
+ * doesn't close it.
+ *
+ * On success, returns 0 and populates "pArchive".  Returns nonzero on
+ * failure.
+ */
+int mzOpenZipArchiveReader(SysReader* pReader, ZipArchive* pArchive);
+
+/*
+ * Tell an open archive which file it was mapped or is read from, so
+ * that stored entries can be copied out of it by the kernel rather than
+ * through user space.  "fd" must stay open until the archive is closed; the
+ * archive doesn't close it.
+ */
+void mzSetZipArchiveFd(ZipArchive* pArchive, int fd);
+
+/*
+ * Let stored entries be copied to files by the kernel (given an fd; see
+ * mzSetZipArchiveFd()).  Their data then never passes through user
+ * space, so their CRC isn't checked: a caller that asks for this must
+ * be sure of the archive's bytes some other way, right up to
+ * extraction.  It's off unless asked for, and then every entry's CRC is
+ * checked in the same pass that writes it.
+ */
+void mzSetZipArchiveKernelCopy(ZipArchive* pArchive, bool kernelCopy);
+
+/*
+ * Write the parsed entry table of an open archive to "fd", so that
+ * another process with the same archive mapped can open it with
+ * mzOpenZipArchiveWithIndex() instead of parsing the central directory
+ * again.  The index holds offsets, not pointers, and is only good for
+ * an identical archive.
+ *
+ * Returns true on success.
+ */
+bool mzWriteZipIndex(const ZipArchive* pArchive, int fd);
+
+/*
+ * Open a Zip archive from an index written by mzWriteZipIndex().  The
+ * index is checked against the archive's length and EOCD and every
+ * offset in it bounds-checked, but the central directory isn't read.
+ *
+ * On success, returns 0 and populates "pArchive".  Returns nonzero on
+ * failure; the archive can still be opened with mzOpenZipArchive().
+ */
+int mzOpenZipArchiveWithIndex(unsigned char* addr, size_t length, int indexFd,
+        ZipArchive* pArchive);
+
+/*
+ * The same for an archive read through "pReader", as for
+ * mzOpenZipArchiveReader().  The central directory is still read in, for
+ * the entries' names, but not parsed.
+ */
+int mzOpenZipArchiveReaderWithIndex(SysReader* pReader, int indexFd,
+        ZipArchive* pArchive);
+
 /*
  * Close archive, releasing resources associated with it.
  *
@@ -85,6 +162,15 @@ void mzCloseZipArchive(ZipArchive* pArchive);
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName);
 
+/*
+ * Find the entries whose names begin with "prefix", such as everything
+ * under "dir/".  Entries are sorted by name, so these are consecutive:
+ * sets *pFirst to the index of the first (see mzGetZipEntryAt()) and
+ * returns how many there are.  This takes O(log n) time.
+ */
+unsigned int mzFindZipEntriesWithPrefix(const ZipArchive* pArchive,
+        const char* prefix, unsigned int* pFirst);
+
 /*
  * Get the number of entries in the Zip archive.
  */
@@ -121,10 +207,10 @@ INLINE UnterminatedString mzGetZipEntryFileName(const ZipEntry* pEntry) {
     ret.len = pEntry->fileNameLen;
     return ret;
 }
-INLINE long mzGetZipEntryOffset(const ZipEntry* pEntry) {
+INLINE uint64_t mzGetZipEntryOffset(const ZipEntry* pEntry) {
     return pEntry->offset;
 }
-INLINE long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
+INLINE uint64_t mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
     return pEntry->uncompLen;
 }
 INLINE long mzGetZipEntryModTime(const ZipEntry* pEntry) {
@@ -158,7 +244,9 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     void *cookie);
 
 /*
- * Read an entry into a buffer allocated by the caller.
+ * Read an entry into a buffer allocated by the caller.  If the buffer
+ * has room for all of it, the entry is inflated straight into it and
+ * its CRC checked.
  */
 bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
         char* buf, int bufLen);
@@ -170,14 +258,28 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
 bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry);
 
 /*
- * Inflate and write an entry to a file.
+ * Start reading in the first "maxLen" bytes of an entry's data, or all
+ * of it if that's less, without waiting for them.  Extracting it soon
+ * after then needn't wait for storage.
+ */
+void mzPrefetchZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
+        uint64_t maxLen);
+
+/*
+ * Inflate and write an entry to a file, at its current offset.  Stored
+ * entries are written straight from the mapping, or the read buffer, in
+ * large pieces, or copied within the kernel if the archive allows it
+ * (see mzSetZipArchiveKernelCopy()).  Unless it was copied by the
+ * kernel, the entry's CRC is checked on the way, so a false return may
+ * leave the file written but corrupt.
  */
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd);
 
 /*
  * Inflate and write an entry to a memory buffer, which must be long
- * enough to hold mzGetZipEntryUncomplen(pEntry) bytes.
+ * enough to hold mzGetZipEntryUncomplen(pEntry) bytes.  The entry's
+ * CRC is checked on the way.
  */
 bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char* buffer);
@@ -218,6 +320,19 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
         void (*callback)(const char *fn, void*), void *cookie,
         struct selabel_handle *sehnd);
 
+/*
+ * As mzExtractRecursive(), with up to numThreads threads (including
+ * the caller's) inflating and writing files at once.  Directories are
+ * all created first, in archive order, on the calling thread.  The
+ * callback is called for each file as it's finished, so not in archive
+ * order, but only one call is made at a time.
+ */
+bool mzExtractRecursiveParallel(const ZipArchive *pArchive,
+        const char *zipDir, const char *targetDir,
+        int flags, const struct utimbuf *timestamp,
+        void (*callback)(const char *fn, void*), void *cookie,
+        struct selabel_handle *sehnd, int numThreads);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host tool: convert a keys file written by DumpPublicKey into the
+// binary keystore that recovery loads at install time.
+//
+//   mkkeystore <keys> <keystore>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "keystore.h"
+
+void ui_print(const char* format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <keys> <keystore>\n", argv[0]);
+        return 2;
+    }
+
+    int num_keys;
+    Certificate* certs = load_keys(argv[1], &num_keys);
+    if (certs == NULL) {
+        fprintf(stderr, "failed to load keys from %s\n", argv[1]);
+        return 1;
+    }
+
+    uint8_t digest[SHA_DIGEST_SIZE];
+    if (!keys_file_digest(argv[1], digest)) {
+        fprintf(stderr, "failed to read %s\n", argv[1]);
+        return 1;
+    }
+
+    if (write_keystore(argv[2], certs, num_keys, digest) != 0) {
+        fprintf(stderr, "failed to write %s\n", argv[2]);
+        return 1;
+    }
+    return 0;
+}
@@ -97,7 +97,7 @@ static int verify_sod()
 }
 
 static int verify_eod(size_t actual_hash_datalen,
-        SHA1_CTX* actual_sha1_ctx, MD5_CTX* actual_md5_ctx)
+        SHA_CTX* actual_sha1_ctx, MD5_CTX* actual_md5_ctx)
 {
     int rc = -1;
     char eodbuf[PROP_LINE_LEN*10];
@@ -138,7 +138,7 @@ static int verify_eod(size_t actual_hash_datalen,
 
     int n;
     if (hash_name != NULL && !strcasecmp(hash_name, "sha1")) {
-        SHA1Final(digest, actual_sha1_ctx);
+        memcpy(digest, MH_SHA_final(actual_sha1_ctx), SHA1_DIGEST_LENGTH);
          for (n = 0; n < SHA1_DIGEST_LENGTH; ++n) {
              sprintf(hexdigest+2*n, "%02x", digest[n]);
          }
@@ -189,14 +189,14 @@ static int do_restore_tree(int sockfd)
     create_tar(compress, "r");
 
     size_t save_hash_datalen;
-    SHA1_CTX save_sha1_ctx;
+    SHA_CTX  save_sha1_ctx;
     MD5_CTX  save_md5_ctx;
 
     char cur_mount[PATH_MAX];
     cur_mount[0] = '\0';
     while (1) {
         save_hash_datalen = hash_datalen;
-        memcpy(&save_sha1_ctx, &sha1_ctx, sizeof(SHA1_CTX));
+        memcpy(&save_sha1_ctx, &sha1_ctx, sizeof(SHA_CTX));
         memcpy(&save_md5_ctx, &md5_ctx, sizeof(MD5_CTX));
         rc = th_read(tar);
         if (rc != 0) {
@@ -4,7 +4,10 @@ include $(CLEAR_VARS)
 
 # Build the unit tests.
 test_src_files := \
-    asn1_decoder_test.cpp
+    asn1_decoder_test.cpp \
+    dirutil_test.cpp \
+    keystore_test.cpp \
+    zip_test.cpp
 
 shared_libraries := \
     liblog \
@@ -13,7 +16,12 @@ shared_libraries := \
 static_libraries := \
     libgtest \
     libgtest_main \
-    libverifier
+    libverifier \
+    libminzip \
+    libminhash \
+    libmincrypt \
+    libselinux \
+    libz
 
 $(foreach file,$(test_src_files), \
     $(eval include $(CLEAR_VARS)) \
@@ -21,6 +29,6 @@ $(foreach file,$(test_src_files), \
     $(eval LOCAL_STATIC_LIBRARIES := $(static_libraries)) \
     $(eval LOCAL_SRC_FILES := $(file)) \
     $(eval LOCAL_MODULE := $(notdir $(file:%.cpp=%))) \
-    $(eval LOCAL_C_INCLUDES := $(LOCAL_PATH)/..) \
+    $(eval LOCAL_C_INCLUDES := $(LOCAL_PATH)/.. external/zlib) \
     $(eval include $(BUILD_NATIVE_TEST)) \
 )
\ No newline at end of file
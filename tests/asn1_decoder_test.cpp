@@ -43,6 +43,7 @@ TEST_F(Asn1DecoderTest, Empty_Failure) {
     size_t length;
     EXPECT_FALSE(asn1_oid_get(ctx, &junk, &length));
     EXPECT_FALSE(asn1_octet_string_get(ctx, &junk, &length));
+    EXPECT_FALSE(asn1_bit_string_get(ctx, &junk, &length));
 
     asn1_context_free(ctx);
 }
@@ -235,4 +236,43 @@ TEST_F(Asn1DecoderTest, OctetStringGet_Success) {
     asn1_context_free(ctx);
 }
 
+TEST_F(Asn1DecoderTest, BitStringGet_LengthZero_Failure) {
+    uint8_t data[] = { 0x03, 0x00, 0x55, };
+    asn1_context_t* ctx = asn1_context_new(data, sizeof(data));
+    uint8_t* string;
+    size_t length;
+    ASSERT_FALSE(asn1_bit_string_get(ctx, &string, &length));
+    asn1_context_free(ctx);
+}
+
+TEST_F(Asn1DecoderTest, BitStringGet_TooSmall_Failure) {
+    uint8_t data[] = { 0x03, 0x03, 0x00, 0xAA, };
+    asn1_context_t* ctx = asn1_context_new(data, sizeof(data));
+    uint8_t* string;
+    size_t length;
+    ASSERT_FALSE(asn1_bit_string_get(ctx, &string, &length));
+    asn1_context_free(ctx);
+}
+
+TEST_F(Asn1DecoderTest, BitStringGet_UnusedBits_Failure) {
+    uint8_t data[] = { 0x03, 0x02, 0x04, 0xA0, };
+    asn1_context_t* ctx = asn1_context_new(data, sizeof(data));
+    uint8_t* string;
+    size_t length;
+    ASSERT_FALSE(asn1_bit_string_get(ctx, &string, &length));
+    asn1_context_free(ctx);
+}
+
+TEST_F(Asn1DecoderTest, BitStringGet_Success) {
+    uint8_t data[] = { 0x03, 0x03, 0x00, 0xAA, 0x55, };
+    asn1_context_t* ctx = asn1_context_new(data, sizeof(data));
+    uint8_t* string;
+    size_t length;
+    ASSERT_TRUE(asn1_bit_string_get(ctx, &string, &length));
+    EXPECT_EQ(2U, length);
+    EXPECT_EQ(0xAAU, string[0]);
+    EXPECT_EQ(0x55U, string[1]);
+    asn1_context_free(ctx);
+}
+
 } // namespace android
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <string>
+
+#include "minzip/DirUtil.h"
+
+namespace android {
+
+class DirCacheTest : public testing::Test {
+  protected:
+    virtual void SetUp() {
+        const char* tmpdir = getenv("TMPDIR");
+        if (tmpdir == NULL) tmpdir = "/data/local/tmp";
+        root_ = std::string(tmpdir) + "/dirutil_test";
+        dirUnlinkHierarchy(root_.c_str());
+        ASSERT_EQ(0, mkdir(root_.c_str(), 0755));
+        cache_ = dirCacheCreate();
+        ASSERT_TRUE(cache_ != NULL);
+    }
+
+    virtual void TearDown() {
+        dirCacheFree(cache_);
+        dirUnlinkHierarchy(root_.c_str());
+    }
+
+    int Create(const std::string& path, bool strip,
+               const struct utimbuf* timestamp = NULL) {
+        std::string full = root_ + "/" + path;
+        return dirCacheCreateHierarchy(cache_, full.c_str(), 0755,
+                                       timestamp, strip, NULL);
+    }
+
+    bool IsDir(const std::string& path) {
+        struct stat st;
+        std::string full = root_ + "/" + path;
+        return stat(full.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    }
+
+    std::string root_;
+    DirCache* cache_;
+};
+
+TEST_F(DirCacheTest, CreatesParents) {
+    EXPECT_EQ(0, Create("a/b/c/file", true));
+    EXPECT_TRUE(IsDir("a/b/c"));
+    EXPECT_FALSE(IsDir("a/b/c/file"));
+    EXPECT_EQ(0, Create("a/b/d/", false));
+    EXPECT_TRUE(IsDir("a/b/d"));
+}
+
+TEST_F(DirCacheTest, SiblingsAndBacktracking) {
+    EXPECT_EQ(0, Create("a/b/c/d/f1", true));
+    EXPECT_EQ(0, Create("a/b/c/e/f2", true));
+    EXPECT_EQ(0, Create("a/x/f3", true));
+    EXPECT_EQ(0, Create("a//b///c/d/f4", true));
+    EXPECT_EQ(0, Create("b/f5", true));
+    EXPECT_TRUE(IsDir("a/b/c/d"));
+    EXPECT_TRUE(IsDir("a/b/c/e"));
+    EXPECT_TRUE(IsDir("a/x"));
+    EXPECT_TRUE(IsDir("b"));
+}
+
+TEST_F(DirCacheTest, AgreesWithUncached) {
+    std::string full = root_ + "/p/q/r/";
+    EXPECT_EQ(0, dirCreateHierarchy(full.c_str(), 0755, NULL, false, NULL));
+    EXPECT_EQ(0, Create("p/q/r/s/", false));
+    EXPECT_EQ(0, Create("p/q/file", true));
+    EXPECT_TRUE(IsDir("p/q/r/s"));
+}
+
+TEST_F(DirCacheTest, TimestampsNewDirectories) {
+    struct utimbuf timestamp = { 1217592000, 1217592000 };
+    EXPECT_EQ(0, Create("t/u/", false, &timestamp));
+    struct stat st;
+    ASSERT_EQ(0, stat((root_ + "/t/u").c_str(), &st));
+    EXPECT_EQ(1217592000, st.st_mtime);
+}
+
+TEST_F(DirCacheTest, FileInTheWay_Failure) {
+    EXPECT_EQ(0, Create("a/f", true));
+    int fd = creat((root_ + "/a/f").c_str(), 0644);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    EXPECT_EQ(-1, Create("a/f/g/h", true));
+    EXPECT_EQ(ENOTDIR, errno);
+    // The parents that did exist are still usable.
+    EXPECT_EQ(0, Create("a/g/h", true));
+    EXPECT_TRUE(IsDir("a/g"));
+}
+
+TEST_F(DirCacheTest, NoDirectoryPart_Failure) {
+    EXPECT_EQ(-1, dirCacheCreateHierarchy(cache_, "file", 0755, NULL, true, NULL));
+    EXPECT_EQ(-1, dirCacheCreateHierarchy(cache_, "", 0755, NULL, false, NULL));
+}
+
+} // namespace android
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "keystore.h"
+
+extern "C" void ui_print(const char* format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stdout, format, ap);
+    va_end(ap);
+}
+
+namespace android {
+
+class KeystoreTest : public testing::Test {
+  protected:
+    virtual void SetUp() {
+        const char* tmpdir = getenv("TMPDIR");
+        if (tmpdir == NULL) tmpdir = "/data/local/tmp";
+        snprintf(keys_file_, sizeof(keys_file_), "%s/keystore_test_keys", tmpdir);
+        snprintf(keystore_file_, sizeof(keystore_file_), "%s/keystore_test_store", tmpdir);
+    }
+
+    virtual void TearDown() {
+        unlink(keys_file_);
+        unlink(keystore_file_);
+    }
+
+    // Write a keys file in the DumpPublicKey format holding one RSA
+    // key (derived from seed) per hash, and one EC key.
+    void WriteKeys(uint32_t seed) {
+        FILE* f = fopen(keys_file_, "w");
+        ASSERT_TRUE(f != NULL);
+        for (int version = 2; version <= 4; version += 2) {
+            fprintf(f, "v%d {64,0x%x,{", version, seed);
+            for (int i = 0; i < 64; ++i) fprintf(f, "%s%u", i ? "," : "", seed * 7 + i);
+            fprintf(f, "},{");
+            for (int i = 0; i < 64; ++i) fprintf(f, "%s%u", i ? "," : "", seed * 13 + i);
+            fprintf(f, "}},\n");
+        }
+        fprintf(f, "v5 {32,{");
+        for (int i = 0; i < 32; ++i) fprintf(f, "%s%u", i ? "," : "", (seed + i) & 0xff);
+        fprintf(f, "},{");
+        for (int i = 0; i < 32; ++i) fprintf(f, "%s%u", i ? "," : "", (seed * 3 + i) & 0xff);
+        fprintf(f, "}}");
+        fclose(f);
+    }
+
+    void BuildKeystore() {
+        int num_keys;
+        Certificate* certs = load_keys(keys_file_, &num_keys);
+        ASSERT_TRUE(certs != NULL);
+        uint8_t digest[SHA_DIGEST_SIZE];
+        ASSERT_TRUE(keys_file_digest(keys_file_, digest));
+        ASSERT_EQ(0, write_keystore(keystore_file_, certs, num_keys, digest));
+        free(certs);
+    }
+
+    char keys_file_[256];
+    char keystore_file_[256];
+};
+
+// Find the certificate in certs with the same key and hash as cert.
+static const Certificate* find_same(const Certificate* certs, int num_keys,
+                                    const Certificate* cert) {
+    for (int i = 0; i < num_keys; ++i) {
+        if (certs[i].key_type != cert->key_type || certs[i].hash_len != cert->hash_len) {
+            continue;
+        }
+        if (cert->key_type == Certificate::RSA
+                ? memcmp(certs[i].rsa, cert->rsa, sizeof(RSAPublicKey)) == 0
+                : memcmp(certs[i].ec, cert->ec, sizeof(ECPublicKey)) == 0) {
+            return &certs[i];
+        }
+    }
+    return NULL;
+}
+
+TEST_F(KeystoreTest, RoundTrip) {
+    WriteKeys(1);
+    BuildKeystore();
+
+    int text_keys;
+    Certificate* text = load_keys(keys_file_, &text_keys);
+    ASSERT_TRUE(text != NULL);
+    int stored_keys;
+    Certificate* stored = load_keystore(keystore_file_, keys_file_, &stored_keys);
+    ASSERT_TRUE(stored != NULL);
+
+    ASSERT_EQ(3, text_keys);
+    ASSERT_EQ(text_keys, stored_keys);
+    for (int i = 0; i < text_keys; ++i) {
+        const Certificate* match = find_same(stored, stored_keys, &text[i]);
+        ASSERT_TRUE(match != NULL);
+        EXPECT_EQ(0, memcmp(match->fingerprint, text[i].fingerprint, SHA_DIGEST_SIZE));
+    }
+    // The two RSA entries share a key, so they share a fingerprint.
+    EXPECT_EQ(0, memcmp(text[0].fingerprint, text[1].fingerprint, SHA_DIGEST_SIZE));
+    EXPECT_NE(0, memcmp(text[0].fingerprint, text[2].fingerprint, SHA_DIGEST_SIZE));
+    for (int i = 1; i < stored_keys; ++i) {
+        EXPECT_LE(memcmp(stored[i-1].fingerprint, stored[i].fingerprint, SHA_DIGEST_SIZE), 0);
+    }
+
+    free(text);
+    free(stored);
+}
+
+TEST_F(KeystoreTest, StaleKeystoreIsIgnored) {
+    WriteKeys(1);
+    BuildKeystore();
+    WriteKeys(2);
+
+    int text_keys;
+    Certificate* text = load_keys(keys_file_, &text_keys);
+    ASSERT_TRUE(text != NULL);
+    int loaded_keys;
+    Certificate* loaded = load_keystore(keystore_file_, keys_file_, &loaded_keys);
+    ASSERT_TRUE(loaded != NULL);
+
+    ASSERT_EQ(text_keys, loaded_keys);
+    for (int i = 0; i < text_keys; ++i) {
+        EXPECT_TRUE(find_same(loaded, loaded_keys, &text[i]) != NULL);
+    }
+
+    free(text);
+    free(loaded);
+}
+
+TEST_F(KeystoreTest, CorruptKeystoreIsIgnored) {
+    WriteKeys(1);
+    BuildKeystore();
+    ASSERT_EQ(0, truncate(keystore_file_, 100));
+
+    int loaded_keys;
+    Certificate* loaded = load_keystore(keystore_file_, keys_file_, &loaded_keys);
+    ASSERT_TRUE(loaded != NULL);
+    EXPECT_EQ(3, loaded_keys);
+    free(loaded);
+}
+
+TEST_F(KeystoreTest, MissingKeysFile_Failure) {
+    int loaded_keys;
+    EXPECT_TRUE(load_keystore(keystore_file_, keys_file_, &loaded_keys) == NULL);
+}
+
+} // namespace android
@@ -0,0 +1,492 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "minzip/SysUtil.h"
+#include "minzip/Zip.h"
+#include "zlib.h"
+
+namespace android {
+
+static const uint64_t kFourGB = 1ULL << 32;
+
+static void put2(std::string* s, uint16_t v) {
+    s->push_back(v & 0xff);
+    s->push_back(v >> 8);
+}
+
+static void put4(std::string* s, uint32_t v) {
+    put2(s, v & 0xffff);
+    put2(s, v >> 16);
+}
+
+static void put8(std::string* s, uint64_t v) {
+    put4(s, v & 0xffffffff);
+    put4(s, v >> 32);
+}
+
+struct TestEntry {
+    const char* name;
+    std::string data;
+    bool deflate;
+};
+
+// How to lay out the archive WriteZip() builds.
+struct ZipLayout {
+    bool zip64;             // Zip64 sizes, offsets and EOCD
+    bool locator;           // write the Zip64 EOCD locator
+    uint64_t pad;           // size of a stored entry of zeros to put first
+    uint64_t comp_len;      // if nonzero, claimed in place of the real compressed size
+};
+
+static std::string raw_deflate(const std::string& data) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    deflateInit2(&zs, 9, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    std::string out(deflateBound(&zs, data.size()), '\0');
+    zs.next_in = (Bytef*) data.data();
+    zs.avail_in = data.size();
+    zs.next_out = (Bytef*) &out[0];
+    zs.avail_out = out.size();
+    deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return out;
+}
+
+// The CRC of len zero bytes, a multiple of 64K, without a pass over them.
+static uint32_t zeros_crc(uint64_t len) {
+    static const unsigned char zeros[65536] = { 0 };
+    uint32_t block = crc32(0, zeros, sizeof(zeros));
+    uint64_t block_len = sizeof(zeros);
+    uint32_t crc = crc32(0, NULL, 0);
+    for (uint64_t n = len / sizeof(zeros); n != 0; n >>= 1) {
+        if (n & 1) crc = crc32_combine(crc, block, block_len);
+        block = crc32_combine(block, block, block_len);
+        block_len *= 2;
+    }
+    return crc;
+}
+
+class ZipTest : public testing::Test {
+  protected:
+    virtual void SetUp() {
+        const char* tmpdir = getenv("TMPDIR");
+        if (tmpdir == NULL) tmpdir = "/data/local/tmp";
+        snprintf(zip_file_, sizeof(zip_file_), "%s/zip_test.zip", tmpdir);
+        snprintf(out_file_, sizeof(out_file_), "%s/zip_test.out", tmpdir);
+        snprintf(index_file_, sizeof(index_file_), "%s/zip_test.index", tmpdir);
+        map_.addr = NULL;
+        reader_ = NULL;
+        memset(&zip_, 0, sizeof(zip_));
+    }
+
+    virtual void TearDown() {
+        mzCloseZipArchive(&zip_);
+        if (map_.addr != NULL) sysReleaseMap(&map_);
+        sysReaderClose(reader_);
+        unlink(zip_file_);
+        unlink(out_file_);
+        unlink(index_file_);
+    }
+
+    // Append one entry's local header to f and its central directory
+    // record to cd.  If data is NULL, the entry is size zeros, left as a
+    // hole in the file.
+    bool WriteEntry(FILE* f, std::string* cd, uint64_t* pos, const char* name,
+                    const std::string* data, uint64_t size, bool deflate,
+                    const ZipLayout& layout) {
+        std::string stored;
+        uint32_t crc;
+        if (data != NULL) {
+            stored = deflate ? raw_deflate(*data) : *data;
+            crc = crc32(0, (const Bytef*) data->data(), data->size());
+        } else {
+            crc = zeros_crc(size);
+        }
+        uint64_t length = data != NULL ? stored.size() : size;
+        uint64_t comp_len = layout.comp_len ? layout.comp_len : length;
+        uint16_t name_len = strlen(name);
+
+        std::string local;
+        put4(&local, 0x04034b50);
+        put2(&local, 45);
+        put2(&local, 0);
+        put2(&local, deflate ? 8 : 0);
+        put4(&local, 0);
+        put4(&local, crc);
+        put4(&local, layout.zip64 ? 0xffffffff : length);
+        put4(&local, layout.zip64 ? 0xffffffff : size);
+        put2(&local, name_len);
+        put2(&local, layout.zip64 ? 20 : 0);
+        local.append(name);
+        if (layout.zip64) {
+            put2(&local, 0x0001);
+            put2(&local, 16);
+            put8(&local, size);
+            put8(&local, length);
+        }
+
+        put4(cd, 0x02014b50);
+        put2(cd, (3 << 8) | 45);
+        put2(cd, 45);
+        put2(cd, 0);
+        put2(cd, deflate ? 8 : 0);
+        put4(cd, 0);
+        put4(cd, crc);
+        put4(cd, layout.zip64 ? 0xffffffff : comp_len);
+        put4(cd, layout.zip64 ? 0xffffffff : size);
+        put2(cd, name_len);
+        put2(cd, layout.zip64 ? 28 : 0);
+        put2(cd, 0);
+        put2(cd, 0);
+        put2(cd, 0);
+        put4(cd, 0100644 << 16);
+        put4(cd, layout.zip64 ? 0xffffffff : *pos);
+        cd->append(name);
+        if (layout.zip64) {
+            put2(cd, 0x0001);
+            put2(cd, 24);
+            put8(cd, size);
+            put8(cd, comp_len);
+            put8(cd, *pos);
+        }
+
+        if (fwrite(local.data(), 1, local.size(), f) != local.size()) return false;
+        if (data != NULL) {
+            if (fwrite(stored.data(), 1, stored.size(), f) != stored.size()) return false;
+        } else if (fseeko(f, size, SEEK_CUR) != 0) {
+            return false;
+        }
+        *pos += local.size() + length;
+        return true;
+    }
+
+    // Write entries to zip_file_ as layout says.
+    bool WriteZip(const std::vector<TestEntry>& entries, const ZipLayout& layout) {
+        FILE* f = fopen(zip_file_, "w");
+        if (f == NULL) return false;
+
+        std::string cd;
+        uint64_t pos = 0;
+        size_t count = entries.size();
+        bool ok = true;
+        if (layout.pad != 0) {
+            ok = WriteEntry(f, &cd, &pos, "pad", NULL, layout.pad, false, layout);
+            count++;
+        }
+        for (size_t i = 0; ok && i < entries.size(); ++i) {
+            const TestEntry& e = entries[i];
+            ok = WriteEntry(f, &cd, &pos, e.name, &e.data, e.data.size(), e.deflate, layout);
+        }
+        if (!ok) {
+            fclose(f);
+            return false;
+        }
+
+        std::string end;
+        uint64_t cd_offset = pos;
+        uint64_t record_offset = cd_offset + cd.size();
+        if (layout.zip64) {
+            put4(&end, 0x06064b50);
+            put8(&end, 44);
+            put2(&end, 45);
+            put2(&end, 45);
+            put4(&end, 0);
+            put4(&end, 0);
+            put8(&end, count);
+            put8(&end, count);
+            put8(&end, cd.size());
+            put8(&end, cd_offset);
+            if (layout.locator) {
+                put4(&end, 0x07064b50);
+                put4(&end, 0);
+                put8(&end, record_offset);
+                put4(&end, 1);
+            }
+        }
+        put4(&end, 0x06054b50);
+        put2(&end, 0);
+        put2(&end, 0);
+        put2(&end, layout.zip64 ? 0xffff : count);
+        put2(&end, layout.zip64 ? 0xffff : count);
+        put4(&end, layout.zip64 ? 0xffffffff : cd.size());
+        put4(&end, layout.zip64 ? 0xffffffff : cd_offset);
+        put2(&end, 0);
+
+        ok = fwrite(cd.data(), 1, cd.size(), f) == cd.size() &&
+                  fwrite(end.data(), 1, end.size(), f) == end.size();
+        return fclose(f) == 0 && ok;
+    }
+
+    int OpenZip() {
+        if (sysMapFile(zip_file_, &map_) != 0) {
+            map_.addr = NULL;
+            return -1;
+        }
+        return mzOpenZipArchive(map_.addr, map_.length, &zip_);
+    }
+
+    int OpenZipReader() {
+        reader_ = sysReaderOpen(zip_file_);
+        if (reader_ == NULL) return -1;
+        return mzOpenZipArchiveReader(reader_, &zip_);
+    }
+
+    // Check that entry e reads back right every way there is to read it.
+    void ExpectEntry(const TestEntry& e) {
+        const ZipEntry* entry = mzFindZipEntry(&zip_, e.name);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(e.data.size(), mzGetZipEntryUncompLen(entry));
+        EXPECT_TRUE(mzIsZipEntryIntact(&zip_, entry));
+
+        std::string buffer(e.data.size(), '\0');
+        ASSERT_TRUE(mzExtractZipEntryToBuffer(&zip_, entry, (unsigned char*) &buffer[0]));
+        EXPECT_TRUE(buffer == e.data);
+
+        int fd = open(out_file_, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        ASSERT_NE(-1, fd);
+        ASSERT_TRUE(mzExtractZipEntryToFile(&zip_, entry, fd));
+        std::string written(e.data.size(), '\0');
+        EXPECT_EQ((ssize_t) written.size(), pread(fd, &written[0], written.size(), 0));
+        close(fd);
+        EXPECT_TRUE(written == e.data);
+    }
+
+    std::vector<TestEntry> Entries() {
+        std::vector<TestEntry> entries;
+        TestEntry small = { "a.txt", "hello, zip64\n", false };
+        TestEntry large = { "dir/b.bin", std::string(), true };
+        // Random, so that even deflated it's read in several pieces.
+        uint32_t x = 1;
+        for (int i = 0; i < 400000; ++i) {
+            x = x * 1103515245 + 12345;
+            large.data.push_back(x >> 24);
+        }
+        entries.push_back(small);
+        entries.push_back(large);
+        return entries;
+    }
+
+    char zip_file_[256];
+    char out_file_[256];
+    char index_file_[256];
+    MemMapping map_;
+    SysReader* reader_;
+    ZipArchive zip_;
+};
+
+TEST_F(ZipTest, ClassicArchive) {
+    std::vector<TestEntry> entries = Entries();
+    ZipLayout layout = { false, false, 0, 0 };
+    ASSERT_TRUE(WriteZip(entries, layout));
+    ASSERT_EQ(0, OpenZip());
+    ASSERT_EQ(2U, mzZipEntryCount(&zip_));
+    for (size_t i = 0; i < entries.size(); ++i) ExpectEntry(entries[i]);
+}
+
+TEST_F(ZipTest, Zip64Archive) {
+    std::vector<TestEntry> entries = Entries();
+    ZipLayout layout = { true, true, 0, 0 };
+    ASSERT_TRUE(WriteZip(entries, layout));
+    ASSERT_EQ(0, OpenZip());
+    ASSERT_EQ(2U, mzZipEntryCount(&zip_));
+    for (size_t i = 0; i < entries.size(); ++i) ExpectEntry(entries[i]);
+}
+
+TEST_F(ZipTest, Zip64Index) {
+    std::vector<TestEntry> entries = Entries();
+    ZipLayout layout = { true, true, 0, 0 };
+    ASSERT_TRUE(WriteZip(entries, layout));
+    ASSERT_EQ(0, OpenZip());
+
+    int fd = open(index_file_, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_NE(-1, fd);
+    ASSERT_TRUE(mzWriteZipIndex(&zip_, fd));
+    mzCloseZipArchive(&zip_);
+    ASSERT_EQ(0, lseek(fd, 0, SEEK_SET));
+    ASSERT_EQ(0, mzOpenZipArchiveWithIndex(map_.addr, map_.length, fd, &zip_));
+    close(fd);
+    for (size_t i = 0; i < entries.size(); ++i) ExpectEntry(entries[i]);
+}
+
+TEST_F(ZipTest, EntriesPast4GB) {
+    if (sizeof(void*) < 8) {
+        printf("a 32-bit process can't map a package this large; skipping\n");
+        return;
+    }
+    std::vector<TestEntry> entries = Entries();
+    ZipLayout layout = { true, true, kFourGB, 0 };
+    ASSERT_TRUE(WriteZip(entries, layout));
+    ASSERT_EQ(0, OpenZip());
+    ASSERT_EQ(3U, mzZipEntryCount(&zip_));
+    const ZipEntry* entry = mzFindZipEntry(&zip_, "a.txt");
+    ASSERT_TRUE(entry != NULL);
+    EXPECT_GT(mzGetZipEntryOffset(entry), kFourGB);
+    for (size_t i = 0; i < entries.size(); ++i) ExpectEntry(entries[i]);
+}
+
+TEST_F(ZipTest, ReaderArchive) {
+    std::vector<TestEntry> entries = Entries();
+    ZipLayout layout = { true, true, 0, 0 };
+    ASSERT_TRUE(WriteZip(entries, layout));
+    ASSERT_EQ(0, OpenZipReader());
+    ASSERT_EQ(2U, mzZipEntryCount(&zip_));
+    for (size_t i = 0; i < entries.size(); ++i) ExpectEntry(entries[i]);
+}
+
+// An index written from an archive that isn't mapped opens one that is.
+TEST_F(ZipTest, ReaderIndex) {
+    std::vector<TestEntry> entries = Entries();
+    ZipLayout layout = { true, true, 0, 0 };
+    ASSERT_TRUE(WriteZip(entries, layout));
+    ASSERT_EQ(0, OpenZipReader());
+
+    int fd = open(index_file_, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_NE(-1, fd);
+    ASSERT_TRUE(mzWriteZipIndex(&zip_, fd));
+    mzCloseZipArchive(&zip_);
+    ASSERT_EQ(0, lseek(fd, 0, SEEK_SET));
+    ASSERT_EQ(0, sysMapFile(zip_file_, &map_));
+    ASSERT_EQ(0, mzOpenZipArchiveWithIndex(map_.addr, map_.length, fd, &zip_));
+    close(fd);
+    for (size_t i = 0; i < entries.size(); ++i) ExpectEntry(entries[i]);
+}
+
+// So does one that isn't, as the updater reads a block-mapped package.
+TEST_F(ZipTest, ReaderIndex_Unmapped) {
+    std::vector<TestEntry> entries = Entries();
+    ZipLayout layout = { true, true, 0, 0 };
+    ASSERT_TRUE(WriteZip(entries, layout));
+    ASSERT_EQ(0, OpenZipReader());
+
+    int fd = open(index_file_, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_NE(-1, fd);
+    ASSERT_TRUE(mzWriteZipIndex(&zip_, fd));
+    mzCloseZipArchive(&zip_);
+    ASSERT_EQ(0, lseek(fd, 0, SEEK_SET));
+    ASSERT_EQ(0, mzOpenZipArchiveReaderWithIndex(reader_, fd, &zip_));
+    close(fd);
+    ASSERT_EQ(2U, mzZipEntryCount(&zip_));
+    for (size_t i = 0; i < entries.size(); ++i) ExpectEntry(entries[i]);
+}
+
+// Nothing is mapped, so this works even in a 32-bit process.
+TEST_F(ZipTest, ReaderEntriesPast4GB) {
+    std::vector<TestEntry> entries = Entries();
+    ZipLayout layout = { true, true, kFourGB, 0 };
+    ASSERT_TRUE(WriteZip(entries, layout));
+    ASSERT_EQ(0, OpenZipReader());
+    ASSERT_EQ(3U, mzZipEntryCount(&zip_));
+    for (size_t i = 0; i < entries.size(); ++i) ExpectEntry(entries[i]);
+}
+
+// Even with the archive's fd to hand, a stored entry is written from
+// user space with its CRC checked unless the kernel copy is asked for.
+TEST_F(ZipTest, StoredEntryCrc_Failure) {
+    std::vector<TestEntry> entries = Entries();
+    ZipLayout layout = { false, false, 0, 0 };
+    ASSERT_TRUE(WriteZip(entries, layout));
+    ASSERT_EQ(0, OpenZip());
+    const ZipEntry* entry = mzFindZipEntry(&zip_, "a.txt");
+    ASSERT_TRUE(entry != NULL);
+    uint64_t offset = mzGetZipEntryOffset(entry);
+    mzCloseZipArchive(&zip_);
+    sysReleaseMap(&map_);
+    map_.addr = NULL;
+
+    int zip_fd = open(zip_file_, O_RDWR);
+    ASSERT_NE(-1, zip_fd);
+    ASSERT_EQ(1, pwrite(zip_fd, "J", 1, offset));
+    ASSERT_EQ(0, OpenZip());
+    mzSetZipArchiveFd(&zip_, zip_fd);
+    entry = mzFindZipEntry(&zip_, "a.txt");
+    ASSERT_TRUE(entry != NULL);
+
+    int fd = open(out_file_, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_NE(-1, fd);
+    EXPECT_FALSE(mzExtractZipEntryToFile(&zip_, entry, fd));
+    close(fd);
+    close(zip_fd);
+}
+
+// With the kernel copy asked for, stored entries are copied that way.
+TEST_F(ZipTest, KernelCopy) {
+    std::vector<TestEntry> entries = Entries();
+    ZipLayout layout = { false, false, 0, 0 };
+    ASSERT_TRUE(WriteZip(entries, layout));
+    ASSERT_EQ(0, OpenZip());
+    int zip_fd = open(zip_file_, O_RDONLY);
+    ASSERT_NE(-1, zip_fd);
+    mzSetZipArchiveFd(&zip_, zip_fd);
+    mzSetZipArchiveKernelCopy(&zip_, true);
+    for (size_t i = 0; i < entries.size(); ++i) ExpectEntry(entries[i]);
+    close(zip_fd);
+}
+
+// A name that's in the archive twice is extracted once, from its last
+// copy, however many threads there are.
+TEST_F(ZipTest, DuplicateEntries) {
+    std::vector<TestEntry> entries = Entries();
+    entries[0].name = "dir/a.txt";
+    TestEntry dup = { "dir/b.bin", "the last copy\n", false };
+    entries.push_back(dup);
+    ZipLayout layout = { false, false, 0, 0 };
+    ASSERT_TRUE(WriteZip(entries, layout));
+    ASSERT_EQ(0, OpenZip());
+
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s.dir", zip_file_);
+    std::string file = std::string(dir) + "/b.bin";
+    for (int threads = 1; threads <= 4; threads *= 4) {
+        mkdir(dir, 0755);
+        ASSERT_TRUE(mzExtractRecursiveParallel(&zip_, "dir", dir, 0, NULL, NULL, NULL,
+                                               NULL, threads));
+        std::string written(64, '\0');
+        int fd = open(file.c_str(), O_RDONLY);
+        ASSERT_NE(-1, fd);
+        written.resize(read(fd, &written[0], written.size()));
+        close(fd);
+        EXPECT_TRUE(written == dup.data) << threads << " threads";
+        unlink(file.c_str());
+        unlink((std::string(dir) + "/a.txt").c_str());
+        rmdir(dir);
+    }
+}
+
+TEST_F(ZipTest, MissingZip64Locator_Failure) {
+    ZipLayout layout = { true, false, 0, 0 };
+    ASSERT_TRUE(WriteZip(Entries(), layout));
+    EXPECT_NE(0, OpenZip());
+}
+
+TEST_F(ZipTest, Zip64SizePastEnd_Failure) {
+    ZipLayout layout = { true, true, 0, kFourGB * 3 };
+    ASSERT_TRUE(WriteZip(Entries(), layout));
+    EXPECT_NE(0, OpenZip());
+}
+
+} // namespace android
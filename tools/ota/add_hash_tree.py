@@ -0,0 +1,205 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2015 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Add a signed hash tree to an OTA package that already carries a
+whole-file signature, so recovery can verify it chunk by chunk (see
+hash_tree.h for the format).
+
+usage: add_hash_tree.py [-c chunk_size] [-s] <key.pk8> <input.zip> <output.zip>
+
+  -c  chunk size in bytes (default: the smallest power of two from
+      1MB up whose leaf hashes fit in the archive comment)
+  -s  sign the root with SHA-256 rather than SHA-1; the key's entry in
+      res/keys must say the same.  EC keys always use SHA-256.
+
+Needs the openssl command-line tool.
+"""
+
+import getopt
+import hashlib
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+MAGIC = b"RHASHTR1"
+HEADER_SIZE = 44
+LEAF_SIZE = 32
+FOOTER_SIZE = 6
+EOCD_HEADER_SIZE = 22
+EOCD_MAGIC = b"PK\x05\x06"
+MAX_COMMENT_SIZE = 0xffff
+MIN_CHUNK_SIZE = 1024 * 1024
+MAX_CHUNK_SIZE = 16 * 1024 * 1024
+# Room to leave for the root signature: a 4096-bit RSA signature, which
+# is larger than any P-256 ECDSA one.
+MAX_SIGNATURE_SIZE = 512
+
+
+def die(msg):
+  sys.stderr.write("add_hash_tree: %s\n" % msg)
+  sys.exit(1)
+
+
+def openssl(args, data=None):
+  p = subprocess.Popen(["openssl"] + args, stdin=subprocess.PIPE,
+                       stdout=subprocess.PIPE)
+  out, _ = p.communicate(data)
+  if p.returncode != 0:
+    die("openssl %s failed" % args[0])
+  return out
+
+
+def der_element(data, pos):
+  """Return (tag, start of contents, end of contents) of the DER
+  element at data[pos]."""
+  tag = bytearray(data[pos:pos + 1])[0]
+  length = bytearray(data[pos + 1:pos + 2])[0]
+  pos += 2
+  if length & 0x80:
+    n = length & 0x7f
+    length = 0
+    for b in bytearray(data[pos:pos + n]):
+      length = (length << 8) | b
+    pos += n
+  return tag, pos, pos + length
+
+
+def key_fingerprint(spki):
+  """SHA-1 of the subjectPublicKey BIT STRING in a DER
+  SubjectPublicKeyInfo, as recovery's Certificate::fingerprint."""
+  _, pos, _ = der_element(spki, 0)           # SubjectPublicKeyInfo
+  _, _, pos = der_element(spki, pos)         # skip AlgorithmIdentifier
+  tag, start, end = der_element(spki, pos)   # subjectPublicKey
+  if tag != 0x03 or bytearray(spki[start:start + 1])[0] != 0:
+    die("unexpected SubjectPublicKeyInfo")
+  return hashlib.sha1(spki[start + 1:end]).digest()
+
+
+class Key(object):
+  def __init__(self, pk8_file):
+    self.pem = openssl(["pkcs8", "-inform", "DER", "-nocrypt", "-in", pk8_file])
+    text = openssl(["pkey", "-noout", "-text"], self.pem)
+    self.is_ec = b"ASN1 OID" in text or b"NIST CURVE" in text
+    spki = openssl(["pkey", "-pubout", "-outform", "DER"], self.pem)
+    self.fingerprint = key_fingerprint(spki)
+
+  def sign(self, digest, hash_name):
+    f = tempfile.NamedTemporaryFile(delete=False)
+    try:
+      f.write(self.pem)
+      f.close()
+      args = ["pkeyutl", "-sign", "-inkey", f.name]
+      if not self.is_ec:
+        args += ["-pkeyopt", "digest:" + hash_name]
+      return openssl(args, digest)
+    finally:
+      os.unlink(f.name)
+
+
+def choose_chunk_size(signed_len, room):
+  chunk_size = MIN_CHUNK_SIZE
+  while chunk_size <= MAX_CHUNK_SIZE:
+    num_chunks = (signed_len + chunk_size - 1) // chunk_size
+    if num_chunks * LEAF_SIZE <= room:
+      return chunk_size
+    chunk_size *= 2
+  die("package is too large for a hash tree")
+
+
+def main(argv):
+  try:
+    opts, args = getopt.getopt(argv, "c:s")
+  except getopt.GetoptError as e:
+    die(str(e))
+  chunk_size = None
+  hash_name = "sha1"
+  for o, a in opts:
+    if o == "-c":
+      chunk_size = int(a, 0)
+    elif o == "-s":
+      hash_name = "sha256"
+  if len(args) != 3:
+    sys.stderr.write(__doc__)
+    sys.exit(2)
+  key_file, input_file, output_file = args
+
+  with open(input_file, "rb") as f:
+    data = f.read()
+
+  footer = bytearray(data[-FOOTER_SIZE:])
+  if len(data) < FOOTER_SIZE or footer[2] != 0xff or footer[3] != 0xff:
+    die("%s has no whole-file signature" % input_file)
+  signature_start = footer[0] | (footer[1] << 8)
+  comment_size = footer[4] | (footer[5] << 8)
+  eocd = len(data) - comment_size - EOCD_HEADER_SIZE
+  if eocd < 0 or data[eocd:eocd + 4] != EOCD_MAGIC or signature_start > comment_size:
+    die("%s has a malformed footer" % input_file)
+  signed_len = eocd + EOCD_HEADER_SIZE - 2
+  comment = data[eocd + EOCD_HEADER_SIZE:]
+  # Whatever comment the signing tool left ahead of the signature is
+  # kept, after the tree; recovery only looks at the start.  If there's
+  # already a tree, it's replaced.
+  prefix = comment[:comment_size - signature_start]
+  if prefix.startswith(MAGIC):
+    num_chunks, = struct.unpack("<I", prefix[12:16])
+    end = HEADER_SIZE + num_chunks * LEAF_SIZE
+    size, = struct.unpack("<I", prefix[end:end + 4])
+    prefix = prefix[end + 4 + size:]
+  signature_block = comment[comment_size - signature_start:]
+
+  key = Key(key_file)
+  if key.is_ec:
+    hash_name = "sha256"
+
+  room = (MAX_COMMENT_SIZE - len(prefix) - len(signature_block) - HEADER_SIZE -
+          4 - MAX_SIGNATURE_SIZE)
+  if chunk_size is None:
+    chunk_size = choose_chunk_size(signed_len, room)
+  if chunk_size <= 0 or chunk_size > MAX_CHUNK_SIZE:
+    die("chunk size must be between 1 and %d" % MAX_CHUNK_SIZE)
+  num_chunks = (signed_len + chunk_size - 1) // chunk_size
+  if num_chunks * LEAF_SIZE > room:
+    die("%d chunks don't fit in the comment; use a larger chunk size" % num_chunks)
+
+  tree = [MAGIC, struct.pack("<IIQ", chunk_size, num_chunks, signed_len),
+          key.fingerprint]
+  for offset in range(0, signed_len, chunk_size):
+    end = min(offset + chunk_size, signed_len)
+    tree.append(hashlib.sha256(data[offset:end]).digest())
+  tree = b"".join(tree)
+
+  root = hashlib.new(hash_name, tree).digest()
+  signature = key.sign(root, hash_name)
+  block = tree + struct.pack("<I", len(signature)) + signature
+
+  new_comment = block + prefix + signature_block[:-2]
+  new_size = struct.pack("<H", len(new_comment) + 2)
+  output = (data[:eocd + EOCD_HEADER_SIZE - 2] + new_size + new_comment +
+            new_size)
+  if output.find(EOCD_MAGIC, eocd + 4) >= 0:
+    # Recovery rejects packages with a second EOCD marker after the
+    # real one, since minzip might find it instead.
+    die("hash tree contains an EOCD marker; try another chunk size")
+  with open(output_file, "wb") as f:
+    f.write(output)
+  sys.stderr.write("%d chunks of %d bytes; %s-signed root\n" %
+                   (num_chunks, chunk_size, hash_name))
+
+
+if __name__ == "__main__":
+  main(sys.argv[1:])
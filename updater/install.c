@@ -40,10 +40,11 @@
 #include "cutils/misc.h"
 #include "cutils/properties.h"
 #include "edify/expr.h"
-#include "mincrypt/sha.h"
+#include "minhash/sha.h"
 #include "minzip/DirUtil.h"
 #include "mtdutils/mounts.h"
 #include "mtdutils/mtdutils.h"
+#include "prefetch.h"
 #include "updater.h"
 
 #include <dirent.h>
@@ -55,6 +56,10 @@ static int totalbaks = 0;
 #include "make_ext4fs.h"
 #endif
 
+// Upper bound on threads package_extract_dir() inflates files on.
+// Beyond this the writes, not the inflating, are what limit it.
+#define MAX_EXTRACT_THREADS 4
+
 // mount(fs_type, partition_type, location, mount_point)
 //
 //    fs_type="yaffs2" partition_type="MTD"     location=partition
@@ -406,14 +411,20 @@ Value* PackageExtractDirFn(const char* name, State* state,
     char* dest_path;
     if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
 
-    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    ZipArchive* za = ui->package_zip;
+    PrefetchAdvance(ui->prefetch, zip_path);
 
     // To create a consistent system image, never use the clock for timestamps.
     struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
-    bool success = mzExtractRecursive(za, zip_path, dest_path,
-                                      MZ_EXTRACT_FILES_ONLY, &timestamp,
-                                      NULL, NULL, sehandle);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > 0 ? cpus : 1;
+    if (threads > MAX_EXTRACT_THREADS) threads = MAX_EXTRACT_THREADS;
+
+    bool success = mzExtractRecursiveParallel(za, zip_path, dest_path,
+                                              MZ_EXTRACT_FILES_ONLY, &timestamp,
+                                              NULL, NULL, sehandle, threads);
     free(zip_path);
     free(dest_path);
     return StringValue(strdup(success ? "t" : ""));
@@ -439,7 +450,9 @@ Value* PackageExtractFileFn(const char* name, State* state,
         char* dest_path;
         if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
 
-        ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+        UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+        ZipArchive* za = ui->package_zip;
+        PrefetchAdvance(ui->prefetch, zip_path);
         const ZipEntry* entry = mzFindZipEntry(za, zip_path);
         if (entry == NULL) {
             printf("%s: no %s in package\n", name, zip_path);
@@ -471,13 +484,20 @@ Value* PackageExtractFileFn(const char* name, State* state,
 
         if (ReadArgs(state, argv, 1, &zip_path) < 0) return NULL;
 
-        ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+        UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+        ZipArchive* za = ui->package_zip;
+        PrefetchAdvance(ui->prefetch, zip_path);
         const ZipEntry* entry = mzFindZipEntry(za, zip_path);
         if (entry == NULL) {
             printf("%s: no %s in package\n", name, zip_path);
             goto done1;
         }
 
+        // A Zip64 entry can be larger than this process can hold.
+        if (mzGetZipEntryUncompLen(entry) > SIZE_MAX / 2) {
+            printf("%s: %s is too large to read into memory\n", name, zip_path);
+            goto done1;
+        }
         v->size = mzGetZipEntryUncompLen(entry);
         v->data = malloc(v->size);
         if (v->data == NULL) {
@@ -1367,7 +1387,7 @@ Value* Sha1CheckFn(const char* name, State* state, int argc, Expr* argv[]) {
         return StringValue(strdup(""));
     }
     uint8_t digest[SHA_DIGEST_SIZE];
-    SHA_hash(args[0]->data, args[0]->size, digest);
+    MH_SHA_hash(args[0]->data, args[0]->size, digest);
     FreeValue(args[0]);
 
     if (argc == 1) {
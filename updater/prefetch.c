@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "prefetch.h"
+
+// How much compressed data to have in flight ahead of the entry being
+// extracted.  Enough to cover the flash writes of a typical step,
+// little enough not to push the step's own pages out of the cache.
+#define PREFETCH_BYTES (32 * 1024 * 1024)
+
+// One package_extract_file() or package_extract_dir() call in the
+// script, covering items [start, end).
+typedef struct {
+    char* name;
+    int start;
+    int end;
+} PrefetchStep;
+
+struct Prefetch {
+    ZipArchive* za;
+
+    PrefetchStep* steps;
+    int step_count;
+    int step_alloc;
+
+    // Every entry the steps extract, in order, with the total
+    // compressed length of the items before each one.
+    const ZipEntry** items;
+    uint64_t* before;
+    int item_count;
+    int item_alloc;
+
+    int cursor;       // first step not yet reached
+    int next_item;    // first item not yet prefetched
+};
+
+// Returns -1 if out of memory.
+static int AddItem(Prefetch* pf, const ZipEntry* entry) {
+    if (pf->item_count >= pf->item_alloc) {
+        int alloc = pf->item_alloc ? pf->item_alloc * 2 : 64;
+        const ZipEntry** items = realloc(pf->items, alloc * sizeof(items[0]));
+        if (items == NULL) return -1;
+        pf->items = items;
+        // One more for the total after the last item.
+        uint64_t* before = realloc(pf->before, (alloc + 1) * sizeof(before[0]));
+        if (before == NULL) return -1;
+        pf->before = before;
+        pf->item_alloc = alloc;
+    }
+    pf->before[pf->item_count + 1] =
+        pf->before[pf->item_count] + entry->compLen;
+    pf->items[pf->item_count++] = entry;
+    return 0;
+}
+
+// Returns -1 if out of memory.
+static int AddStep(Prefetch* pf, const char* name, int dir) {
+    if (pf->step_count >= pf->step_alloc) {
+        int alloc = pf->step_alloc ? pf->step_alloc * 2 : 16;
+        PrefetchStep* steps = realloc(pf->steps, alloc * sizeof(steps[0]));
+        if (steps == NULL) return -1;
+        pf->steps = steps;
+        pf->step_alloc = alloc;
+    }
+    char* step_name = strdup(name);
+    if (step_name == NULL) return -1;
+    PrefetchStep* step = pf->steps + pf->step_count++;
+    step->name = step_name;
+    step->start = pf->item_count;
+
+    if (!dir) {
+        const ZipEntry* entry = mzFindZipEntry(pf->za, name);
+        if (entry != NULL && AddItem(pf, entry) != 0) {
+            return -1;
+        }
+    } else {
+        // Look the directory up the way mzExtractRecursiveParallel()
+        // will, with a trailing slash unless it names the whole package.
+        size_t len = strlen(name);
+        char* prefix = malloc(len + 2);
+        if (prefix == NULL) return -1;
+        strcpy(prefix, name);
+        if (len > 0 && name[len-1] != '/') {
+            strcpy(prefix + len, "/");
+        }
+        unsigned int first;
+        unsigned int n = mzFindZipEntriesWithPrefix(pf->za, prefix, &first);
+        unsigned int i;
+        free(prefix);
+        for (i = 0; i < n; ++i) {
+            if (AddItem(pf, mzGetZipEntryAt(pf->za, first + i)) != 0) {
+                return -1;
+            }
+        }
+    }
+    step->end = pf->item_count;
+    return 0;
+}
+
+// Arguments are evaluated before the function they are passed to, so
+// visit them first.  Both arms of an if() are visited; we can't tell
+// which one will run.  Returns -1 if out of memory.
+static int ScanExpr(Prefetch* pf, Expr* expr,
+                    Function extract_file, Function extract_dir) {
+    int i;
+    for (i = 0; i < expr->argc; ++i) {
+        if (ScanExpr(pf, expr->argv[i], extract_file, extract_dir) != 0) {
+            return -1;
+        }
+    }
+    if (expr->argc < 1 || expr->argv[0]->fn != Literal) return 0;
+    if (extract_file != NULL && expr->fn == extract_file) {
+        return AddStep(pf, expr->argv[0]->name, 0);
+    } else if (extract_dir != NULL && expr->fn == extract_dir) {
+        return AddStep(pf, expr->argv[0]->name, 1);
+    }
+    return 0;
+}
+
+// Start reading items from next_item onward, until PREFETCH_BYTES
+// past the end of step are in flight.
+static void Issue(Prefetch* pf, const PrefetchStep* step) {
+    uint64_t base = pf->before[step->end];
+    int i = pf->next_item > step->end ? pf->next_item : step->end;
+    for (; i < pf->item_count; ++i) {
+        uint64_t ahead = pf->before[i] - base;
+        if (ahead >= PREFETCH_BYTES) break;
+        mzPrefetchZipEntry(pf->za, pf->items[i], PREFETCH_BYTES - ahead);
+    }
+    if (i > pf->next_item) {
+        pf->next_item = i;
+    }
+}
+
+Prefetch* PrefetchCreate(Expr* root, ZipArchive* za) {
+    // Prefetching is only a hint; if we can't set it up, go without.
+    Prefetch* pf = calloc(1, sizeof(Prefetch));
+    if (pf == NULL) {
+        printf("prefetch: out of memory; not prefetching\n");
+        return NULL;
+    }
+    pf->za = za;
+    pf->before = calloc(1, sizeof(pf->before[0]));
+    if (pf->before == NULL ||
+        ScanExpr(pf, root, FindFunction("package_extract_file"),
+                 FindFunction("package_extract_dir")) != 0) {
+        printf("prefetch: out of memory; not prefetching\n");
+        PrefetchFree(pf);
+        return NULL;
+    }
+    if (pf->item_count == 0) {
+        PrefetchFree(pf);
+        return NULL;
+    }
+
+    // Nothing is being extracted yet; get the first step going.
+    PrefetchStep start = { NULL, 0, 0 };
+    Issue(pf, &start);
+    return pf;
+}
+
+void PrefetchAdvance(Prefetch* pf, const char* zip_path) {
+    if (pf == NULL) return;
+
+    // Usually this is the step at the cursor; a skipped if() arm moves
+    // us further along.  Failing that, the script may be going back
+    // over something it already extracted.
+    int i;
+    for (i = pf->cursor; i < pf->step_count; ++i) {
+        if (strcmp(pf->steps[i].name, zip_path) == 0) break;
+    }
+    if (i == pf->step_count) {
+        for (i = 0; i < pf->cursor; ++i) {
+            if (strcmp(pf->steps[i].name, zip_path) == 0) break;
+        }
+        if (i == pf->cursor) return;
+    }
+    pf->cursor = i + 1;
+    Issue(pf, pf->steps + i);
+}
+
+void PrefetchFree(Prefetch* pf) {
+    if (pf == NULL) return;
+    int i;
+    for (i = 0; i < pf->step_count; ++i) {
+        free(pf->steps[i].name);
+    }
+    free(pf->steps);
+    free(pf->items);
+    free(pf->before);
+    free(pf);
+}
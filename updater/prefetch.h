@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_PREFETCH_H_
+#define _UPDATER_PREFETCH_H_
+
+#include "edify/expr.h"
+#include "minzip/Zip.h"
+
+typedef struct Prefetch Prefetch;
+
+// Scan the parsed script for the package entries it extracts, in the
+// order it will extract them, and start reading in the first of them.
+// Only entries named by a string literal can be found this way.
+// Returns NULL if the script extracts nothing we can see.
+Prefetch* PrefetchCreate(Expr* root, ZipArchive* za);
+
+// Called as the script starts extracting zip_path: read ahead the
+// entries that come after it, while this one is written out.
+void PrefetchAdvance(Prefetch* pf, const char* zip_path);
+
+void PrefetchFree(Prefetch* pf);
+
+#endif
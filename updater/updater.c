@@ -14,13 +14,17 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "edify/expr.h"
 #include "updater.h"
 #include "install.h"
+#include "prefetch.h"
 #include "minzip/Zip.h"
 #include "minzip/SysUtil.h"
 
@@ -68,18 +72,64 @@ int main(int argc, char** argv) {
 
     const char* package_filename = argv[3];
     MemMapping map;
-    if (sysMapFile(package_filename, &map) != 0) {
-        printf("failed to map package %s\n", argv[3]);
-        return 3;
+    SysReader* reader = NULL;
+    // Keep an ordinary package open, so that stored entries can be
+    // copied out of it by the kernel.
+    int package_fd = -1;
+    if (package_filename[0] == '@') {
+        // A block map ('@') is read with pread(), a run of blocks at a
+        // time; mapping it would take an mmap() per extent.  There's no
+        // single file to copy from.
+        reader = sysReaderOpen(package_filename);
+        if (reader == NULL) {
+            printf("failed to open package %s\n", argv[3]);
+            return 3;
+        }
+    } else {
+        package_fd = open(package_filename, O_RDONLY);
+        if (package_fd < 0) {
+            printf("failed to open package %s: %s\n", argv[3], strerror(errno));
+            return 3;
+        }
+        // A package too large for our address space is read with pread()
+        // instead; only its central directory is then kept in memory.
+        if (sysMapFD(package_fd, &map) != 0) {
+            map.addr = NULL;
+            reader = sysReaderOpenFd(package_fd);
+            if (reader == NULL) {
+                printf("failed to map package %s\n", argv[3]);
+                return 3;
+            }
+            printf("can't map package %s; reading it instead\n", argv[3]);
+        }
     }
     ZipArchive za;
-    int err;
-    err = mzOpenZipArchive(map.addr, map.length, &za);
+    int err = -1;
+
+    // Recovery may have left us the entry table it already parsed.
+    const char* zip_index = getenv("UPDATER_ZIP_INDEX");
+    if (zip_index != NULL) {
+        int index_fd = open(zip_index, O_RDONLY);
+        if (index_fd >= 0) {
+            err = reader != NULL ? mzOpenZipArchiveReaderWithIndex(reader, index_fd, &za)
+                                 : mzOpenZipArchiveWithIndex(map.addr, map.length, index_fd, &za);
+            close(index_fd);
+        }
+        if (err != 0) {
+            printf("can't use zip index %s; parsing package\n", zip_index);
+        }
+        unsetenv("UPDATER_ZIP_INDEX");
+    }
+    if (err != 0) {
+        err = reader != NULL ? mzOpenZipArchiveReader(reader, &za)
+                             : mzOpenZipArchive(map.addr, map.length, &za);
+    }
     if (err != 0) {
         printf("failed to open package %s: %s\n",
                argv[3], strerror(err));
         return 3;
     }
+    mzSetZipArchiveFd(&za, package_fd);
 
     const ZipEntry* script_entry = mzFindZipEntry(&za, SCRIPT_NAME);
     if (script_entry == NULL) {
@@ -128,6 +178,7 @@ int main(int argc, char** argv) {
     updater_info.cmd_pipe = cmd_pipe;
     updater_info.package_zip = &za;
     updater_info.version = atoi(version);
+    updater_info.prefetch = PrefetchCreate(root, &za);
 
     State state;
     state.cookie = &updater_info;
@@ -155,10 +206,18 @@ int main(int argc, char** argv) {
         free(result);
     }
 
+    PrefetchFree(updater_info.prefetch);
     if (updater_info.package_zip) {
         mzCloseZipArchive(updater_info.package_zip);
     }
-    sysReleaseMap(&map);
+    if (reader != NULL) {
+        sysReaderClose(reader);
+    } else {
+        sysReleaseMap(&map);
+    }
+    if (package_fd >= 0) {
+        close(package_fd);
+    }
     free(script);
 
     return 0;
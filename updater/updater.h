@@ -27,6 +27,7 @@ typedef struct {
     FILE* cmd_pipe;
     ZipArchive* package_zip;
     int version;
+    struct Prefetch* prefetch;
 } UpdaterInfo;
 
 extern struct selabel_handle *sehandle;
@@ -16,6 +16,8 @@
 
 #include "asn1_decoder.h"
 #include "common.h"
+#include "digest_engine.h"
+#include "hash_tree.h"
 #include "ui.h"
 #include "verifier.h"
 
@@ -25,10 +27,14 @@
 #include "mincrypt/rsa.h"
 #include "mincrypt/sha.h"
 #include "mincrypt/sha256.h"
+#include "minhash/sha.h"
+#include "minzip/SysUtil.h"
 
-#include <string.h>
-#include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 extern RecoveryUI* ui;
 
@@ -104,38 +110,115 @@ static bool read_pkcs7(uint8_t* pkcs7_der, size_t pkcs7_der_len, uint8_t** sig_d
     return *sig_der != NULL;
 }
 
-// Look for an RSA signature embedded in the .ZIP file comment given
-// the path to the zip.  Verify it matches one of the given public
-// keys.
-//
-// Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
-// or no key matches the signature).
+/*
+ * Compute the fingerprint (see Certificate::fingerprint) of the key in
+ * the first certificate of the PKCS#7 CertificateSet, which the signing
+ * tools fill with the signer's own certificate:
+ *
+ *   SEQUENCE (ContentInfo)
+ *     OID (ContentType)
+ *     [0] (content)
+ *       SEQUENCE (SignedData)
+ *         INTEGER (version CMSVersion)
+ *         SET (DigestAlgorithmIdentifiers)
+ *         SEQUENCE (EncapsulatedContentInfo)
+ *         [0] (CertificateSet)
+ *           SEQUENCE (Certificate)
+ *             SEQUENCE (TBSCertificate)
+ *               [0] (version OPTIONAL)
+ *               INTEGER (serialNumber)
+ *               SEQUENCE (signature AlgorithmIdentifier)
+ *               SEQUENCE (issuer Name)
+ *               SEQUENCE (validity)
+ *               SEQUENCE (subject Name)
+ *               SEQUENCE (SubjectPublicKeyInfo)
+ *                 SEQUENCE (algorithm AlgorithmIdentifier)
+ *                 BIT STRING (subjectPublicKey)
+ *
+ * This only picks which key to try first; the signature itself is
+ * what gets verified.
+ */
+static bool read_signer_fingerprint(uint8_t* pkcs7_der, size_t pkcs7_der_len,
+        uint8_t* fingerprint) {
+    // Every context opened on the way down, freed together at the end.
+    asn1_context_t* ctx[8] = { NULL };
+    uint8_t* key;
+    size_t key_len;
+
+    bool found = (ctx[0] = asn1_context_new(pkcs7_der, pkcs7_der_len)) != NULL
+            && (ctx[1] = asn1_sequence_get(ctx[0])) != NULL
+            && asn1_sequence_next(ctx[1])
+            && (ctx[2] = asn1_constructed_get(ctx[1])) != NULL
+            && (ctx[3] = asn1_sequence_get(ctx[2])) != NULL
+            && asn1_sequence_next(ctx[3])
+            && asn1_sequence_next(ctx[3])
+            && asn1_sequence_next(ctx[3])
+            && (ctx[4] = asn1_constructed_get(ctx[3])) != NULL
+            && asn1_constructed_type(ctx[4]) == 0
+            && (ctx[5] = asn1_sequence_get(ctx[4])) != NULL
+            && (ctx[6] = asn1_sequence_get(ctx[5])) != NULL
+            && asn1_constructed_skip_all(ctx[6])
+            && asn1_sequence_next(ctx[6])
+            && asn1_sequence_next(ctx[6])
+            && asn1_sequence_next(ctx[6])
+            && asn1_sequence_next(ctx[6])
+            && asn1_sequence_next(ctx[6])
+            && (ctx[7] = asn1_sequence_get(ctx[6])) != NULL
+            && asn1_sequence_next(ctx[7])
+            && asn1_bit_string_get(ctx[7], &key, &key_len);
+    if (found) {
+        MH_SHA_hash(key, key_len, fingerprint);
+    }
 
-int verify_file(unsigned char* addr, size_t length,
-                const Certificate* pKeys, unsigned int numKeys) {
-    ui->SetProgress(0.0);
+    for (size_t i = 0; i < sizeof(ctx) / sizeof(ctx[0]); ++i) {
+        asn1_context_free(ctx[i]);
+    }
+    return found;
+}
 
-    // An archive with a whole-file signature will end in six bytes:
-    //
-    //   (2-byte signature start) $ff $ff (2-byte comment size)
-    //
-    // (As far as the ZIP format is concerned, these are part of the
-    // archive comment.)  We start by reading this footer, this tells
-    // us how far back from the end we have to start reading to find
-    // the whole comment.
+// An archive with a whole-file signature will end in six bytes:
+//
+//   (2-byte signature start) $ff $ff (2-byte comment size)
+//
+// (As far as the ZIP format is concerned, these are part of the
+// archive comment.)  We start by reading this footer, this tells
+// us how far back from the end we have to start reading to find
+// the whole comment.
 
 #define FOOTER_SIZE 6
+#define EOCD_HEADER_SIZE 22
 
-    if (length < FOOTER_SIZE) {
+// The most of the end of the file parse_footer() can need: the EOCD
+// record plus the largest possible comment.
+#define MAX_TAIL_SIZE (EOCD_HEADER_SIZE + 0xffff)
+
+// Hash in large blocks; each digest runs on its own thread, so this
+// costs about as much as the slowest one alone.
+#define BUFFER_SIZE (1024 * 1024)
+
+// How far ahead of the hashing verify_file() keeps a mapped package
+// coming in from storage.
+#define READAHEAD_WINDOW (8 * BUFFER_SIZE)
+
+// Check the footer and EOCD of a package that is length bytes long.
+// tail holds the last tail_len bytes of the package.  On success,
+// stores how many leading bytes of the package the signature covers,
+// where the signature block sits within tail, and where the rest of
+// the comment (which may hold a hash tree) does.
+static bool parse_footer(const unsigned char* tail, size_t tail_len, size_t length,
+                         size_t* signed_len, const unsigned char** signature,
+                         size_t* signature_size, const unsigned char** comment,
+                         size_t* comment_len) {
+    if (length < FOOTER_SIZE || tail_len < FOOTER_SIZE) {
         LOGE("not big enough to contain footer\n");
-        return VERIFY_FAILURE;
+        return false;
     }
 
-    unsigned char* footer = addr + length - FOOTER_SIZE;
+    const unsigned char* footer = tail + tail_len - FOOTER_SIZE;
 
     if (footer[2] != 0xff || footer[3] != 0xff) {
         LOGE("footer is wrong\n");
-        return VERIFY_FAILURE;
+        return false;
     }
 
     size_t comment_size = footer[4] + (footer[5] << 8);
@@ -145,34 +228,32 @@ int verify_file(unsigned char* addr, size_t length,
 
     if (signature_start <= FOOTER_SIZE) {
         LOGE("Signature start is in the footer");
-        return VERIFY_FAILURE;
+        return false;
     }
 
-#define EOCD_HEADER_SIZE 22
-
     // The end-of-central-directory record is 22 bytes plus any
     // comment length.
     size_t eocd_size = comment_size + EOCD_HEADER_SIZE;
 
-    if (length < eocd_size) {
+    if (length < eocd_size || tail_len < eocd_size) {
         LOGE("not big enough to contain EOCD\n");
-        return VERIFY_FAILURE;
+        return false;
     }
 
     // Determine how much of the file is covered by the signature.
     // This is everything except the signature data and length, which
     // includes all of the EOCD except for the comment length field (2
     // bytes) and the comment data.
-    size_t signed_len = length - eocd_size + EOCD_HEADER_SIZE - 2;
+    *signed_len = length - eocd_size + EOCD_HEADER_SIZE - 2;
 
-    unsigned char* eocd = addr + length - eocd_size;
+    const unsigned char* eocd = tail + tail_len - eocd_size;
 
     // If this is really is the EOCD record, it will begin with the
     // magic number $50 $4b $05 $06.
     if (eocd[0] != 0x50 || eocd[1] != 0x4b ||
         eocd[2] != 0x05 || eocd[3] != 0x06) {
         LOGE("signature length doesn't match EOCD marker\n");
-        return VERIFY_FAILURE;
+        return false;
     }
 
     size_t i;
@@ -184,62 +265,126 @@ int verify_file(unsigned char* addr, size_t length,
             // which could be exploitable.  Fail verification if
             // this sequence occurs anywhere after the real one.
             LOGE("EOCD marker occurs after start of EOCD\n");
-            return VERIFY_FAILURE;
+            return false;
         }
     }
 
-#define BUFFER_SIZE 4096
+    if (signature_start > eocd_size) {
+        LOGE("signature start is before the EOCD\n");
+        return false;
+    }
+
+    *signature = eocd + eocd_size - signature_start;
+    *signature_size = signature_start - FOOTER_SIZE;
+    *comment = eocd + EOCD_HEADER_SIZE;
+    *comment_len = comment_size > signature_start ? comment_size - signature_start : 0;
+    return true;
+}
 
-    bool need_sha1 = false;
-    bool need_sha256 = false;
-    for (i = 0; i < numKeys; ++i) {
+// Return the DigestEngine mask covering every hash the keys use.
+static int digests_for_keys(const Certificate* pKeys, unsigned int numKeys) {
+    int digests = 0;
+    for (unsigned int i = 0; i < numKeys; ++i) {
         switch (pKeys[i].hash_len) {
-            case SHA_DIGEST_SIZE: need_sha1 = true; break;
-            case SHA256_DIGEST_SIZE: need_sha256 = true; break;
+            case SHA_DIGEST_SIZE: digests |= DigestEngine::SHA1; break;
+            case SHA256_DIGEST_SIZE: digests |= DigestEngine::SHA256; break;
         }
     }
+    return digests;
+}
 
-    SHA_CTX sha1_ctx;
-    SHA256_CTX sha256_ctx;
-    SHA_init(&sha1_ctx);
-    SHA256_init(&sha256_ctx);
+// Fill order with the indices of all the keys, those whose fingerprint
+// matches signer first, so that normally only one key is ever tried;
+// the rest keep their original order.  signer may be NULL if it isn't
+// known.  Returns how many keys it named.
+static size_t order_keys(const uint8_t* signer, const Certificate* pKeys,
+                         unsigned int numKeys, size_t* order) {
+    size_t num_named = 0;
+    for (size_t i = 0; i < numKeys; ++i) {
+        if (signer != NULL && memcmp(pKeys[i].fingerprint, signer, SHA_DIGEST_SIZE) == 0) {
+            order[num_named++] = i;
+        }
+    }
+    for (size_t i = 0, k = num_named; i < numKeys; ++i) {
+        if (signer == NULL || memcmp(pKeys[i].fingerprint, signer, SHA_DIGEST_SIZE) != 0) {
+            order[k++] = i;
+        }
+    }
+    return num_named;
+}
 
-    double frac = -1.0;
-    size_t so_far = 0;
-    while (so_far < signed_len) {
-        size_t size = signed_len - so_far;
-        if (size > BUFFER_SIZE) size = BUFFER_SIZE;
+// Check that sig_der is key i's signature of hash, which must be the
+// digest the key calls for.
+static bool check_key(const Certificate* key, size_t i, const uint8_t* sig_der,
+                      size_t sig_der_length, const uint8_t* hash) {
+    if (key->key_type == Certificate::RSA) {
+        if (sig_der_length < RSANUMBYTES) {
+            // "signature" block isn't big enough to contain an RSA block.
+            LOGI("signature is too short for RSA key %zu\n", i);
+            return false;
+        }
 
-        if (need_sha1) SHA_update(&sha1_ctx, addr + so_far, size);
-        if (need_sha256) SHA256_update(&sha256_ctx, addr + so_far, size);
-        so_far += size;
+        if (!RSA_verify(key->rsa, sig_der, RSANUMBYTES, hash, key->hash_len)) {
+            LOGI("failed to verify against RSA key %zu\n", i);
+            return false;
+        }
+        return true;
+    } else if (key->key_type == Certificate::EC
+            && key->hash_len == SHA256_DIGEST_SIZE) {
+        p256_int r, s;
+        if (!dsa_sig_unpack(const_cast<uint8_t*>(sig_der), sig_der_length, &r, &s)) {
+            LOGI("Not a DSA signature block for EC key %zu\n", i);
+            return false;
+        }
 
-        double f = so_far / (double)signed_len;
-        if (f > frac + 0.02 || size == so_far) {
-            ui->SetProgress(f);
-            frac = f;
+        p256_int p256_hash;
+        p256_from_bin(hash, &p256_hash);
+        if (!p256_ecdsa_verify(&(key->ec->x), &(key->ec->y), &p256_hash, &r, &s)) {
+            LOGI("failed to verify against EC key %zu\n", i);
+            return false;
         }
+        return true;
     }
+    LOGI("Unknown key type %d\n", key->key_type);
+    return false;
+}
 
-    const uint8_t* sha1 = SHA_final(&sha1_ctx);
-    const uint8_t* sha256 = SHA256_final(&sha256_ctx);
+static const char* key_type_name(const Certificate* key) {
+    return key->key_type == Certificate::RSA ? "RSA" : "EC";
+}
 
+// Check the PKCS#7 signature block against each of the given keys,
+// using whichever of the finished digests the key calls for.
+static int verify_signature(const unsigned char* signature, size_t signature_size,
+                            const uint8_t* sha1, const uint8_t* sha256,
+                            const Certificate* pKeys, unsigned int numKeys) {
     uint8_t* sig_der = NULL;
     size_t sig_der_length = 0;
 
-    size_t signature_size = signature_start - FOOTER_SIZE;
-    if (!read_pkcs7(eocd + eocd_size - signature_start, signature_size, &sig_der,
+    if (!read_pkcs7(const_cast<uint8_t*>(signature), signature_size, &sig_der,
             &sig_der_length)) {
         LOGE("Could not find signature DER block\n");
         return VERIFY_FAILURE;
     }
 
+    size_t* order = (size_t*)malloc(numKeys * sizeof(size_t));
+    if (order == NULL) {
+        free(sig_der);
+        return VERIFY_FAILURE;
+    }
+    uint8_t signer[SHA_DIGEST_SIZE];
+    bool have_signer = read_signer_fingerprint(const_cast<uint8_t*>(signature),
+                                               signature_size, signer);
+    size_t num_named = order_keys(have_signer ? signer : NULL, pKeys, numKeys, order);
+    LOGI("signer's certificate names %zu of %u key(s)\n", num_named, numKeys);
+
     /*
      * Check to make sure at least one of the keys matches the signature. Since
      * any key can match, we need to try each before determining a verification
      * failure has happened.
      */
-    for (i = 0; i < numKeys; ++i) {
+    for (size_t k = 0; k < numKeys; ++k) {
+        size_t i = order[k];
         const uint8_t* hash;
         switch (pKeys[i].hash_len) {
             case SHA_DIGEST_SIZE: hash = sha1; break;
@@ -247,215 +392,349 @@ int verify_file(unsigned char* addr, size_t length,
             default: continue;
         }
 
-        // The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that
-        // the signing tool appends after the signature itself.
-        if (pKeys[i].key_type == Certificate::RSA) {
-            if (sig_der_length < RSANUMBYTES) {
-                // "signature" block isn't big enough to contain an RSA block.
-                LOGI("signature is too short for RSA key %zu\n", i);
-                continue;
-            }
-
-            if (!RSA_verify(pKeys[i].rsa, sig_der, RSANUMBYTES,
-                            hash, pKeys[i].hash_len)) {
-                LOGI("failed to verify against RSA key %zu\n", i);
-                continue;
-            }
-
-            LOGI("whole-file signature verified against RSA key %zu\n", i);
-            free(sig_der);
-            return VERIFY_SUCCESS;
-        } else if (pKeys[i].key_type == Certificate::EC
-                && pKeys[i].hash_len == SHA256_DIGEST_SIZE) {
-            p256_int r, s;
-            if (!dsa_sig_unpack(sig_der, sig_der_length, &r, &s)) {
-                LOGI("Not a DSA signature block for EC key %zu\n", i);
-                continue;
-            }
-
-            p256_int p256_hash;
-            p256_from_bin(hash, &p256_hash);
-            if (!p256_ecdsa_verify(&(pKeys[i].ec->x), &(pKeys[i].ec->y),
-                                   &p256_hash, &r, &s)) {
-                LOGI("failed to verify against EC key %zu\n", i);
-                continue;
-            }
-
-            LOGI("whole-file signature verified against EC key %zu\n", i);
+        if (check_key(&pKeys[i], i, sig_der, sig_der_length, hash)) {
+            LOGI("whole-file signature verified against %s key %zu\n",
+                 key_type_name(&pKeys[i]), i);
+            free(order);
             free(sig_der);
             return VERIFY_SUCCESS;
-        } else {
-            LOGI("Unknown key type %d\n", pKeys[i].key_type);
         }
     }
+    free(order);
     free(sig_der);
     LOGE("failed to verify whole-file signature\n");
     return VERIFY_FAILURE;
 }
 
-// Reads a file containing one or more public keys as produced by
-// DumpPublicKey:  this is an RSAPublicKey struct as it would appear
-// as a C source literal, eg:
-//
-//  "{64,0xc926ad21,{1795090719,...,-695002876},{-857949815,...,1175080310}}"
-//
-// For key versions newer than the original 2048-bit e=3 keys
-// supported by Android, the string is preceded by a version
-// identifier, eg:
-//
-//  "v2 {64,0xc926ad21,{1795090719,...,-695002876},{-857949815,...,1175080310}}"
-//
-// (Note that the braces and commas in this example are actual
-// characters the parser expects to find in the file; the ellipses
-// indicate more numbers omitted from this example.)
-//
-// The file may contain multiple keys in this format, separated by
-// commas.  The last key must not be followed by a comma.
-//
-// A Certificate is a pair of an RSAPublicKey and a particular hash
-// (we support SHA-1 and SHA-256; we store the hash length to signify
-// which is being used).  The hash used is implied by the version number.
-//
-//       1: 2048-bit RSA key with e=3 and SHA-1 hash
-//       2: 2048-bit RSA key with e=65537 and SHA-1 hash
-//       3: 2048-bit RSA key with e=3 and SHA-256 hash
-//       4: 2048-bit RSA key with e=65537 and SHA-256 hash
-//       5: 256-bit EC key using the NIST P-256 curve parameters and SHA-256 hash
+static void set_progress(double fraction) {
+    ui->SetProgress(fraction);
+}
+
+// Returned by verify_hash_tree() when the package can't be checked by
+// its hash tree, and the whole-file signature must be used instead.
+#define VERIFY_WHOLE_FILE (-1)
+
+// If the comment bytes ahead of the whole-file signature start with a
+// hash tree (see hash_tree.h) over the signed_len bytes the whole-file
+// signature covers, and one of the keys signed its root, check the
+// package chunk by chunk instead of as a whole.  Chunks are read from
+// addr if it isn't NULL and through reader otherwise.  Returns VERIFY_SUCCESS
+// or VERIFY_FAILURE from the chunks, or VERIFY_WHOLE_FILE.
+static int verify_hash_tree(const unsigned char* block, size_t block_size, size_t signed_len,
+                            const unsigned char* addr, const SysReader* reader,
+                            const Certificate* pKeys, unsigned int numKeys) {
+    HashTree* tree = HashTree::Parse(block, block_size);
+    if (tree == NULL) {
+        return VERIFY_WHOLE_FILE;
+    }
+    if (tree->data_size() != signed_len) {
+        LOGW("hash tree covers %llu bytes, not %zu; ignoring it\n",
+             (unsigned long long)tree->data_size(), signed_len);
+        delete tree;
+        return VERIFY_WHOLE_FILE;
+    }
+
+    size_t* order = (size_t*)malloc(numKeys * sizeof(size_t));
+    if (order == NULL) {
+        delete tree;
+        return VERIFY_WHOLE_FILE;
+    }
+    order_keys(tree->fingerprint(), pKeys, numKeys, order);
+
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+    MH_SHA_hash(tree->signed_data(), tree->signed_size(), sha1);
+    MH_SHA256_hash(tree->signed_data(), tree->signed_size(), sha256);
+
+    bool trusted = false;
+    for (size_t k = 0; k < numKeys && !trusted; ++k) {
+        size_t i = order[k];
+        const uint8_t* hash;
+        switch (pKeys[i].hash_len) {
+            case SHA_DIGEST_SIZE: hash = sha1; break;
+            case SHA256_DIGEST_SIZE: hash = sha256; break;
+            default: continue;
+        }
+        if (check_key(&pKeys[i], i, tree->signature(), tree->signature_size(), hash)) {
+            LOGI("hash tree verified against %s key %zu\n", key_type_name(&pKeys[i]), i);
+            trusted = true;
+        }
+    }
+    free(order);
+
+    int result = VERIFY_WHOLE_FILE;
+    if (!trusted) {
+        LOGW("hash tree isn't signed by any key; checking whole file\n");
+    } else {
+        LOGI("checking %zu chunk(s) of %zu bytes\n", tree->num_chunks(), tree->chunk_size());
+        result = tree->VerifyAll(addr, reader, set_progress) ? VERIFY_SUCCESS : VERIFY_FAILURE;
+        if (result != VERIFY_SUCCESS) {
+            LOGE("package doesn't match its hash tree\n");
+        }
+    }
+    delete tree;
+    return result;
+}
+
+// Look for an RSA signature embedded in the .ZIP file comment given
+// the path to the zip.  Verify it matches one of the given public
+// keys.
 //
-// Returns NULL if the file failed to parse, or if it contain zero keys.
-Certificate*
-load_keys(const char* filename, int* numKeys) {
-    Certificate* out = NULL;
-    *numKeys = 0;
+// Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
+// or no key matches the signature).
+
+int verify_file(unsigned char* addr, size_t length,
+                const Certificate* pKeys, unsigned int numKeys) {
+    ui->SetProgress(0.0);
+
+    size_t signed_len;
+    const unsigned char* signature;
+    size_t signature_size;
+    const unsigned char* comment;
+    size_t comment_len;
+    if (!parse_footer(addr, length, length, &signed_len, &signature, &signature_size,
+                      &comment, &comment_len)) {
+        return VERIFY_FAILURE;
+    }
 
-    FILE* f = fopen(filename, "r");
-    if (f == NULL) {
-        LOGE("opening %s: %s\n", filename, strerror(errno));
-        goto exit;
+    int result = verify_hash_tree(comment, comment_len, signed_len, addr, NULL, pKeys, numKeys);
+    if (result != VERIFY_WHOLE_FILE) {
+        return result;
     }
 
+    DigestEngine engine(digests_for_keys(pKeys, numKeys));
+    SysReadahead* readahead = sysReadaheadStart(addr, signed_len, READAHEAD_WINDOW, false);
+
+    double frac = -1.0;
+    size_t so_far = 0;
+    while (so_far < signed_len) {
+        size_t size = signed_len - so_far;
+        if (size > BUFFER_SIZE) size = BUFFER_SIZE;
+
+        sysReadaheadSetCursor(readahead, so_far);
+        engine.Update(addr + so_far, size);
+        so_far += size;
+
+        double f = so_far / (double)signed_len;
+        if (f > frac + 0.02 || size == so_far) {
+            ui->SetProgress(f);
+            frac = f;
+        }
+    }
+
+    sysReadaheadStop(readahead);
+    engine.Final();
+    return verify_signature(signature, signature_size, engine.sha1(), engine.sha256(),
+                            pKeys, numKeys);
+}
+
+// Reads one block at a time on a helper thread, so the next block of
+// the package is coming off the disk while the current one is hashed.
+class BlockReader {
+  public:
+    explicit BlockReader(const SysReader* reader)
+        : reader_(reader), buf_(NULL), len_(0), offset_(0), busy_(false), ok_(true),
+          error_(0), exiting_(false), started_(false) {
+        pthread_mutex_init(&mutex_, NULL);
+        pthread_cond_init(&cond_, NULL);
+        started_ = pthread_create(&thread_, NULL, ThreadMain, this) == 0;
+    }
+
+    ~BlockReader() {
+        pthread_mutex_lock(&mutex_);
+        exiting_ = true;
+        pthread_cond_broadcast(&cond_);
+        pthread_mutex_unlock(&mutex_);
+        if (started_) pthread_join(thread_, NULL);
+        pthread_cond_destroy(&cond_);
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    // Begin reading len bytes at offset into buf.
+    void Start(unsigned char* buf, size_t len, off64_t offset) {
+        if (!started_) {
+            // No helper thread; read synchronously instead.
+            ok_ = sysReaderRead(reader_, buf, len, offset);
+            error_ = ok_ ? 0 : errno;
+            return;
+        }
+        pthread_mutex_lock(&mutex_);
+        buf_ = buf;
+        len_ = len;
+        offset_ = offset;
+        busy_ = true;
+        pthread_cond_broadcast(&cond_);
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    // Wait for the read begun by Start(); returns false if it failed,
+    // with the errno of the failed read in *error.
+    bool Wait(int* error) {
+        pthread_mutex_lock(&mutex_);
+        while (busy_) {
+            pthread_cond_wait(&cond_, &mutex_);
+        }
+        bool ok = ok_;
+        *error = error_;
+        pthread_mutex_unlock(&mutex_);
+        return ok;
+    }
+
+  private:
+    static void* ThreadMain(void* cookie) {
+        BlockReader* reader = reinterpret_cast<BlockReader*>(cookie);
+        pthread_mutex_lock(&reader->mutex_);
+        while (true) {
+            while (!reader->exiting_ && !reader->busy_) {
+                pthread_cond_wait(&reader->cond_, &reader->mutex_);
+            }
+            if (reader->exiting_) {
+                break;
+            }
+            unsigned char* buf = reader->buf_;
+            size_t len = reader->len_;
+            off64_t offset = reader->offset_;
+            pthread_mutex_unlock(&reader->mutex_);
+
+            bool ok = sysReaderRead(reader->reader_, buf, len, offset);
+            int error = ok ? 0 : errno;
+
+            pthread_mutex_lock(&reader->mutex_);
+            reader->ok_ = ok;
+            reader->error_ = error;
+            reader->busy_ = false;
+            pthread_cond_broadcast(&reader->cond_);
+        }
+        pthread_mutex_unlock(&reader->mutex_);
+        return NULL;
+    }
+
+    const SysReader* reader_;
+    unsigned char* buf_;
+    size_t len_;
+    off64_t offset_;
+    bool busy_;
+    bool ok_;
+    int error_;             // errno of the last read, if it failed
+    bool exiting_;
+    bool started_;
+    pthread_t thread_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t cond_;
+};
+
+// Like verify_file(), but reads the package through reader instead of
+// needing all of it mapped.  The signed region is streamed through
+// two BUFFER_SIZE buffers, so memory use doesn't depend on the size
+// of the package.
+int verify_file_reader(const SysReader* reader, const Certificate* pKeys,
+                       unsigned int numKeys) {
+    ui->SetProgress(0.0);
+
+    size_t length = sysReaderLength(reader);
+    if ((off64_t)length != sysReaderLength(reader)) {
+        LOGE("package is too large (%lld bytes)\n", (long long)sysReaderLength(reader));
+        return VERIFY_FAILURE;
+    }
+
+    size_t tail_len = length < MAX_TAIL_SIZE ? length : MAX_TAIL_SIZE;
+    unsigned char* tail = (unsigned char*)malloc(tail_len);
+    unsigned char* buffers[2];
+    buffers[0] = (unsigned char*)malloc(BUFFER_SIZE);
+    buffers[1] = (unsigned char*)malloc(BUFFER_SIZE);
+    int result = VERIFY_FAILURE;
+
+    size_t signed_len;
+    const unsigned char* signature;
+    size_t signature_size;
+    const unsigned char* comment;
+    size_t comment_len;
+
+    if (tail == NULL || buffers[0] == NULL || buffers[1] == NULL) {
+        LOGE("failed to allocate verification buffers\n");
+        goto done;
+    }
+
+    if (!sysReaderRead(reader, tail, tail_len, length - tail_len)) {
+        LOGE("failed to read package footer: %s\n", strerror(errno));
+        goto done;
+    }
+
+    if (!parse_footer(tail, tail_len, length, &signed_len, &signature, &signature_size,
+                      &comment, &comment_len)) {
+        goto done;
+    }
+
+    result = verify_hash_tree(comment, comment_len, signed_len, NULL, reader, pKeys, numKeys);
+    if (result != VERIFY_WHOLE_FILE) {
+        goto done;
+    }
+    result = VERIFY_FAILURE;
+
+    // Tell the kernel we'll read the whole thing once, front to back.
+    sysReaderAdvise(reader, 0, signed_len, SYS_MAP_SEQUENTIAL);
+
     {
-        int i;
-        bool done = false;
-        while (!done) {
-            ++*numKeys;
-            out = (Certificate*)realloc(out, *numKeys * sizeof(Certificate));
-            Certificate* cert = out + (*numKeys - 1);
-            memset(cert, '\0', sizeof(Certificate));
-
-            char start_char;
-            if (fscanf(f, " %c", &start_char) != 1) goto exit;
-            if (start_char == '{') {
-                // a version 1 key has no version specifier.
-                cert->key_type = Certificate::RSA;
-                cert->rsa = (RSAPublicKey*)malloc(sizeof(RSAPublicKey));
-                cert->rsa->exponent = 3;
-                cert->hash_len = SHA_DIGEST_SIZE;
-            } else if (start_char == 'v') {
-                int version;
-                if (fscanf(f, "%d {", &version) != 1) goto exit;
-                switch (version) {
-                    case 2:
-                        cert->key_type = Certificate::RSA;
-                        cert->rsa = (RSAPublicKey*)malloc(sizeof(RSAPublicKey));
-                        cert->rsa->exponent = 65537;
-                        cert->hash_len = SHA_DIGEST_SIZE;
-                        break;
-                    case 3:
-                        cert->key_type = Certificate::RSA;
-                        cert->rsa = (RSAPublicKey*)malloc(sizeof(RSAPublicKey));
-                        cert->rsa->exponent = 3;
-                        cert->hash_len = SHA256_DIGEST_SIZE;
-                        break;
-                    case 4:
-                        cert->key_type = Certificate::RSA;
-                        cert->rsa = (RSAPublicKey*)malloc(sizeof(RSAPublicKey));
-                        cert->rsa->exponent = 65537;
-                        cert->hash_len = SHA256_DIGEST_SIZE;
-                        break;
-                    case 5:
-                        cert->key_type = Certificate::EC;
-                        cert->ec = (ECPublicKey*)calloc(1, sizeof(ECPublicKey));
-                        cert->hash_len = SHA256_DIGEST_SIZE;
-                        break;
-                    default:
-                        goto exit;
-                }
+        DigestEngine engine(digests_for_keys(pKeys, numKeys));
+        BlockReader block_reader(reader);
+
+        double frac = -1.0;
+        size_t so_far = 0;
+        int current = 0;
+        size_t size = signed_len < BUFFER_SIZE ? signed_len : BUFFER_SIZE;
+        block_reader.Start(buffers[current], size, 0);
+
+        while (so_far < signed_len) {
+            int error;
+            if (!block_reader.Wait(&error)) {
+                LOGE("failed to read package at %zu: %s\n", so_far, strerror(error));
+                goto done;
             }
 
-            if (cert->key_type == Certificate::RSA) {
-                RSAPublicKey* key = cert->rsa;
-                if (fscanf(f, " %i , 0x%x , { %u",
-                           &(key->len), &(key->n0inv), &(key->n[0])) != 3) {
-                    goto exit;
-                }
-                if (key->len != RSANUMWORDS) {
-                    LOGE("key length (%d) does not match expected size\n", key->len);
-                    goto exit;
-                }
-                for (i = 1; i < key->len; ++i) {
-                    if (fscanf(f, " , %u", &(key->n[i])) != 1) goto exit;
-                }
-                if (fscanf(f, " } , { %u", &(key->rr[0])) != 1) goto exit;
-                for (i = 1; i < key->len; ++i) {
-                    if (fscanf(f, " , %u", &(key->rr[i])) != 1) goto exit;
-                }
-                fscanf(f, " } } ");
-
-                LOGI("read key e=%d hash=%d\n", key->exponent, cert->hash_len);
-            } else if (cert->key_type == Certificate::EC) {
-                ECPublicKey* key = cert->ec;
-                int key_len;
-                unsigned int byte;
-                uint8_t x_bytes[P256_NBYTES];
-                uint8_t y_bytes[P256_NBYTES];
-                if (fscanf(f, " %i , { %u", &key_len, &byte) != 2) goto exit;
-                if (key_len != P256_NBYTES) {
-                    LOGE("Key length (%d) does not match expected size %d\n", key_len, P256_NBYTES);
-                    goto exit;
-                }
-                x_bytes[P256_NBYTES - 1] = byte;
-                for (i = P256_NBYTES - 2; i >= 0; --i) {
-                    if (fscanf(f, " , %u", &byte) != 1) goto exit;
-                    x_bytes[i] = byte;
-                }
-                if (fscanf(f, " } , { %u", &byte) != 1) goto exit;
-                y_bytes[P256_NBYTES - 1] = byte;
-                for (i = P256_NBYTES - 2; i >= 0; --i) {
-                    if (fscanf(f, " , %u", &byte) != 1) goto exit;
-                    y_bytes[i] = byte;
-                }
-                fscanf(f, " } } ");
-                p256_from_bin(x_bytes, &key->x);
-                p256_from_bin(y_bytes, &key->y);
-            } else {
-                LOGE("Unknown key type %d\n", cert->key_type);
-                goto exit;
+            // Kick off the read of the next block before hashing this one.
+            size_t next = so_far + size;
+            size_t next_size = 0;
+            if (next < signed_len) {
+                next_size = signed_len - next;
+                if (next_size > BUFFER_SIZE) next_size = BUFFER_SIZE;
+                block_reader.Start(buffers[1 - current], next_size, next);
             }
 
-            // if the line ends in a comma, this file has more keys.
-            switch (fgetc(f)) {
-            case ',':
-                // more keys to come.
-                break;
+            engine.Update(buffers[current], size);
 
-            case EOF:
-                done = true;
-                break;
+            // Nothing will read these pages again during verification;
+            // let them go rather than pushing out other cached data.
+            sysReaderAdvise(reader, so_far, size, SYS_MAP_DONTNEED);
+            so_far += size;
 
-            default:
-                LOGE("unexpected character between keys\n");
-                goto exit;
+            double f = so_far / (double)signed_len;
+            if (f > frac + 0.02 || size == so_far) {
+                ui->SetProgress(f);
+                frac = f;
             }
+
+            current = 1 - current;
+            size = next_size;
         }
+
+        engine.Final();
+        result = verify_signature(signature, signature_size, engine.sha1(), engine.sha256(),
+                                  pKeys, numKeys);
     }
 
-    fclose(f);
-    return out;
+done:
+    free(buffers[1]);
+    free(buffers[0]);
+    free(tail);
+    return result;
+}
 
-exit:
-    if (f) fclose(f);
-    free(out);
-    *numKeys = 0;
-    return NULL;
+int verify_file_fd(int fd, const Certificate* pKeys, unsigned int numKeys) {
+    SysReader* reader = sysReaderOpenFd(fd);
+    if (reader == NULL) {
+        return VERIFY_FAILURE;
+    }
+    int result = verify_file_reader(reader, pKeys, numKeys);
+    sysReaderClose(reader);
+    return result;
 }
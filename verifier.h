@@ -19,6 +19,8 @@
 
 #include "mincrypt/p256.h"
 #include "mincrypt/rsa.h"
+#include "mincrypt/sha.h"
+#include "minzip/SysUtil.h"
 
 typedef struct {
     p256_int x;
@@ -35,16 +37,38 @@ typedef struct {
     KeyType key_type;
     RSAPublicKey* rsa;
     ECPublicKey* ec;
+
+    // SHA-1 of the key as encoded in the subjectPublicKey BIT STRING of
+    // an X.509 certificate (the RFC 5280 key identifier), so the key
+    // named by a package's signing certificate can be found directly.
+    // All zeros if unknown; see set_key_fingerprint().
+    uint8_t fingerprint[SHA_DIGEST_SIZE];
 } Certificate;
 
 /* addr and length define a an update package file that has been
  * loaded (or mmap'ed, or whatever) into memory.  Verify that the file
  * is signed and the signature matches one of the given keys.  Return
  * one of the constants below.
+ *
+ * If the package carries a hash tree signed by one of the keys (see
+ * hash_tree.h), it is checked chunk by chunk against the tree instead.
  */
 int verify_file(unsigned char* addr, size_t length,
                 const Certificate *pKeys, unsigned int numKeys);
 
+/* Like verify_file(), but reads the package through reader in
+ * bounded-size blocks rather than requiring it to be mapped.
+ */
+int verify_file_reader(const SysReader* reader, const Certificate *pKeys,
+                       unsigned int numKeys);
+
+/* verify_file_reader() for the open regular file fd.
+ */
+int verify_file_fd(int fd, const Certificate *pKeys, unsigned int numKeys);
+
+/* Parse a file of keys in the text format written by DumpPublicKey.
+ * Returns a malloc'ed array, or NULL on error.
+ */
 Certificate* load_keys(const char* filename, int* numKeys);
 
 #define VERIFY_SUCCESS        0
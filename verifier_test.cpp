@@ -14,14 +14,19 @@
  * limitations under the License.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "digest_engine.h"
+#include "keystore.h"
 #include "verifier.h"
 #include "ui.h"
 #include "mincrypt/sha.h"
@@ -175,17 +180,59 @@ static Certificate* add_certificate(Certificate** certsp, int* num_keys,
     return &certs[i];
 }
 
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Time the digest engine over the whole package in each mode
+// verify_file() can use, and report the throughput.
+static void benchmark_digests(const unsigned char* addr, size_t length) {
+    static const struct {
+        const char* name;
+        int digests;
+    } modes[] = {
+        { "sha1", DigestEngine::SHA1 },
+        { "sha256", DigestEngine::SHA256 },
+        { "sha1+sha256", DigestEngine::SHA1 | DigestEngine::SHA256 },
+    };
+    const size_t block = 1024 * 1024;
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+        double start = now_sec();
+        DigestEngine engine(modes[m].digests);
+        for (size_t so_far = 0; so_far < length; so_far += block) {
+            size_t size = length - so_far < block ? length - so_far : block;
+            engine.Update(addr + so_far, size);
+        }
+        engine.Final();
+        double elapsed = now_sec() - start;
+        fprintf(stderr, "%-12s %8.1f MB/s (%zu bytes in %.3f s)\n", modes[m].name,
+                elapsed > 0 ? length / elapsed / (1024 * 1024) : 0.0, length, elapsed);
+    }
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s [-sha256] [-ec | -f4 | -file <keys>] <package>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-bench] [-stream] [-sha256] [-ec | -f4 | -file <keys>] <package>\n",
+                argv[0]);
         return 2;
     }
     Certificate* certs = NULL;
     int num_keys = 0;
+    bool bench = false;
+    bool stream = false;
 
     int argn = 1;
     while (argn < argc) {
-        if (strcmp(argv[argn], "-sha256") == 0) {
+        if (strcmp(argv[argn], "-bench") == 0) {
+            ++argn;
+            bench = true;
+        } else if (strcmp(argv[argn], "-stream") == 0) {
+            ++argn;
+            stream = true;
+        } else if (strcmp(argv[argn], "-sha256") == 0) {
             if (num_keys == 0) {
                 fprintf(stderr, "May only specify -sha256 after key type\n");
                 return 2;
@@ -238,6 +285,9 @@ int main(int argc, char **argv) {
         certs->hash_len = SHA_DIGEST_SIZE;
         num_keys = 1;
     }
+    for (int i = 0; i < num_keys; ++i) {
+        set_key_fingerprint(&certs[i]);
+    }
 
     ui = new FakeUI();
 
@@ -247,7 +297,22 @@ int main(int argc, char **argv) {
         return 4;
     }
 
-    int result = verify_file(map.addr, map.length, certs, num_keys);
+    if (bench) {
+        benchmark_digests(map.addr, map.length);
+    }
+
+    int result;
+    if (stream) {
+        SysReader* reader = sysReaderOpen(argv[argn]);
+        if (reader == NULL) {
+            fprintf(stderr, "failed to open %s: %s\n", argv[argn], strerror(errno));
+            return 4;
+        }
+        result = verify_file_reader(reader, certs, num_keys);
+        sysReaderClose(reader);
+    } else {
+        result = verify_file(map.addr, map.length, certs, num_keys);
+    }
     if (result == VERIFY_SUCCESS) {
         printf("VERIFIED\n");
         return 0;
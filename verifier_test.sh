@@ -112,6 +112,30 @@ expect_fail fake-eocd.zip
 expect_fail alter-metadata.zip
 expect_fail alter-footer.zip
 
+# the same checks, reading the package through verify_file_fd()
+expect_succeed otasigned.zip -stream -e3
+expect_succeed otasigned_sha256.zip -stream -ec -e3 -e3 -sha256
+expect_succeed otasigned_ecdsa_sha256.zip -stream -f4 -sha256 -e3 -ec -sha256
+expect_fail otasigned.zip -stream -f4
+expect_fail random.zip -stream
+expect_fail fake-eocd.zip -stream
+expect_fail alter-metadata.zip -stream
+expect_fail alter-footer.zip -stream
+
+# packages carrying a signed hash tree
+expect_succeed otasigned_tree.zip -e3
+expect_succeed otasigned_tree.zip -stream -e3
+expect_succeed otasigned_tree_ecdsa_sha256.zip -f4 -sha256 -e3 -ec -sha256
+expect_succeed otasigned_tree_ecdsa_sha256.zip -stream -ec -sha256
+expect_fail otasigned_tree.zip -f4
+# tree signed by f4, whole file by e3: either key alone is enough
+expect_succeed otasigned_tree_f4.zip -f4
+expect_succeed otasigned_tree_f4.zip -e3
+# a bad chunk fails outright; a bad tree falls back to the whole file
+expect_fail alter-tree-chunk.zip -e3
+expect_fail alter-tree-chunk.zip -stream -e3
+expect_succeed alter-tree-leaf.zip -e3
+
 # --------------- cleanup ----------------------
 
 cleanup
@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "verify_cache.h"
+
+#include "minhash/sha.h"
+
+#define VERIFY_CACHE_FILE "/cache/recovery/last_verified"
+#define VERIFY_CACHE_TEMP VERIFY_CACHE_FILE ".tmp"
+#define BOOT_ID_FILE "/proc/sys/kernel/random/boot_id"
+
+// How many packages to remember.
+#define MAX_ENTRIES 8
+
+// One cache line: five numbers, three hex digests, and separators.
+#define ENTRY_SIZE 512
+
+#define FOOTER_SIZE 6
+#define EOCD_HEADER_SIZE 22
+
+static void hex_encode(const uint8_t* data, size_t len, char* out) {
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; ++i) {
+        out[i*2] = hex[data[i] >> 4];
+        out[i*2+1] = hex[data[i] & 0xf];
+    }
+    out[len*2] = '\0';
+}
+
+static bool read_fully_at(int fd, uint8_t* buf, size_t len, off64_t offset) {
+    while (len > 0) {
+        ssize_t n = pread64(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// Digest the EOCD record and everything after it (the comment, which
+// holds the signature and footer).
+static bool hash_tail(int fd, off64_t length, uint8_t* digest) {
+    uint8_t footer[FOOTER_SIZE];
+    if (length < FOOTER_SIZE || !read_fully_at(fd, footer, FOOTER_SIZE, length - FOOTER_SIZE)) {
+        return false;
+    }
+    size_t eocd_size = footer[4] + (footer[5] << 8) + EOCD_HEADER_SIZE;
+    if (length < (off64_t)eocd_size) {
+        return false;
+    }
+
+    uint8_t* eocd = (uint8_t*)malloc(eocd_size);
+    if (eocd == NULL) {
+        return false;
+    }
+    bool ok = read_fully_at(fd, eocd, eocd_size, length - eocd_size);
+    if (ok) {
+        MH_SHA256_hash(eocd, eocd_size, digest);
+    }
+    free(eocd);
+    return ok;
+}
+
+// Digest the key material (and hash choice) of every key, in order.
+static void hash_keys(const Certificate* pKeys, unsigned int numKeys, uint8_t* digest) {
+    SHA256_CTX ctx;
+    MH_SHA256_init(&ctx);
+    for (unsigned int i = 0; i < numKeys; ++i) {
+        int header[2] = { pKeys[i].key_type, pKeys[i].hash_len };
+        MH_SHA256_update(&ctx, header, sizeof(header));
+        if (pKeys[i].key_type == Certificate::RSA && pKeys[i].rsa != NULL) {
+            MH_SHA256_update(&ctx, pKeys[i].rsa, sizeof(RSAPublicKey));
+        } else if (pKeys[i].key_type == Certificate::EC && pKeys[i].ec != NULL) {
+            MH_SHA256_update(&ctx, pKeys[i].ec, sizeof(ECPublicKey));
+        }
+    }
+    memcpy(digest, MH_SHA256_final(&ctx), SHA256_DIGEST_SIZE);
+}
+
+// The kernel picks a new random boot_id on every boot.  Tying entries
+// to it means only a record written by this recovery session counts,
+// never one planted in /cache by the system before rebooting.
+static bool read_boot_id(char* out, size_t len) {
+    FILE* f = fopen(BOOT_ID_FILE, "r");
+    if (f == NULL) {
+        return false;
+    }
+    bool ok = fgets(out, len, f) != NULL;
+    fclose(f);
+    if (ok) {
+        out[strcspn(out, "\n")] = '\0';
+    }
+    return ok && out[0] != '\0';
+}
+
+// Build the cache line describing the package open on fd.
+static bool make_entry(int fd, const Certificate* pKeys, unsigned int numKeys,
+                       char* entry, size_t len) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+
+    char boot_id[64];
+    if (!read_boot_id(boot_id, sizeof(boot_id))) {
+        return false;
+    }
+
+    uint8_t tail_digest[SHA256_DIGEST_SIZE];
+    if (!hash_tail(fd, st.st_size, tail_digest)) {
+        return false;
+    }
+    uint8_t keys_digest[SHA256_DIGEST_SIZE];
+    hash_keys(pKeys, numKeys, keys_digest);
+
+    char tail_hex[SHA256_DIGEST_SIZE*2+1];
+    char keys_hex[SHA256_DIGEST_SIZE*2+1];
+    hex_encode(tail_digest, sizeof(tail_digest), tail_hex);
+    hex_encode(keys_digest, sizeof(keys_digest), keys_hex);
+
+    int n = snprintf(entry, len, "%s %llu %llu %lld %lld.%09ld %lld.%09ld %s %s\n",
+                     boot_id,
+                     (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+                     (long long)st.st_size,
+                     (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec,
+                     (long long)st.st_ctim.tv_sec, (long)st.st_ctim.tv_nsec,
+                     tail_hex, keys_hex);
+    return n > 0 && (size_t)n < len;
+}
+
+bool verify_cache_lookup(int fd, const Certificate* pKeys, unsigned int numKeys) {
+    char entry[ENTRY_SIZE];
+    if (!make_entry(fd, pKeys, numKeys, entry, sizeof(entry))) {
+        return false;
+    }
+
+    FILE* f = fopen_path(VERIFY_CACHE_FILE, "r");
+    if (f == NULL) {
+        return false;
+    }
+    bool found = false;
+    char line[ENTRY_SIZE];
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        found = strcmp(line, entry) == 0;
+    }
+    fclose(f);
+    return found;
+}
+
+void verify_cache_store(int fd, const Certificate* pKeys, unsigned int numKeys) {
+    char entry[ENTRY_SIZE];
+    if (!make_entry(fd, pKeys, numKeys, entry, sizeof(entry))) {
+        return;
+    }
+
+    // Newest entry first, followed by as many older ones as fit.
+    FILE* out = fopen_path(VERIFY_CACHE_TEMP, "w");
+    if (out == NULL) {
+        LOGW("failed to open %s: %s\n", VERIFY_CACHE_TEMP, strerror(errno));
+        return;
+    }
+    fputs(entry, out);
+
+    FILE* in = fopen(VERIFY_CACHE_FILE, "r");
+    if (in != NULL) {
+        char line[ENTRY_SIZE];
+        int kept = 1;
+        while (kept < MAX_ENTRIES && fgets(line, sizeof(line), in) != NULL) {
+            if (strcmp(line, entry) != 0) {
+                fputs(line, out);
+                ++kept;
+            }
+        }
+        fclose(in);
+    }
+
+    bool ok = fflush(out) == 0 && fsync(fileno(out)) == 0;
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || rename(VERIFY_CACHE_TEMP, VERIFY_CACHE_FILE) != 0) {
+        LOGW("failed to update %s: %s\n", VERIFY_CACHE_FILE, strerror(errno));
+        unlink(VERIFY_CACHE_TEMP);
+    }
+}
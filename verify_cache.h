@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_VERIFY_CACHE_H
+#define _RECOVERY_VERIFY_CACHE_H
+
+#include "verifier.h"
+
+/* Remembers packages that verify_file_fd() accepted, so that retrying
+ * an install of the same, unchanged file can skip the hashing pass.
+ *
+ * An entry is keyed on the package's device, inode, size, mtime and
+ * ctime, a digest of its EOCD record and signature block, a
+ * fingerprint of the key set it was checked against, and the current
+ * boot.  Any change to one of these makes the lookup miss.
+ */
+
+/* Return true if the open package fd was already verified against
+ * exactly this set of keys, during this boot, and hasn't changed.
+ */
+bool verify_cache_lookup(int fd, const Certificate* pKeys, unsigned int numKeys);
+
+/* Record that the open package fd verified against this set of keys.
+ */
+void verify_cache_store(int fd, const Certificate* pKeys, unsigned int numKeys);
+
+#endif  /* _RECOVERY_VERIFY_CACHE_H */
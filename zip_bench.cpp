@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmark for opening an archive and looking up entries by name.
+// Writes a package of empty entries with the names in shuffled order,
+// as an OTA of a whole system partition might have them, and times
+// mzOpenZipArchive() and mzFindZipEntry() for names that are there and
+// names that aren't.
+//
+// For comparison it also builds the entry table the way minzip used to:
+// each entry, in the old 80-byte (LP64) ZipEntry, put in name order as
+// it's read with a binary search and a memmove(), and then added to a
+// HashTable of pointers.  The "old open" time is the time that took on
+// top of parsing the central directory, which both ways share.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Hash.h has no extern "C" of its own.
+extern "C" {
+#include "minzip/Hash.h"
+}
+#include "minzip/SysUtil.h"
+#include "minzip/Zip.h"
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void put2(std::string* s, uint16_t v) {
+    s->push_back(v & 0xff);
+    s->push_back(v >> 8);
+}
+
+static void put4(std::string* s, uint32_t v) {
+    put2(s, v & 0xffff);
+    put2(s, v >> 16);
+}
+
+// Write a package of empty, stored entries with the given names.
+static bool write_zip(const char* filename, const std::vector<std::string>& names) {
+    std::string local, cd, end;
+    for (size_t i = 0; i < names.size(); ++i) {
+        uint32_t offset = local.size();
+        put4(&local, 0x04034b50);
+        put2(&local, 20);
+        put2(&local, 0);
+        put2(&local, 0);
+        put4(&local, 0);
+        put4(&local, 0);
+        put4(&local, 0);
+        put4(&local, 0);
+        put2(&local, names[i].size());
+        put2(&local, 0);
+        local.append(names[i]);
+
+        put4(&cd, 0x02014b50);
+        put2(&cd, (3 << 8) | 20);
+        put2(&cd, 20);
+        put2(&cd, 0);
+        put2(&cd, 0);
+        put4(&cd, 0);
+        put4(&cd, 0);
+        put4(&cd, 0);
+        put4(&cd, 0);
+        put2(&cd, names[i].size());
+        put2(&cd, 0);
+        put2(&cd, 0);
+        put2(&cd, 0);
+        put2(&cd, 0);
+        put4(&cd, 0100644 << 16);
+        put4(&cd, offset);
+        cd.append(names[i]);
+    }
+    put4(&end, 0x06054b50);
+    put2(&end, 0);
+    put2(&end, 0);
+    put2(&end, names.size());
+    put2(&end, names.size());
+    put4(&end, cd.size());
+    put4(&end, local.size());
+    put2(&end, 0);
+
+    FILE* f = fopen(filename, "w");
+    if (f == NULL) return false;
+    bool ok = fwrite(local.data(), 1, local.size(), f) == local.size() &&
+              fwrite(cd.data(), 1, cd.size(), f) == cd.size() &&
+              fwrite(end.data(), 1, end.size(), f) == end.size();
+    return fclose(f) == 0 && ok;
+}
+
+// The ZipEntry minzip used before the entry table was packed.
+struct OldEntry {
+    unsigned int fileNameLen;
+    const char* fileName;
+    long offset;
+    long compLen;
+    long uncompLen;
+    int compression;
+    long modTime;
+    long crc32;
+    int versionMadeBy;
+    long externalFileAttributes;
+};
+
+static unsigned int compute_hash(const char* name, int len) {
+    unsigned int hash = 2;
+    while (len--) hash = hash * 31 + *name++;
+    return hash;
+}
+
+static int hashcmp_entry(const void* a, const void* b) {
+    const OldEntry* e1 = (const OldEntry*) a;
+    const OldEntry* e2 = (const OldEntry*) b;
+    if (e1->fileNameLen != e2->fileNameLen) return e1->fileNameLen - e2->fileNameLen;
+    return memcmp(e1->fileName, e2->fileName, e1->fileNameLen);
+}
+
+static int hashcmp_name(const void* a, const void* b) {
+    const OldEntry* e = (const OldEntry*) a;
+    const char* name = (const char*) b;
+    unsigned int len = strlen(name);
+    if (e->fileNameLen != len) return e->fileNameLen - len;
+    return memcmp(e->fileName, name, len);
+}
+
+// Build the old entry table from the entries of an open archive, taken
+// in central directory order.  Returns the hash table; the entries are
+// left in *entries.
+static HashTable* old_open(const ZipArchive* za, const std::vector<unsigned int>& cd_order,
+                           OldEntry* entries) {
+    unsigned int n = cd_order.size();
+    HashTable* hash = mzHashTableCreate(mzHashSize(n), NULL);
+    for (unsigned int i = 0; i < n; ++i) {
+        const ZipEntry* ze = mzGetZipEntryAt(za, cd_order[i]);
+        UnterminatedString name = mzGetZipEntryFileName(ze);
+        int low = 0, high = i - 1;
+        while (low <= high) {
+            int mid = low + (high - low) / 2;
+            unsigned int len = entries[mid].fileNameLen < name.len ?
+                    entries[mid].fileNameLen : name.len;
+            int diff = strncmp(entries[mid].fileName, name.str, len);
+            if (diff == 0) diff = entries[mid].fileNameLen - name.len;
+            if (diff < 0) {
+                low = mid + 1;
+            } else if (diff > 0) {
+                high = mid - 1;
+            } else {
+                break;
+            }
+        }
+        unsigned int target = high + 1;
+        memmove(entries + target + 1, entries + target, (i - target) * sizeof(OldEntry));
+        memset(&entries[target], 0, sizeof(OldEntry));
+        entries[target].fileName = name.str;
+        entries[target].fileNameLen = name.len;
+        entries[target].offset = mzGetZipEntryOffset(ze);
+    }
+    for (unsigned int i = 0; i < n; ++i) {
+        mzHashTableLookup(hash, compute_hash(entries[i].fileName, entries[i].fileNameLen),
+                          &entries[i], hashcmp_entry, true);
+    }
+    return hash;
+}
+
+static double best_of(double a, double b) {
+    return a < b ? a : b;
+}
+
+static int run(unsigned int count, const char* filename) {
+    // Names like those in a system image, in a shuffled order.
+    std::vector<std::string> names, misses;
+    char buf[128];
+    for (unsigned int i = 0; i < count; ++i) {
+        snprintf(buf, sizeof(buf), "system/%s/%04u/file-%u.%s",
+                 (i % 3 == 0) ? "app" : (i % 3 == 1) ? "lib" : "framework",
+                 i / 100, i, (i % 2) ? "so" : "apk");
+        names.push_back(buf);
+        snprintf(buf, sizeof(buf), "system/priv-app/%04u/missing-%u.apk", i / 100, i);
+        misses.push_back(buf);
+    }
+    srand(count);
+    for (unsigned int i = count - 1; i > 0; --i) {
+        std::swap(names[i], names[rand() % (i + 1)]);
+    }
+    if (!write_zip(filename, names)) {
+        fprintf(stderr, "failed to write %s\n", filename);
+        return 1;
+    }
+
+    MemMapping map;
+    if (sysMapFile(filename, &map) != 0) {
+        fprintf(stderr, "failed to map %s\n", filename);
+        return 1;
+    }
+
+    ZipArchive za;
+    double open_time = 1e9;
+    for (int i = 0; i < 5; ++i) {
+        double start = now_sec();
+        int err = mzOpenZipArchive(map.addr, map.length, &za);
+        open_time = best_of(open_time, now_sec() - start);
+        if (err != 0) {
+            fprintf(stderr, "failed to open %s\n", filename);
+            return 1;
+        }
+        if (i < 4) mzCloseZipArchive(&za);
+    }
+
+    // The old code got the entries in central directory order.
+    std::vector<unsigned int> cd_order(count);
+    for (unsigned int i = 0; i < count; ++i) {
+        const ZipEntry* ze = mzFindZipEntry(&za, names[i].c_str());
+        if (ze == NULL) {
+            fprintf(stderr, "%s not found\n", names[i].c_str());
+            return 1;
+        }
+        cd_order[i] = ze - mzGetZipEntryAt(&za, 0);
+    }
+    OldEntry* old_entries = (OldEntry*) malloc(count * sizeof(OldEntry));
+    HashTable* old_hash = NULL;
+    double old_open_time = 1e9;
+    for (int i = 0; i < 5; ++i) {
+        mzHashTableFree(old_hash);
+        double start = now_sec();
+        old_hash = old_open(&za, cd_order, old_entries);
+        old_open_time = best_of(old_open_time, now_sec() - start);
+    }
+
+    // Look names up in shuffled order, so as not to favor either table.
+    const int kRounds = 5;
+    double hit = 1e9, miss = 1e9, old_hit = 1e9, old_miss = 1e9;
+    int failed = 0;
+    for (int r = 0; r < kRounds; ++r) {
+        double start = now_sec();
+        for (unsigned int i = 0; i < count; ++i) {
+            if (mzFindZipEntry(&za, names[i].c_str()) == NULL) failed = 1;
+        }
+        hit = best_of(hit, now_sec() - start);
+        start = now_sec();
+        for (unsigned int i = 0; i < count; ++i) {
+            if (mzFindZipEntry(&za, misses[i].c_str()) != NULL) failed = 1;
+        }
+        miss = best_of(miss, now_sec() - start);
+
+        start = now_sec();
+        for (unsigned int i = 0; i < count; ++i) {
+            const char* name = names[i].c_str();
+            if (mzHashTableLookup(old_hash, compute_hash(name, strlen(name)), (void*) name,
+                                  hashcmp_name, false) == NULL) failed = 1;
+        }
+        old_hit = best_of(old_hit, now_sec() - start);
+        start = now_sec();
+        for (unsigned int i = 0; i < count; ++i) {
+            const char* name = misses[i].c_str();
+            if (mzHashTableLookup(old_hash, compute_hash(name, strlen(name)), (void*) name,
+                                  hashcmp_name, false) != NULL) failed = 1;
+        }
+        old_miss = best_of(old_miss, now_sec() - start);
+    }
+
+    printf("%6u entries: open %8.2f ms  hit %5.0f ns  miss %5.0f ns\n",
+           count, open_time * 1e3, hit / count * 1e9, miss / count * 1e9);
+    printf("%6s    old: open +%7.2f ms  hit %5.0f ns  miss %5.0f ns\n",
+           "", old_open_time * 1e3, old_hit / count * 1e9, old_miss / count * 1e9);
+    if (failed) printf("MISMATCH\n");
+
+    mzHashTableFree(old_hash);
+    free(old_entries);
+    mzCloseZipArchive(&za);
+    sysReleaseMap(&map);
+    unlink(filename);
+    return failed;
+}
+
+int main(int argc, char** argv) {
+    std::vector<unsigned int> counts;
+    for (int i = 1; i < argc; ++i) {
+        counts.push_back(strtoul(argv[i], NULL, 0));
+        if (counts.back() == 0 || counts.back() > 65535) {
+            fprintf(stderr, "Usage: %s [<entries> ...]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (counts.empty()) {
+        counts.push_back(20000);
+        counts.push_back(60000);
+    }
+
+    const char* tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL) tmpdir = "/data/local/tmp";
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s/zip_bench.zip", tmpdir);
+
+    int failed = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        if (run(counts[i], filename) != 0) failed = 1;
+    }
+    return failed;
+}